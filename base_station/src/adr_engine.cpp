@@ -0,0 +1,126 @@
+#include "adr_engine.h"
+#include <math.h>
+
+AdrEngine::AdrEngine() :
+    historyNext(0),
+    historyCount(0),
+    downlink(0.0),
+    downlinkValid(false) {
+}
+
+void AdrEngine::onUplink(int rssi, float snr, const LinkParams& params) {
+    // A strong signal reads about the same SNR as a merely good one; use
+    // RSSI over the noise floor there so the margin isn't underestimated
+    if (snr >= ADR_SNR_SATURATION) {
+        float noiseFloor = -174.0f + 10.0f * log10f(params.bandwidth * 1000.0f) + ADR_NOISE_FIGURE;
+        float rssiSnr = rssi - noiseFloor;
+        if (rssiSnr > snr) {
+            snr = rssiSnr;
+        }
+    }
+
+    history[historyNext] = normalise(snr, params);
+    historyNext = (historyNext + 1) % ADR_HISTORY_SIZE;
+    if (historyCount < ADR_HISTORY_SIZE) {
+        historyCount++;
+    }
+}
+
+void AdrEngine::onDownlink(float snr, const LinkParams& params) {
+    downlink = normalise(snr, params);
+    downlinkValid = true;
+}
+
+void AdrEngine::reset() {
+    historyNext = 0;
+    historyCount = 0;
+    downlinkValid = false;
+}
+
+bool AdrEngine::evaluate(const LinkParams& current, LinkParams& proposal) const {
+    if (historyCount < ADR_HISTORY_SIZE) {
+        return false;
+    }
+
+    float reference = getReferenceSnr();
+
+    // Faster, or at least ADR_HYSTERESIS_DB less power, only with the extra margin
+    LinkParams faster = choose(reference, ADR_MARGIN_DB + ADR_HYSTERESIS_DB);
+    float fasterRate = LinkRate::bitrate(faster);
+    float currentRate = LinkRate::bitrate(current);
+    if (fasterRate > currentRate || (fasterRate == currentRate && faster.power + ADR_HYSTERESIS_DB <= current.power)) {
+        proposal = faster;
+        return true;
+    }
+
+    // Slower or more power as soon as the current settings lose their margin
+    if (requiredPower(reference, ADR_MARGIN_DB, current.spreadingFactor, current.bandwidth) > current.power) {
+        proposal = choose(reference, ADR_MARGIN_DB);
+        return !LinkRate::equal(proposal, current);
+    }
+
+    return false;
+}
+
+float AdrEngine::getReferenceSnr() const {
+    if (historyCount == 0) {
+        return 0.0;
+    }
+
+    float total = 0;
+    for (uint8_t i = 0; i < historyCount; i++) {
+        total += history[i];
+    }
+    float uplink = total / historyCount;
+
+    // The weaker direction limits the link
+    return downlinkValid && downlink < uplink ? downlink : uplink;
+}
+
+uint8_t AdrEngine::getSampleCount() const {
+    return historyCount;
+}
+
+float AdrEngine::normalise(float snr, const LinkParams& params) {
+    // SNR rises 1 dB per dB of TX power and 3 dB per halving of bandwidth
+    return snr - params.power + 10.0f * log10f(params.bandwidth / 125.0f);
+}
+
+LinkParams AdrEngine::choose(float referenceSnr, float margin) {
+    static const uint16_t bandwidths[] = { 500, 250, 125 };
+
+    LinkParams best = LinkRate::defaults(125, LINK_MAX_SF, 5, LINK_MAX_POWER);
+    float bestRate = 0;
+    bool found = false;
+
+    for (uint8_t b = 0; b < 3; b++) {
+        for (uint8_t sf = LINK_MIN_SF; sf <= LINK_MAX_SF; sf++) {
+            float power = ceilf(requiredPower(referenceSnr, margin, sf, bandwidths[b]));
+            if (power > LINK_MAX_POWER) {
+                continue;
+            }
+            if (power < LINK_MIN_POWER) {
+                power = LINK_MIN_POWER;
+            }
+
+            LinkParams candidate = LinkRate::defaults(bandwidths[b], sf, 5, (int8_t)power);
+            float rate = LinkRate::bitrate(candidate);
+            if (!found || rate > bestRate || (rate == bestRate && candidate.power < best.power)) {
+                best = candidate;
+                bestRate = rate;
+                found = true;
+            }
+        }
+    }
+
+    // Nothing keeps the margin: slowest rate, full power, strongest coding
+    if (!found) {
+        best.codingRate = 8;
+    }
+
+    return best;
+}
+
+float AdrEngine::requiredPower(float referenceSnr, float margin, uint8_t spreadingFactor, uint16_t bandwidth) {
+    return LinkRate::requiredSnr(spreadingFactor) + margin - referenceSnr + 10.0f * log10f(bandwidth / 125.0f);
+}
@@ -0,0 +1,69 @@
+#ifndef ADR_ENGINE_H
+#define ADR_ENGINE_H
+
+#include <Arduino.h>
+#include "link_params.h"
+
+// Adaptive data rate: picks the fastest spreading factor/bandwidth and the
+// lowest TX power that keep ADR_MARGIN_DB of SNR above what the SX1262 needs
+// to demodulate, from the signal of recent uplinks and the ACK SNR the remote
+// reports in its metrics (the downlink). The handshake that makes both ends
+// switch together lives in LoRaCommunication.
+
+// Uplinks averaged per decision; no decision before this many since the last change
+#define ADR_HISTORY_SIZE     8
+
+// SNR kept above the demodulation floor (dB)
+#define ADR_MARGIN_DB        10.0
+
+// Extra margin needed before going faster or lowering power, so the choice
+// doesn't flap around a threshold (dB)
+#define ADR_HYSTERESIS_DB    3.0
+
+// SX1262 SNR readings flatten out above this; beyond it the margin is taken
+// from RSSI over the thermal noise floor instead (dB)
+#define ADR_SNR_SATURATION   10.0
+
+// Receiver noise figure used for the noise floor (dB)
+#define ADR_NOISE_FIGURE     6.0
+
+class AdrEngine {
+public:
+    AdrEngine();
+
+    // Signal of an uplink received with the given settings
+    void onUplink(int rssi, float snr, const LinkParams& params);
+
+    // Average ACK SNR reported by the remote (its "snr" metric)
+    void onDownlink(float snr, const LinkParams& params);
+
+    // Forget the history, e.g. after the settings changed
+    void reset();
+
+    // Pick new settings. Returns false if there isn't enough history yet or
+    // current settings are still the right choice.
+    bool evaluate(const LinkParams& current, LinkParams& proposal) const;
+
+    // Average link SNR normalised to 0 dBm TX power at 125 kHz (valid once
+    // getSampleCount() > 0)
+    float getReferenceSnr() const;
+    uint8_t getSampleCount() const;
+
+private:
+    float history[ADR_HISTORY_SIZE];    // Normalised uplink SNR
+    uint8_t historyNext;
+    uint8_t historyCount;
+    float downlink;                     // Normalised downlink SNR
+    bool downlinkValid;
+
+    // SNR normalised to 0 dBm TX power at 125 kHz
+    static float normalise(float snr, const LinkParams& params);
+
+    // Fastest settings that keep margin (dB) above the demodulation floor
+    static LinkParams choose(float referenceSnr, float margin);
+
+    // TX power needed for the margin at a spreading factor and bandwidth
+    static float requiredPower(float referenceSnr, float margin, uint8_t spreadingFactor, uint16_t bandwidth);
+};
+
+#endif // ADR_ENGINE_H
@@ -0,0 +1,34 @@
+#include "airtime.h"
+
+namespace Airtime {
+
+uint32_t symbolUs(const LinkParams& params) {
+    // 2^SF chips at BW chips per second
+    return (uint32_t)(((uint64_t)1000 << params.spreadingFactor) / params.bandwidth);
+}
+
+bool lowDataRateOptimize(const LinkParams& params) {
+    return symbolUs(params) >= AIRTIME_LDRO_SYMBOL_US;
+}
+
+uint32_t timeOnAirUs(const LinkParams& params, size_t payloadLength, uint16_t preambleLength,
+                     bool explicitHeader, bool crc) {
+    uint8_t sf = params.spreadingFactor;
+
+    // SF5/6 have a longer sync sequence and no 8 bit header offset
+    uint32_t syncQuarterSymbols = sf < 7 ? 25 : 17;     // 6.25 or 4.25 symbols
+    int32_t bits = 8 * (int32_t)payloadLength + (crc ? 16 : 0) - 4 * sf + (sf < 7 ? 0 : 8) + (explicitHeader ? 20 : 0);
+    if (bits < 0) {
+        bits = 0;
+    }
+
+    // Payload bits are coded in blocks of 4*SF (4*(SF-2) with LDRO), each CR+4 symbols long
+    uint32_t divisor = 4 * (lowDataRateOptimize(params) && sf >= 7 ? sf - 2 : sf);
+    uint32_t blocks = (bits + divisor - 1) / divisor;
+    uint32_t quarterSymbols = (preambleLength + 8) * 4 + syncQuarterSymbols + blocks * params.codingRate * 4;
+
+    // In quarter symbols to keep the sync fraction exact
+    return (uint32_t)(((uint64_t)quarterSymbols * (1000000ULL << sf) / (params.bandwidth * 1000ULL)) / 4);
+}
+
+}  // namespace Airtime
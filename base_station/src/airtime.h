@@ -0,0 +1,26 @@
+#ifndef AIRTIME_H
+#define AIRTIME_H
+
+#include <Arduino.h>
+#include "link_params.h"
+
+// SX1262 time-on-air (datasheet section 6.1.4, same model as RadioLib's
+// getTimeOnAir) for the radio settings actually in use. Unlike the radio's
+// own getTimeOnAir() it can be asked about settings not applied yet.
+
+// Low data rate optimisation is switched on from this symbol time (RadioLib's rule)
+#define AIRTIME_LDRO_SYMBOL_US  16000
+
+namespace Airtime {
+    // Symbol duration in microseconds
+    uint32_t symbolUs(const LinkParams& params);
+
+    // Whether low data rate optimisation applies at these settings
+    bool lowDataRateOptimize(const LinkParams& params);
+
+    // Time on air of a payload in microseconds
+    uint32_t timeOnAirUs(const LinkParams& params, size_t payloadLength, uint16_t preambleLength,
+                         bool explicitHeader, bool crc);
+}
+
+#endif // AIRTIME_H
@@ -0,0 +1,70 @@
+#include "arq_receiver.h"
+
+ArqReceiver::ArqReceiver() :
+    started(false),
+    cumulative(0),
+    bitmap(0) {
+}
+
+bool ArqReceiver::onFrame(uint32_t id, uint32_t windowOffset) {
+    // Oldest ID the sender still cares about; IDs before it were delivered,
+    // given up on or never windowed (e.g. pings)
+    uint32_t lowEdge = id - windowOffset;
+
+    // First frame, or the sender restarted its IDs
+    if (!started || (int32_t)(lowEdge - cumulative) < -32) {
+        started = true;
+        cumulative = lowEdge - 1;
+        bitmap = 0;
+    }
+
+    // Skip anything the sender no longer waits for
+    if ((int32_t)(lowEdge - 1 - cumulative) > 0) {
+        advanceTo(lowEdge - 1);
+    }
+
+    // Keep the frame inside the bitmap
+    if ((int32_t)(id - cumulative) > 32) {
+        advanceTo(id - 32);
+    }
+
+    // Already covered by the cumulative ACK
+    if ((int32_t)(id - cumulative) <= 0) {
+        return false;
+    }
+
+    // Already received out of order
+    uint32_t bit = id - cumulative - 1;
+    if (bitmap & (1UL << bit)) {
+        return false;
+    }
+    bitmap |= 1UL << bit;
+
+    // Fold any contiguous run into the cumulative ID
+    while (bitmap & 1) {
+        cumulative++;
+        bitmap >>= 1;
+    }
+
+    return true;
+}
+
+uint32_t ArqReceiver::getCumulative() const {
+    return cumulative;
+}
+
+uint32_t ArqReceiver::getBitmap() const {
+    return bitmap;
+}
+
+void ArqReceiver::advanceTo(uint32_t newCumulative) {
+    uint32_t shift = newCumulative - cumulative;
+    bitmap = shift >= 32 ? 0 : bitmap >> shift;
+    cumulative = newCumulative;
+
+    // IDs received right after the new edge are now contiguous
+    while (bitmap & 1) {
+        cumulative++;
+        bitmap >>= 1;
+    }
+}
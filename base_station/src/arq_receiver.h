@@ -0,0 +1,32 @@
+#ifndef ARQ_RECEIVER_H
+#define ARQ_RECEIVER_H
+
+#include <Arduino.h>
+
+// Receiver side of the selective-repeat protocol. Tracks which windowed frame
+// IDs have arrived as a cumulative ID (everything up to and including it was
+// received) plus a bitmap of the 32 IDs after it, which is exactly what the
+// block ACK carries back to the sender.
+class ArqReceiver {
+public:
+    ArqReceiver();
+
+    // Record a windowed frame. windowOffset is the frame's distance from the
+    // oldest frame the sender still has outstanding. Returns false for a
+    // duplicate (already delivered) frame.
+    bool onFrame(uint32_t id, uint32_t windowOffset);
+
+    // State to report in the block ACK
+    uint32_t getCumulative() const;
+    uint32_t getBitmap() const;
+
+private:
+    bool started;
+    uint32_t cumulative;
+    uint32_t bitmap;        // Bit n set = ID cumulative + 1 + n received
+
+    // Move the cumulative ID forward to newCumulative
+    void advanceTo(uint32_t newCumulative);
+};
+
+#endif // ARQ_RECEIVER_H
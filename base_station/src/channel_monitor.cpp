@@ -0,0 +1,96 @@
+#include "channel_monitor.h"
+
+ChannelMonitor::ChannelMonitor() :
+    plan(Hopping::initialPlan(0)),
+    channels(),
+    leftOutAt(),
+    judgedFrom(),
+    stats() {
+}
+
+void ChannelMonitor::begin(uint16_t seed) {
+    plan = Hopping::initialPlan(seed);
+}
+
+void ChannelMonitor::onSlot(uint8_t channel, bool heard) {
+    if (channel < HOP_CHANNEL_COUNT) {
+        Hopping::record(channels[channel], heard);
+    }
+}
+
+void ChannelMonitor::onFrame(uint8_t channel, float rssi) {
+    if (channel < HOP_CHANNEL_COUNT) {
+        Hopping::recordRssi(channels[channel], rssi);
+    }
+}
+
+void ChannelMonitor::onCrcError(uint8_t channel) {
+    if (channel < HOP_CHANNEL_COUNT) {
+        channels[channel].crcErrors++;
+    }
+}
+
+void ChannelMonitor::update(uint32_t superframe) {
+    if (plan.changeAt > superframe) {
+        return;
+    }
+    plan.mask = plan.nextMask;
+
+    // Average error rate of the channels in use that have enough frames to judge
+    float total = 0.0f;
+    uint8_t judged = 0;
+    for (uint8_t i = 0; i < HOP_CHANNEL_COUNT; i++) {
+        if ((plan.mask & (1U << i)) && channels[i].frames - judgedFrom[i] >= HOP_MIN_FRAMES) {
+            total += channels[i].errorRate;
+            judged++;
+        }
+    }
+
+    uint16_t mask = plan.mask;
+    uint8_t inUse = __builtin_popcount(mask);
+    for (uint8_t i = 0; i < HOP_CHANNEL_COUNT; i++) {
+        uint16_t bit = 1U << i;
+        ChannelStats& channel = channels[i];
+
+        if (!(mask & bit)) {
+            // Give it another chance, judged afresh
+            if (superframe >= leftOutAt[i] + HOP_RETRY_SUPERFRAMES) {
+                mask |= bit;
+                channel.errorRate = 0.0f;
+                judgedFrom[i] = channel.frames;
+                stats.restored++;
+            }
+            continue;
+        }
+
+        if (channel.frames - judgedFrom[i] < HOP_MIN_FRAMES || judged < 2 || inUse <= HOP_MIN_CHANNELS) {
+            continue;
+        }
+        float others = (total - channel.errorRate) / (judged - 1);
+        if (channel.errorRate >= HOP_BLACKLIST_ERROR_RATE && channel.errorRate >= others + HOP_BLACKLIST_MARGIN) {
+            mask &= ~bit;
+            leftOutAt[i] = superframe + HOP_MASK_LEAD;
+            inUse--;
+            stats.blacklisted++;
+        }
+    }
+
+    // Remotes learn of it in the beacons before it applies
+    if (mask != plan.mask) {
+        plan.nextMask = mask;
+        plan.changeAt = superframe + HOP_MASK_LEAD;
+        stats.changes++;
+    }
+}
+
+const HopPlan& ChannelMonitor::getPlan() const {
+    return plan;
+}
+
+const ChannelStats& ChannelMonitor::getChannelStats(uint8_t channel) const {
+    return channels[channel < HOP_CHANNEL_COUNT ? channel : 0];
+}
+
+const HopStats& ChannelMonitor::getStats() const {
+    return stats;
+}
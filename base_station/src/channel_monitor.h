@@ -0,0 +1,57 @@
+#ifndef CHANNEL_MONITOR_H
+#define CHANNEL_MONITOR_H
+
+#include <Arduino.h>
+#include "hopping.h"
+
+// Base side of frequency hopping: how each channel of the plan does, and
+// which ones are in the hop set. Every slot with an owner is expected to
+// carry a frame; the share of those that don't arrive is a channel's error
+// rate. Remotes that have nothing to send, or have gone, raise it on every
+// channel alike, so a channel is only left out when it is also clearly
+// worse than the others. It is tried again after HOP_RETRY_SUPERFRAMES.
+
+#define HOP_BLACKLIST_ERROR_RATE  0.5f    // Error rate that gets a channel left out...
+#define HOP_BLACKLIST_MARGIN      0.25f   // ...if it is also this much above the others' average
+#define HOP_MIN_FRAMES            8       // Expected frames on a channel before it's judged
+#define HOP_MIN_CHANNELS          3       // Never hop on fewer
+#define HOP_RETRY_SUPERFRAMES     20      // Superframes a channel stays out of the hop set (1 h)
+
+// Hop set changes
+struct HopStats {
+    uint32_t changes;           // New hop sets announced
+    uint32_t blacklisted;       // Channels left out
+    uint32_t restored;          // Channels back in after HOP_RETRY_SUPERFRAMES
+};
+
+class ChannelMonitor {
+public:
+    ChannelMonitor();
+
+    // Start over with every channel in the hop set
+    void begin(uint16_t seed);
+
+    // A slot with an owner ended on a channel, with or without a frame in it
+    void onSlot(uint8_t channel, bool heard);
+
+    // A frame was received on a channel, or failed its CRC
+    void onFrame(uint8_t channel, float rssi);
+    void onCrcError(uint8_t channel);
+
+    // Before the beacon of a superframe: announce a new hop set if channels
+    // should be left out or put back (no more than one change pending)
+    void update(uint32_t superframe);
+
+    const HopPlan& getPlan() const;
+    const ChannelStats& getChannelStats(uint8_t channel) const;
+    const HopStats& getStats() const;
+
+private:
+    HopPlan plan;
+    ChannelStats channels[HOP_CHANNEL_COUNT];
+    uint32_t leftOutAt[HOP_CHANNEL_COUNT];  // First superframe without the channel
+    uint32_t judgedFrom[HOP_CHANNEL_COUNT]; // Frame count when the channel was last put back
+    HopStats stats;
+};
+
+#endif // CHANNEL_MONITOR_H
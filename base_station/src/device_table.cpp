@@ -0,0 +1,83 @@
+#include "device_table.h"
+
+DeviceTable::DeviceTable() {
+    clear();
+}
+
+DeviceEntry* DeviceTable::touch(uint32_t id) {
+    if (id == DEVICE_ID_EMPTY) {
+        return nullptr;
+    }
+
+    uint16_t slot = probe(id);
+    DeviceEntry& entry = entries[slot];
+    if (entry.id == id) {
+        return &entry;
+    }
+
+    // New device; keep the load low enough for short probe runs
+    if (used >= DEVICE_TABLE_MAX) {
+        stats.rejected++;
+        return nullptr;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.id = id;
+    entry.firstSeen = millis();
+    used++;
+    return &entry;
+}
+
+DeviceEntry* DeviceTable::find(uint32_t id) {
+    if (id == DEVICE_ID_EMPTY) {
+        return nullptr;
+    }
+
+    DeviceEntry& entry = entries[probe(id)];
+    return entry.id == id ? &entry : nullptr;
+}
+
+const DeviceEntry* DeviceTable::next(uint16_t* slot) const {
+    while (*slot < DEVICE_TABLE_SIZE) {
+        const DeviceEntry& entry = entries[(*slot)++];
+        if (entry.id != DEVICE_ID_EMPTY) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+void DeviceTable::clear() {
+    for (uint16_t i = 0; i < DEVICE_TABLE_SIZE; i++) {
+        entries[i].id = DEVICE_ID_EMPTY;
+    }
+    used = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+uint16_t DeviceTable::count() const {
+    return used;
+}
+
+const DeviceTableStats& DeviceTable::getStats() const {
+    return stats;
+}
+
+uint16_t DeviceTable::probe(uint32_t id) {
+    // Fibonacci hashing spreads sequential IDs (and MAC suffixes) across the table
+    uint16_t slot = (uint32_t)(id * 2654435761u) >> (32 - DEVICE_TABLE_BITS);
+    uint32_t probes = 1;
+
+    // Never full (DEVICE_TABLE_MAX < DEVICE_TABLE_SIZE), so an empty slot ends the run
+    while (entries[slot].id != id && entries[slot].id != DEVICE_ID_EMPTY) {
+        slot = (slot + 1) & (DEVICE_TABLE_SIZE - 1);
+        probes++;
+    }
+
+    stats.lookups++;
+    stats.probes += probes;
+    if (probes > stats.maxProbes) {
+        stats.maxProbes = probes;
+    }
+    return slot;
+}
@@ -0,0 +1,76 @@
+#ifndef DEVICE_TABLE_H
+#define DEVICE_TABLE_H
+
+#include <Arduino.h>
+#include "sequence_window.h"
+
+// State of every remote heard, keyed by the device ID each uplink carries
+// (FIELD_DEVICE_ID). Fixed-size open-addressing table with linear probing:
+// no allocation, and a lookup touches one or two slots on average as long as
+// the table stays at most three quarters full.
+
+// Slots (power of two); 2048 slots of 64 bytes = 128 KB
+#define DEVICE_TABLE_BITS    11
+#define DEVICE_TABLE_SIZE    (1 << DEVICE_TABLE_BITS)
+
+// Devices admitted before new ones are turned away (75% load)
+#define DEVICE_TABLE_MAX     1536
+
+// Marks an empty slot. Frames without a device ID (older remote firmware) are
+// filed under 0.
+#define DEVICE_ID_EMPTY      0xFFFFFFFF
+
+// What the base knows about one remote
+struct DeviceEntry {
+    uint32_t id;
+    uint32_t firstSeen;         // millis()
+    uint32_t lastSeen;
+    uint32_t packets;           // Frames received (a batched frame counts once)
+    uint32_t messages;          // Messages decoded (one per batched sample)
+    float snr;                  // Last uplink
+    int16_t rssi;
+    uint16_t batteryMv;         // Last reported, 0 = never
+    uint8_t batteryPercent;
+    bool charging;
+    uint16_t rtt;               // Remote's smoothed ACK round trip (0.1 ms), 0 = not reported
+    SequenceWindow sequence;    // Received message IDs (loss, reordering, duplicates)
+};
+
+// Lookup cost
+struct DeviceTableStats {
+    uint32_t lookups;
+    uint32_t probes;            // Slots examined by all lookups
+    uint32_t maxProbes;         // Longest single lookup
+    uint32_t rejected;          // New devices turned away because the table was full
+};
+
+class DeviceTable {
+public:
+    DeviceTable();
+
+    // Entry for a device, added on first sight. nullptr if the table is full.
+    DeviceEntry* touch(uint32_t id);
+
+    // Entry for a known device, or nullptr
+    DeviceEntry* find(uint32_t id);
+
+    // Iterate occupied entries: start with *slot = 0, nullptr after the last
+    const DeviceEntry* next(uint16_t* slot) const;
+
+    // Forget every device and the lookup statistics
+    void clear();
+
+    uint16_t count() const;
+
+    const DeviceTableStats& getStats() const;
+
+private:
+    DeviceEntry entries[DEVICE_TABLE_SIZE];
+    uint16_t used;
+    DeviceTableStats stats;
+
+    // Slot holding the ID, or the empty slot that ends its probe run
+    uint16_t probe(uint32_t id);
+};
+
+#endif // DEVICE_TABLE_H
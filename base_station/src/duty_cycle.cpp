@@ -0,0 +1,105 @@
+#include "duty_cycle.h"
+
+DutyCycle::DutyCycle() :
+    current(0),
+    bucketStart(0),
+    limitPermille(0),
+    stats() {
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void DutyCycle::setLimit(uint16_t permille) {
+    limitPermille = permille;
+}
+
+uint16_t DutyCycle::getLimit() const {
+    return limitPermille;
+}
+
+DutyDecision DutyCycle::check(uint32_t airtimeUs, TxPriority priority) {
+    advance();
+
+    if (limitPermille == 0 || usedUs() + airtimeUs <= shareUs(priority)) {
+        return DUTY_SEND;
+    }
+
+    // Data can wait for the budget; diagnostics and ACKs are worthless late
+    if (priority == TX_PRIORITY_NORMAL) {
+        stats.framesDeferred++;
+        return DUTY_DEFER;
+    }
+    stats.framesDropped++;
+    return DUTY_DROP;
+}
+
+void DutyCycle::record(uint32_t airtimeUs) {
+    advance();
+    buckets[current] += airtimeUs;
+    stats.framesSent++;
+    stats.airtimeTotalUs += airtimeUs;
+}
+
+uint32_t DutyCycle::waitMs(uint32_t airtimeUs, TxPriority priority) {
+    advance();
+
+    uint64_t used = usedUs();
+    uint64_t share = shareUs(priority);
+    if (limitPermille == 0 || used + airtimeUs <= share) {
+        return 0;
+    }
+
+    // Buckets expire oldest first: the k-th oldest once the current one is k + 1 buckets old
+    unsigned long intoBucket = millis() - bucketStart;
+    for (uint8_t k = 0; k < DUTY_BUCKETS - 1; k++) {
+        used -= buckets[(current + 1 + k) % DUTY_BUCKETS];
+        if (used + airtimeUs <= share) {
+            return (k + 1) * DUTY_BUCKET_MS - intoBucket;
+        }
+    }
+
+    // Only fits once the current bucket is gone too (or never, if larger than the share)
+    return DUTY_WINDOW_MS - intoBucket;
+}
+
+uint32_t DutyCycle::getAirtimeUsedMs() {
+    advance();
+    return usedUs() / 1000;
+}
+
+const DutyStats& DutyCycle::getStats() const {
+    return stats;
+}
+
+void DutyCycle::advance() {
+    unsigned long now = millis();
+
+    // Idle for the whole window: nothing left to remember
+    if (now - bucketStart >= DUTY_WINDOW_MS) {
+        memset(buckets, 0, sizeof(buckets));
+        bucketStart = now;
+        return;
+    }
+
+    while (now - bucketStart >= DUTY_BUCKET_MS) {
+        current = (current + 1) % DUTY_BUCKETS;
+        buckets[current] = 0;
+        bucketStart += DUTY_BUCKET_MS;
+    }
+}
+
+uint64_t DutyCycle::usedUs() const {
+    uint64_t total = 0;
+    for (uint8_t i = 0; i < DUTY_BUCKETS; i++) {
+        total += buckets[i];
+    }
+    return total;
+}
+
+uint64_t DutyCycle::shareUs(TxPriority priority) const {
+    uint64_t budget = (uint64_t)DUTY_WINDOW_MS * limitPermille;    // ms * permille = us
+    switch (priority) {
+        case TX_PRIORITY_LOW:    return budget * DUTY_LOW_SHARE / 100;
+        case TX_PRIORITY_NORMAL: return budget * DUTY_NORMAL_SHARE / 100;
+        default:                 return budget;
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <Arduino.h>
+
+// Forward error correction for transfers (see fragment.h). Fragments are
+// taken in groups of up to FEC_MAX_DATA, each followed by up to
+// FEC_MAX_PARITY parity fragments: a systematic Reed-Solomon erasure code
+// over GF(256) built on a Cauchy matrix, so any k of a group's fragments,
+// data or parity, give back its k data fragments. A short last fragment
+// counts as padded with zeros. Identical copies in both trees.
+
+#define FEC_MAX_DATA        32      // Data fragments per group
+#define FEC_MAX_PARITY      4       // Parity fragments per group
+#define FEC_FIELD_OVERHEAD  4       // FIELD_FEC: tag, length and two varints
+
+#if FEC_MAX_DATA + FEC_MAX_PARITY > 256
+#error "Cauchy matrix needs distinct field elements for every row and column"
+#endif
+
+namespace Fec {
+    // Weight of data fragment `data` in parity fragment `parity`
+    uint8_t coefficient(uint8_t parity, uint8_t data);
+
+    // Product in GF(256)
+    uint8_t multiply(uint8_t a, uint8_t b);
+
+    // out[i] ^= c * in[i] for length bytes
+    void multiplyAdd(uint8_t* out, const uint8_t* in, size_t length, uint8_t c);
+
+    // Invert an n x n matrix (row-major, n up to FEC_MAX_PARITY) in place.
+    // False if it's singular.
+    bool invert(uint8_t* matrix, uint8_t n);
+}
+
+#endif // FEC_H
@@ -0,0 +1,136 @@
+#include "fragment.h"
+
+namespace Fragment {
+
+uint16_t count(uint32_t totalLength, uint16_t fragmentSize) {
+    return fragmentSize == 0 ? 0 : (totalLength + fragmentSize - 1) / fragmentSize;
+}
+
+uint16_t parityCount(uint16_t fragments, uint8_t groupData, uint8_t groupParity) {
+    if (groupData == 0 || groupParity == 0) return 0;
+    return (fragments + groupData - 1) / groupData * groupParity;
+}
+
+uint16_t groupOf(uint16_t index, uint16_t fragments, uint8_t groupData, uint8_t groupParity) {
+    if (groupData == 0 || groupParity == 0) return index;
+    return index < fragments ? index / groupData : (index - fragments) / groupParity;
+}
+
+size_t encode(uint8_t* buffer, size_t size, uint32_t id, uint32_t timestamp, uint8_t flags,
+              uint32_t deviceId, const FragmentInfo& fragment) {
+    size_t offset = WireFormat::writeHeader(buffer, size, WIRE_TYPE_FRAGMENT, flags, id, timestamp);
+    if (offset == 0) return 0;
+
+    // Varints first, then the data, as one bytes field
+    uint8_t body[FRAG_FIELD_OVERHEAD + FRAG_DATA_SIZE];
+    uint32_t values[] = { fragment.transfer, fragment.totalLength, fragment.fragmentSize, fragment.index };
+    size_t length = 0;
+    for (size_t i = 0; i < 4; i++) {
+        length += WireFormat::writeVarint(body + length, sizeof(body) - length, values[i]);
+    }
+    if (fragment.length > sizeof(body) - length) return 0;
+    memcpy(body + length, fragment.data, fragment.length);
+    length += fragment.length;
+
+    size_t n = WireFormat::writeBytes(buffer + offset, size - offset, FIELD_FRAGMENT, body, length);
+    if (n == 0) return 0;
+    offset += n;
+
+    if (fragment.groupParity > 0) {
+        uint8_t fec[4];
+        size_t m = WireFormat::writeVarint(fec, sizeof(fec), fragment.groupData);
+        m += WireFormat::writeVarint(fec + m, sizeof(fec) - m, fragment.groupParity);
+        n = WireFormat::writeBytes(buffer + offset, size - offset, FIELD_FEC, fec, m);
+        if (n == 0) return 0;
+        offset += n;
+    }
+
+    n = WireFormat::writeDeviceId(buffer + offset, size - offset, deviceId);
+    if (n == 0) return 0;
+    return offset + n;
+}
+
+bool decode(const uint8_t* buffer, size_t length, FragmentInfo& fragment) {
+    FrameHeader header;
+    size_t offset = WireFormat::readHeader(buffer, length, header);
+    if (offset == 0 || header.type != WIRE_TYPE_FRAGMENT) {
+        return false;
+    }
+
+    const uint8_t* body = nullptr;
+    uint32_t bodyLength = 0;
+    uint32_t fec[2] = { 0, 0 };
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(buffer + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        if (wireType != WIRE_BYTES) {
+            continue;
+        }
+        if (fieldId == FIELD_FRAGMENT) {
+            body = bytes;
+            bodyLength = raw;
+        } else if (fieldId == FIELD_FEC) {
+            size_t used = 0;
+            for (size_t i = 0; i < 2; i++) {
+                size_t m = WireFormat::readVarint(bytes + used, raw - used, &fec[i]);
+                if (m == 0) {
+                    return false;
+                }
+                used += m;
+            }
+        }
+    }
+    if (body == nullptr) {
+        return false;
+    }
+
+    uint32_t values[4];
+    size_t used = 0;
+    for (size_t i = 0; i < 4; i++) {
+        size_t m = WireFormat::readVarint(body + used, bodyLength - used, &values[i]);
+        if (m == 0) {
+            return false;
+        }
+        used += m;
+    }
+
+    // Within limits, and the data is exactly what the index says it should be
+    if (values[0] > 0xFFFF || values[1] == 0 || values[1] > FRAG_MAX_TRANSFER_SIZE ||
+        values[2] < FRAG_MIN_DATA_SIZE || values[2] > FRAG_DATA_SIZE) {
+        return false;
+    }
+    if (fec[1] > 0 && (fec[1] > FEC_MAX_PARITY || fec[0] < fec[1] || fec[0] > FEC_MAX_DATA)) {
+        return false;
+    }
+    uint16_t fragments = count(values[1], values[2]);
+    if (values[3] >= fragments + parityCount(fragments, fec[0], fec[1])) {
+        return false;
+    }
+    uint32_t expected = values[2];
+    if (values[3] < fragments) {
+        uint32_t start = values[3] * values[2];
+        expected = values[1] - start < values[2] ? values[1] - start : values[2];
+    }
+    if (bodyLength - used != expected) {
+        return false;
+    }
+
+    fragment.transfer = values[0];
+    fragment.totalLength = values[1];
+    fragment.fragmentSize = values[2];
+    fragment.index = values[3];
+    fragment.data = body + used;
+    fragment.length = expected;
+    fragment.groupData = fec[1] > 0 ? fec[0] : 0;
+    fragment.groupParity = fec[1];
+    return true;
+}
+
+} // namespace Fragment
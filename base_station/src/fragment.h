@@ -0,0 +1,63 @@
+#ifndef FRAGMENT_H
+#define FRAGMENT_H
+
+#include <Arduino.h>
+#include "wire_format.h"
+#include "fec.h"
+
+// Transfers larger than a frame: the remote splits the data into numbered
+// fragments and sends them through its ARQ window, so the base's block ACKs
+// ask again for exactly the fragments that didn't arrive. The base collects
+// them in a fixed pool (see reassembly.h) and forwards the transfer once it
+// has every fragment. Each fragment is a WIRE_TYPE_FRAGMENT frame with
+// FIELD_FRAGMENT and FIELD_DEVICE_ID, plus FIELD_FEC when the transfer
+// carries parity fragments (see fec.h). See docs/protocol.md.
+
+#define FRAG_MAX_TRANSFER_SIZE  65536   // Largest transfer, bytes
+#define FRAG_DATA_SIZE          200     // Data bytes per fragment
+#define FRAG_TDMA_DATA_SIZE     40      // Per fragment in TDMA mode (fits TDMA_SLOT_FRAME_SIZE)
+#define FRAG_MIN_DATA_SIZE      32      // Smallest fragment size the base accepts
+#define FRAG_MAX_FRAGMENTS      (FRAG_MAX_TRANSFER_SIZE / FRAG_MIN_DATA_SIZE)
+
+// Fragment indices, parity included. Data fragments come first, then the
+// parity fragments group by group; a group has at least as many data
+// fragments as parity ones.
+#define FRAG_MAX_INDEX          (2 * FRAG_MAX_FRAGMENTS + FEC_MAX_DATA)
+
+// Largest FIELD_FRAGMENT header: tag, length and four varints
+#define FRAG_FIELD_OVERHEAD     14
+
+// One fragment of a transfer
+struct FragmentInfo {
+    uint16_t transfer;          // Transfer ID, per sender
+    uint32_t totalLength;       // Bytes in the whole transfer
+    uint16_t fragmentSize;      // Data bytes in every fragment but the last
+    uint16_t index;             // Parity fragments follow the data fragments
+    const uint8_t* data;        // Points into the frame (or the sender's data)
+    uint16_t length;
+    uint8_t groupData;          // Data fragments per FEC group (0: no FEC)
+    uint8_t groupParity;        // Parity fragments per FEC group
+};
+
+namespace Fragment {
+    // Number of fragments a transfer is split into
+    uint16_t count(uint32_t totalLength, uint16_t fragmentSize);
+
+    // Number of parity fragments for that many data fragments
+    uint16_t parityCount(uint16_t fragments, uint8_t groupData, uint8_t groupParity);
+
+    // FEC group of a fragment index
+    uint16_t groupOf(uint16_t index, uint16_t fragments, uint8_t groupData, uint8_t groupParity);
+
+    // Fragment frame: header, FIELD_FRAGMENT (transfer, total length,
+    // fragment size and index as varints, then the data), FIELD_FEC if the
+    // fragment has groupParity, and FIELD_DEVICE_ID. Returns the frame
+    // length, 0 if out of space.
+    size_t encode(uint8_t* buffer, size_t size, uint32_t id, uint32_t timestamp, uint8_t flags,
+                  uint32_t deviceId, const FragmentInfo& fragment);
+
+    // Find FIELD_FRAGMENT in a frame; false if it has none or it doesn't add up
+    bool decode(const uint8_t* buffer, size_t length, FragmentInfo& fragment);
+}
+
+#endif // FRAGMENT_H
@@ -0,0 +1,37 @@
+#include "heap_count.h"
+
+static uint32_t allocationCount = 0;
+
+extern "C" {
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    // realloc(ptr, 0) frees
+    if (size > 0) {
+        __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+    }
+    return __real_realloc(ptr, size);
+}
+
+}
+
+namespace HeapCount {
+
+uint32_t allocations() {
+    return __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+}
+
+}  // namespace HeapCount
@@ -0,0 +1,17 @@
+#ifndef HEAP_COUNT_H
+#define HEAP_COUNT_H
+
+#include <Arduino.h>
+
+// Count of heap allocations, to check that per-packet paths don't allocate.
+// malloc, calloc and realloc are wrapped at link time (the -Wl,--wrap flags
+// of the base_station environment in platformio.ini), which also catches new
+// and Arduino String. IDF code calling heap_caps_malloc() directly (FreeRTOS,
+// drivers) isn't counted.
+
+namespace HeapCount {
+    // Allocations since boot, from every task
+    uint32_t allocations();
+}
+
+#endif // HEAP_COUNT_H
@@ -0,0 +1,48 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <Arduino.h>
+
+// Running latency statistics in microseconds: an EWMA for the current value
+// and a log2 histogram for the distribution, in constant memory and time per
+// sample.
+
+// Histogram buckets: bucket 0 holds samples under LATENCY_BUCKET0_US, bucket i
+// [LATENCY_BUCKET0_US << (i - 1), LATENCY_BUCKET0_US << i), the last one everything above
+#define LATENCY_BUCKETS      16
+#define LATENCY_BUCKET0_US   1024    // ~1 ms; the last bucket starts at ~16.8 s
+
+// Weight of a new sample in the EWMA is 1 / 2^LATENCY_EWMA_SHIFT (1/8, as TCP's smoothed RTT)
+#define LATENCY_EWMA_SHIFT   3
+
+class LatencyStats {
+public:
+    LatencyStats();
+
+    void record(uint32_t us);
+
+    uint32_t getCount() const;
+    uint32_t getEwmaUs() const;
+    uint32_t getMinUs() const;
+    uint32_t getMaxUs() const;
+
+    // Sample counts per bucket (LATENCY_BUCKETS of them)
+    const uint32_t* getHistogram() const;
+
+    // Upper limit of the bucket the given percentile (1-100) falls in, 0 without samples
+    uint32_t percentileUs(uint8_t percent) const;
+
+    // Upper limit of a bucket (UINT32_MAX for the last)
+    static uint32_t bucketLimitUs(uint8_t bucket);
+
+    void clear();
+
+private:
+    uint32_t count;
+    uint32_t ewmaUs;
+    uint32_t minUs;
+    uint32_t maxUs;
+    uint32_t buckets[LATENCY_BUCKETS];
+};
+
+#endif // LATENCY_STATS_H
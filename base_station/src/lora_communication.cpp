@@ -1,9 +1,22 @@
 #include "lora_communication.h"
+#include "serial_manager.h"
 #include <time.h>
+#include <esp_timer.h>
 
 // Initialize message ID counter
 uint32_t nextMessageId = 1;
 
+// Every message fits a frame at its longest, protocol fields included
+static_assert(Schema::PING.maxSize <= MAX_PACKET_SIZE, "ping doesn't fit MAX_PACKET_SIZE");
+static_assert(Schema::PONG.maxSize <= MAX_PACKET_SIZE, "pong doesn't fit MAX_PACKET_SIZE");
+static_assert(Schema::DATA.maxSize <= RX_FRAME_SIZE, "data doesn't fit a receive ring slot");
+static_assert(Schema::STATUS.maxSize <= RX_FRAME_SIZE, "status doesn't fit a receive ring slot");
+
+// State shared with the DIO1 interrupt handler
+static TaskHandle_t rxTaskHandle = nullptr;
+static volatile bool rxArmed = false;        // Radio is in RX mode, DIO1 means RX done
+static volatile uint32_t rxIrqAt = 0;        // micros() of the last RX-done interrupt
+
 // Global instance
 LoRaCommunication loraCommunication;
 
@@ -11,7 +24,45 @@ LoRaCommunication::LoRaCommunication() :
     // For Heltec WiFi LoRa 32 V3 with original schematic pins
     // The pin discovery test confirmed these are the correct pins
     lora(new Module(LORA_CS_PIN, LORA_DIO1_PIN, LORA_RST_PIN, LORA_BUSY_PIN, SPI, SPISettings(2000000, MSBFIRST, SPI_MODE0))),
-    isInitialized(false) {
+    isInitialized(false),
+    radioMutex(nullptr),
+    frameHeld(false),
+    rxStats(),
+    lastPollAt(0),
+    windowReceivers(),
+    batchBuffer(nullptr),
+    batchLength(0),
+    batchCount(0),
+    batchIndex(0),
+    batchRssi(0),
+    batchSnr(0.0),
+    batchHasDevice(false),
+    batchDevice(0),
+    codecResync(false),
+    resyncDevice(0),
+    adrState(ADR_STABLE),
+    linkParams(LinkRate::defaults(LORA_BANDWIDTH, LORA_SPREADING_FACTOR, LORA_CODING_RATE, LORA_POWER)),
+    previousParams(linkParams),
+    proposedParams(linkParams),
+    reportedParams(linkParams),
+    adrSequence(0),
+    proposalsSent(0),
+    lastHeardAt(0),
+    switchedAt(0),
+    adrStats(),
+    txDoneAt(0),
+    pingSentAt(0),
+    pingPending(false),
+    nextBeaconAt(0),
+    beaconSequence(0),
+    radioChannel(HOP_HOME),
+    hopChannel(HOP_HOME),
+    hopSlot(WIRE_NO_SLOT),
+    hopSlotExpected(false),
+    hopSlotHeard(false),
+    hopNextAt(0) {
+    dutyCycle.setLimit(LORA_DUTY_CYCLE_PERMILLE);
+    
     // Initialize SPI explicitly for ESP32-S3 with the working pin configuration
     SPI.begin(LORA_SCK_PIN, LORA_MISO_PIN, LORA_MOSI_PIN, LORA_CS_PIN); // SCK, MISO, MOSI, SS
 }
@@ -57,144 +108,740 @@ bool LoRaCommunication::begin() {
         lora.setCRC(true);
     }
     
+    // Serializes SPI access between the radio task and loop()
+    radioMutex = xSemaphoreCreateMutex();
+    
+    // First beacon as soon as the radio task runs
+    nextBeaconAt = esp_timer_get_time();
+    
+    // Our own hop sequence, so bases in range of each other mostly miss each other
+    channelMonitor.begin(LORA_HOP_SEED != 0 ? LORA_HOP_SEED : (uint16_t)(ESP.getEfuseMac() >> 24));
+    
+#if LORA_RX_USE_IRQ
+    // Radio task drains the FIFO as soon as DIO1 signals RX done
+    xTaskCreatePinnedToCore(radioTask, "lora_rx", RX_TASK_STACK_SIZE, this,
+                            RX_TASK_PRIORITY, &rxTaskHandle, RX_TASK_CORE);
+    lora.setDio1Action(onDio1Interrupt);
+#endif
+    
     Serial.println(F("LoRa module initialized!"));
     isInitialized = true;
+    
+    // Start listening
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    armReceiver();
+    xSemaphoreGive(radioMutex);
+    
     return true;
 }
 
-bool LoRaCommunication::sendMessage(const char* type, JsonDocument& payload, int* rssi, float* snr) {
+bool LoRaCommunication::sendMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload,
+                                     int* rssi, float* snr) {
     if (!isInitialized) {
-        Serial.println(F("LoRa module not initialized"));
+        serialManager.sendError("LoRa module not initialized");
         return false;
     }
     
-    // Create the message document
-    StaticJsonDocument<MAX_PACKET_SIZE> doc;
-    
-    // Build the message
-    buildMessage(doc, type, payload);
-    
-    // Serialize the JSON document to a string
-    char buffer[MAX_PACKET_SIZE];
-    size_t bytes = serializeJson(doc, buffer, MAX_PACKET_SIZE);
+    // Build the binary frame
+    uint8_t buffer[MAX_PACKET_SIZE];
+    uint32_t messageId = 0;
+    size_t bytes = buildMessage(buffer, sizeof(buffer), message, metrics, payload, &messageId);
+    if (bytes == 0) {
+        serialManager.sendError("Failed to encode message");
+        return false;
+    }
     
     // Send the message with retries
     for (int attempt = 0; attempt < MAX_RETRIES; attempt++) {
-        // Print debug info
-        Serial.print(F("Sending message (attempt "));
-        Serial.print(attempt + 1);
-        Serial.print(F("): "));
-        Serial.println(buffer);
+        char text[64];
+        snprintf(text, sizeof(text), "Sending message (attempt %d): %s #%lu, %u bytes", attempt + 1, message.name,
+                 (unsigned long)messageId, (unsigned)bytes);
+        serialManager.debug(text);
+        
+        // Our own messages give way to ACKs when the budget runs short
+        xSemaphoreTake(radioMutex, portMAX_DELAY);
+        DutyDecision decision = dutyCycle.check(frameAirtimeUs(bytes), TX_PRIORITY_LOW);
+        xSemaphoreGive(radioMutex);
+        if (decision != DUTY_SEND) {
+            serialManager.sendError("Duty cycle budget exhausted, message dropped");
+            return false;
+        }
         
         // Transmit the packet
-        int state = lora.transmit(buffer, bytes);
+        int state = transmitFrame(buffer, bytes);
         if (state != RADIOLIB_ERR_NONE) {
-            Serial.print(F("Transmission failed! Error code: "));
-            Serial.println(state);
-            delay(100 * (attempt + 1));  // Exponential backoff
+            snprintf(text, sizeof(text), "Transmission failed! Error code: %d", state);
+            serialManager.log(text);
+            // Back off by the frame's airtime per attempt, longer at slow settings
+            delay((attempt + 1) * (frameAirtimeUs(bytes) / 1000 + 1));
             continue;
         }
         
-        // For the base station, no need to wait for acknowledgment unless it's a ping
-        if (strcmp(type, MSG_TYPE_PING) == 0) {
-            // TODO: Implement ping response handling if needed
-            // For now, just consider it successful
+        // No ACK for our messages; a ping is answered by a pong, timed in receiveMessage()
+        if (message.type == WIRE_TYPE_PING) {
+            pingSentAt = txDoneAt;
+            pingPending = true;
         }
         
         return true;
     }
     
-    Serial.println(F("Failed to send message after max retries"));
+    serialManager.sendError("Failed to send message after max retries");
     return false;
 }
 
-bool LoRaCommunication::receiveMessage(JsonDocument& doc, int* rssi, float* snr) {
+bool LoRaCommunication::receiveMessage(JsonDocument& doc, DecodedMessage& message, int* rssi, float* snr) {
     if (!isInitialized) {
-        Serial.println(F("LoRa module not initialized"));
+        serialManager.log("LoRa module not initialized");
         return false;
     }
     
-    // Check if a packet is available
-    if (!lora.available()) {
+    // Hand out the remaining samples of a batched frame one at a time
+    if (batchIndex < batchCount) {
+        return receiveSample(doc, message, rssi, snr);
+    }
+    
+    // Done with the previous frame and its samples
+    releaseFrame();
+    
+    // Take the oldest frame captured by the radio task. It's decoded where it
+    // is, and stays in the ring until the handler is done with the message.
+    RawFrame* frame = rxRing.peek();
+    if (frame == nullptr) {
         return false;
     }
+    frameHeld = true;
     
-    // Receive the packet
-    String message = "";
-    int state = lora.readData(message);
+    // Track how long frames wait between capture and decoding
+    uint32_t queueLatency = micros() - frame->capturedAt;
+    if (queueLatency > rxStats.queueLatencyMaxUs) {
+        rxStats.queueLatencyMaxUs = queueLatency;
+    }
     
-    // Get RSSI and SNR
+    // Get RSSI and SNR captured with the frame
     if (rssi != nullptr) {
-        *rssi = lora.getRSSI();
+        *rssi = frame->rssi;
     }
     if (snr != nullptr) {
-        *snr = lora.getSNR();
+        *snr = frame->snr;
     }
     
-    // Check for errors
-    if (state != RADIOLIB_ERR_NONE) {
-        Serial.print(F("Reception failed! Error code: "));
-        Serial.println(state);
+    uint8_t* buffer = frame->data;
+    size_t length = frame->length;
+    uint32_t capturedAt = frame->capturedAt;
+    uint8_t channel = frame->channel;
+    
+    // Windowed frames are acknowledged per burst and may arrive twice
+    FrameHeader header;
+    bool validHeader = WireFormat::readHeader(buffer, length, header) > 0;
+    bool windowed = validHeader && (header.flags & WIRE_FLAG_WINDOWED);
+    
+    // Answer to our ping: time it from our TX done to its RX done
+    if (validHeader && header.type == WIRE_TYPE_PONG && pingPending) {
+        uint32_t rtt = capturedAt - pingSentAt;
+        pingPending = false;
+        if (rtt < PING_RTT_TIMEOUT * 1000UL) {
+            pingRtt.record(rtt);
+            char text[32];
+            snprintf(text, sizeof(text), "Ping RTT %lu us", (unsigned long)rtt);
+            serialManager.debug(text);
+        }
+    }
+    // Part of a transfer: collected, not decoded
+    if (windowed && header.type == WIRE_TYPE_FRAGMENT) {
+        return receiveFragment(buffer, length, header, channel, doc, message);
+    }
+    
+    if (windowed && !handleWindowedFrame(buffer, length, header, channel)) {
+        rxStats.duplicates++;
+        char text[48];
+        snprintf(text, sizeof(text), "Duplicate windowed frame #%lu", (unsigned long)header.id);
+        serialManager.debug(text);
         return false;
     }
     
-    // Print debug info
-    Serial.print(F("Received: "));
-    Serial.println(message);
+    // Batched data frame: keep it and return its samples as separate messages
+    uint8_t samples = WireFormat::countSamples(buffer, length);
+    if (samples > 0) {
+        batchBuffer = buffer;
+        WireFormat::readHeader(batchBuffer, length, batchHeader);
+        batchLength = length;
+        batchCount = samples;
+        batchIndex = 0;
+        batchRssi = rssi != nullptr ? *rssi : 0;
+        batchSnr = snr != nullptr ? *snr : 0.0;
+        batchHasDevice = WireFormat::findRawField(batchBuffer, length, FIELD_DEVICE_ID, &batchDevice);
+        rxStats.batchedFrames++;
+        rxStats.batchedSamples += samples;
+        return receiveSample(doc, message, rssi, snr);
+    }
     
-    // Parse the JSON document
-    DeserializationError error = deserializeJson(doc, message);
-    if (error) {
-        Serial.print(F("JSON parsing failed: "));
-        Serial.println(error.c_str());
+    // Decode the binary frame through its message schema, then into the JSON
+    // layout used on serial; the payload points into the frame
+    if (!Schema::decode(buffer, length, message)) {
+        rxStats.decodeErrors++;
+        char text[48];
+        snprintf(text, sizeof(text), "Frame decoding failed, %u bytes", (unsigned)length);
+        serialManager.debug(text);
         return false;
     }
+    Schema::toJson(message, doc);
+    echoReceived(doc);
+    
+    return true;
+}
+
+void LoRaCommunication::releaseFrame() {
+    if (frameHeld) {
+        rxRing.pop();
+        frameHeld = false;
+    }
+}
+
+bool LoRaCommunication::receiveSample(JsonDocument& doc, DecodedMessage& message, int* rssi, float* snr) {
+    uint8_t index = batchIndex++;
     
-    // Send acknowledgment for most message types
-    if (doc.containsKey("id") && 
-        doc.containsKey("type") && 
-        strcmp(doc["type"], MSG_TYPE_PONG) != 0) {  // Don't ack an ack
-        sendAcknowledgment(doc["id"]);
+    // All samples of a batch arrived with the same signal
+    if (rssi != nullptr) {
+        *rssi = batchRssi;
+    }
+    if (snr != nullptr) {
+        *snr = batchSnr;
     }
     
+    // Samples are compressed against the previous one or an earlier frame
+    // of the same remote
+    uint32_t device = batchHasDevice ? batchDevice : 0;
+    uint8_t fieldId;
+    const uint8_t* body;
+    size_t bodyLength;
+    bool decoded = WireFormat::findSample(batchBuffer, batchLength, index, &fieldId, &body, &bodyLength) &&
+                   metricDecoder.decode(device, fieldId, body, bodyLength, index == 0, message.metrics);
+    
+    // Last sample: the frame can now serve as a reference
+    if (batchIndex == batchCount) {
+        metricDecoder.frameDone(device, batchHeader.id);
+    }
+    
+    if (!decoded) {
+        // Most likely the reference is gone (e.g. after a reboot); ask this
+        // remote for a keyframe. The ACKs are sent under the mutex.
+        xSemaphoreTake(radioMutex, portMAX_DELAY);
+        resyncDevice = device;
+        codecResync = true;
+        xSemaphoreGive(radioMutex);
+        char text[64];
+        snprintf(text, sizeof(text), "Sample decoding failed, frame #%lu index %u", (unsigned long)batchHeader.id, index);
+        serialManager.debug(text);
+        return false;
+    }
+    
+    message.header = batchHeader;
+    message.device = device;
+    message.payload = nullptr;
+    message.sample = index;
+    message.samples = batchCount;
+    Schema::toJson(message, doc);
+    echoReceived(doc);
+    
     return true;
 }
 
-void LoRaCommunication::checkForIncomingMessages(void (*messageHandler)(const char* type, JsonDocument& doc, int rssi, float snr)) {
-    if (!isInitialized || messageHandler == nullptr) {
+void LoRaCommunication::echoReceived(const JsonDocument& doc) {
+    // In binary mode the message already goes out as a data record; JSON
+    // text of it would undo what the binary records save
+    if (!serialManager.isDebugEnabled() || serialManager.getOutputMode() == SERIAL_OUTPUT_BINARY) {
         return;
     }
     
-    // Check if a packet is available
-    if (!lora.available()) {
+    char text[SERIAL_BUFFER_SIZE];
+    size_t length = snprintf(text, sizeof(text), "Received: ");
+    serializeJson(doc, text + length, sizeof(text) - length);
+    serialManager.debug(text);
+}
+
+void LoRaCommunication::checkForIncomingMessages(void (*messageHandler)(const DecodedMessage& message, JsonDocument& doc, int rssi, float snr)) {
+    if (!isInitialized || messageHandler == nullptr) {
         return;
     }
     
-    // Receive the message
-    StaticJsonDocument<MAX_PACKET_SIZE> doc;
+#if !LORA_RX_USE_IRQ
+    // Polled mode: the receiver sits idle until loop() comes around again
+    uint32_t now = micros();
+    if (lastPollAt != 0 && now - lastPollAt > rxStats.pollGapMaxUs) {
+        rxStats.pollGapMaxUs = now - lastPollAt;
+    }
+    lastPollAt = now;
+    
+    if (digitalRead(LORA_DIO1_PIN) == HIGH) {
+        rxIrqAt = now;
+        serviceReceive();
+    }
+#endif
+    
+    // Adaptive data rate decisions and timeouts
+    adrPoll();
+    
+    // Transfers the remote stopped sending
+    reassembly.expire(millis());
+    
+    // Decode everything captured since the last call
+    StaticJsonDocument<RX_DOC_SIZE> doc;
+    DecodedMessage message;
     int rssi = 0;
     float snr = 0.0;
     
-    if (receiveMessage(doc, &rssi, &snr)) {
-        // Extract the message type
-        if (doc.containsKey("type")) {
-            const char* type = doc["type"];
+    while (rxRing.count() > 0 || batchIndex < batchCount) {
+        doc.clear();
+        uint32_t allocationsBefore = HeapCount::allocations();
+        if (receiveMessage(doc, message, &rssi, &snr)) {
+            // The remote's average ACK SNR is the downlink side of the link margin
+            if (Schema::has<FIELD_SNR>(message.metrics)) {
+                xSemaphoreTake(radioMutex, portMAX_DELAY);
+                adrEngine.onDownlink(Schema::get<FIELD_SNR>(message.metrics), linkParams);
+                xSemaphoreGive(radioMutex);
+            }
             
             // Call the message handler
-            messageHandler(type, doc, rssi, snr);
+            messageHandler(message, doc, rssi, snr);
+            
+            // A completed transfer has been forwarded by now
+            reassembly.releaseComplete();
+        }
+        
+        // Frames are read into the ring and decoded in place, and documents
+        // are fixed-size: this should stay at zero
+        uint32_t allocations = HeapCount::allocations() - allocationsBefore;
+        rxStats.heapAllocations += allocations;
+        if (allocations > rxStats.heapAllocationsMax) {
+            rxStats.heapAllocationsMax = allocations;
+        }
+    }
+}
+
+void LoRaCommunication::serviceReceive() {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    
+    // Ignore stray wakeups (e.g. the receiver was disarmed for a transmission)
+    if (!rxArmed) {
+        xSemaphoreGive(radioMutex);
+        return;
+    }
+    rxArmed = false;
+    uint32_t irqAt = rxIrqAt;
+    
+    // Drain the FIFO straight into the ring
+    RawFrame* slot = rxRing.reserve();
+    if (slot == nullptr) {
+        // Decoder fell behind, the frame is lost
+        rxStats.framesDropped++;
+    } else {
+        size_t length = lora.getPacketLength();
+        if (length > RX_FRAME_SIZE) {
+            length = RX_FRAME_SIZE;
         }
+        int state = lora.readData(slot->data, length);
+        
+        if (state == RADIOLIB_ERR_NONE) {
+            slot->capturedAt = irqAt;
+            slot->length = length;
+            slot->rssi = lora.getRSSI();
+            slot->snr = lora.getSNR();
+            slot->channel = radioChannel;
+            hopSlotHeard = true;
+            channelMonitor.onFrame(radioChannel, slot->rssi);
+            
+            // Check before committing; once published the slot belongs to loop()
+            FrameHeader header;
+            bool ackNeeded = WireFormat::readHeader(slot->data, length, header) > 0 &&
+                             (header.type == WIRE_TYPE_PING || header.type == WIRE_TYPE_DATA ||
+                              header.type == WIRE_TYPE_STATUS) &&
+                             !(header.flags & WIRE_FLAG_WINDOWED);
+            int16_t rssi = slot->rssi;
+            float snr = slot->snr;
+            
+            // Link margin and ADR handshake, also before committing
+            adrOnReceive(slot->data, length, rssi, snr);
+            uint16_t tdmaSlot = WIRE_NO_SLOT;
+            uint8_t slotFlags = ackNeeded ? slotAckFlags(slot->data, length, &tdmaSlot) : 0;
+            
+            rxRing.commit();
+            rxStats.framesReceived++;
+            
+            uint32_t depth = rxRing.count();
+            if (depth > rxStats.ringHighWater) {
+                rxStats.ringHighWater = depth;
+            }
+            
+            // Acknowledge straight from the radio task, before any decoding
+            if (ackNeeded) {
+                uint32_t device = 0;
+                WireFormat::findRawField(slot->data, length, FIELD_DEVICE_ID, &device);
+                transmitAck(device, header.id, rssi, snr, irqAt, slotFlags, tdmaSlot);
+            }
+        } else if (state == RADIOLIB_ERR_CRC_MISMATCH) {
+            rxStats.crcErrors++;
+            channelMonitor.onCrcError(radioChannel);
+        } else {
+            rxStats.readErrors++;
+        }
+    }
+    
+    // Listen again as quickly as possible
+    armReceiver();
+    
+    // Time the receiver was deaf after RX done
+    uint32_t deadTime = micros() - irqAt;
+    rxStats.deadTimeLastUs = deadTime;
+    rxStats.deadTimeTotalUs += deadTime;
+    if (deadTime > rxStats.deadTimeMaxUs) {
+        rxStats.deadTimeMaxUs = deadTime;
+    }
+    
+    xSemaphoreGive(radioMutex);
+}
+
+const RxStats& LoRaCommunication::getRxStats() const {
+    return rxStats;
+}
+
+const CodecStats& LoRaCommunication::getCodecStats() const {
+    return metricDecoder.getStats();
+}
+
+const LinkParams& LoRaCommunication::getLinkParams() const {
+    return linkParams;
+}
+
+const AdrStats& LoRaCommunication::getAdrStats() const {
+    return adrStats;
+}
+
+uint32_t LoRaCommunication::getAirtimePerHourMs() {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    uint32_t airtime = dutyCycle.getAirtimeUsedMs();
+    xSemaphoreGive(radioMutex);
+    return airtime;
+}
+
+const DutyStats& LoRaCommunication::getDutyStats() const {
+    return dutyCycle.getStats();
+}
+
+const LatencyStats& LoRaCommunication::getPingRttStats() const {
+    return pingRtt;
+}
+
+const TdmaScheduler& LoRaCommunication::getTdmaScheduler() const {
+    return tdmaScheduler;
+}
+
+const ChannelMonitor& LoRaCommunication::getChannelMonitor() const {
+    return channelMonitor;
+}
+
+uint32_t LoRaCommunication::frameAirtimeUs(size_t length) const {
+    return Airtime::timeOnAirUs(linkParams, length, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC);
+}
+
+void LoRaCommunication::transmitAck(uint32_t device, uint32_t messageId, int16_t rssi, float snr, uint32_t irqAt,
+                                    uint8_t slotFlags, uint16_t slot) {
+    // Caller must hold radioMutex. Over the full budget the remote retries instead.
+    if (dutyCycle.check(frameAirtimeUs(WIRE_MAX_ACK_SIZE), TX_PRIORITY_HIGH) != DUTY_SEND) {
+        return;
+    }
+    
+    AckFrame ack;
+    ack.id = messageId;
+    ack.flags = adrAckFlags(&ack.linkParams) | slotFlags | resyncAckFlag(device);
+    ack.slot = slot;
+    ack.rssi = rssi;
+    ack.snr = snr;
+    
+    // Turnaround from RX done to the start of the ACK transmission
+    uint32_t turnaround = micros() - irqAt;
+    ack.turnaroundUs = turnaround > 0xFFFF ? 0xFFFF : turnaround;
+    
+    uint8_t frame[WIRE_MAX_ACK_SIZE];
+    size_t length = WireFormat::encodeAck(frame, sizeof(frame), ack);
+    
+    // DIO1 also signals TX done; rxArmed is already false so the task ignores it
+    if (lora.transmit(frame, length) != RADIOLIB_ERR_NONE) {
+        rxStats.ackErrors++;
+        return;
+    }
+    dutyCycle.record(frameAirtimeUs(length));
+    adrAfterAck(ack.flags);
+    
+    rxStats.acksSent++;
+    rxStats.ackTurnaroundLastUs = turnaround;
+    rxStats.ackTurnaroundTotalUs += turnaround;
+    if (turnaround > rxStats.ackTurnaroundMaxUs) {
+        rxStats.ackTurnaroundMaxUs = turnaround;
     }
 }
 
-bool LoRaCommunication::sendAcknowledgment(uint32_t messageId) {
-    // Create a pong response with the same ID
-    StaticJsonDocument<200> response;
-    response["type"] = MSG_TYPE_PONG;
-    response["id"] = messageId;
-    response["timestamp"] = millis() / 1000;
+uint8_t LoRaCommunication::slotAckFlags(const uint8_t* data, size_t length, uint16_t* slot) {
+    // Caller must hold radioMutex. Only remotes running TDMA ask for a slot.
+    uint32_t deviceId = 0;
+    if (!LORA_TDMA_ENABLE || length < WIRE_MIN_FRAME_SIZE || !(data[1] & WIRE_FLAG_TDMA) ||
+        Tdma::dedicatedSlots(tdmaScheduler.getLayout()) == 0 ||
+        !WireFormat::findRawField(data, length, FIELD_DEVICE_ID, &deviceId)) {
+        return 0;
+    }
     
-    // Send the acknowledgment
-    return sendMessage(MSG_TYPE_PONG, response);
+    // Every ACK carries the slot, so a remote that lost it (or never had one) learns it
+    *slot = tdmaScheduler.slotFor(deviceId, millis());
+    return WIRE_ACK_FLAG_SLOT;
+}
+
+void LoRaCommunication::beaconPoll() {
+    int64_t now = esp_timer_get_time();
+    if (now < nextBeaconAt) {
+        return;
+    }
+    
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    
+    // Slots sized for the radio settings in use
+    SuperframeLayout layout = Tdma::plan(TDMA_SUPERFRAME_MS,
+                                         frameAirtimeUs(TDMA_MAX_BEACON_SIZE + (LORA_HOP_ENABLE ? HOP_MAX_FIELD_SIZE : 0)),
+                                         frameAirtimeUs(TDMA_SLOT_FRAME_SIZE), frameAirtimeUs(WIRE_MAX_BLOCK_ACK_SIZE));
+    tdmaScheduler.setLayout(layout);
+    
+    // Remotes take the start out of the delay; more than a guard late (the
+    // mutex was held for a long transmission) and the beacon is skipped
+    uint8_t beacon[TDMA_MAX_BEACON_SIZE + HOP_MAX_FIELD_SIZE];
+    int64_t startAt = esp_timer_get_time();
+    uint32_t delayUs = startAt - nextBeaconAt;
+    size_t length = Tdma::encodeBeacon(beacon, sizeof(beacon), beaconSequence, millis() / 1000, layout, delayUs);
+    
+    // Hop set for this superframe and any change coming up
+    if (LORA_HOP_ENABLE && length > 0) {
+        channelMonitor.update(beaconSequence);
+        size_t n = Hopping::writeBeaconField(beacon + length, sizeof(beacon) - length, channelMonitor.getPlan(), beaconSequence);
+        length = n > 0 ? length + n : 0;
+    }
+    
+    bool sent = false;
+    if (length > 0 && delayUs <= TDMA_GUARD_MS * 1000 &&
+        dutyCycle.check(frameAirtimeUs(length), TX_PRIORITY_HIGH) == DUTY_SEND) {
+        // DIO1 also signals TX done; make sure the radio task ignores it
+        rxArmed = false;
+        tune(HOP_HOME);
+        if (lora.transmit(beacon, length) == RADIOLIB_ERR_NONE) {
+            dutyCycle.record(frameAirtimeUs(length));
+            sent = true;
+        }
+        armReceiver();
+    }
+    tdmaScheduler.countBeacon(sent);
+    
+    xSemaphoreGive(radioMutex);
+    
+    // A skipped beacon keeps its superframe number, so remotes count periods right
+    do {
+        beaconSequence++;
+        nextBeaconAt += (int64_t)TDMA_SUPERFRAME_MS * 1000;
+    } while (nextBeaconAt <= now);
+}
+
+void LoRaCommunication::hopPoll() {
+    int64_t now = esp_timer_get_time();
+    if (now < hopNextAt) {
+        return;
+    }
+    
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    
+    // The slot just over: did its owner's frame arrive?
+    if (hopSlot != WIRE_NO_SLOT && hopSlotExpected) {
+        channelMonitor.onSlot(hopChannel, hopSlotHeard);
+    }
+    
+    // Slot of the superframe we're in; before slot 0 and after the last one
+    // the beacon is on LORA_FREQUENCY
+    const SuperframeLayout& layout = tdmaScheduler.getLayout();
+    int64_t firstSlotAt = nextBeaconAt - (int64_t)TDMA_SUPERFRAME_MS * 1000 + (int64_t)layout.firstSlotMs * 1000;
+    int64_t slotUs = (int64_t)layout.slotMs * 1000;
+    hopSlot = WIRE_NO_SLOT;
+    hopNextAt = nextBeaconAt;
+    if (beaconSequence > 0 && slotUs > 0) {
+        if (now < firstSlotAt) {
+            hopNextAt = firstSlotAt;
+        } else if ((now - firstSlotAt) / slotUs < layout.slotCount) {
+            hopSlot = (now - firstSlotAt) / slotUs;
+            hopNextAt = firstSlotAt + (hopSlot + 1) * slotUs;
+        }
+    }
+    
+    // Slots with an owner and the shared ones hop; free ones stay on
+    // LORA_FREQUENCY for remotes sending without a slot
+    bool shared = hopSlot != WIRE_NO_SLOT && hopSlot >= Tdma::dedicatedSlots(layout);
+    hopSlotExpected = hopSlot != WIRE_NO_SLOT && !shared && tdmaScheduler.isAssigned(hopSlot);
+    hopSlotHeard = false;
+    hopChannel = shared || hopSlotExpected ? Hopping::channelFor(channelMonitor.getPlan(), beaconSequence - 1, hopSlot) : HOP_HOME;
+    
+    if (hopChannel != radioChannel) {
+        tune(hopChannel);
+        armReceiver();
+    }
+    
+    xSemaphoreGive(radioMutex);
+}
+
+void LoRaCommunication::tune(uint8_t channel) {
+    // Caller must hold radioMutex. The frequency only changes in standby.
+    if (!LORA_HOP_ENABLE || channel == radioChannel) {
+        return;
+    }
+    rxArmed = false;
+    lora.standby();
+    
+    // The image calibration done by begin() covers the whole band; skip it on every hop
+    float frequency = channel == HOP_HOME ? LORA_FREQUENCY : Hopping::frequencyMhz(channel);
+    // Counted, not printed: this runs in the radio task and on the receive
+    // path, and neither writes to the port
+    if (lora.setFrequency(frequency, false) != RADIOLIB_ERR_NONE) {
+        rxStats.radioErrors++;
+        return;
+    }
+    radioChannel = channel;
+}
+
+TickType_t LoRaCommunication::tdmaWaitTicks() const {
+    // Rounded up; the beacon reports how late it started
+    int64_t wakeAt = LORA_HOP_ENABLE && hopNextAt < nextBeaconAt ? hopNextAt : nextBeaconAt;
+    int64_t wait = wakeAt - esp_timer_get_time();
+    return wait > 0 ? pdMS_TO_TICKS((wait + 999) / 1000) : 0;
+}
+
+uint8_t LoRaCommunication::resyncAckFlag(uint32_t device) {
+    if (!codecResync || resyncDevice != device) {
+        return 0;
+    }
+    codecResync = false;
+    return WIRE_ACK_FLAG_RESYNC;
+}
+
+ArqReceiver& LoRaCommunication::windowReceiver(uint32_t device) {
+    WindowReceiver* oldest = &windowReceivers[0];
+    for (uint8_t i = 0; i < ARQ_RECEIVERS; i++) {
+        WindowReceiver& receiver = windowReceivers[i];
+        if (receiver.used && receiver.device == device) {
+            receiver.lastAt = millis();
+            return receiver.arq;
+        }
+        if (!receiver.used || (oldest->used && (int32_t)(receiver.lastAt - oldest->lastAt) < 0)) {
+            oldest = &receiver;
+        }
+    }
+    
+    // Starts over from the window the remote reports with its next frame
+    oldest->used = true;
+    oldest->device = device;
+    oldest->lastAt = millis();
+    oldest->arq = ArqReceiver();
+    return oldest->arq;
+}
+
+bool LoRaCommunication::handleWindowedFrame(const uint8_t* buffer, size_t length, const FrameHeader& header, uint8_t channel,
+                                            bool accept) {
+    uint32_t windowOffset = 0;
+    uint32_t device = 0;
+    WireFormat::findRawField(buffer, length, FIELD_WINDOW_OFFSET, &windowOffset);
+    WireFormat::findRawField(buffer, length, FIELD_DEVICE_ID, &device);
+    ArqReceiver& arq = windowReceiver(device);
+    bool isNew = accept && arq.onFrame(header.id, windowOffset);
+    
+    // Last frame of the burst: report everything received so far. Built and
+    // sent under the mutex so the ADR handshake can't change in between.
+    // Over the full budget the remote's timeout and probe recover the burst.
+    if (header.flags & WIRE_FLAG_ACK_REQ) {
+        xSemaphoreTake(radioMutex, portMAX_DELAY);
+        
+        if (dutyCycle.check(frameAirtimeUs(WIRE_MAX_BLOCK_ACK_SIZE), TX_PRIORITY_HIGH) != DUTY_SEND) {
+            xSemaphoreGive(radioMutex);
+            return isNew;
+        }
+        
+        uint8_t ack[WIRE_MAX_BLOCK_ACK_SIZE];
+        uint32_t packedParams = 0;
+        uint16_t slot = WIRE_NO_SLOT;
+        uint8_t flags = adrAckFlags(&packedParams) | slotAckFlags(buffer, length, &slot) | resyncAckFlag(device);
+        size_t ackLength = WireFormat::encodeBlockAck(ack, sizeof(ack), header.id, millis() / 1000,
+                                                      arq.getCumulative(), arq.getBitmap(),
+                                                      flags, packedParams, slot);
+        
+        // DIO1 also signals TX done; make sure the radio task ignores it.
+        // The slot may be over by now, the remote still listens where it sent.
+        rxArmed = false;
+        tune(channel);
+        if (ackLength > 0 && lora.transmit(ack, ackLength) == RADIOLIB_ERR_NONE) {
+            rxStats.blockAcks++;
+            dutyCycle.record(frameAirtimeUs(ackLength));
+            adrAfterAck(flags);
+        }
+        tune(hopChannel);
+        armReceiver();
+        
+        xSemaphoreGive(radioMutex);
+    }
+    
+    return isNew;
+}
+
+bool LoRaCommunication::receiveFragment(const uint8_t* buffer, size_t length, const FrameHeader& header, uint8_t channel,
+                                       JsonDocument& doc, DecodedMessage& message) {
+    FragmentInfo fragment;
+    uint32_t device = 0;
+    bool valid = Fragment::decode(buffer, length, fragment);
+    WireFormat::findRawField(buffer, length, FIELD_DEVICE_ID, &device);
+    
+    // Only what the pool took is acknowledged; the rest comes again
+    FragmentOutcome outcome = valid ? reassembly.store(device, fragment) : FRAG_NO_ROOM;
+    bool isNew = handleWindowedFrame(buffer, length, header, channel, outcome != FRAG_NO_ROOM);
+    if (!isNew && outcome != FRAG_COMPLETE) {
+        if (!valid) {
+            rxStats.decodeErrors++;
+            char text[48];
+            snprintf(text, sizeof(text), "Fragment decoding failed, frame #%lu", (unsigned long)header.id);
+            serialManager.debug(text);
+        } else if (outcome != FRAG_NO_ROOM) {
+            rxStats.duplicates++;
+        }
+        return false;
+    }
+    
+    // Every new frame is reported, so the device's loss tracking sees its ID
+    message.header = header;
+    message.device = device;
+    MetricCodec::clear(message.metrics);
+    message.metrics.timestamp = header.timestamp;
+    message.payload = nullptr;
+    message.sample = 0;
+    message.samples = 0;
+    
+    doc["type"] = MSG_TYPE_FRAGMENT;
+    doc["id"] = header.id;
+    doc["timestamp"] = header.timestamp;
+    doc["device"] = device;
+    doc["transfer"] = fragment.transfer;
+    doc["index"] = fragment.index;
+    doc["fragments"] = Fragment::count(fragment.totalLength, fragment.fragmentSize);
+    doc["length"] = fragment.totalLength;
+    if (outcome == FRAG_COMPLETE) {
+        doc["complete"] = true;
+        char text[48];
+        snprintf(text, sizeof(text), "Transfer %u complete, %lu bytes", fragment.transfer,
+                 (unsigned long)fragment.totalLength);
+        serialManager.debug(text);
+    }
+    return true;
+}
+
+const ReassemblyPool& LoRaCommunication::getReassembly() const {
+    return reassembly;
 }
 
 uint32_t LoRaCommunication::getNextMessageId() {
@@ -203,15 +850,21 @@ uint32_t LoRaCommunication::getNextMessageId() {
 
 void LoRaCommunication::sleep() {
     if (isInitialized) {
+        xSemaphoreTake(radioMutex, portMAX_DELAY);
+        rxArmed = false;
         lora.sleep();
-        Serial.println(F("LoRa module in sleep mode"));
+        xSemaphoreGive(radioMutex);
+        serialManager.log("LoRa module in sleep mode");
     }
 }
 
 void LoRaCommunication::wakeup() {
     if (isInitialized) {
+        xSemaphoreTake(radioMutex, portMAX_DELAY);
         lora.standby();
-        Serial.println(F("LoRa module woken up"));
+        armReceiver();
+        xSemaphoreGive(radioMutex);
+        serialManager.log("LoRa module woken up");
     }
 }
 
@@ -219,23 +872,205 @@ SX1262* LoRaCommunication::getModule() {
     return &lora;
 }
 
-void LoRaCommunication::buildMessage(JsonDocument& doc, const char* type, const JsonDocument& payload) {
-    // Set message type
-    doc["type"] = type;
+size_t LoRaCommunication::buildMessage(uint8_t* buffer, size_t size, const MessageSchema& message, const MetricRecord* metrics,
+                                       const char* payload, uint32_t* messageId) {
+    // Assign the message ID
+    *messageId = getNextMessageId();
     
-    // Set message ID
-    doc["id"] = getNextMessageId();
+    // Encode header (type, ID, seconds since boot) followed by metrics and payload
+    return Schema::encode(buffer, size, message, *messageId, millis() / 1000, metrics, payload);
+}
+
+int LoRaCommunication::transmitFrame(const uint8_t* data, size_t length) {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    
+    // DIO1 also signals TX done; make sure the radio task ignores it.
+    // Remotes only listen outside their slots on LORA_FREQUENCY.
+    rxArmed = false;
+    tune(HOP_HOME);
+    int state = lora.transmit(data, length);
+    txDoneAt = micros();
+    if (state == RADIOLIB_ERR_NONE) {
+        dutyCycle.record(frameAirtimeUs(length));
+    }
+    
+    // Go back to listening
+    tune(hopChannel);
+    armReceiver();
+    
+    xSemaphoreGive(radioMutex);
+    return state;
+}
+
+void LoRaCommunication::adrOnReceive(const uint8_t* data, size_t length, int rssi, float snr) {
+    // Caller must hold radioMutex
+    lastHeardAt = millis();
+    adrEngine.onUplink(rssi, snr, linkParams);
+    
+    // Hearing the remote at all confirms the new settings
+    if (adrState == ADR_PROBATION) {
+        adrState = ADR_STABLE;
+    }
+    
+    // Remote echoed our proposal: it's ready, switch after the next ACK
+    uint32_t packed = 0;
+    if (adrState == ADR_PROPOSING && WireFormat::findRawField(data, length, FIELD_LINK_PARAMS, &packed) &&
+        packed == LinkRate::pack(proposedParams, adrSequence)) {
+        adrState = ADR_SWITCH_PENDING;
+    }
+}
+
+uint8_t LoRaCommunication::adrAckFlags(uint32_t* packedParams) {
+    // Caller must hold radioMutex
+    *packedParams = 0;
+    
+    if (adrState == ADR_SWITCH_PENDING) {
+        return WIRE_ACK_FLAG_SWITCH;
+    }
     
-    // Set timestamp (seconds since boot)
-    doc["timestamp"] = millis() / 1000;
+    if (adrState == ADR_PROPOSING) {
+        // Remote isn't taking it (or can't hear us); wait for fresh history
+        if (proposalsSent >= ADR_PROPOSAL_ATTEMPTS) {
+            adrState = ADR_STABLE;
+            adrEngine.reset();
+            return 0;
+        }
+        proposalsSent++;
+        *packedParams = LinkRate::pack(proposedParams, adrSequence);
+        return WIRE_ACK_FLAG_PARAMS;
+    }
+    
+    return 0;
+}
+
+void LoRaCommunication::adrAfterAck(uint8_t flags) {
+    // Caller must hold radioMutex; the radio is in standby after the ACK
+    if (!(flags & WIRE_ACK_FLAG_SWITCH) || adrState != ADR_SWITCH_PENDING) {
+        return;
+    }
     
-    // Copy metrics if present
-    if (payload.containsKey("metrics")) {
-        doc["metrics"] = payload["metrics"];
+    previousParams = linkParams;
+    if (switchParams(proposedParams)) {
+        adrStats.switches++;
+        adrState = ADR_PROBATION;
+        switchedAt = millis();
+    } else {
+        adrState = ADR_STABLE;
     }
+}
+
+void LoRaCommunication::adrPoll() {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    uint32_t now = millis();
+    bool proposed = false;
+    
+    if (adrState == ADR_PROBATION && now - switchedAt >= ADR_PROBATION_TIMEOUT) {
+        // Remote never showed up on the new settings
+        rxArmed = false;
+        lora.standby();
+        switchParams(previousParams);
+        armReceiver();
+        adrStats.rollbacks++;
+        adrState = ADR_STABLE;
+    } else if (now - lastHeardAt >= ADR_LINK_LOST_TIMEOUT && !LinkRate::equal(linkParams, LinkRate::fallback())) {
+        // Nothing heard for a long time; meet the remote on the fallback settings
+        rxArmed = false;
+        lora.standby();
+        switchParams(LinkRate::fallback());
+        armReceiver();
+        adrStats.fallbacks++;
+        adrState = ADR_STABLE;
+        lastHeardAt = now;
+    } else if (LORA_ADR_ENABLE && adrState == ADR_STABLE && adrEngine.evaluate(linkParams, proposedParams)) {
+        // Offer the new settings in the next ACKs
+        adrSequence++;
+        proposalsSent = 0;
+        adrState = ADR_PROPOSING;
+        adrStats.proposals++;
+        proposed = true;
+    }
+    
+    // Report changes made by the radio task or above
+    bool changed = !LinkRate::equal(linkParams, reportedParams);
+    reportedParams = linkParams;
+    xSemaphoreGive(radioMutex);
+    
+    // Called on the receive path, so through the serial egress ring
+    char text[96];
+    char params[32];
+    if (proposed) {
+        LinkRate::format(params, sizeof(params), proposedParams);
+        snprintf(text, sizeof(text), "ADR proposing %s, link SNR %.2f dB at 0 dBm/125 kHz", params,
+                 adrEngine.getReferenceSnr());
+        serialManager.log(text);
+    }
+    if (changed) {
+        LinkRate::format(params, sizeof(params), reportedParams);
+        snprintf(text, sizeof(text), "Link settings now %s", params);
+        serialManager.log(text);
+    }
+}
+
+bool LoRaCommunication::switchParams(const LinkParams& params) {
+    // Caller must hold radioMutex
+    int state = LinkRate::apply(lora, params);
+    if (state != RADIOLIB_ERR_NONE) {
+        // Leave the radio as it was rather than half configured
+        LinkRate::apply(lora, linkParams);
+        return false;
+    }
+    
+    linkParams = params;
+    adrEngine.reset();
+    return true;
+}
+
+void LoRaCommunication::armReceiver() {
+    // Caller must hold radioMutex
+    // Counted, not printed, like a failed channel change
+    if (lora.startReceive() != RADIOLIB_ERR_NONE) {
+        rxStats.radioErrors++;
+        return;
+    }
+    rxArmed = true;
+}
+
+void LoRaCommunication::radioTask(void* param) {
+    LoRaCommunication* self = static_cast<LoRaCommunication*>(param);
+    
+    for (;;) {
+        // Sleep until the DIO1 interrupt fires, or the next beacon or slot is due
+        uint32_t pending = ulTaskNotifyTake(pdTRUE, LORA_TDMA_ENABLE ? self->tdmaWaitTicks() : portMAX_DELAY);
+        
+        // More than one interrupt before we got here means the FIFO was
+        // overwritten at least once
+        if (pending > 1) {
+            self->rxStats.irqOverruns += pending - 1;
+        }
+        
+        if (pending > 0) {
+            self->serviceReceive();
+        }
+        
+        if (LORA_TDMA_ENABLE) {
+            self->beaconPoll();
+        }
+        if (LORA_HOP_ENABLE) {
+            self->hopPoll();
+        }
+    }
+}
+
+void IRAM_ATTR LoRaCommunication::onDio1Interrupt() {
+    if (!rxArmed || rxTaskHandle == nullptr) {
+        return;
+    }
+    
+    rxIrqAt = micros();
     
-    // Copy payload if present
-    if (payload.containsKey("payload")) {
-        doc["payload"] = payload["payload"];
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(rxTaskHandle, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
     }
 }
@@ -4,6 +4,19 @@
 #include <Arduino.h>
 #include <RadioLib.h>
 #include <ArduinoJson.h>
+#include "wire_format.h"
+#include "message_schema.h"
+#include "rx_ring.h"
+#include "arq_receiver.h"
+#include "metric_codec.h"
+#include "adr_engine.h"
+#include "airtime.h"
+#include "duty_cycle.h"
+#include "latency_stats.h"
+#include "tdma_scheduler.h"
+#include "channel_monitor.h"
+#include "reassembly.h"
+#include "heap_count.h"
 
 // LoRa module pins for Heltec WiFi LoRa 32 V3 (ESP32-S3)
 // Using pins confirmed by pin discovery testing
@@ -26,16 +39,93 @@
 #define LORA_PREAMBLE_LENGTH 8       // symbols - minimal preamble length
 #define LORA_ENABLE_CRC      true    // Enable CRC checking
 
-// Message types
-#define MSG_TYPE_PING    "ping"
-#define MSG_TYPE_PONG    "pong"
-#define MSG_TYPE_DATA    "data"
-#define MSG_TYPE_STATUS  "status"
+// Regulatory duty cycle, permille of airtime per hour (EU868: 1%, US915: no limit)
+#define LORA_DUTY_CYCLE_PERMILLE ((LORA_FREQUENCY) < 900.0 ? 10 : 0)
+
+// Serial "type" of fragment messages (other message types: see message_schema.h)
+#define MSG_TYPE_FRAGMENT "fragment"
 
 // Communication parameters
 #define MAX_PACKET_SIZE    256   // Maximum size of packet to send
 #define MAX_RETRIES        3     // Maximum number of transmission retries
 #define ACK_TIMEOUT        1000  // Timeout for acknowledgment in ms
+#define RX_DOC_SIZE        512   // JSON document for one decoded message or sample
+
+// Receive path: 1 = DIO1 interrupt wakes a radio task that drains the FIFO,
+// 0 = loop() polls DIO1 (kept for comparing RX dead time)
+#define LORA_RX_USE_IRQ      1
+#define RX_TASK_PRIORITY     (configMAX_PRIORITIES - 2)
+#define RX_TASK_STACK_SIZE   4096
+#define RX_TASK_CORE         0   // loop() runs on core 1
+
+// Adaptive data rate: 1 = propose radio settings from the measured link
+// margin (see adr_engine.h), 0 = keep the LORA_* settings
+#define LORA_ADR_ENABLE        1
+#define ADR_PROPOSAL_ATTEMPTS  3        // ACKs carrying a proposal before it's dropped
+#define ADR_PROBATION_TIMEOUT  600000   // ms to hear the remote on new settings before rolling back
+#define ADR_LINK_LOST_TIMEOUT  1800000  // ms without any frame before falling back to LINK_FALLBACK_*
+
+// TDMA: 1 = broadcast a beacon every TDMA_SUPERFRAME_MS from the radio task and
+// hand each remote an uplink slot in its ACKs (see tdma.h), 0 = no beacons
+#define LORA_TDMA_ENABLE       0
+
+#if LORA_TDMA_ENABLE && !LORA_RX_USE_IRQ
+#error "TDMA beacons are sent by the radio task, which needs LORA_RX_USE_IRQ"
+#endif
+
+// Frequency hopping: 1 = listen in each TDMA slot on the channel the hop plan
+// gives it and leave out channels that lose frames (see hopping.h and
+// channel_monitor.h), 0 = stay on LORA_FREQUENCY
+#define LORA_HOP_ENABLE        0
+#define LORA_HOP_SEED          0        // Seed of the hop sequence (0 = from the MAC address, so nearby bases differ)
+
+#if LORA_HOP_ENABLE && !LORA_TDMA_ENABLE
+#error "Frequency hopping follows the TDMA slots, it needs LORA_TDMA_ENABLE"
+#endif
+
+// A pong later than this after our ping isn't counted as its answer
+#define PING_RTT_TIMEOUT       10000    // ms
+
+// Remotes whose windowed receive state is kept at once; the one heard from
+// least recently gives its state up to a new one, and starts over from its
+// window the next time it sends a burst
+#define ARQ_RECEIVERS          8
+
+// Receive path statistics
+struct RxStats {
+    uint32_t framesReceived;     // Frames drained into the ring
+    uint32_t framesDropped;      // Frames lost because the ring was full
+    uint32_t crcErrors;
+    uint32_t readErrors;
+    uint32_t decodeErrors;       // Frames that didn't decode (bad header or fields)
+    uint32_t irqOverruns;        // RX-done interrupts not serviced before the next one
+    uint32_t deadTimeLastUs;     // RX done to FIFO drained and receiver re-armed
+    uint32_t deadTimeMaxUs;
+    uint64_t deadTimeTotalUs;
+    uint32_t pollGapMaxUs;       // Longest gap between polls (polled mode only)
+    uint32_t queueLatencyMaxUs;  // Capture to decode
+    uint32_t ringHighWater;
+    uint32_t duplicates;         // Windowed frames received again after a lost block ACK
+    uint32_t blockAcks;          // Block ACKs sent for windowed bursts
+    uint32_t batchedFrames;      // Data frames carrying several samples
+    uint32_t batchedSamples;
+    uint32_t acksSent;           // Fixed ACKs sent by the radio task
+    uint32_t ackErrors;
+    uint32_t radioErrors;        // Channel changes and receiver starts the radio refused
+    uint32_t ackTurnaroundLastUs; // RX done to ACK transmit start
+    uint32_t ackTurnaroundMaxUs;
+    uint64_t ackTurnaroundTotalUs;
+    uint32_t heapAllocations;    // While decoding and handling messages; other tasks' count too (heap_count.h)
+    uint32_t heapAllocationsMax; // Most for one message
+};
+
+// Adaptive data rate statistics
+struct AdrStats {
+    uint32_t proposals;          // New settings offered to the remote
+    uint32_t switches;           // Settings changed by the handshake
+    uint32_t rollbacks;          // Remote not heard on new settings, previous ones restored
+    uint32_t fallbacks;          // Link lost, robust fallback settings applied
+};
 
 // Message IDs
 extern uint32_t nextMessageId;
@@ -47,17 +137,50 @@ public:
     // Initialize the LoRa module
     bool begin();
     
-    // Send JSON message and wait for acknowledgment
-    bool sendMessage(const char* type, JsonDocument& payload, int* rssi = nullptr, float* snr = nullptr);
+    // Encode a message as a binary frame and send it. The schema decides
+    // which fields of metrics (nullptr = none) and whether payload go in the frame.
+    bool sendMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload = nullptr,
+                     int* rssi = nullptr, float* snr = nullptr);
     
-    // Check if a message is available and receive it
-    bool receiveMessage(JsonDocument& doc, int* rssi = nullptr, float* snr = nullptr);
+    // Take the oldest captured frame from the receive ring and decode it,
+    // into message and into the JSON layout used on serial. A batched frame
+    // is returned as one message per sample. Decoded in place: the payload
+    // and strings in doc point into the frame, which stays in the ring
+    // until the next call.
+    bool receiveMessage(JsonDocument& doc, DecodedMessage& message, int* rssi = nullptr, float* snr = nullptr);
     
     // Check for incoming messages and process them
-    void checkForIncomingMessages(void (*messageHandler)(const char* type, JsonDocument& doc, int rssi, float snr));
+    void checkForIncomingMessages(void (*messageHandler)(const DecodedMessage& message, JsonDocument& doc, int rssi, float snr));
     
-    // Send an acknowledgment
-    bool sendAcknowledgment(uint32_t messageId);
+    // Drain a received frame from the radio into the ring and re-arm the receiver
+    void serviceReceive();
+    
+    // Get receive path statistics
+    const RxStats& getRxStats() const;
+    
+    // Get sample decompression statistics
+    const CodecStats& getCodecStats() const;
+    
+    // Radio settings in use, and adaptive data rate statistics
+    const LinkParams& getLinkParams() const;
+    const AdrStats& getAdrStats() const;
+    
+    // Transmit airtime in the last hour and duty-cycle statistics
+    uint32_t getAirtimePerHourMs();
+    const DutyStats& getDutyStats() const;
+    
+    // Round-trip time of our pings: TX done to the pong's RX-done interrupt
+    const LatencyStats& getPingRttStats() const;
+    
+    // TDMA superframe layout, slot owners and beacon statistics
+    const TdmaScheduler& getTdmaScheduler() const;
+    
+    // Hop set and per-channel statistics
+    const ChannelMonitor& getChannelMonitor() const;
+    
+    // Transfers being collected from fragments. A fragment message with
+    // "complete" set means its transfer can be read until the handler returns.
+    const ReassemblyPool& getReassembly() const;
     
     // Get the next message ID
     uint32_t getNextMessageId();
@@ -74,9 +197,157 @@ public:
 private:
     SX1262 lora;
     bool isInitialized;
+    SemaphoreHandle_t radioMutex;
+    RxRing rxRing;
+    bool frameHeld;             // The ring's oldest frame is being decoded in place
+    RxStats rxStats;
+    uint32_t lastPollAt;
+    
+    // Windowed receive state, per remote (window IDs are per sender)
+    struct WindowReceiver {
+        bool used;
+        uint32_t device;
+        uint32_t lastAt;        // millis() of its last windowed frame
+        ArqReceiver arq;
+    };
+    WindowReceiver windowReceivers[ARQ_RECEIVERS];
+    
+    ReassemblyPool reassembly;  // Only touched from loop()
+    
+    // Batched frame whose samples are being handed out (the held frame)
+    const uint8_t* batchBuffer;
+    FrameHeader batchHeader;
+    size_t batchLength;
+    uint8_t batchCount;
+    uint8_t batchIndex;
+    int batchRssi;
+    float batchSnr;
+    bool batchHasDevice;
+    uint32_t batchDevice;
+    
+    // Decompression of batched samples
+    MetricDecoder metricDecoder;
+    bool codecResync;           // Ask resyncDevice for a keyframe in the next ACK to it (under radioMutex)
+    uint32_t resyncDevice;
+    
+    // Adaptive data rate handshake, all under radioMutex
+    enum AdrState {
+        ADR_STABLE,
+        ADR_PROPOSING,          // Proposal goes out in the next ACKs
+        ADR_SWITCH_PENDING,     // Remote echoed it, switch after the next ACK
+        ADR_PROBATION           // Switched, waiting to hear the remote on the new settings
+    };
+    AdrEngine adrEngine;
+    AdrState adrState;
+    LinkParams linkParams;      // Settings in use
+    LinkParams previousParams;  // Restored if the remote isn't heard after a switch
+    LinkParams proposedParams;
+    LinkParams reportedParams;  // Last settings printed from loop()
+    uint8_t adrSequence;
+    uint8_t proposalsSent;
+    uint32_t lastHeardAt;       // millis() of the last frame received
+    uint32_t switchedAt;
+    AdrStats adrStats;
+    
+    // Airtime budget, under radioMutex. ACKs may use all of it, our own messages less.
+    DutyCycle dutyCycle;
+    
+    // Ping round trips (one ping outstanding at a time)
+    LatencyStats pingRtt;
+    uint32_t txDoneAt;          // micros() when the last transmitFrame() finished
+    uint32_t pingSentAt;
+    bool pingPending;
+    
+    // TDMA, under radioMutex; times are esp_timer_get_time() us
+    TdmaScheduler tdmaScheduler;
+    int64_t nextBeaconAt;       // Scheduled start of the next beacon
+    uint32_t beaconSequence;    // Superframe number, counts skipped beacons too
+    
+    // Frequency hopping, under radioMutex
+    ChannelMonitor channelMonitor;
+    uint8_t radioChannel;       // Channel the radio is tuned to, HOP_HOME for LORA_FREQUENCY
+    uint8_t hopChannel;         // Channel of the current slot (or HOP_HOME between slots)
+    uint16_t hopSlot;           // Current slot, WIRE_NO_SLOT outside the slots
+    bool hopSlotExpected;       // It has an owner, so a frame should arrive in it
+    bool hopSlotHeard;
+    int64_t hopNextAt;          // Next slot boundary
+    
+    // Transmit a frame and return to receive mode
+    int transmitFrame(const uint8_t* data, size_t length);
+    
+    // Time on air of a frame at the current settings
+    uint32_t frameAirtimeUs(size_t length) const;
+    
+    // Give the frame receiveMessage() decoded back to the radio task
+    void releaseFrame();
+    
+    // Decode the next sample of the current batched frame
+    bool receiveSample(JsonDocument& doc, DecodedMessage& message, int* rssi, float* snr);
+    
+    // Echo a decoded message as a debug record, through the serial egress
+    // ring like everything else loop() prints
+    void echoReceived(const JsonDocument& doc);
+    
+    // Windowed receive state of a remote, taken over from the least
+    // recently heard one if it has none
+    ArqReceiver& windowReceiver(uint32_t device);
+    
+    // Track a windowed frame and answer its burst with a block ACK if asked,
+    // on the channel the frame came in on. A frame that isn't accepted is
+    // reported missing, so it's sent again. Returns false for a duplicate.
+    bool handleWindowedFrame(const uint8_t* buffer, size_t length, const FrameHeader& header, uint8_t channel,
+                             bool accept = true);
+    
+    // Keep a fragment (if there's room) and describe it in doc and message
+    // (no metrics); false for a duplicate, a refused or an invalid one
+    bool receiveFragment(const uint8_t* buffer, size_t length, const FrameHeader& header, uint8_t channel,
+                         JsonDocument& doc, DecodedMessage& message);
+    
+    // Send the fixed ACK for a received frame (caller holds radioMutex)
+    void transmitAck(uint32_t device, uint32_t messageId, int16_t rssi, float snr, uint32_t irqAt, uint8_t slotFlags,
+                     uint16_t slot);
+    
+    // The keyframe request flag for an ACK to device, cleared once sent
+    uint8_t resyncAckFlag(uint32_t device);
+    
+    // TDMA (caller holds radioMutex): the flag and slot for the ACK to a
+    // remote's frame, and the beacon once it's due
+    uint8_t slotAckFlags(const uint8_t* data, size_t length, uint16_t* slot);
+    void beaconPoll();
+    
+    // Hopping (radio task): follow the slots from channel to channel and
+    // count which ones with an owner stayed empty
+    void hopPoll();
+    
+    // Tune to a plan channel or HOP_HOME (caller holds radioMutex and re-arms the receiver)
+    void tune(uint8_t channel);
+    
+    // Radio task wait until the next beacon or slot boundary
+    TickType_t tdmaWaitTicks() const;
+    
+    // Put the radio in continuous receive mode (caller holds radioMutex)
+    void armReceiver();
+    
+    // ADR handshake (caller holds radioMutex): note a received frame, pick
+    // the flags (and proposal) for the next ACK, act on an ACK just sent
+    void adrOnReceive(const uint8_t* data, size_t length, int rssi, float snr);
+    uint8_t adrAckFlags(uint32_t* packedParams);
+    void adrAfterAck(uint8_t flags);
+    
+    // ADR decisions and timeouts, from loop()
+    void adrPoll();
+    
+    // Change radio settings (caller holds radioMutex, radio in standby)
+    bool switchParams(const LinkParams& params);
+    
+    // Radio task body and DIO1 interrupt handler
+    static void radioTask(void* param);
+    static void onDio1Interrupt();
     
-    // Helper method to build a standard message
-    void buildMessage(JsonDocument& doc, const char* type, const JsonDocument& payload);
+    // Helper method to build a standard message as a binary frame.
+    // Returns the frame length (0 on failure) and the assigned message ID.
+    size_t buildMessage(uint8_t* buffer, size_t size, const MessageSchema& message, const MetricRecord* metrics,
+                        const char* payload, uint32_t* messageId);
 };
 
 extern LoRaCommunication loraCommunication;
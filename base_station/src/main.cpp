@@ -2,37 +2,53 @@
 #include "lora_communication.h"
 #include "display_manager.h"
 #include "serial_manager.h"
+#include "device_table.h"
 
 // Pin for a button to cycle display pages (optional)
 #define BUTTON_PIN 0  // Usually GPIO0 has a button on ESP32 dev boards
 
+// Interval between receive path statistics reports on serial
+#define RX_STATS_INTERVAL 60000  // 60 seconds
+
+// Time device table lookups at boot (fills the table, then clears it)
+#define DEVICE_TABLE_BENCHMARK 0
+
+// Time the serial output of received data messages at boot, in JSON and in
+// binary mode (SERIAL_BENCHMARK_MS each)
+#define SERIAL_BENCHMARK 0
+#define SERIAL_BENCHMARK_MS 5000
+
 // Statistics
 unsigned long totalPacketsReceived = 0;
 unsigned long errorPackets = 0;
 unsigned long lastPacketTime = 0;
 unsigned long uptimeStart = 0;
 
-// Remote device status
-float remoteBatteryVoltage = 0.0;
-uint8_t remoteBatteryPercentage = 0;
-bool remoteIsCharging = false;
-unsigned long remoteLastSeen = 0;
+// Remote devices, and the one heard last (shown on the display)
+DeviceTable deviceTable;
+DeviceEntry* lastDevice = nullptr;
 
 // Signal metrics
-int lastRssi = -120;
-float lastSnr = 0.0;
 float packetLossRate = 0.0;
 float avgLatency = 0.0;
 
 // Function prototypes
 void setupHardware();
 void handleButton();
-void handleIncomingMessage(const char* type, JsonDocument& doc, int rssi, float snr);
-void updateRemoteMetrics(JsonDocument& doc);
-void updateSignalMetrics(int rssi, float snr);
+void handleIncomingMessage(const DecodedMessage& message, JsonDocument& doc, int rssi, float snr);
+void updateRemoteMetrics(DeviceEntry* device, const MetricRecord& metrics);
+void updateSignalMetrics(DeviceEntry* device, int rssi, float snr);
 void updateDisplay();
 void checkSerialCommands();
 void sendStatusToSerial();
+unsigned long countErrors();
+void addRxStats(JsonObject radio);
+void reportRxStats();
+void addDeviceStats(JsonObject devices);
+void addLatencyStats(JsonObject latency, const LatencyStats& stats);
+void benchmarkDeviceTable();
+void addSerialStats(JsonObject serial);
+void benchmarkSerial();
 
 void setup() {
   // Initialize serial communication
@@ -45,6 +61,14 @@ void setup() {
   // Initialize hardware
   setupHardware();
   
+#if DEVICE_TABLE_BENCHMARK
+  benchmarkDeviceTable();
+#endif
+  
+#if SERIAL_BENCHMARK
+  benchmarkSerial();
+#endif
+  
   // Display welcome message
   displayManager.showStatus("Base Station Ready");
   serialManager.sendStatus("Base Station Ready");
@@ -63,6 +87,9 @@ void loop() {
   // Process any serial commands
   checkSerialCommands();
   
+  // Periodically report receive path statistics
+  reportRxStats();
+  
   // Small delay to prevent CPU hogging
   delay(10);
 }
@@ -116,7 +143,7 @@ void handleButton() {
     if (buttonState == LOW && lastButtonState == HIGH) {
       // Cycle to the next display page
       displayManager.nextPage();
-      Serial.println(F("Display page changed"));
+      serialManager.debug("Display page changed");
     }
   }
   
@@ -124,21 +151,52 @@ void handleButton() {
   lastButtonState = buttonState;
 }
 
-void handleIncomingMessage(const char* type, JsonDocument& doc, int rssi, float snr) {
-  // Update signal metrics
-  updateSignalMetrics(rssi, snr);
+void handleIncomingMessage(const DecodedMessage& message, JsonDocument& doc, int rssi, float snr) {
+  // Look up the sender, adding it on first sight (0 = remote without a device ID)
+  DeviceEntry* device = deviceTable.touch(message.device);
+  if (device == nullptr) {
+    errorPackets++;
+    serialManager.sendError("Device table full, message dropped");
+    return;
+  }
+  lastDevice = device;
   
-  // Record message receipt
-  totalPacketsReceived++;
+  // Record message receipt (samples of a batched frame count as one packet)
+  device->messages++;
+  if (message.sample == 0) {
+    totalPacketsReceived++;
+    device->packets++;
+    
+    // Track the message ID for loss, reordering and duplicates
+    SeqResult result = device->sequence.update(message.header.id, message.header.timestamp, millis());
+    if (result == SEQ_RESET) {
+      serialManager.log("Remote device restarted its message IDs");
+    }
+  }
+  device->lastSeen = millis();
   lastPacketTime = millis();
   
+  // Fragments only count for loss tracking; a finished transfer goes out whole
+  uint8_t type = message.header.type;
+  if (type == WIRE_TYPE_FRAGMENT) {
+    if (doc["complete"]) {
+      const Transfer* transfer = loraCommunication.getReassembly().find(message.device, doc["transfer"].as<uint16_t>());
+      if (transfer != nullptr) {
+        serialManager.sendTransfer(loraCommunication.getReassembly(), *transfer);
+      }
+      displayManager.showStatus("Transfer Received");
+    }
+    updateSignalMetrics(device, rssi, snr);
+    return;
+  }
+  
   // Send data to serial
-  serialManager.sendRemoteData(doc);
+  serialManager.sendRemoteData(message, doc);
   
   // Handle different message types
-  if (strcmp(type, MSG_TYPE_DATA) == 0) {
+  if (type == WIRE_TYPE_DATA) {
     // Update remote device metrics
-    updateRemoteMetrics(doc);
+    updateRemoteMetrics(device, message.metrics);
     
     // Update display with remote status
     displayManager.showStatus("Data Received");
@@ -146,15 +204,14 @@ void handleIncomingMessage(const char* type, JsonDocument& doc, int rssi, float
     // Log the data receipt
     serialManager.log("Data received from remote device");
   }
-  else if (strcmp(type, MSG_TYPE_STATUS) == 0) {
+  else if (type == WIRE_TYPE_STATUS) {
     // Update remote device metrics
-    updateRemoteMetrics(doc);
+    updateRemoteMetrics(device, message.metrics);
     
     // Display status message if present
-    if (doc.containsKey("payload")) {
-      const char* status = doc["payload"];
-      displayManager.showStatus(status);
-      serialManager.sendStatus(status);
+    if (message.payload != nullptr) {
+      displayManager.showStatus(message.payload);
+      serialManager.sendStatus(message.payload);
     } else {
       displayManager.showStatus("Status Received");
     }
@@ -162,63 +219,64 @@ void handleIncomingMessage(const char* type, JsonDocument& doc, int rssi, float
     // Log the status receipt
     serialManager.log("Status update received from remote device");
   }
-  else if (strcmp(type, MSG_TYPE_PING) == 0) {
+  else if (type == WIRE_TYPE_PING) {
     // Ping was already automatically acknowledged by lora_communication
     displayManager.showStatus("Ping Received");
     serialManager.log("Ping received from remote device");
   }
+  
+  // Update signal metrics (after the remote's own measurements were taken in)
+  updateSignalMetrics(device, rssi, snr);
 }
 
-void updateRemoteMetrics(JsonDocument& doc) {
+void updateRemoteMetrics(DeviceEntry* device, const MetricRecord& metrics) {
   // Extract battery information if present
-  if (doc.containsKey("metrics")) {
-    JsonObject metrics = doc["metrics"];
-    
-    if (metrics.containsKey("battery")) {
-      remoteBatteryVoltage = metrics["battery"];
+  if (metrics.present != 0) {
+    if (Schema::has<FIELD_BATTERY>(metrics)) {
+      device->batteryMv = Schema::get<FIELD_BATTERY>(metrics) * 1000.0f + 0.5f;
     }
     
-    if (metrics.containsKey("battery_percent")) {
-      remoteBatteryPercentage = metrics["battery_percent"];
+    if (Schema::has<FIELD_BATTERY_PERCENT>(metrics)) {
+      device->batteryPercent = Schema::getCount<FIELD_BATTERY_PERCENT>(metrics);
     }
     
-    if (metrics.containsKey("charging")) {
-      remoteIsCharging = (metrics["charging"] == 1);
+    if (Schema::has<FIELD_CHARGING>(metrics)) {
+      device->charging = (Schema::getCount<FIELD_CHARGING>(metrics) == 1);
     }
     
-    // Update last seen time
-    remoteLastSeen = millis();
+    if (Schema::has<FIELD_RTT>(metrics)) {
+      float rtt = Schema::get<FIELD_RTT>(metrics) * 10.0f + 0.5f;
+      device->rtt = rtt < 65535.0f ? (uint16_t)rtt : 65535;
+    }
     
     // Update display with remote status
-    unsigned long lastSeenSeconds = (millis() - remoteLastSeen) / 1000;
-    displayManager.updateRemoteStatus(remoteBatteryVoltage, remoteBatteryPercentage, remoteIsCharging, lastSeenSeconds);
+    unsigned long lastSeenSeconds = (millis() - device->lastSeen) / 1000;
+    displayManager.updateRemoteStatus(device->batteryMv / 1000.0f, device->batteryPercent, device->charging, lastSeenSeconds);
   }
 }
 
-void updateSignalMetrics(int rssi, float snr) {
+void updateSignalMetrics(DeviceEntry* device, int rssi, float snr) {
   // Update signal metrics
-  lastRssi = rssi;
-  lastSnr = snr;
+  device->rssi = rssi;
+  device->snr = snr;
   
-  // Calculate packet loss rate (placeholder logic)
-  // In real implementation, would track expected vs received packets
-  packetLossRate = 0.05;  // Example: 5% loss
+  // Packet loss over the sender's last SEQ_WINDOW_BITS message IDs
+  packetLossRate = device->sequence.windowLoss();
   
-  // Calculate average latency (placeholder)
-  // In real implementation, would track round-trip times
-  avgLatency = 150.0;  // Example: 150ms
+  // Round-trip time the remote measures on its ACK exchanges
+  avgLatency = device->rtt / 10.0;
   
   // Update display with signal metrics
-  displayManager.updateSignalMetrics(lastRssi, lastSnr, packetLossRate, avgLatency);
+  displayManager.updateSignalMetrics(rssi, snr, packetLossRate, avgLatency);
   
   // Send to serial
-  serialManager.sendSignalMetrics(lastRssi, lastSnr, packetLossRate, avgLatency);
+  serialManager.sendSignalMetrics(rssi, snr, packetLossRate, avgLatency);
 }
 
 void updateDisplay() {
   // Update system metrics
   unsigned long uptime = (millis() - uptimeStart) / 1000;  // In seconds
-  displayManager.updateSystemMetrics(uptime, totalPacketsReceived, errorPackets);
+  displayManager.updateSystemMetrics(uptime, totalPacketsReceived, countErrors());
   
   // Update the display
   displayManager.update();
@@ -234,10 +292,8 @@ void checkSerialCommands() {
     
     // Handle the command (most commands are handled by serialManager)
     if (command.startsWith(PING_COMMAND)) {
-      // Create a ping message
-      StaticJsonDocument<200> pingDoc;
       // Send a ping to the remote device
-      loraCommunication.sendMessage(MSG_TYPE_PING, pingDoc);
+      loraCommunication.sendMessage(Schema::PING, nullptr);
       
       // Update display
       displayManager.showStatus("Ping Sent");
@@ -252,27 +308,339 @@ void checkSerialCommands() {
 
 void sendStatusToSerial() {
   // Create status document
-  StaticJsonDocument<512> statusDoc;
+  StaticJsonDocument<3072> statusDoc;
   
   // Add system status
   statusDoc["uptime"] = (millis() - uptimeStart) / 1000;
   statusDoc["packets_received"] = totalPacketsReceived;
-  statusDoc["errors"] = errorPackets;
+  statusDoc["errors"] = countErrors();
   
-  // Add remote device status
+  // Add status of the remote heard last
   JsonObject remote = statusDoc.createNestedObject("remote_device");
-  remote["battery"] = remoteBatteryVoltage;
-  remote["battery_percent"] = remoteBatteryPercentage;
-  remote["charging"] = remoteIsCharging;
-  remote["last_seen"] = (millis() - remoteLastSeen) / 1000;
+  if (lastDevice != nullptr) {
+    remote["id"] = lastDevice->id;
+    remote[Schema::fieldName(FIELD_BATTERY)] = lastDevice->batteryMv / 1000.0f;
+    remote[Schema::fieldName(FIELD_BATTERY_PERCENT)] = lastDevice->batteryPercent;
+    remote[Schema::fieldName(FIELD_CHARGING)] = lastDevice->charging;
+    remote["last_seen"] = (millis() - lastDevice->lastSeen) / 1000;
+    remote["rtt_ms"] = lastDevice->rtt / 10.0;
+    
+    // Message ID history
+    const SequenceWindow& sequence = lastDevice->sequence;
+    remote["received"] = sequence.getReceived();
+    remote["lost"] = sequence.getLost();
+    remote["reordered"] = sequence.getReordered();
+    remote["duplicates"] = sequence.getDuplicates();
+    remote["resets"] = sequence.getResets();
+  }
   
   // Add signal metrics
   JsonObject signal = statusDoc.createNestedObject("signal");
-  signal["rssi"] = lastRssi;
-  signal["snr"] = lastSnr;
-  signal["packet_loss"] = packetLossRate;
-  signal["latency"] = avgLatency;
+  signal["rssi"] = lastDevice != nullptr ? lastDevice->rssi : -120;
+  signal["snr"] = lastDevice != nullptr ? lastDevice->snr : 0.0;
+  signal["packet_loss"] = lastDevice != nullptr ? lastDevice->sequence.windowLoss() : 0.0;
+  signal["latency"] = lastDevice != nullptr ? lastDevice->rtt / 10.0 : 0.0;
+  
+  // Add receive path statistics
+  addRxStats(statusDoc.createNestedObject("radio"));
+  
+  // Add device table statistics
+  addDeviceStats(statusDoc.createNestedObject("devices"));
+  
+  // Add serial output statistics
+  addSerialStats(statusDoc.createNestedObject("serial"));
   
   // Send to serial
   serialManager.sendMetrics(statusDoc);
 }
+
+unsigned long countErrors() {
+  // Frames heard but not usable, and senders the device table had no room for
+  const RxStats& stats = loraCommunication.getRxStats();
+  return errorPackets + stats.crcErrors + stats.readErrors + stats.decodeErrors;
+}
+
+void addRxStats(JsonObject radio) {
+  const RxStats& stats = loraCommunication.getRxStats();
+  
+  radio["rx_mode"] = LORA_RX_USE_IRQ ? "irq" : "poll";
+  radio["frames"] = stats.framesReceived;
+  radio["dropped"] = stats.framesDropped;
+  radio["crc_errors"] = stats.crcErrors;
+  radio["read_errors"] = stats.readErrors;
+  radio["decode_errors"] = stats.decodeErrors;
+  radio["irq_overruns"] = stats.irqOverruns;
+  radio["dead_time_us"] = stats.deadTimeLastUs;
+  radio["dead_time_max_us"] = stats.deadTimeMaxUs;
+  radio["dead_time_avg_us"] = stats.framesReceived > 0 ? (uint32_t)(stats.deadTimeTotalUs / stats.framesReceived) : 0;
+  radio["poll_gap_max_us"] = stats.pollGapMaxUs;
+  radio["queue_latency_max_us"] = stats.queueLatencyMaxUs;
+  radio["ring_high_water"] = stats.ringHighWater;
+  radio["duplicates"] = stats.duplicates;
+  radio["block_acks"] = stats.blockAcks;
+  radio["batched_frames"] = stats.batchedFrames;
+  radio["batched_samples"] = stats.batchedSamples;
+  radio["acks"] = stats.acksSent;
+  radio["ack_errors"] = stats.ackErrors;
+  radio["radio_errors"] = stats.radioErrors;
+  radio["ack_turnaround_us"] = stats.ackTurnaroundLastUs;
+  radio["ack_turnaround_max_us"] = stats.ackTurnaroundMaxUs;
+  radio["ack_turnaround_avg_us"] = stats.acksSent > 0 ? (uint32_t)(stats.ackTurnaroundTotalUs / stats.acksSent) : 0;
+  radio["heap_allocs"] = stats.heapAllocations;
+  radio["heap_allocs_max"] = stats.heapAllocationsMax;
+  
+  // Sample decompression
+  const CodecStats& codec = loraCommunication.getCodecStats();
+  radio["keyframes"] = codec.keyframes;
+  radio["deltas"] = codec.deltas;
+  radio["missing_reference"] = codec.missingReference;
+  
+  // Adaptive data rate
+  const LinkParams& link = loraCommunication.getLinkParams();
+  const AdrStats& adr = loraCommunication.getAdrStats();
+  radio["sf"] = link.spreadingFactor;
+  radio["bw_khz"] = link.bandwidth;
+  radio["cr"] = link.codingRate;
+  radio["tx_power"] = link.power;
+  radio["adr_proposals"] = adr.proposals;
+  radio["adr_switches"] = adr.switches;
+  radio["adr_rollbacks"] = adr.rollbacks;
+  radio["adr_fallbacks"] = adr.fallbacks;
+  
+  // Duty-cycle budget
+  const DutyStats& duty = loraCommunication.getDutyStats();
+  radio["airtime_ms"] = loraCommunication.getAirtimePerHourMs();
+  radio["duty_deferred"] = duty.framesDeferred;
+  radio["duty_dropped"] = duty.framesDropped;
+  
+  // Round trips of our pings
+  addLatencyStats(radio.createNestedObject("ping_rtt"), loraCommunication.getPingRttStats());
+  
+  // Transfers and the reassembly pool
+  const ReassemblyStats& reassembly = loraCommunication.getReassembly().getStats();
+  JsonObject transfers = radio.createNestedObject("transfers");
+  transfers["completed"] = reassembly.completed;
+  transfers["expired"] = reassembly.expired;
+  transfers["bytes"] = reassembly.bytes;
+  transfers["fragments"] = reassembly.fragments;
+  transfers["duplicates"] = reassembly.duplicates;
+  transfers["refused"] = reassembly.refused;
+  transfers["pool_blocks"] = FRAG_POOL_BLOCKS;
+  transfers["blocks_used"] = reassembly.blocksUsed;
+  transfers["blocks_peak"] = reassembly.blocksPeak;
+  transfers["parity"] = reassembly.parity;
+  transfers["recovered"] = reassembly.recovered;
+  transfers["decode_us"] = reassembly.decodeUs;
+  transfers["decode_max_us"] = reassembly.decodeMaxUs;
+  
+  // Beacons and slot assignment
+  if (LORA_TDMA_ENABLE) {
+    const TdmaScheduler& scheduler = loraCommunication.getTdmaScheduler();
+    const SuperframeLayout& layout = scheduler.getLayout();
+    const TdmaStats& tdma = scheduler.getStats();
+    JsonObject superframe = radio.createNestedObject("tdma");
+    superframe["period_ms"] = layout.periodMs;
+    superframe["slot_ms"] = layout.slotMs;
+    superframe["slots"] = layout.slotCount;
+    superframe["assigned"] = scheduler.assigned();
+    superframe["beacons"] = tdma.beacons;
+    superframe["beacons_skipped"] = tdma.beaconsSkipped;
+    superframe["assignments"] = tdma.assignments;
+    superframe["reclaimed"] = tdma.reclaimed;
+    superframe["full"] = tdma.full;
+  }
+  
+  // Hop set and how each channel of the plan does
+  if (LORA_HOP_ENABLE) {
+    const ChannelMonitor& monitor = loraCommunication.getChannelMonitor();
+    const HopPlan& plan = monitor.getPlan();
+    const HopStats& hop = monitor.getStats();
+    JsonObject hopping = radio.createNestedObject("hop");
+    hopping["seed"] = plan.seed;
+    hopping["mask"] = plan.mask;
+    hopping["next_mask"] = plan.nextMask;
+    hopping["changes"] = hop.changes;
+    hopping["blacklisted"] = hop.blacklisted;
+    hopping["restored"] = hop.restored;
+    
+    // One entry per channel, in plan order
+    JsonArray expected = hopping.createNestedArray("expected");
+    JsonArray received = hopping.createNestedArray("received");
+    JsonArray errorRate = hopping.createNestedArray("error_pct");
+    JsonArray rssi = hopping.createNestedArray("rssi");
+    for (uint8_t channel = 0; channel < HOP_CHANNEL_COUNT; channel++) {
+      const ChannelStats& stats = monitor.getChannelStats(channel);
+      expected.add(stats.frames);
+      received.add(stats.received);
+      errorRate.add((int)(stats.errorRate * 100 + 0.5f));
+      rssi.add((int)stats.rssi);
+    }
+  }
+}
+
+void addLatencyStats(JsonObject latency, const LatencyStats& stats) {
+  latency["count"] = stats.getCount();
+  latency["avg_us"] = stats.getEwmaUs();
+  latency["min_us"] = stats.getMinUs();
+  latency["max_us"] = stats.getMaxUs();
+  latency["p50_us"] = stats.percentileUs(50);
+  latency["p90_us"] = stats.percentileUs(90);
+  
+  // Counts per power-of-two bucket, from under 1 ms up
+  JsonArray histogram = latency.createNestedArray("histogram");
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+    histogram.add(stats.getHistogram()[i]);
+  }
+}
+
+void reportRxStats() {
+  static unsigned long lastReportTime = 0;
+  
+  // Only report if enough time has passed
+  if (millis() - lastReportTime < RX_STATS_INTERVAL) {
+    return;
+  }
+  lastReportTime = millis();
+  
+  StaticJsonDocument<3072> statsDoc;
+  addRxStats(statsDoc.createNestedObject("radio"));
+  addDeviceStats(statsDoc.createNestedObject("devices"));
+  addSerialStats(statsDoc.createNestedObject("serial"));
+  serialManager.sendMetrics(statsDoc);
+}
+
+void addDeviceStats(JsonObject devices) {
+  const DeviceTableStats& stats = deviceTable.getStats();
+  
+  devices["count"] = deviceTable.count();
+  devices["capacity"] = DEVICE_TABLE_MAX;
+  devices["rejected"] = stats.rejected;
+  devices["lookups"] = stats.lookups;
+  devices["probes_avg"] = stats.lookups > 0 ? (float)stats.probes / stats.lookups : 0.0;
+  devices["probes_max"] = stats.maxProbes;
+}
+
+void addSerialStats(JsonObject serial) {
+  const SerialStats& stats = serialManager.getStats();
+  unsigned long uptime = (millis() - uptimeStart) / 1000;
+  
+  serial["output"] = serialManager.getOutputMode() == SERIAL_OUTPUT_BINARY ? "binary" : "json";
+  serial["baud"] = SERIAL_USB_CDC ? 0 : serialManager.getBaudRate();
+  serial["records"] = stats.records;
+  serial["bytes"] = stats.bytes;
+  serial["records_per_s"] = uptime > 0 ? (float)stats.records / uptime : 0.0;
+  serial["write_us"] = stats.writeUs;
+  serial["write_max_us"] = stats.writeMaxUs;
+  
+  // Egress ring between loop() and the port
+  EgressStats egress = serialManager.getEgressStats();
+  serial["drop"] = serialManager.getDropPolicy() == SERIAL_DROP_LOW_PRIORITY ? "low" : "oldest";
+  serial["queued_bytes"] = egress.queuedBytes;
+  serial["sent"] = egress.sentRecords;
+  serial["sent_bytes"] = egress.sentBytes;
+  serial["dropped"] = egress.droppedRecords;
+  serial["dropped_bytes"] = egress.droppedBytes;
+  serial["latency_max_us"] = egress.latencyMaxUs;
+  serial["ring_peak"] = egress.peakBytes;
+  serial["stall_us"] = egress.stallUs;
+}
+
+void benchmarkDeviceTable() {
+  // Device-like IDs (24-bit MAC suffixes) from a fixed sequence, so runs are comparable
+  auto deviceId = [](uint32_t i) {
+    uint32_t x = i * 0x9E3779B1u;
+    x ^= x >> 15;
+    x *= 0x2C1B3C6Du;
+    x ^= x >> 12;
+    return x & 0xFFFFFF;
+  };
+  
+  const uint16_t sizes[] = { 100, 1000, DEVICE_TABLE_MAX };
+  for (uint16_t n : sizes) {
+    deviceTable.clear();
+    for (uint16_t i = 0; i < n; i++) {
+      deviceTable.touch(deviceId(i));
+    }
+    
+    // Look every device up ten times, as the receive path does once per packet
+    uint32_t lookupsBefore = deviceTable.getStats().lookups;
+    uint32_t probesBefore = deviceTable.getStats().probes;
+    uint32_t start = ESP.getCycleCount();
+    for (uint8_t round = 0; round < 10; round++) {
+      for (uint16_t i = 0; i < n; i++) {
+        deviceTable.find(deviceId(i));
+      }
+    }
+    uint32_t cycles = ESP.getCycleCount() - start;
+    uint32_t lookups = deviceTable.getStats().lookups - lookupsBefore;
+    
+    char text[96];
+    snprintf(text, sizeof(text), "Device table: %u devices, %.2f cycles (%.2f ns) and %.2f probes per lookup",
+             (unsigned)deviceTable.count(), (float)cycles / lookups,
+             (float)cycles / lookups / ESP.getCpuFreqMHz() * 1000.0f,
+             (float)(deviceTable.getStats().probes - probesBefore) / lookups);
+    serialManager.log(text);
+  }
+  
+  deviceTable.clear();
+}
+
+void benchmarkSerial() {
+  // A data message with the remote's usual metrics, decoded like a received one
+  MetricRecord sample;
+  MetricCodec::clear(sample);
+  Schema::setCount<FIELD_UPTIME>(sample, 86400);
+  Schema::setCount<FIELD_FREE_MEMORY>(sample, 201344);
+  Schema::set<FIELD_TEMPERATURE>(sample, 25.4f);
+  Schema::set<FIELD_BATTERY>(sample, 3.92f);
+  Schema::setCount<FIELD_BATTERY_PERCENT>(sample, 87);
+  Schema::setCount<FIELD_CHARGING>(sample, 0);
+  Schema::set<FIELD_SUCCESS_RATE>(sample, 0.95f);
+  Schema::set<FIELD_AVG_RETRIES>(sample, 0.3f);
+  Schema::setCount<FIELD_AVG_LATENCY>(sample, 412);
+  Schema::setCount<FIELD_TOTAL_PACKETS>(sample, 2880);
+  Schema::setCount<FIELD_AIRTIME>(sample, 5120);
+  Schema::set<FIELD_RTT>(sample, 231.5f);
+  
+  uint8_t frame[MAX_PACKET_SIZE];
+  size_t length = Schema::encode(frame, sizeof(frame), Schema::DATA, 1000, 86400, &sample);
+  DecodedMessage message;
+  StaticJsonDocument<RX_DOC_SIZE> doc;
+  Schema::decode(frame, length, message);
+  message.device = 0xA1B2C3;
+  Schema::toJson(message, doc);
+  
+  // The records handleIncomingMessage() sends per data message, as fast as
+  // loop() can produce them; what the port takes is what the egress task
+  // wrote out, the rest was dropped from the ring
+  const SerialOutput modes[] = { SERIAL_OUTPUT_JSON, SERIAL_OUTPUT_BINARY };
+  for (uint8_t i = 0; i < 2; i++) {
+    serialManager.setOutputMode(modes[i]);
+    serialManager.drain();
+    EgressStats before = serialManager.getEgressStats();
+    unsigned long start = millis();
+    while (millis() - start < SERIAL_BENCHMARK_MS) {
+      serialManager.sendRemoteData(message, doc);
+      serialManager.log("Data received from remote device");
+      serialManager.sendSignalMetrics(-92, 7.25f, 0.02f, 231.5f);
+    }
+    serialManager.drain();
+    SERIAL_PORT.flush();
+    unsigned long elapsed = millis() - start;
+    EgressStats after = serialManager.getEgressStats();
+    uint32_t records = after.sentRecords - before.sentRecords;
+    uint32_t bytes = after.sentBytes - before.sentBytes;
+    
+    Serial.print(modes[i] == SERIAL_OUTPUT_BINARY ? F("\nSerial binary: ") : F("\nSerial JSON: "));
+    Serial.print(records * 1000UL / elapsed);
+    Serial.print(F(" records/s, "));
+    Serial.print((float)bytes / records);
+    Serial.print(F(" bytes per record, "));
+    Serial.print(records / 3 * 1000UL / elapsed);
+    Serial.print(F(" data messages/s, "));
+    Serial.print(after.droppedRecords - before.droppedRecords);
+    Serial.println(F(" records dropped"));
+  }
+  
+  serialManager.setOutputMode(SERIAL_OUTPUT_JSON);
+}
@@ -0,0 +1,535 @@
+#include "metric_codec.h"
+#include "wire_format.h"
+
+// No window yet for an XOR-coded field
+#define XOR_NO_WINDOW 0xFF
+
+// Largest delta body: reference ID, mask, timestamp and every field at worst case
+#define DELTA_BODY_SIZE 104
+
+// Bit-level writer, most significant bit first
+class BitWriter {
+public:
+    BitWriter(uint8_t* buffer, size_t size) : buffer(buffer), size(size), bits(0), overflow(false) {}
+
+    void write(uint32_t value, uint8_t count) {
+        for (int i = count - 1; i >= 0; i--) {
+            size_t byte = bits >> 3;
+            if (byte >= size) {
+                overflow = true;
+                return;
+            }
+            if ((bits & 7) == 0) {
+                buffer[byte] = 0;
+            }
+            if ((value >> i) & 1) {
+                buffer[byte] |= 0x80 >> (bits & 7);
+            }
+            bits++;
+        }
+    }
+
+    size_t length() const { return (bits + 7) >> 3; }
+    bool ok() const { return !overflow; }
+
+private:
+    uint8_t* buffer;
+    size_t size;
+    size_t bits;
+    bool overflow;
+};
+
+// Bit-level reader matching BitWriter
+class BitReader {
+public:
+    BitReader(const uint8_t* buffer, size_t length) : buffer(buffer), length(length), bits(0), underflow(false) {}
+
+    uint32_t read(uint8_t count) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            size_t byte = bits >> 3;
+            if (byte >= length) {
+                underflow = true;
+                return 0;
+            }
+            value = (value << 1) | ((buffer[byte] >> (7 - (bits & 7))) & 1);
+            bits++;
+        }
+        return value;
+    }
+
+    void fail() { underflow = true; }
+    bool ok() const { return !underflow; }
+
+private:
+    const uint8_t* buffer;
+    size_t length;
+    size_t bits;
+    bool underflow;
+};
+
+// Counters grow steadily and compress best as delta-of-delta
+static bool isCounter(uint8_t fieldId) {
+    return fieldId == FIELD_UPTIME || fieldId == FIELD_TOTAL_PACKETS;
+}
+
+// Delta-of-delta: '0' | '10'+7 bits | '110'+9 bits | '1110'+12 bits | '1111'+32 bits
+static void writeDod(BitWriter& out, uint32_t dod) {
+    int32_t value = (int32_t)dod;
+    if (value == 0) {
+        out.write(0, 1);
+    } else if (value >= -63 && value <= 64) {
+        out.write(0x2, 2);
+        out.write(dod & 0x7F, 7);
+    } else if (value >= -255 && value <= 256) {
+        out.write(0x6, 3);
+        out.write(dod & 0x1FF, 9);
+    } else if (value >= -2047 && value <= 2048) {
+        out.write(0xE, 4);
+        out.write(dod & 0xFFF, 12);
+    } else {
+        out.write(0xF, 4);
+        out.write(dod, 32);
+    }
+}
+
+static uint32_t readDod(BitReader& in) {
+    if (in.read(1) == 0) return 0;
+
+    uint32_t value;
+    if (in.read(1) == 0) {
+        value = in.read(7);
+        return value > 64 ? value - 128 : value;
+    }
+    if (in.read(1) == 0) {
+        value = in.read(9);
+        return value > 256 ? value - 512 : value;
+    }
+    if (in.read(1) == 0) {
+        value = in.read(12);
+        return value > 2048 ? value - 4096 : value;
+    }
+    return in.read(32);
+}
+
+// XOR against the previous value: '0' unchanged, '10' + bits inside the
+// previous window, '11' + 5-bit leading zeros + 5-bit length - 1 + bits
+static void writeXor(BitWriter& out, uint32_t previous, uint32_t value, uint8_t& leading, uint8_t& trailing) {
+    uint32_t x = previous ^ value;
+    if (x == 0) {
+        out.write(0, 1);
+        return;
+    }
+    out.write(1, 1);
+
+    uint8_t lz = __builtin_clz(x);
+    uint8_t tz = __builtin_ctz(x);
+    if (leading != XOR_NO_WINDOW && lz >= leading && tz >= trailing) {
+        out.write(0, 1);
+        out.write(x >> trailing, 32 - leading - trailing);
+        return;
+    }
+
+    uint8_t meaningful = 32 - lz - tz;
+    out.write(1, 1);
+    out.write(lz, 5);
+    out.write(meaningful - 1, 5);
+    out.write(x >> tz, meaningful);
+    leading = lz;
+    trailing = tz;
+}
+
+static uint32_t readXor(BitReader& in, uint32_t previous, uint8_t& leading, uint8_t& trailing) {
+    if (in.read(1) == 0) return previous;
+
+    if (in.read(1) == 0) {
+        if (leading == XOR_NO_WINDOW) {
+            // Reuse without a window: malformed
+            in.fail();
+            return previous;
+        }
+        uint32_t bits = in.read(32 - leading - trailing);
+        return previous ^ (bits << trailing);
+    }
+
+    uint8_t lz = in.read(5);
+    uint8_t meaningful = in.read(5) + 1;
+    if (lz + meaningful > 32) {
+        in.fail();
+        return previous;
+    }
+    uint8_t tz = 32 - lz - meaningful;
+    uint32_t bits = in.read(meaningful);
+    leading = lz;
+    trailing = tz;
+    return previous ^ (bits << tz);
+}
+
+namespace MetricCodec {
+
+void clear(MetricRecord& record) {
+    record.timestamp = 0;
+    record.present = 0;
+    record.timestampDelta = 0;
+    for (uint8_t i = 0; i < CODEC_MAX_FIELDS; i++) {
+        record.raw[i] = 0;
+        record.delta[i] = 0;
+        record.leading[i] = XOR_NO_WINDOW;
+        record.trailing[i] = 0;
+    }
+}
+
+size_t encodeKeyframe(uint8_t* buffer, size_t size, MetricRecord& record) {
+    uint8_t body[WIRE_MAX_SAMPLE_SIZE];
+    size_t offset = WireFormat::writeVarint(body, sizeof(body), record.timestamp);
+    if (offset == 0) {
+        return 0;
+    }
+
+    for (uint8_t i = 0; i < CODEC_MAX_FIELDS; i++) {
+        const WireField* field = WireFormat::findField(i + 1);
+        if (!(record.present & (1 << i)) || field == nullptr) {
+            continue;
+        }
+        size_t n = WireFormat::writeField(body + offset, sizeof(body) - offset, *field, record.raw[i]);
+        if (n == 0) {
+            return 0;
+        }
+        offset += n;
+    }
+
+    // A keyframe starts the coding state over
+    record.timestampDelta = 0;
+    for (uint8_t i = 0; i < CODEC_MAX_FIELDS; i++) {
+        record.delta[i] = 0;
+        record.leading[i] = XOR_NO_WINDOW;
+        record.trailing[i] = 0;
+    }
+
+    return WireFormat::writeBytes(buffer, size, FIELD_SAMPLE, body, offset);
+}
+
+bool decodeKeyframe(const uint8_t* body, size_t length, MetricRecord& record) {
+    clear(record);
+
+    size_t offset = WireFormat::readVarint(body, length, &record.timestamp);
+    if (offset == 0) {
+        return false;
+    }
+
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(body + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        // Skip fields from newer firmware
+        const WireField* field = WireFormat::findField(fieldId);
+        if (field == nullptr || field->wireType != wireType || fieldId > CODEC_MAX_FIELDS) {
+            continue;
+        }
+        record.raw[fieldId - 1] = raw;
+        record.present |= 1 << (fieldId - 1);
+    }
+
+    return true;
+}
+
+size_t encodeDelta(uint8_t* buffer, size_t size, uint32_t refId, const MetricRecord& ref, MetricRecord& record) {
+    uint8_t body[DELTA_BODY_SIZE];
+    size_t offset = WireFormat::writeVarint(body, sizeof(body), refId);
+    if (offset == 0) {
+        return 0;
+    }
+
+    BitWriter out(body + offset, sizeof(body) - offset);
+
+    // Field set, usually unchanged
+    if (record.present == ref.present) {
+        out.write(0, 1);
+    } else {
+        out.write(1, 1);
+        out.write(record.present, 16);
+    }
+
+    // Timestamp
+    uint32_t delta = record.timestamp - ref.timestamp;
+    writeDod(out, delta - ref.timestampDelta);
+    record.timestampDelta = delta;
+
+    for (uint8_t i = 0; i < CODEC_MAX_FIELDS; i++) {
+        if (!(record.present & (1 << i))) {
+            record.delta[i] = 0;
+            record.leading[i] = XOR_NO_WINDOW;
+            record.trailing[i] = 0;
+            continue;
+        }
+
+        // A field new since the reference is coded against zero
+        bool inRef = ref.present & (1 << i);
+        uint32_t previous = inRef ? ref.raw[i] : 0;
+
+        if (isCounter(i + 1)) {
+            delta = record.raw[i] - previous;
+            writeDod(out, delta - (inRef ? ref.delta[i] : 0));
+            record.delta[i] = delta;
+        } else {
+            record.leading[i] = inRef ? ref.leading[i] : XOR_NO_WINDOW;
+            record.trailing[i] = inRef ? ref.trailing[i] : 0;
+            writeXor(out, previous, record.raw[i], record.leading[i], record.trailing[i]);
+        }
+    }
+
+    if (!out.ok()) {
+        return 0;
+    }
+
+    return WireFormat::writeBytes(buffer, size, FIELD_DELTA_SAMPLE, body, offset + out.length());
+}
+
+size_t readDeltaRef(const uint8_t* body, size_t length, uint32_t* refId) {
+    return WireFormat::readVarint(body, length, refId);
+}
+
+bool decodeDelta(const uint8_t* body, size_t length, const MetricRecord& ref, MetricRecord& record) {
+    BitReader in(body, length);
+
+    record.present = in.read(1) ? in.read(16) : ref.present;
+
+    uint32_t delta = ref.timestampDelta + readDod(in);
+    record.timestamp = ref.timestamp + delta;
+    record.timestampDelta = delta;
+
+    for (uint8_t i = 0; i < CODEC_MAX_FIELDS; i++) {
+        record.raw[i] = 0;
+        record.delta[i] = 0;
+        record.leading[i] = XOR_NO_WINDOW;
+        record.trailing[i] = 0;
+
+        if (!(record.present & (1 << i))) {
+            continue;
+        }
+
+        bool inRef = ref.present & (1 << i);
+        uint32_t previous = inRef ? ref.raw[i] : 0;
+
+        if (isCounter(i + 1)) {
+            delta = (inRef ? ref.delta[i] : 0) + readDod(in);
+            record.raw[i] = previous + delta;
+            record.delta[i] = delta;
+        } else {
+            record.leading[i] = inRef ? ref.leading[i] : XOR_NO_WINDOW;
+            record.trailing[i] = inRef ? ref.trailing[i] : 0;
+            record.raw[i] = readXor(in, previous, record.leading[i], record.trailing[i]);
+        }
+    }
+
+    return in.ok();
+}
+
+}  // namespace MetricCodec
+
+MetricEncoder::MetricEncoder() :
+    referenceId(0),
+    hasReference(false),
+    frameIsKeyframe(false),
+    forceKeyframe(true),
+    framesSinceKeyframe(0),
+    pendingNext(0),
+    stats() {
+    MetricCodec::clear(reference);
+    MetricCodec::clear(last);
+    for (uint8_t i = 0; i < CODEC_HISTORY_SIZE; i++) {
+        pending[i].used = false;
+    }
+}
+
+size_t MetricEncoder::encode(uint8_t* buffer, size_t size, const MetricRecord& sample, bool firstInFrame) {
+    MetricRecord record = sample;
+    size_t n;
+    bool keyframe = false;
+
+    if (!firstInFrame) {
+        // Later samples refer to the one before them in the same frame
+        n = MetricCodec::encodeDelta(buffer, size, 0, last, record);
+    } else if (forceKeyframe || !hasReference || framesSinceKeyframe >= CODEC_KEYFRAME_INTERVAL) {
+        keyframe = true;
+        n = MetricCodec::encodeKeyframe(buffer, size, record);
+    } else {
+        n = MetricCodec::encodeDelta(buffer, size, referenceId, reference, record);
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+
+    if (firstInFrame) {
+        frameIsKeyframe = keyframe;
+    }
+    if (keyframe) {
+        stats.keyframes++;
+        stats.keyframeBytes += n;
+    } else {
+        stats.deltas++;
+        stats.deltaBytes += n;
+    }
+
+    last = record;
+    return n;
+}
+
+void MetricEncoder::frameQueued(uint32_t frameId) {
+    Pending& slot = pending[pendingNext];
+    pendingNext = (pendingNext + 1) % CODEC_HISTORY_SIZE;
+    slot.id = frameId;
+    slot.used = true;
+    slot.record = last;
+
+    if (frameIsKeyframe) {
+        forceKeyframe = false;
+        framesSinceKeyframe = 0;
+    } else {
+        framesSinceKeyframe++;
+    }
+}
+
+void MetricEncoder::frameAcked(uint32_t frameId) {
+    Pending* slot = findPending(frameId);
+    if (slot == nullptr) {
+        return;
+    }
+
+    // Only move the reference forward (ACKs of a window can arrive out of order)
+    if (!hasReference || (int32_t)(frameId - referenceId) > 0) {
+        reference = slot->record;
+        referenceId = frameId;
+        hasReference = true;
+    }
+    slot->used = false;
+}
+
+void MetricEncoder::frameFailed(uint32_t frameId) {
+    Pending* slot = findPending(frameId);
+    if (slot == nullptr) {
+        return;
+    }
+    slot->used = false;
+
+    // Resynchronize with a keyframe after giving up on a frame
+    forceKeyframe = true;
+}
+
+void MetricEncoder::requestKeyframe() {
+    forceKeyframe = true;
+}
+
+const CodecStats& MetricEncoder::getStats() const {
+    return stats;
+}
+
+MetricEncoder::Pending* MetricEncoder::findPending(uint32_t frameId) {
+    for (uint8_t i = 0; i < CODEC_HISTORY_SIZE; i++) {
+        if (pending[i].used && pending[i].id == frameId) {
+            return &pending[i];
+        }
+    }
+    return nullptr;
+}
+
+MetricDecoder::MetricDecoder() :
+    lastValid(false),
+    historyNext(0),
+    stats() {
+    MetricCodec::clear(last);
+    for (uint8_t i = 0; i < CODEC_HISTORY_SIZE; i++) {
+        history[i].used = false;
+    }
+}
+
+bool MetricDecoder::decode(uint32_t device, uint8_t fieldId, const uint8_t* body, size_t length, bool firstInFrame,
+                           MetricRecord& record) {
+    if (firstInFrame) {
+        lastValid = false;
+    }
+
+    if (fieldId == FIELD_SAMPLE) {
+        if (!MetricCodec::decodeKeyframe(body, length, record)) {
+            lastValid = false;
+            return false;
+        }
+        stats.keyframes++;
+        stats.keyframeBytes += length;
+        last = record;
+        lastValid = true;
+        return true;
+    }
+
+    uint32_t refId = 0;
+    size_t n = MetricCodec::readDeltaRef(body, length, &refId);
+    if (n == 0) {
+        lastValid = false;
+        return false;
+    }
+
+    // Find the reference: the previous sample, or the last one of an earlier
+    // frame from the same device
+    const MetricRecord* ref = nullptr;
+    if (refId == 0) {
+        ref = lastValid ? &last : nullptr;
+    } else {
+        for (uint8_t i = 0; i < CODEC_HISTORY_SIZE; i++) {
+            if (history[i].used && history[i].device == device && history[i].id == refId) {
+                ref = &history[i].record;
+                break;
+            }
+        }
+    }
+
+    if (ref == nullptr) {
+        stats.missingReference++;
+        lastValid = false;
+        return false;
+    }
+
+    if (!MetricCodec::decodeDelta(body + n, length - n, *ref, record)) {
+        lastValid = false;
+        return false;
+    }
+    stats.deltas++;
+    stats.deltaBytes += length;
+    last = record;
+    lastValid = true;
+    return true;
+}
+
+void MetricDecoder::frameDone(uint32_t device, uint32_t frameId) {
+    if (!lastValid) {
+        return;
+    }
+
+    // Replace an earlier copy of the same frame (retransmission)
+    Reference* slot = nullptr;
+    for (uint8_t i = 0; i < CODEC_HISTORY_SIZE; i++) {
+        if (history[i].used && history[i].device == device && history[i].id == frameId) {
+            slot = &history[i];
+            break;
+        }
+    }
+    if (slot == nullptr) {
+        slot = &history[historyNext];
+        historyNext = (historyNext + 1) % CODEC_HISTORY_SIZE;
+    }
+
+    slot->device = device;
+    slot->id = frameId;
+    slot->used = true;
+    slot->record = last;
+}
+
+const CodecStats& MetricDecoder::getStats() const {
+    return stats;
+}
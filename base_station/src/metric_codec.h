@@ -0,0 +1,145 @@
+#ifndef METRIC_CODEC_H
+#define METRIC_CODEC_H
+
+#include <Arduino.h>
+
+// Compression of successive metric samples (Gorilla-style)
+//
+// A keyframe sample (FIELD_SAMPLE) is self-contained. A delta sample
+// (FIELD_DELTA_SAMPLE) names a reference and is bit-packed against it:
+//   varint   : reference frame ID (0 = previous sample in the same frame)
+//   bits     : '0' same fields as the reference, '1' + 16-bit presence mask
+//   bits     : timestamp as delta-of-delta
+//   bits     : per present field, delta-of-delta for counters (uptime,
+//              total_packets) and XOR against the reference value otherwise
+// The first sample of a frame refers to the last sample of the most recent
+// frame the base acknowledged, so a lost frame never breaks the chain.
+// See docs/protocol.md for the bit codes and measured ratios.
+
+// Metric field IDs handled by the codec (1 to CODEC_MAX_FIELDS)
+#define CODEC_MAX_FIELDS        16
+
+// A keyframe is sent at least every this many frames
+#define CODEC_KEYFRAME_INTERVAL 10
+
+// Frames remembered as references (remote: unacknowledged, base: received)
+#define CODEC_HISTORY_SIZE      16
+
+// One sample in raw wire units, plus the state the next sample is coded against
+struct MetricRecord {
+    uint32_t timestamp;
+    uint16_t present;                   // Bit i set: field i + 1 present
+    uint32_t raw[CODEC_MAX_FIELDS];
+
+    // Delta-of-delta state for the timestamp and counter fields
+    uint32_t timestampDelta;
+    uint32_t delta[CODEC_MAX_FIELDS];
+
+    // XOR state: meaningful-bit window of the last change (0xFF = none yet)
+    uint8_t leading[CODEC_MAX_FIELDS];
+    uint8_t trailing[CODEC_MAX_FIELDS];
+};
+
+// Codec statistics
+struct CodecStats {
+    uint32_t keyframes;
+    uint32_t deltas;
+    uint32_t keyframeBytes;
+    uint32_t deltaBytes;
+    uint32_t missingReference;  // Base only: deltas whose reference wasn't known
+};
+
+namespace MetricCodec {
+    // Reset a record to no fields and no coding state
+    void clear(MetricRecord& record);
+
+    // Write a complete keyframe field. Resets the record's coding state.
+    size_t encodeKeyframe(uint8_t* buffer, size_t size, MetricRecord& record);
+    bool decodeKeyframe(const uint8_t* body, size_t length, MetricRecord& record);
+
+    // Write a complete delta field against ref. Updates the record's coding state.
+    size_t encodeDelta(uint8_t* buffer, size_t size, uint32_t refId, const MetricRecord& ref, MetricRecord& record);
+
+    // Read the reference ID at the start of a delta body; returns bytes consumed
+    size_t readDeltaRef(const uint8_t* body, size_t length, uint32_t* refId);
+
+    // Decode the rest of a delta body (after the reference ID) against ref
+    bool decodeDelta(const uint8_t* body, size_t length, const MetricRecord& ref, MetricRecord& record);
+}
+
+// Sender side: picks keyframe or delta for each sample and tracks which
+// frames the base has acknowledged
+class MetricEncoder {
+public:
+    MetricEncoder();
+
+    // Encode a sample as the next one in the frame being built. Returns the
+    // field length, or 0 if it doesn't fit (state unchanged).
+    size_t encode(uint8_t* buffer, size_t size, const MetricRecord& sample, bool firstInFrame);
+
+    // The samples encoded since the last call went out in this frame
+    void frameQueued(uint32_t frameId);
+
+    // Delivery result for a frame; failed frames make the next one a keyframe
+    void frameAcked(uint32_t frameId);
+    void frameFailed(uint32_t frameId);
+
+    // The base lost its reference, start the next frame with a keyframe
+    void requestKeyframe();
+
+    const CodecStats& getStats() const;
+
+private:
+    struct Pending {
+        uint32_t id;
+        bool used;
+        MetricRecord record;
+    };
+
+    MetricRecord reference;         // Last sample of the newest acknowledged frame
+    uint32_t referenceId;
+    bool hasReference;
+    MetricRecord last;              // Last sample encoded in the current frame
+    bool frameIsKeyframe;
+    bool forceKeyframe;
+    uint8_t framesSinceKeyframe;
+    Pending pending[CODEC_HISTORY_SIZE];
+    uint8_t pendingNext;
+    CodecStats stats;
+
+    Pending* findPending(uint32_t frameId);
+};
+
+// Receiver side: decodes samples and remembers the last sample of each
+// recent frame as a possible reference. Frame IDs are per sender, so
+// references are kept and looked up by device and frame ID; the history is
+// shared by all senders.
+class MetricDecoder {
+public:
+    MetricDecoder();
+
+    // Decode one sample body of a frame from device, in order
+    bool decode(uint32_t device, uint8_t fieldId, const uint8_t* body, size_t length, bool firstInFrame,
+                MetricRecord& record);
+
+    // All samples of the frame were decoded, remember its last one
+    void frameDone(uint32_t device, uint32_t frameId);
+
+    const CodecStats& getStats() const;
+
+private:
+    struct Reference {
+        uint32_t device;
+        uint32_t id;
+        bool used;
+        MetricRecord record;
+    };
+
+    MetricRecord last;
+    bool lastValid;
+    Reference history[CODEC_HISTORY_SIZE];
+    uint8_t historyNext;
+    CodecStats stats;
+};
+
+#endif // METRIC_CODEC_H
@@ -0,0 +1,352 @@
+#include "reassembly.h"
+
+ReassemblyPool::ReassemblyPool() :
+    transfers(),
+    blockUsed(),
+    stats(),
+    finished(),
+    finishedNext(0),
+    parity() {
+}
+
+bool ReassemblyPool::canStore(uint32_t device, const FragmentInfo& fragment) const {
+    if (isFinished(device, fragment.transfer)) {
+        return true;
+    }
+
+    // A stale transfer with the same ID gives its blocks back first
+    uint8_t available = freeBlocks();
+    bool entry = false;
+    for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS; i++) {
+        const Transfer& transfer = transfers[i];
+        if (!transfer.active) {
+            entry = true;
+        } else if (transfer.device == device && transfer.id == fragment.transfer) {
+            if (matches(transfer, fragment)) {
+                return true;
+            }
+            available += transfer.blockCount;
+            entry = true;
+        }
+    }
+    return entry && available >= blocksFor(fragment.totalLength);
+}
+
+FragmentOutcome ReassemblyPool::store(uint32_t device, const FragmentInfo& fragment) {
+    if (isFinished(device, fragment.transfer)) {
+        stats.duplicates++;
+        return FRAG_DUPLICATE;
+    }
+    if (!canStore(device, fragment)) {
+        stats.refused++;
+        return FRAG_NO_ROOM;
+    }
+
+    Transfer* transfer = lookup(device, fragment.transfer);
+    if (transfer != nullptr && !matches(*transfer, fragment)) {
+        // The remote restarted and reused the ID
+        release(*transfer);
+        transfer = nullptr;
+    }
+
+    // New transfer: an entry and all of its blocks
+    if (transfer == nullptr) {
+        for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS && transfer == nullptr; i++) {
+            if (!transfers[i].active) {
+                transfer = &transfers[i];
+            }
+        }
+        transfer->active = true;
+        transfer->complete = false;
+        transfer->device = device;
+        transfer->id = fragment.transfer;
+        transfer->length = fragment.totalLength;
+        transfer->fragmentSize = fragment.fragmentSize;
+        transfer->groupData = fragment.groupData;
+        transfer->groupParity = fragment.groupParity;
+        transfer->fragments = Fragment::count(fragment.totalLength, fragment.fragmentSize);
+        transfer->received = 0;
+        transfer->startedAt = millis();
+        memset(transfer->have, 0, sizeof(transfer->have));
+
+        transfer->blockCount = blocksFor(fragment.totalLength);
+        uint8_t block = 0;
+        for (uint8_t i = 0; i < transfer->blockCount; i++) {
+            while (blockUsed[block]) {
+                block++;
+            }
+            blockUsed[block] = true;
+            transfer->blocks[i] = block;
+        }
+        stats.blocksUsed += transfer->blockCount;
+        if (stats.blocksUsed > stats.blocksPeak) {
+            stats.blocksPeak = stats.blocksUsed;
+        }
+    }
+    transfer->lastAt = millis();
+
+    if (fragment.index >= transfer->fragments) {
+        FragmentOutcome outcome = storeParity(*transfer, fragment);
+        if (outcome != FRAG_STORED) {
+            return outcome;
+        }
+    } else {
+        uint8_t bit = 1 << (fragment.index & 7);
+        if (transfer->have[fragment.index >> 3] & bit) {
+            stats.duplicates++;
+            return FRAG_DUPLICATE;
+        }
+
+        write(*transfer, (uint32_t)fragment.index * fragment.fragmentSize, fragment.data, fragment.length);
+        transfer->have[fragment.index >> 3] |= bit;
+        transfer->received++;
+        stats.fragments++;
+    }
+
+    if (transfer->groupParity > 0) {
+        decodeGroup(*transfer, Fragment::groupOf(fragment.index, transfer->fragments,
+                                                 transfer->groupData, transfer->groupParity));
+    }
+
+    if (transfer->received < transfer->fragments) {
+        return FRAG_STORED;
+    }
+    transfer->complete = true;
+    stats.completed++;
+    stats.bytes += transfer->length;
+
+    finished[finishedNext].device = device;
+    finished[finishedNext].id = fragment.transfer;
+    finished[finishedNext].used = true;
+    finishedNext = (finishedNext + 1) % FRAG_MAX_TRANSFERS;
+    return FRAG_COMPLETE;
+}
+
+const Transfer* ReassemblyPool::find(uint32_t device, uint16_t id) const {
+    for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS; i++) {
+        if (transfers[i].active && transfers[i].device == device && transfers[i].id == id) {
+            return &transfers[i];
+        }
+    }
+    return nullptr;
+}
+
+size_t ReassemblyPool::read(const Transfer& transfer, uint32_t offset, uint8_t* out, size_t size) const {
+    size_t copied = 0;
+    while (copied < size && offset + copied < transfer.length) {
+        uint32_t at = offset + copied;
+        size_t n = FRAG_BLOCK_SIZE - at % FRAG_BLOCK_SIZE;
+        if (n > size - copied) {
+            n = size - copied;
+        }
+        if (n > transfer.length - at) {
+            n = transfer.length - at;
+        }
+        memcpy(out + copied, &pool[transfer.blocks[at / FRAG_BLOCK_SIZE]][at % FRAG_BLOCK_SIZE], n);
+        copied += n;
+    }
+    return copied;
+}
+
+void ReassemblyPool::releaseComplete() {
+    for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS; i++) {
+        if (transfers[i].active && transfers[i].complete) {
+            release(transfers[i]);
+        }
+    }
+}
+
+void ReassemblyPool::expire(unsigned long now) {
+    for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS; i++) {
+        if (transfers[i].active && !transfers[i].complete && now - transfers[i].lastAt >= FRAG_IDLE_TIMEOUT_MS) {
+            release(transfers[i]);
+            stats.expired++;
+        }
+    }
+}
+
+const ReassemblyStats& ReassemblyPool::getStats() const {
+    return stats;
+}
+
+Transfer* ReassemblyPool::lookup(uint32_t device, uint16_t id) {
+    return const_cast<Transfer*>(find(device, id));
+}
+
+bool ReassemblyPool::isFinished(uint32_t device, uint16_t id) const {
+    for (uint8_t i = 0; i < FRAG_MAX_TRANSFERS; i++) {
+        if (finished[i].used && finished[i].device == device && finished[i].id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t ReassemblyPool::freeBlocks() const {
+    return FRAG_POOL_BLOCKS - stats.blocksUsed;
+}
+
+bool ReassemblyPool::matches(const Transfer& transfer, const FragmentInfo& fragment) {
+    return transfer.length == fragment.totalLength && transfer.fragmentSize == fragment.fragmentSize &&
+           transfer.groupData == fragment.groupData && transfer.groupParity == fragment.groupParity;
+}
+
+uint8_t ReassemblyPool::blocksFor(uint32_t length) {
+    return (length + FRAG_BLOCK_SIZE - 1) / FRAG_BLOCK_SIZE;
+}
+
+void ReassemblyPool::write(Transfer& transfer, uint32_t offset, const uint8_t* data, size_t length) {
+    size_t copied = 0;
+    while (copied < length) {
+        uint32_t at = offset + copied;
+        size_t inBlock = FRAG_BLOCK_SIZE - at % FRAG_BLOCK_SIZE;
+        size_t n = length - copied < inBlock ? length - copied : inBlock;
+        memcpy(&pool[transfer.blocks[at / FRAG_BLOCK_SIZE]][at % FRAG_BLOCK_SIZE], data + copied, n);
+        copied += n;
+    }
+}
+
+FragmentOutcome ReassemblyPool::storeParity(Transfer& transfer, const FragmentInfo& fragment) {
+    uint8_t entry = &transfer - transfers;
+    uint16_t group = Fragment::groupOf(fragment.index, transfer.fragments, transfer.groupData, transfer.groupParity);
+
+    // Useless once the group has all its data, or if we have it already
+    bool have = true;
+    uint16_t first = group * transfer.groupData;
+    for (uint16_t i = first; i < first + transfer.groupData && i < transfer.fragments && have; i++) {
+        have = transfer.have[i >> 3] & (1 << (i & 7));
+    }
+    int8_t slot = -1;
+    for (uint8_t i = 0; i < FEC_PARITY_SLOTS && !have; i++) {
+        if (!parity[i].used) {
+            slot = slot < 0 ? i : slot;
+        } else if (parity[i].transfer == entry && parity[i].index == fragment.index) {
+            have = true;
+        }
+    }
+    if (have) {
+        stats.duplicates++;
+        return FRAG_DUPLICATE;
+    }
+    if (slot < 0) {
+        stats.refused++;
+        return FRAG_NO_ROOM;
+    }
+
+    parity[slot].used = true;
+    parity[slot].transfer = entry;
+    parity[slot].index = fragment.index;
+    memcpy(parity[slot].data, fragment.data, fragment.length);
+    stats.parity++;
+    return FRAG_STORED;
+}
+
+uint16_t ReassemblyPool::lengthOf(const Transfer& transfer, uint16_t index) {
+    uint32_t start = (uint32_t)index * transfer.fragmentSize;
+    return transfer.length - start < transfer.fragmentSize ? transfer.length - start : transfer.fragmentSize;
+}
+
+void ReassemblyPool::decodeGroup(Transfer& transfer, uint16_t group) {
+    uint8_t entry = &transfer - transfers;
+    uint16_t first = group * transfer.groupData;
+    uint8_t size = transfer.fragments - first < transfer.groupData ? transfer.fragments - first : transfer.groupData;
+
+    uint16_t missing[FEC_MAX_PARITY];
+    uint8_t missingCount = 0;
+    for (uint8_t j = 0; j < size; j++) {
+        uint16_t index = first + j;
+        if (!(transfer.have[index >> 3] & (1 << (index & 7)))) {
+            if (missingCount == FEC_MAX_PARITY) {
+                return;
+            }
+            missing[missingCount++] = index;
+        }
+    }
+    if (missingCount == 0) {
+        releaseParity(transfer, group);
+        return;
+    }
+
+    // One parity fragment per missing data fragment
+    uint8_t slots[FEC_MAX_PARITY];
+    uint8_t slotCount = 0;
+    uint16_t firstParity = transfer.fragments + group * transfer.groupParity;
+    for (uint8_t i = 0; i < FEC_PARITY_SLOTS && slotCount < missingCount; i++) {
+        if (parity[i].used && parity[i].transfer == entry &&
+            parity[i].index >= firstParity && parity[i].index < firstParity + transfer.groupParity) {
+            slots[slotCount++] = i;
+        }
+    }
+    if (slotCount < missingCount) {
+        return;
+    }
+
+    unsigned long started = micros();
+
+    // Syndromes: each parity fragment less what the data we have put into it
+    uint8_t* fragment = scratch[FEC_MAX_PARITY];
+    for (uint8_t r = 0; r < missingCount; r++) {
+        memcpy(scratch[r], parity[slots[r]].data, transfer.fragmentSize);
+    }
+    for (uint8_t j = 0; j < size; j++) {
+        uint16_t index = first + j;
+        if (!(transfer.have[index >> 3] & (1 << (index & 7)))) {
+            continue;
+        }
+        uint16_t length = lengthOf(transfer, index);
+        read(transfer, (uint32_t)index * transfer.fragmentSize, fragment, length);
+        for (uint8_t r = 0; r < missingCount; r++) {
+            Fec::multiplyAdd(scratch[r], fragment, length, Fec::coefficient(parity[slots[r]].index - firstParity, j));
+        }
+    }
+
+    // Solve for the missing data
+    uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    for (uint8_t r = 0; r < missingCount; r++) {
+        for (uint8_t c = 0; c < missingCount; c++) {
+            matrix[r * missingCount + c] = Fec::coefficient(parity[slots[r]].index - firstParity, missing[c] - first);
+        }
+    }
+    if (!Fec::invert(matrix, missingCount)) {
+        return;
+    }
+    for (uint8_t c = 0; c < missingCount; c++) {
+        memset(fragment, 0, transfer.fragmentSize);
+        for (uint8_t r = 0; r < missingCount; r++) {
+            Fec::multiplyAdd(fragment, scratch[r], transfer.fragmentSize, matrix[c * missingCount + r]);
+        }
+        uint16_t index = missing[c];
+        write(transfer, (uint32_t)index * transfer.fragmentSize, fragment, lengthOf(transfer, index));
+        transfer.have[index >> 3] |= 1 << (index & 7);
+        transfer.received++;
+        stats.recovered++;
+    }
+    releaseParity(transfer, group);
+
+    uint32_t elapsed = micros() - started;
+    stats.decodeUs += elapsed;
+    if (elapsed > stats.decodeMaxUs) {
+        stats.decodeMaxUs = elapsed;
+    }
+}
+
+void ReassemblyPool::releaseParity(const Transfer& transfer, uint16_t group) {
+    uint8_t entry = &transfer - transfers;
+    for (uint8_t i = 0; i < FEC_PARITY_SLOTS; i++) {
+        if (parity[i].used && parity[i].transfer == entry &&
+            (group == 0xFFFF || Fragment::groupOf(parity[i].index, transfer.fragments, transfer.groupData,
+                                                  transfer.groupParity) == group)) {
+            parity[i].used = false;
+        }
+    }
+}
+
+void ReassemblyPool::release(Transfer& transfer) {
+    releaseParity(transfer, 0xFFFF);
+    for (uint8_t i = 0; i < transfer.blockCount; i++) {
+        blockUsed[transfer.blocks[i]] = false;
+    }
+    stats.blocksUsed -= transfer.blockCount;
+    transfer.blockCount = 0;
+    transfer.active = false;
+}
@@ -0,0 +1,156 @@
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include <Arduino.h>
+#include "fragment.h"
+
+// Base side of transfers (see fragment.h). Fragments are copied into a pool
+// of FRAG_POOL_BLOCKS fixed-size blocks. A transfer is only taken on when
+// the pool has blocks for all of it, and they're set aside right then, so
+// transfers in progress can't starve each other. A fragment that finds no
+// room isn't acknowledged, and the remote sends it again later. A transfer
+// that stops getting fragments is dropped after FRAG_IDLE_TIMEOUT_MS.
+//
+// Parity fragments (see fec.h) wait in one of FEC_PARITY_SLOTS until their
+// group has as many fragments as data fragments, when the missing data is
+// computed into the pool. With every slot taken, a parity fragment is
+// refused like one that finds no room.
+
+#define FRAG_BLOCK_SIZE         512
+#define FRAG_POOL_BLOCKS        128     // 64 KB: one largest transfer, or several smaller ones
+#define FRAG_MAX_TRANSFERS      4       // In progress at once
+#define FRAG_IDLE_TIMEOUT_MS    900000  // 15 minutes, five TDMA superframes
+#define FRAG_BLOCKS_PER_TRANSFER (FRAG_MAX_TRANSFER_SIZE / FRAG_BLOCK_SIZE)
+#define FEC_PARITY_SLOTS        16      // Parity fragments held for groups still short of data
+
+#if FRAG_POOL_BLOCKS > 255
+#error "Block numbers are 8-bit"
+#endif
+
+// What became of a fragment
+enum FragmentOutcome {
+    FRAG_STORED,                // Kept, transfer still incomplete
+    FRAG_COMPLETE,              // Kept, and it was the last one missing
+    FRAG_DUPLICATE,             // Already had it (sent again after the ACK got lost)
+    FRAG_NO_ROOM                // No free entry, not enough free blocks, or no parity slot
+};
+
+// A transfer being collected
+struct Transfer {
+    bool active;
+    bool complete;              // Every fragment is in; released after it's forwarded
+    uint32_t device;
+    uint16_t id;
+    uint32_t length;
+    uint16_t fragmentSize;
+    uint8_t groupData;          // FEC group, 0 without FEC
+    uint8_t groupParity;
+    uint16_t fragments;         // Data fragments
+    uint16_t received;          // Data fragments in, decoded ones included
+    unsigned long startedAt;
+    unsigned long lastAt;
+    uint8_t blockCount;
+    uint8_t blocks[FRAG_BLOCKS_PER_TRANSFER];           // Pool block of each FRAG_BLOCK_SIZE of data
+    uint8_t have[(FRAG_MAX_FRAGMENTS + 7) / 8];         // Bit i set: fragment i is in
+};
+
+// Reassembly statistics
+struct ReassemblyStats {
+    uint32_t completed;
+    uint32_t expired;           // Dropped after FRAG_IDLE_TIMEOUT_MS
+    uint32_t fragments;         // Kept
+    uint32_t parity;            // Parity fragments kept
+    uint32_t recovered;         // Data fragments decoded from parity
+    uint32_t duplicates;
+    uint32_t refused;           // Fragments not taken for lack of room
+    uint32_t bytes;             // Data in completed transfers
+    uint8_t blocksUsed;
+    uint8_t blocksPeak;
+    uint32_t decodeUs;          // Time spent decoding
+    uint32_t decodeMaxUs;       // Longest for one group
+};
+
+class ReassemblyPool {
+public:
+    ReassemblyPool();
+
+    // Copy a fragment into its transfer, taking the transfer on if it's new
+    FragmentOutcome store(uint32_t device, const FragmentInfo& fragment);
+
+    // Transfer of a device (nullptr if none)
+    const Transfer* find(uint32_t device, uint16_t id) const;
+
+    // Copy up to size bytes of a transfer's data from offset; returns bytes copied
+    size_t read(const Transfer& transfer, uint32_t offset, uint8_t* out, size_t size) const;
+
+    // Free the blocks of complete transfers (once forwarded)
+    void releaseComplete();
+
+    // Drop transfers that haven't had a fragment for FRAG_IDLE_TIMEOUT_MS
+    void expire(unsigned long now);
+
+    const ReassemblyStats& getStats() const;
+
+private:
+    Transfer transfers[FRAG_MAX_TRANSFERS];
+    uint8_t pool[FRAG_POOL_BLOCKS][FRAG_BLOCK_SIZE];
+    bool blockUsed[FRAG_POOL_BLOCKS];
+    ReassemblyStats stats;
+
+    // Transfers completed lately, so a fragment sent again after the remote
+    // missed our ACKs doesn't start them over
+    struct Finished {
+        uint32_t device;
+        uint16_t id;
+        bool used;
+    };
+    Finished finished[FRAG_MAX_TRANSFERS];
+    uint8_t finishedNext;
+
+    // A parity fragment waiting for the rest of its group
+    struct ParitySlot {
+        bool used;
+        uint8_t transfer;       // Entry in transfers
+        uint16_t index;
+        uint8_t data[FRAG_DATA_SIZE];
+    };
+    ParitySlot parity[FEC_PARITY_SLOTS];
+
+    // Syndromes of a group being decoded, and one fragment
+    uint8_t scratch[FEC_MAX_PARITY + 1][FRAG_DATA_SIZE];
+
+    // Whether a fragment can be taken: its transfer is in progress, or
+    // there's an entry and blocks for all of it
+    bool canStore(uint32_t device, const FragmentInfo& fragment) const;
+
+    Transfer* lookup(uint32_t device, uint16_t id);
+    bool isFinished(uint32_t device, uint16_t id) const;
+    uint8_t freeBlocks() const;
+
+    // Whether a transfer's header matches the fragment's
+    static bool matches(const Transfer& transfer, const FragmentInfo& fragment);
+
+    // Blocks for a transfer of this length
+    static uint8_t blocksFor(uint32_t length);
+
+    // Copy data into a transfer at offset (it may straddle blocks)
+    void write(Transfer& transfer, uint32_t offset, const uint8_t* data, size_t length);
+
+    // Keep a parity fragment for its group
+    FragmentOutcome storeParity(Transfer& transfer, const FragmentInfo& fragment);
+
+    // Bytes in data fragment index
+    static uint16_t lengthOf(const Transfer& transfer, uint16_t index);
+
+    // Rebuild a group's missing data fragments if its parity covers them,
+    // and free its parity once it has all of them
+    void decodeGroup(Transfer& transfer, uint16_t group);
+
+    // Free the parity slots of a transfer's group (all groups: 0xFFFF)
+    void releaseParity(const Transfer& transfer, uint16_t group);
+
+    // Return a transfer's blocks (and parity slots) to the pool
+    void release(Transfer& transfer);
+};
+
+#endif // REASSEMBLY_H
@@ -0,0 +1,115 @@
+#include "record_writer.h"
+
+namespace RecordCrc {
+
+// Reflected polynomial 0xEDB88320, four bits at a time
+static const uint32_t TABLE[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t update(uint32_t crc, const uint8_t* data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+        crc = (crc >> 4) ^ TABLE[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+}  // namespace RecordCrc
+
+RecordWriter::RecordWriter(Print& out) :
+    out(out),
+    crc(0),
+    blockLength(0),
+    written(0) {
+}
+
+void RecordWriter::begin(uint8_t type) {
+    crc = 0;
+    blockLength = 0;
+    written = 0;
+
+    // Ends whatever came before, so the record can be told apart from it
+    out.write((uint8_t)0);
+    written++;
+
+    write(type);
+}
+
+void RecordWriter::writeU8(uint8_t value) {
+    write(value);
+}
+
+void RecordWriter::writeU16(uint16_t value) {
+    uint8_t bytes[2] = { (uint8_t)value, (uint8_t)(value >> 8) };
+    write(bytes, sizeof(bytes));
+}
+
+void RecordWriter::writeU32(uint32_t value) {
+    uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    write(bytes, sizeof(bytes));
+}
+
+void RecordWriter::writeI16(int16_t value) {
+    writeU16((uint16_t)value);
+}
+
+void RecordWriter::writeFloat(float value) {
+    // IEEE 754 single; the ESP32 is little-endian already
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeU32(bits);
+}
+
+size_t RecordWriter::write(uint8_t value) {
+    crc = RecordCrc::update(crc, &value, 1);
+    put(value);
+    return 1;
+}
+
+size_t RecordWriter::write(const uint8_t* data, size_t length) {
+    crc = RecordCrc::update(crc, data, length);
+    for (size_t i = 0; i < length; i++) {
+        put(data[i]);
+    }
+    return length;
+}
+
+size_t RecordWriter::end() {
+    // CRC of everything since the type byte
+    uint32_t value = crc;
+    for (uint8_t i = 0; i < 4; i++) {
+        put((uint8_t)(value >> (8 * i)));
+    }
+
+    // The last block goes out even if empty, then the delimiter
+    flushBlock(blockLength + 1);
+    out.write((uint8_t)0);
+    written++;
+    return written;
+}
+
+void RecordWriter::put(uint8_t value) {
+    // A zero ends the block; its code says where the zero was
+    if (value == 0) {
+        flushBlock(blockLength + 1);
+        return;
+    }
+
+    block[blockLength++] = value;
+
+    // A full block has no zero after it
+    if (blockLength == RECORD_BLOCK_SIZE) {
+        flushBlock(0xFF);
+    }
+}
+
+void RecordWriter::flushBlock(uint8_t code) {
+    out.write(code);
+    out.write(block, blockLength);
+    written += 1 + blockLength;
+    blockLength = 0;
+}
@@ -0,0 +1,74 @@
+#ifndef RECORD_WRITER_H
+#define RECORD_WRITER_H
+
+#include <Arduino.h>
+
+// Binary serial records (SerialManager's binary output mode)
+//
+// A record is a type byte and its fields, all little-endian, followed by the
+// CRC-32 of both (the zlib/IEEE polynomial, little-endian). It goes out
+// COBS-encoded, so it contains no zero byte, between two zero delimiters:
+//   00 | COBS(type, fields..., crc32) | 00
+// Anything else between two zeros (text printed with Serial.print, a record
+// cut short by a reset) fails the CRC and is skipped, so a reader picks the
+// stream up again at the next delimiter. See docs/protocol.md for the record
+// layouts and tools/serial_decode.py for a reader.
+
+// Record types
+#define RECORD_MESSAGE      1   // Ping, data or status message from a remote
+#define RECORD_SIGNAL       2   // Signal metrics of the remote heard last
+#define RECORD_SYSTEM       3   // Uptime, packets and errors
+#define RECORD_STATUS       4   // Status text (timestamp, then the text)
+#define RECORD_LOG          5
+#define RECORD_DEBUG        6
+#define RECORD_ERROR        7
+#define RECORD_METRICS      8   // Statistics document, as JSON text
+#define RECORD_TRANSFER     9   // Completed transfer, its data as raw bytes
+
+// COBS sends up to 254 data bytes per block
+#define RECORD_BLOCK_SIZE   254
+
+// Writes one record at a time, encoding it as it goes: the fields are
+// never collected, so a record can be as long as a transfer. It is a Print,
+// so a JSON document can be serialized straight into a record.
+class RecordWriter : public Print {
+public:
+    explicit RecordWriter(Print& out);
+
+    // Start a record: leading delimiter and type
+    void begin(uint8_t type);
+
+    // Fields
+    void writeU8(uint8_t value);
+    void writeU16(uint16_t value);
+    void writeU32(uint32_t value);
+    void writeI16(int16_t value);
+    void writeFloat(float value);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* data, size_t length);
+    using Print::write;
+
+    // Finish the record: CRC, last block and closing delimiter. Returns the
+    // bytes it took on the wire.
+    size_t end();
+
+private:
+    Print& out;
+    uint32_t crc;
+    uint8_t block[RECORD_BLOCK_SIZE];
+    uint8_t blockLength;
+    size_t written;
+
+    // Encode one byte without adding it to the CRC
+    void put(uint8_t value);
+
+    // Send the block so far with its COBS code
+    void flushBlock(uint8_t code);
+};
+
+namespace RecordCrc {
+    // CRC-32 (zlib), continued from crc (0 to start)
+    uint32_t update(uint32_t crc, const uint8_t* data, size_t length);
+}
+
+#endif // RECORD_WRITER_H
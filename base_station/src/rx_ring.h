@@ -0,0 +1,71 @@
+#ifndef RX_RING_H
+#define RX_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// Number of raw frames buffered between the radio task and the decoder
+// (must be a power of two)
+#define RX_RING_SIZE    8
+
+// Largest frame stored in a ring slot (matches MAX_PACKET_SIZE)
+#define RX_FRAME_SIZE   256
+
+// A frame as drained from the SX1262 FIFO, before any decoding
+struct RawFrame {
+    uint32_t capturedAt;    // micros() when the RX-done interrupt fired
+    int16_t rssi;
+    float snr;
+    uint8_t channel;        // Hop channel it arrived on, HOP_HOME for LORA_FREQUENCY
+    uint16_t length;
+    uint8_t data[RX_FRAME_SIZE];
+};
+
+// Single-producer/single-consumer ring of raw frames. The radio task is the
+// only producer and loop() the only consumer, so no lock is needed: each side
+// owns one index and publishes it with release ordering.
+class RxRing {
+public:
+    RxRing() : head(0), tail(0) {}
+
+    // Producer: get the slot to fill next, or nullptr if the ring is full
+    RawFrame* reserve() {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= RX_RING_SIZE) {
+            return nullptr;
+        }
+        return &slots[h & (RX_RING_SIZE - 1)];
+    }
+
+    // Producer: publish the slot returned by reserve()
+    void commit() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: oldest frame, or nullptr if the ring is empty. It stays the
+    // consumer's until pop(), so it can be decoded in place.
+    RawFrame* peek() {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return &slots[t & (RX_RING_SIZE - 1)];
+    }
+
+    // Consumer: release the frame returned by peek()
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Number of frames waiting to be decoded
+    uint32_t count() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+private:
+    RawFrame slots[RX_RING_SIZE];
+    std::atomic<uint32_t> head;
+    std::atomic<uint32_t> tail;
+};
+
+#endif // RX_RING_H
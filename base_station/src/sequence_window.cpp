@@ -0,0 +1,104 @@
+#include "sequence_window.h"
+
+static void saturatingIncrement(uint16_t& counter) {
+    if (counter < 0xFFFF) {
+        counter++;
+    }
+}
+
+SeqResult SequenceWindow::update(uint32_t id, uint32_t timestamp, unsigned long now) {
+    if (span == 0) {
+        restart(id, now);
+        return SEQ_NEW;
+    }
+
+    if (id > highest) {
+        uint32_t gap = id - highest;
+        if (gap >= SEQ_WINDOW_BITS) {
+            // The whole window leaves, and so do the skipped IDs that don't fit the new one
+            lost += missing(0, span) + (gap - SEQ_WINDOW_BITS);
+            bitmap = 1;
+            span = SEQ_WINDOW_BITS;
+        } else {
+            lost += missing(SEQ_WINDOW_BITS - gap, SEQ_WINDOW_BITS);
+            bitmap = (bitmap << gap) | 1;
+            span = span + gap < SEQ_WINDOW_BITS ? span + gap : SEQ_WINDOW_BITS;
+        }
+        highest = id;
+        highestAt = now;
+        received++;
+        return SEQ_NEW;
+    }
+
+    uint32_t behind = highest - id;
+
+    // Too old to track, or sent after the remote (re)booted. Checked before the
+    // window, so a restarted ID that lands on a gap isn't taken as a late arrival.
+    if (behind >= SEQ_WINDOW_BITS ||
+        (behind > 0 && timestamp <= (now - highestAt) / 1000 + SEQ_RESET_SLACK)) {
+        lost += missing(0, span);
+        saturatingIncrement(resets);
+        restart(id, now);
+        return SEQ_RESET;
+    }
+
+    bool seen = behind < span && (bitmap >> behind) & 1;
+
+    if (seen) {
+        saturatingIncrement(duplicates);
+        return SEQ_DUPLICATE;
+    }
+
+    // Late arrival; older than the first ID heard extends the window back to it
+    bitmap |= (uint64_t)1 << behind;
+    if (behind >= span) {
+        span = behind + 1;
+    }
+    received++;
+    saturatingIncrement(reordered);
+    return SEQ_REORDERED;
+}
+
+float SequenceWindow::windowLoss() const {
+    return span > 0 ? (float)missing(0, span) / span : 0.0;
+}
+
+uint32_t SequenceWindow::getLost() const {
+    return lost + missing(0, span);
+}
+
+uint32_t SequenceWindow::getReceived() const {
+    return received;
+}
+
+uint16_t SequenceWindow::getReordered() const {
+    return reordered;
+}
+
+uint16_t SequenceWindow::getDuplicates() const {
+    return duplicates;
+}
+
+uint16_t SequenceWindow::getResets() const {
+    return resets;
+}
+
+void SequenceWindow::restart(uint32_t id, unsigned long now) {
+    bitmap = 1;
+    highest = id;
+    highestAt = now;
+    span = 1;
+    received++;
+}
+
+uint8_t SequenceWindow::missing(uint8_t from, uint8_t to) const {
+    if (to > span) {
+        to = span;
+    }
+    if (from >= to) {
+        return 0;
+    }
+
+    uint64_t mask = (to == SEQ_WINDOW_BITS ? ~0ULL : ((uint64_t)1 << to) - 1) & ~(((uint64_t)1 << from) - 1);
+    return (to - from) - __builtin_popcountll(bitmap & mask);
+}
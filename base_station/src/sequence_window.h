@@ -0,0 +1,64 @@
+#ifndef SEQUENCE_WINDOW_H
+#define SEQUENCE_WINDOW_H
+
+#include <Arduino.h>
+
+// Receive history of one remote's message IDs. Bit i of the bitmap is set if
+// ID (highest - i) arrived, so loss, reordering and duplicates are counted as
+// each frame comes in, with no per-frame storage. IDs that slide out of the
+// window unset are final losses. All members zero is an empty window, so it
+// can live in a memset() table entry.
+
+// IDs tracked behind the highest one received
+#define SEQ_WINDOW_BITS      64
+
+// An ID behind the highest, received or not, is taken as a reboot of the
+// remote if its timestamp (remote uptime, s) is no more than this past the
+// time since the highest ID arrived, i.e. the remote booted after sending it.
+// A frame sent in the remote's first few seconds and delivered late looks the
+// same, so it counts as a reset too.
+#define SEQ_RESET_SLACK      5
+
+// What a received ID turned out to be
+enum SeqResult {
+    SEQ_NEW,          // Highest so far (may leave a gap)
+    SEQ_REORDERED,    // Filled a gap behind the highest
+    SEQ_DUPLICATE,    // Already received
+    SEQ_RESET         // Remote restarted its IDs; the window starts over
+};
+
+class SequenceWindow {
+public:
+    // Record an ID. timestamp is the remote's uptime when it sent the frame,
+    // now the local millis() it arrived at.
+    SeqResult update(uint32_t id, uint32_t timestamp, unsigned long now);
+
+    // Share of the IDs in the window that are missing (0-1)
+    float windowLoss() const;
+
+    // IDs known to be missing, including those still in the window
+    uint32_t getLost() const;
+    uint32_t getReceived() const;
+    uint16_t getReordered() const;
+    uint16_t getDuplicates() const;
+    uint16_t getResets() const;
+
+private:
+    uint64_t bitmap;
+    uint32_t highest;
+    uint32_t highestAt;     // millis() when the highest ID arrived
+    uint32_t received;      // Distinct IDs
+    uint32_t lost;          // IDs that left the window missing
+    uint16_t reordered;     // Counters saturate
+    uint16_t duplicates;
+    uint16_t resets;
+    uint8_t span;           // IDs covered by the window, 0 = nothing received yet
+
+    // Start over with id as the only ID received
+    void restart(uint32_t id, unsigned long now);
+
+    // Missing IDs at bit positions from to to - 1 (within the span)
+    uint8_t missing(uint8_t from, uint8_t to) const;
+};
+
+#endif // SEQUENCE_WINDOW_H
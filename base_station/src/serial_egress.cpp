@@ -0,0 +1,318 @@
+#include "serial_egress.h"
+
+static_assert((SERIAL_EGRESS_SIZE & (SERIAL_EGRESS_SIZE - 1)) == 0, "SERIAL_EGRESS_SIZE must be a power of two");
+static_assert(SERIAL_EGRESS_HEADROOM < SERIAL_EGRESS_SIZE / 2, "SERIAL_EGRESS_HEADROOM leaves too little to queue");
+
+// Entry flags
+static const uint8_t ENTRY_MORE = 0x01;    // More of the record follows in the next entry
+static const uint8_t ENTRY_KEEP = 0x02;    // Never evicted (transfers)
+
+SerialEgress::SerialEgress(Print& out) :
+    out(out),
+    task(nullptr),
+    mutex(nullptr),
+    policy(SERIAL_DROP_POLICY),
+    head(0),
+    tail(0),
+    released(0),
+    stats(),
+    sending(),
+    sendAt(0),
+    sendEnd(0),
+    writing(false),
+    entryAt(0),
+    writeAt(0),
+    room(0),
+    recordBytes(0),
+    recordPriority(SERIAL_PRIORITY_LOW),
+    recordDropped(false) {
+}
+
+void SerialEgress::begin() {
+    // Guards the ring positions and stats between loop() and the task
+    mutex = xSemaphoreCreateMutex();
+    
+    xTaskCreatePinnedToCore(egressTask, "serial_tx", SERIAL_EGRESS_STACK_SIZE, this,
+                            SERIAL_EGRESS_PRIORITY, &task, SERIAL_EGRESS_CORE);
+}
+
+void SerialEgress::beginRecord(SerialPriority priority) {
+    entryAt = head;
+    writeAt = head;
+    room = 0;
+    recordBytes = 0;
+    recordPriority = priority;
+    recordDropped = false;
+    
+    // Low-priority records keep out of the last part of the ring
+    if (policy == SERIAL_DROP_LOW_PRIORITY && priority == SERIAL_PRIORITY_LOW &&
+        getUsed() > (uint32_t)SERIAL_EGRESS_SIZE * SERIAL_EGRESS_LOW_LIMIT / 100) {
+        recordDropped = true;
+        return;
+    }
+    
+    // Evict ahead of need; the header at least has to fit now
+    if (!makeRoom(SERIAL_EGRESS_HEADROOM) && room < sizeof(Entry)) {
+        if (priority != SERIAL_PRIORITY_BULK) {
+            recordDropped = true;
+            return;
+        }
+        waitForRoom(SERIAL_EGRESS_SIZE / 4);
+    }
+    writeAt += sizeof(Entry);
+    room -= sizeof(Entry);
+}
+
+size_t SerialEgress::write(uint8_t value) {
+    recordBytes++;
+    if (room == 0 && !reserve()) {
+        return 1;
+    }
+    
+    buffer[writeAt & (SERIAL_EGRESS_SIZE - 1)] = value;
+    writeAt++;
+    room--;
+    return 1;
+}
+
+size_t SerialEgress::write(const uint8_t* data, size_t length) {
+    recordBytes += length;
+    
+    // Dropped records still report every byte written, so callers count
+    // what they produced
+    size_t done = 0;
+    while (done < length) {
+        if (room == 0 && !reserve()) {
+            break;
+        }
+        uint32_t n = length - done < room ? length - done : room;
+        copyIn(writeAt, data + done, n);
+        writeAt += n;
+        room -= n;
+        done += n;
+    }
+    return length;
+}
+
+void SerialEgress::endRecord() {
+    if (recordDropped) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        stats.droppedRecords++;
+        stats.droppedBytes += recordBytes;
+        xSemaphoreGive(mutex);
+        return;
+    }
+    
+    commitEntry(recordPriority == SERIAL_PRIORITY_BULK ? ENTRY_KEEP : 0);
+}
+
+bool SerialEgress::drain(uint32_t timeoutMs) {
+    unsigned long start = millis();
+    for (;;) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        bool empty = released == head && !writing;
+        xSemaphoreGive(mutex);
+        
+        if (empty) {
+            return true;
+        }
+        if (millis() - start >= timeoutMs) {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+void SerialEgress::setPolicy(SerialDropPolicy policy) {
+    this->policy = policy;
+}
+
+SerialDropPolicy SerialEgress::getPolicy() const {
+    return policy;
+}
+
+uint32_t SerialEgress::getUsed() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    uint32_t used = head - released;
+    xSemaphoreGive(mutex);
+    return used;
+}
+
+EgressStats SerialEgress::getStats() {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    EgressStats copy = stats;
+    xSemaphoreGive(mutex);
+    return copy;
+}
+
+bool SerialEgress::makeRoom(uint32_t bytes) {
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    
+    // Evicting an entry while the task is part way through an older one
+    // frees its space only once that one is done, so the target counts
+    // from tail.
+    // Under the low-priority policy only high-priority records evict, and
+    // nothing is evicted for a record that can't fit anyway.
+    bool evict = (policy == SERIAL_DROP_OLDEST || recordPriority != SERIAL_PRIORITY_LOW) &&
+                 writeAt - entryAt + bytes <= SERIAL_EGRESS_SIZE;
+    while (evict && SERIAL_EGRESS_SIZE - (writeAt - tail) < bytes && tail != head) {
+        Entry entry;
+        copyOut(tail, &entry, sizeof(entry));
+        if (entry.flags & ENTRY_KEEP) {
+            break;
+        }
+        
+        bool idle = released == tail;
+        tail += sizeof(entry) + entry.length;
+        if (idle) {
+            released = tail;
+        }
+        stats.droppedRecords++;
+        stats.droppedBytes += entry.length;
+    }
+    
+    room = SERIAL_EGRESS_SIZE - (writeAt - released);
+    xSemaphoreGive(mutex);
+    return room >= bytes;
+}
+
+bool SerialEgress::reserve() {
+    if (recordDropped) {
+        return false;
+    }
+    
+    // The task may have made room since the last look, or older records can go
+    if (makeRoom(1)) {
+        return true;
+    }
+    
+    // A transfer goes in a piece at a time
+    if (recordPriority == SERIAL_PRIORITY_BULK) {
+        splitRecord();
+        return true;
+    }
+    
+    // Anything else is dropped whole; nothing of it is queued yet
+    recordDropped = true;
+    writeAt = entryAt;
+    return false;
+}
+
+void SerialEgress::splitRecord() {
+    commitEntry(ENTRY_KEEP | ENTRY_MORE);
+    
+    // The next piece once a quarter of the ring is free, so pieces aren't tiny
+    entryAt = writeAt;
+    waitForRoom(SERIAL_EGRESS_SIZE / 4);
+    writeAt += sizeof(Entry);
+    room -= sizeof(Entry);
+}
+
+void SerialEgress::waitForRoom(uint32_t bytes) {
+    uint32_t startedAt = micros();
+    for (;;) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        room = SERIAL_EGRESS_SIZE - (writeAt - released);
+        xSemaphoreGive(mutex);
+        
+        if (room >= bytes) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    stats.stallUs += micros() - startedAt;
+    xSemaphoreGive(mutex);
+}
+
+void SerialEgress::commitEntry(uint8_t flags) {
+    Entry entry;
+    entry.length = writeAt - entryAt - sizeof(Entry);
+    entry.queuedAt = micros();
+    entry.priority = recordPriority;
+    entry.flags = flags;
+    copyIn(entryAt, &entry, sizeof(entry));
+    
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    head = writeAt;
+    if (!(flags & ENTRY_MORE)) {
+        stats.queuedRecords++;
+        stats.queuedBytes += recordBytes;
+    }
+    if (head - released > stats.peakBytes) {
+        stats.peakBytes = head - released;
+    }
+    xSemaphoreGive(mutex);
+    
+    xTaskNotifyGive(task);
+}
+
+void SerialEgress::copyIn(uint32_t at, const void* data, uint32_t length) {
+    uint32_t offset = at & (SERIAL_EGRESS_SIZE - 1);
+    uint32_t first = length < SERIAL_EGRESS_SIZE - offset ? length : SERIAL_EGRESS_SIZE - offset;
+    memcpy(buffer + offset, data, first);
+    memcpy(buffer, (const uint8_t*)data + first, length - first);
+}
+
+void SerialEgress::copyOut(uint32_t at, void* data, uint32_t length) {
+    uint32_t offset = at & (SERIAL_EGRESS_SIZE - 1);
+    uint32_t first = length < SERIAL_EGRESS_SIZE - offset ? length : SERIAL_EGRESS_SIZE - offset;
+    memcpy(data, buffer + offset, first);
+    memcpy((uint8_t*)data + first, buffer, length - first);
+}
+
+bool SerialEgress::sendNext() {
+    uint8_t chunk[SERIAL_EGRESS_CHUNK];
+    
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (sendAt == sendEnd) {
+        if (tail == head) {
+            xSemaphoreGive(mutex);
+            return false;
+        }
+        
+        // Take the oldest entry; it can't be evicted from here on
+        copyOut(tail, &sending, sizeof(sending));
+        sendAt = tail + sizeof(sending);
+        sendEnd = sendAt + sending.length;
+        tail = sendEnd;
+    }
+    
+    // Copy a chunk out and free its space before the slow part
+    uint32_t length = sendEnd - sendAt < SERIAL_EGRESS_CHUNK ? sendEnd - sendAt : SERIAL_EGRESS_CHUNK;
+    copyOut(sendAt, chunk, length);
+    sendAt += length;
+    bool last = sendAt == sendEnd;
+    
+    // Entries evicted in the meantime are released with the last chunk
+    released = last ? tail : sendAt;
+    writing = true;
+    xSemaphoreGive(mutex);
+    
+    out.write(chunk, length);
+    uint32_t latency = micros() - sending.queuedAt;
+    
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    writing = false;
+    stats.sentBytes += length;
+    if (last && !(sending.flags & ENTRY_MORE)) {
+        stats.sentRecords++;
+        if (latency > stats.latencyMaxUs) {
+            stats.latencyMaxUs = latency;
+        }
+    }
+    xSemaphoreGive(mutex);
+    return true;
+}
+
+void SerialEgress::egressTask(void* param) {
+    SerialEgress* self = static_cast<SerialEgress*>(param);
+    
+    for (;;) {
+        // Sleep until a record is queued, then write out all there is
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (self->sendNext()) {
+        }
+    }
+}
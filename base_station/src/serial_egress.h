@@ -0,0 +1,153 @@
+#ifndef SERIAL_EGRESS_H
+#define SERIAL_EGRESS_H
+
+#include <Arduino.h>
+
+// Bytes of serial output waiting for the egress task (must be a power of
+// two). 16 KB is about 1.4 s of output at 115200 baud.
+#define SERIAL_EGRESS_SIZE        16384
+#define SERIAL_EGRESS_PRIORITY    1       // Below the radio task, which preempts it
+#define SERIAL_EGRESS_STACK_SIZE  3072
+#define SERIAL_EGRESS_CORE        0       // loop() runs on core 1
+
+// The task copies records out of the ring this much at a time before
+// writing them, so a record up to this size frees its space at once
+#define SERIAL_EGRESS_CHUNK       512
+
+// Under SERIAL_DROP_LOW_PRIORITY, low-priority records are refused once the
+// ring is this full (percent), keeping the rest for high-priority ones
+#define SERIAL_EGRESS_LOW_LIMIT   75
+
+// Kept free ahead of each record, evicting older ones if need be, so it can
+// be written while the task is still busy with a record larger than a chunk
+#define SERIAL_EGRESS_HEADROOM    2048
+
+// Longest wait for the ring to empty before a baud rate change
+#define SERIAL_EGRESS_DRAIN_MS    2000
+
+// What gives way when the ring is full, chosen with CMD:CONFIG {"drop": "oldest"} or {"drop": "low"}
+enum SerialDropPolicy {
+    SERIAL_DROP_OLDEST,         // A new record evicts the oldest records queued
+    SERIAL_DROP_LOW_PRIORITY    // Low-priority records are refused past SERIAL_EGRESS_LOW_LIMIT;
+                                // a high-priority one that still doesn't fit evicts the oldest
+};
+#define SERIAL_DROP_POLICY        SERIAL_DROP_OLDEST
+
+enum SerialPriority {
+    SERIAL_PRIORITY_LOW,        // Logs, debug and periodic metrics
+    SERIAL_PRIORITY_HIGH,       // Remote messages, status and errors
+    SERIAL_PRIORITY_BULK        // Transfers: high, and larger than the ring, so they wait for room
+};
+
+// What went through the ring
+struct EgressStats {
+    uint32_t queuedRecords;
+    uint32_t queuedBytes;
+    uint32_t sentRecords;
+    uint32_t sentBytes;
+    uint32_t droppedRecords;    // Refused, evicted or larger than the ring
+    uint32_t droppedBytes;
+    uint32_t latencyMaxUs;      // Longest from queued to written out
+    uint32_t peakBytes;         // Most bytes queued at once
+    uint32_t stallUs;           // Time loop() waited for room for a transfer
+};
+
+// Serial output decoupled from loop(). Records are written into a ring,
+// whole, and a task on core 0 writes them to the port, so a slow or absent
+// USB host fills the ring instead of stalling the caller. When the ring is
+// full a record is dropped whole, per the drop policy, so the output stays
+// a sequence of complete records. Only transfers wait for room.
+//
+// loop() is the only writer. Each ring entry is a header and the bytes of
+// a record; a transfer goes in as several entries as the task makes room.
+class SerialEgress : public Print {
+public:
+    explicit SerialEgress(Print& out);
+
+    // Start the egress task; call before the first record
+    void begin();
+
+    // Start a record, then write it with the Print methods
+    void beginRecord(SerialPriority priority);
+    size_t write(uint8_t value);
+    size_t write(const uint8_t* data, size_t length);
+    using Print::write;
+
+    // Queue the record for the task
+    void endRecord();
+
+    // Wait until everything queued is written, up to timeoutMs. Returns
+    // false on timeout.
+    bool drain(uint32_t timeoutMs);
+
+    void setPolicy(SerialDropPolicy policy);
+    SerialDropPolicy getPolicy() const;
+
+    // Bytes queued now
+    uint32_t getUsed();
+
+    EgressStats getStats();
+
+private:
+    // Ahead of each entry's bytes in the ring
+    struct Entry {
+        uint32_t length;
+        uint32_t queuedAt;      // micros()
+        uint8_t priority;
+        uint8_t flags;
+    };
+
+    Print& out;
+    TaskHandle_t task;
+    SemaphoreHandle_t mutex;
+    SerialDropPolicy policy;
+    uint8_t buffer[SERIAL_EGRESS_SIZE];
+
+    // Ring positions, free-running; under mutex
+    uint32_t head;              // End of the entries queued
+    uint32_t tail;              // Next entry for the task
+    uint32_t released;          // Start of the bytes still in use (the rest of the entry being sent, if any)
+    EgressStats stats;
+
+    // The entry being sent, task only (sendAt and writing under mutex)
+    Entry sending;
+    uint32_t sendAt;
+    uint32_t sendEnd;
+    bool writing;               // A chunk is out of the ring but not yet written
+
+    // The record being written, loop() only
+    uint32_t entryAt;           // Its current entry's header
+    uint32_t writeAt;
+    uint32_t room;              // Bytes free at the last look; only ever grows behind our back
+    uint32_t recordBytes;
+    SerialPriority recordPriority;
+    bool recordDropped;
+
+    // Evict per the policy until bytes would be free once the entry being
+    // written out is done. Sets room; true if bytes are free now.
+    bool makeRoom(uint32_t bytes);
+
+    // Out of room mid-record: evict, split a transfer or drop the record.
+    // False if the record is dropped.
+    bool reserve();
+
+    // Queue the current entry and start the next one of the same record
+    // once the task has made room (transfers only)
+    void splitRecord();
+
+    // Wait until bytes are free (transfers only)
+    void waitForRoom(uint32_t bytes);
+
+    // Queue the current entry
+    void commitEntry(uint8_t flags);
+
+    void copyIn(uint32_t at, const void* data, uint32_t length);
+    void copyOut(uint32_t at, void* data, uint32_t length);
+
+    // Write the next chunk to the port; false if there is none
+    bool sendNext();
+
+    static void egressTask(void* param);
+};
+
+#endif // SERIAL_EGRESS_H
@@ -5,6 +5,12 @@ SerialManager serialManager;
 
 SerialManager::SerialManager() : 
     debugEnabled(true),
+    outputMode(SERIAL_OUTPUT_JSON),
+    baudRate(SERIAL_BAUD_RATE),
+    egress(SERIAL_PORT),
+    record(egress),
+    stats(),
+    recordStartedAt(0),
     bufferIndex(0) {
     
     // Initialize buffer
@@ -12,14 +18,21 @@ SerialManager::SerialManager() :
 }
 
 void SerialManager::begin() {
+#if SERIAL_USB_CDC
+    // Serial (the UART) is initialized in main.cpp; records go over USB
+    USBSerial.begin();
+#endif
     // Serial is already initialized in main.cpp
     Serial.println(F("Serial manager initialized"));
+    
+    // Records go out from the egress task from here on
+    egress.begin();
 }
 
 void SerialManager::processCommands() {
     // Check if serial data is available
-    while (Serial.available()) {
-        char c = Serial.read();
+    while (SERIAL_PORT.available()) {
+        char c = SERIAL_PORT.read();
         
         // Add to buffer if not a newline
         if (c != '\n' && c != '\r') {
@@ -46,16 +59,31 @@ void SerialManager::processCommands() {
 }
 
 void SerialManager::sendMetrics(const JsonDocument& metrics) {
-    // Create a response
-    StaticJsonDocument<512> response;
-    response["type"] = "metrics";
-    response["data"] = metrics;
+    startRecord(SERIAL_PRIORITY_LOW);
     
-    // Send the response
-    sendJsonResponse(response);
+    // The document is written into the record as JSON text; these are
+    // periodic statistics, not per packet
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        record.begin(RECORD_METRICS);
+        serializeJson(metrics, record);
+        finishRecord(record.end());
+        return;
+    }
+    
+    // Wrap the document as it is written rather than copying it; status
+    // documents are too large for a second copy on the stack
+    size_t bytes = egress.print(F("{\"type\":\"metrics\",\"data\":"));
+    bytes += serializeJson(metrics, egress);
+    bytes += egress.println('}');
+    finishRecord(bytes);
 }
 
 void SerialManager::sendStatus(const char* status) {
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        sendTextRecord(RECORD_STATUS, status, SERIAL_PRIORITY_HIGH);
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<256> response;
     response["type"] = "status";
@@ -63,20 +91,114 @@ void SerialManager::sendStatus(const char* status) {
     response["timestamp"] = millis() / 1000;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_HIGH);
 }
 
-void SerialManager::sendRemoteData(const JsonDocument& data) {
+void SerialManager::sendRemoteData(const DecodedMessage& message, const JsonDocument& data) {
+    // Fixed fields, then the raw value of each metric present (scale and
+    // sign from the field table) and the status text to the end
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        startRecord(SERIAL_PRIORITY_HIGH);
+        record.begin(RECORD_MESSAGE);
+        record.writeU8(message.header.type);
+        record.writeU32(message.device);
+        record.writeU32(message.header.id);
+        record.writeU32(message.metrics.timestamp);
+        record.writeU8(message.sample);
+        record.writeU8(message.samples);
+        record.writeU16(message.metrics.present);
+        for (uint8_t i = 0; i < Schema::METRIC_FIELD_COUNT; i++) {
+            if (message.metrics.present & (1u << i)) {
+                record.writeU32(message.metrics.raw[i]);
+            }
+        }
+        if (message.payload != nullptr) {
+            record.write((const uint8_t*)message.payload, strlen(message.payload));
+        }
+        finishRecord(record.end());
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<512> response;
     response["type"] = "remote_data";
     response["data"] = data;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_HIGH);
+}
+
+void SerialManager::sendTransfer(const ReassemblyPool& pool, const Transfer& transfer) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    
+    startRecord(SERIAL_PRIORITY_BULK);
+    
+    // Whole groups of three bytes per chunk, so only the end needs padding
+    uint8_t chunk[192];
+    char text[sizeof(chunk) / 3 * 4];
+    uint32_t offset = 0;
+    
+    // Same fields, with the data as it is
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        record.begin(RECORD_TRANSFER);
+        record.writeU32(transfer.device);
+        record.writeU16(transfer.id);
+        record.writeU32(transfer.length);
+        record.writeU16(transfer.fragments);
+        record.writeU32(transfer.lastAt - transfer.startedAt);
+        while (offset < transfer.length) {
+            size_t n = pool.read(transfer, offset, chunk, sizeof(chunk));
+            record.write(chunk, n);
+            offset += n;
+        }
+        finishRecord(record.end());
+        return;
+    }
+    
+    // Written as it's encoded; a 64 KB transfer is far too large for a document
+    size_t bytes = egress.print(F("{\"type\":\"transfer\",\"device\":"));
+    bytes += egress.print(transfer.device);
+    bytes += egress.print(F(",\"transfer\":"));
+    bytes += egress.print(transfer.id);
+    bytes += egress.print(F(",\"length\":"));
+    bytes += egress.print(transfer.length);
+    bytes += egress.print(F(",\"fragments\":"));
+    bytes += egress.print(transfer.fragments);
+    bytes += egress.print(F(",\"elapsed_ms\":"));
+    bytes += egress.print(transfer.lastAt - transfer.startedAt);
+    bytes += egress.print(F(",\"data\":\""));
+    
+    while (offset < transfer.length) {
+        size_t n = pool.read(transfer, offset, chunk, sizeof(chunk));
+        size_t used = 0;
+        for (size_t i = 0; i < n; i += 3) {
+            uint32_t group = (uint32_t)chunk[i] << 16;
+            if (i + 1 < n) group |= (uint32_t)chunk[i + 1] << 8;
+            if (i + 2 < n) group |= chunk[i + 2];
+            text[used++] = alphabet[(group >> 18) & 0x3F];
+            text[used++] = alphabet[(group >> 12) & 0x3F];
+            text[used++] = i + 1 < n ? alphabet[(group >> 6) & 0x3F] : '=';
+            text[used++] = i + 2 < n ? alphabet[group & 0x3F] : '=';
+        }
+        bytes += egress.write((const uint8_t*)text, used);
+        offset += n;
+    }
+    bytes += egress.println(F("\"}"));
+    finishRecord(bytes);
 }
 
 void SerialManager::sendSignalMetrics(int rssi, float snr, float packetLoss, float avgLatency) {
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        startRecord(SERIAL_PRIORITY_LOW);
+        record.begin(RECORD_SIGNAL);
+        record.writeI16(rssi);
+        record.writeFloat(snr);
+        record.writeFloat(packetLoss);
+        record.writeFloat(avgLatency);
+        finishRecord(record.end());
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<256> response;
     response["type"] = "signal_metrics";
@@ -88,10 +210,20 @@ void SerialManager::sendSignalMetrics(int rssi, float snr, float packetLoss, flo
     metrics["latency"] = avgLatency;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_LOW);
 }
 
 void SerialManager::sendSystemMetrics(unsigned long uptime, unsigned long packets, unsigned long errors) {
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        startRecord(SERIAL_PRIORITY_LOW);
+        record.begin(RECORD_SYSTEM);
+        record.writeU32(uptime);
+        record.writeU32(packets);
+        record.writeU32(errors);
+        finishRecord(record.end());
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<256> response;
     response["type"] = "system_metrics";
@@ -102,10 +234,15 @@ void SerialManager::sendSystemMetrics(unsigned long uptime, unsigned long packet
     metrics["errors"] = errors;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_LOW);
 }
 
 void SerialManager::sendError(const char* errorMessage) {
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        sendTextRecord(RECORD_ERROR, errorMessage, SERIAL_PRIORITY_HIGH);
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<256> response;
     response["type"] = "error";
@@ -113,10 +250,15 @@ void SerialManager::sendError(const char* errorMessage) {
     response["timestamp"] = millis() / 1000;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_HIGH);
 }
 
 void SerialManager::log(const char* message) {
+    if (outputMode == SERIAL_OUTPUT_BINARY) {
+        sendTextRecord(RECORD_LOG, message, SERIAL_PRIORITY_LOW);
+        return;
+    }
+    
     // Create a response
     StaticJsonDocument<256> response;
     response["type"] = "log";
@@ -124,12 +266,17 @@ void SerialManager::log(const char* message) {
     response["timestamp"] = millis() / 1000;
     
     // Send the response
-    sendJsonResponse(response);
+    sendJsonResponse(response, SERIAL_PRIORITY_LOW);
 }
 
 void SerialManager::debug(const char* message) {
     // Only send if debug mode is enabled
     if (debugEnabled) {
+        if (outputMode == SERIAL_OUTPUT_BINARY) {
+            sendTextRecord(RECORD_DEBUG, message, SERIAL_PRIORITY_LOW);
+            return;
+        }
+        
         // Create a response
         StaticJsonDocument<256> response;
         response["type"] = "debug";
@@ -137,7 +284,7 @@ void SerialManager::debug(const char* message) {
         response["timestamp"] = millis() / 1000;
         
         // Send the response
-        sendJsonResponse(response);
+        sendJsonResponse(response, SERIAL_PRIORITY_LOW);
     }
 }
 
@@ -150,16 +297,67 @@ void SerialManager::setDebugMode(bool enabled) {
     log(message);
 }
 
+bool SerialManager::isDebugEnabled() const {
+    return debugEnabled;
+}
+
+void SerialManager::setOutputMode(SerialOutput mode) {
+    outputMode = mode;
+    
+    // Log the change, in the new mode
+    log(mode == SERIAL_OUTPUT_BINARY ? "Output mode binary" : "Output mode JSON");
+}
+
+SerialOutput SerialManager::getOutputMode() const {
+    return outputMode;
+}
+
+void SerialManager::setBaudRate(uint32_t baud) {
+#if SERIAL_USB_CDC
+    // USB runs at its own speed
+    (void)baud;
+#else
+    // Let the output so far go out at the old rate
+    drain();
+    Serial.flush();
+    Serial.updateBaudRate(baud);
+    baudRate = baud;
+#endif
+}
+
+uint32_t SerialManager::getBaudRate() const {
+    return baudRate;
+}
+
+void SerialManager::setDropPolicy(SerialDropPolicy policy) {
+    egress.setPolicy(policy);
+}
+
+SerialDropPolicy SerialManager::getDropPolicy() const {
+    return egress.getPolicy();
+}
+
+bool SerialManager::drain() {
+    return egress.drain(SERIAL_EGRESS_DRAIN_MS);
+}
+
+const SerialStats& SerialManager::getStats() const {
+    return stats;
+}
+
+EgressStats SerialManager::getEgressStats() {
+    return egress.getStats();
+}
+
 bool SerialManager::isCommandAvailable() {
-    // Not implemented in this simplified version
-    // In a full implementation, would maintain a command queue
-    return false;
+    return pendingCommand.length() > 0;
 }
 
 String SerialManager::getNextCommand() {
-    // Not implemented in this simplified version
-    // In a full implementation, would dequeue from a command queue
-    return String("");
+    // One command at a time; main.cpp handles it before the next line is read
+    String command = pendingCommand;
+    pendingCommand = "";
+    return command;
 }
 
 void SerialManager::parseCommand(const String& command) {
@@ -190,12 +388,13 @@ void SerialManager::executeCommand(const String& command, const String& params)
     // Handle the command
     if (command.equalsIgnoreCase(PING_COMMAND)) {
         // Ping command is handled in main.cpp
-        // Just log that we received it
         log("Ping command received");
+        pendingCommand = PING_COMMAND;
     }
     else if (command.equalsIgnoreCase(STATUS_COMMAND)) {
         // Status command is handled in main.cpp
         log("Status command received");
+        pendingCommand = STATUS_COMMAND;
     }
     else if (command.equalsIgnoreCase(RESET_COMMAND)) {
         // Reset command
@@ -217,10 +416,39 @@ void SerialManager::executeCommand(const String& command, const String& params)
     }
 }
 
-void SerialManager::sendJsonResponse(const JsonDocument& response) {
+void SerialManager::sendJsonResponse(const JsonDocument& response, SerialPriority priority) {
+    startRecord(priority);
+    
     // Serialize the JSON
-    serializeJson(response, Serial);
-    Serial.println();  // Add a newline
+    size_t bytes = serializeJson(response, egress);
+    bytes += egress.println();  // Add a newline
+    finishRecord(bytes);
+}
+
+void SerialManager::sendTextRecord(uint8_t type, const char* text, SerialPriority priority) {
+    // Seconds since boot, then the text without a terminator
+    startRecord(priority);
+    record.begin(type);
+    record.writeU32(millis() / 1000);
+    record.write((const uint8_t*)text, strlen(text));
+    finishRecord(record.end());
+}
+
+void SerialManager::startRecord(SerialPriority priority) {
+    recordStartedAt = micros();
+    egress.beginRecord(priority);
+}
+
+void SerialManager::finishRecord(size_t bytes) {
+    egress.endRecord();
+    
+    uint32_t elapsed = micros() - recordStartedAt;
+    stats.records++;
+    stats.bytes += bytes;
+    stats.writeUs += elapsed;
+    if (elapsed > stats.writeMaxUs) {
+        stats.writeMaxUs = elapsed;
+    }
 }
 
 void SerialManager::processConfigCommand(const String& params) {
@@ -246,6 +474,48 @@ void SerialManager::processConfigCommand(const String& params) {
         configChanged = true;
     }
     
+    // Handle output mode; the replies from here on are in the new mode
+    if (config.containsKey("output")) {
+        const char* output = config["output"];
+        if (output != nullptr && strcmp(output, "binary") == 0) {
+            setOutputMode(SERIAL_OUTPUT_BINARY);
+            configChanged = true;
+        } else if (output != nullptr && strcmp(output, "json") == 0) {
+            setOutputMode(SERIAL_OUTPUT_JSON);
+            configChanged = true;
+        } else {
+            sendError("Unknown output mode");
+        }
+    }
+    
+    // Handle baud rate; the host switches once it has read this reply
+    if (config.containsKey("baud")) {
+        uint32_t baud = config["baud"];
+        if (baud < SERIAL_MIN_BAUD_RATE || baud > SERIAL_MAX_BAUD_RATE) {
+            sendError("Baud rate out of range");
+        } else {
+            char message[64];
+            snprintf(message, sizeof(message), "Baud rate %lu", (unsigned long)baud);
+            log(message);
+            setBaudRate(baud);
+            configChanged = true;
+        }
+    }
+    
+    // Handle the drop policy of the egress ring
+    if (config.containsKey("drop")) {
+        const char* drop = config["drop"];
+        if (drop != nullptr && strcmp(drop, "oldest") == 0) {
+            setDropPolicy(SERIAL_DROP_OLDEST);
+            configChanged = true;
+        } else if (drop != nullptr && strcmp(drop, "low") == 0) {
+            setDropPolicy(SERIAL_DROP_LOW_PRIORITY);
+            configChanged = true;
+        } else {
+            sendError("Unknown drop policy");
+        }
+    }
+    
     // Add additional configuration options here
     
     // Log the result
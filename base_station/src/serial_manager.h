@@ -3,11 +3,46 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include "reassembly.h"
+#include "message_schema.h"
+#include "record_writer.h"
+#include "serial_egress.h"
 
 // Serial parameters
 #define SERIAL_BAUD_RATE    115200
 #define SERIAL_BUFFER_SIZE  512
 
+// Baud rates accepted by CMD:CONFIG {"baud": ...} (the USB-UART bridge must
+// support it too; a CP2102 goes up to 921600)
+#define SERIAL_MIN_BAUD_RATE  9600
+#define SERIAL_MAX_BAUD_RATE  3000000
+
+// Records and commands over the S3's native USB (USBSerial, a build with
+// ARDUINO_USB_MODE=1) instead of the UART; baud rates don't apply there.
+// Serial.print output from the other modules stays on the UART. Boards
+// whose USB connector goes to a USB-UART bridge can't use this.
+#define SERIAL_USB_CDC      0
+
+#if SERIAL_USB_CDC
+#define SERIAL_PORT         USBSerial
+#else
+#define SERIAL_PORT         Serial
+#endif
+
+// Output modes, chosen with CMD:CONFIG {"output": "json"} or {"output": "binary"}
+enum SerialOutput {
+    SERIAL_OUTPUT_JSON,     // One JSON object per line
+    SERIAL_OUTPUT_BINARY    // COBS-framed records with a CRC (see record_writer.h)
+};
+
+// What the serial output has produced (records dropped by the egress ring included)
+struct SerialStats {
+    uint32_t records;
+    uint32_t bytes;
+    uint32_t writeUs;       // Time spent building and queueing records
+    uint32_t writeMaxUs;    // Longest for one record
+};
+
 // Serial command prefixes
 #define CMD_PREFIX          "CMD:"
 #define PING_COMMAND        "PING"
@@ -31,8 +66,11 @@ public:
     // Send a status message to serial
     void sendStatus(const char* status);
     
-    // Send remote device data to serial
-    void sendRemoteData(const JsonDocument& data);
+    // Send a message from a remote to serial (data: its JSON layout, used in JSON mode)
+    void sendRemoteData(const DecodedMessage& message, const JsonDocument& data);
+    
+    // Send a completed transfer to serial, its data base64-encoded (raw in binary mode)
+    void sendTransfer(const ReassemblyPool& pool, const Transfer& transfer);
     
     // Send signal metrics to serial
     void sendSignalMetrics(int rssi, float snr, float packetLoss, float avgLatency);
@@ -51,15 +89,44 @@ public:
     
     // Set debug mode
     void setDebugMode(bool enabled);
+    bool isDebugEnabled() const;
     
-    // Check if a command is available
+    // Choose JSON lines or binary records
+    void setOutputMode(SerialOutput mode);
+    SerialOutput getOutputMode() const;
+    
+    // Change the UART baud rate, after the output so far is sent
+    void setBaudRate(uint32_t baud);
+    uint32_t getBaudRate() const;
+    
+    // What gives way when the egress ring is full
+    void setDropPolicy(SerialDropPolicy policy);
+    SerialDropPolicy getDropPolicy() const;
+    
+    // Wait until the output queued so far is written (up to SERIAL_EGRESS_DRAIN_MS)
+    bool drain();
+    
+    // Records and bytes produced, and the time it took
+    const SerialStats& getStats() const;
+    
+    // Records queued, written out and dropped by the egress task
+    EgressStats getEgressStats();
+    
+    // Check if a command is waiting to be handled by main.cpp
     bool isCommandAvailable();
     
-    // Get the next command from the buffer
+    // Take the waiting command (empty if none)
     String getNextCommand();
     
 private:
     bool debugEnabled;
+    SerialOutput outputMode;
+    uint32_t baudRate;
+    SerialEgress egress;
+    RecordWriter record;
+    SerialStats stats;
+    uint32_t recordStartedAt;
+    String pendingCommand;
     char inputBuffer[SERIAL_BUFFER_SIZE];
     int bufferIndex;
     
@@ -70,7 +137,14 @@ private:
     void executeCommand(const String& command, const String& params);
     
     // Send a JSON response
-    void sendJsonResponse(const JsonDocument& response);
+    void sendJsonResponse(const JsonDocument& response, SerialPriority priority);
+    
+    // Send a text record (status, log, debug, error) in binary mode
+    void sendTextRecord(uint8_t type, const char* text, SerialPriority priority);
+    
+    // Start a record in the egress ring, then queue and count it
+    void startRecord(SerialPriority priority);
+    void finishRecord(size_t bytes);
     
     // Process configuration command
     void processConfigCommand(const String& params);
@@ -0,0 +1,60 @@
+#ifndef TDMA_H
+#define TDMA_H
+
+#include <Arduino.h>
+#include "wire_format.h"
+
+// Time-division access for many remotes (LORA_TDMA_ENABLE in lora_communication.h).
+// The base broadcasts a beacon every TDMA_SUPERFRAME_MS. The time each beacon
+// was scheduled to start anchors the superframe that follows it:
+//
+//   beacon | guard | slot 0 | slot 1 | ... | slot n-1 | idle | next beacon
+//
+// A remote is given a slot of its own in the ACK to its first uplink and from
+// then on transmits only in that slot, so remotes with slots never collide.
+// The last TDMA_CONTENTION_SLOTS slots are shared, with listen before talk, by
+// remotes still waiting for one. Each slot fits a frame of up to
+// TDMA_SLOT_FRAME_SIZE bytes, its ACK, and TDMA_GUARD_MS at both ends for
+// the remote's clock drift. See docs/protocol.md.
+
+#define TDMA_SUPERFRAME_MS     180000  // Beacon period; one batch per remote per superframe
+#define TDMA_MAX_SLOTS         128
+#define TDMA_CONTENTION_SLOTS  4
+#define TDMA_SLOT_FRAME_SIZE   80      // Largest uplink a slot is sized for, bytes
+#define TDMA_GUARD_MS          10      // Slack at each end of a slot
+#define TDMA_ACK_DELAY_MS      50      // Uplink end to ACK start (block ACKs come from the base's loop())
+#define TDMA_SLOT_EXPIRY       10      // Superframes a slot stays with a remote that isn't heard
+
+// Largest beacon: header, layout (five varints) and delay
+#define TDMA_MAX_BEACON_SIZE   34
+
+// Superframe layout carried in every beacon
+struct SuperframeLayout {
+    uint32_t periodMs;          // Beacon to beacon
+    uint16_t firstSlotMs;       // Start of the beacon to the start of slot 0
+    uint16_t slotMs;
+    uint16_t slotCount;         // Including the contention slots at the end
+    uint8_t contentionSlots;
+};
+
+namespace Tdma {
+    // Fit as many slots (up to TDMA_MAX_SLOTS) as the period holds, given the
+    // airtime of the beacon, of a TDMA_SLOT_FRAME_SIZE uplink and of its ACK
+    SuperframeLayout plan(uint32_t periodMs, uint32_t beaconUs, uint32_t frameUs, uint32_t ackUs);
+
+    // Start of a slot after the beacon anchor, us
+    uint32_t slotOffsetUs(const SuperframeLayout& layout, uint16_t slot);
+
+    // Slots that can be assigned to a single remote
+    uint16_t dedicatedSlots(const SuperframeLayout& layout);
+
+    // Beacon frame: header with the beacon sequence number as its ID and the
+    // base's uptime, then FIELD_SUPERFRAME and FIELD_BEACON_DELAY. Returns the
+    // frame length, 0 if out of space.
+    size_t encodeBeacon(uint8_t* buffer, size_t size, uint32_t sequence, uint32_t timestamp,
+                        const SuperframeLayout& layout, uint32_t delayUs);
+    bool decodeBeacon(const uint8_t* buffer, size_t length, uint32_t* sequence,
+                      SuperframeLayout& layout, uint32_t* delayUs);
+}
+
+#endif // TDMA_H
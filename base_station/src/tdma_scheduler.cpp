@@ -0,0 +1,85 @@
+#include "tdma_scheduler.h"
+#include "device_table.h"
+
+TdmaScheduler::TdmaScheduler() :
+    layout(),
+    stats() {
+    for (uint16_t i = 0; i < TDMA_MAX_SLOTS; i++) {
+        owners[i] = DEVICE_ID_EMPTY;
+        heardAt[i] = 0;
+    }
+}
+
+void TdmaScheduler::setLayout(const SuperframeLayout& newLayout) {
+    layout = newLayout;
+
+    // Slots past the dedicated ones are gone or now shared
+    for (uint16_t i = Tdma::dedicatedSlots(layout); i < TDMA_MAX_SLOTS; i++) {
+        owners[i] = DEVICE_ID_EMPTY;
+    }
+}
+
+const SuperframeLayout& TdmaScheduler::getLayout() const {
+    return layout;
+}
+
+uint16_t TdmaScheduler::slotFor(uint32_t deviceId, uint32_t now) {
+    uint16_t dedicated = Tdma::dedicatedSlots(layout);
+    uint16_t free = WIRE_NO_SLOT;
+    uint16_t stale = WIRE_NO_SLOT;
+
+    for (uint16_t i = 0; i < dedicated; i++) {
+        if (owners[i] == deviceId) {
+            heardAt[i] = now;
+            return i;
+        }
+        if (owners[i] == DEVICE_ID_EMPTY) {
+            if (free == WIRE_NO_SLOT) {
+                free = i;
+            }
+        } else if (stale == WIRE_NO_SLOT && now - heardAt[i] >= TDMA_SLOT_EXPIRY * layout.periodMs) {
+            stale = i;
+        }
+    }
+
+    // A free slot, else one whose owner has gone quiet
+    uint16_t slot = free != WIRE_NO_SLOT ? free : stale;
+    if (slot == WIRE_NO_SLOT) {
+        stats.full++;
+        return WIRE_NO_SLOT;
+    }
+    if (slot == stale) {
+        stats.reclaimed++;
+    }
+
+    owners[slot] = deviceId;
+    heardAt[slot] = now;
+    stats.assignments++;
+    return slot;
+}
+
+uint16_t TdmaScheduler::assigned() const {
+    uint16_t count = 0;
+    for (uint16_t i = 0; i < TDMA_MAX_SLOTS; i++) {
+        if (owners[i] != DEVICE_ID_EMPTY) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool TdmaScheduler::isAssigned(uint16_t slot) const {
+    return slot < TDMA_MAX_SLOTS && owners[slot] != DEVICE_ID_EMPTY;
+}
+
+void TdmaScheduler::countBeacon(bool sent) {
+    if (sent) {
+        stats.beacons++;
+    } else {
+        stats.beaconsSkipped++;
+    }
+}
+
+const TdmaStats& TdmaScheduler::getStats() const {
+    return stats;
+}
@@ -0,0 +1,52 @@
+#ifndef TDMA_SCHEDULER_H
+#define TDMA_SCHEDULER_H
+
+#include <Arduino.h>
+#include "tdma.h"
+
+// Base side of TDMA mode: the superframe layout announced in the beacons, and
+// which remote owns which slot. A remote gets the first free dedicated slot in
+// the ACK to its first uplink and keeps it while it's heard; a slot silent
+// for TDMA_SLOT_EXPIRY superframes goes to the next remote that needs one.
+// Lookups scan the slot table (at most TDMA_MAX_SLOTS entries, a few us).
+
+// Beacon and slot statistics
+struct TdmaStats {
+    uint32_t beacons;           // Sent
+    uint32_t beaconsSkipped;    // Not sent: the radio was busy for too long, or no budget
+    uint32_t assignments;       // Slots handed to a remote
+    uint32_t reclaimed;         // Of those, slots taken back from a silent remote
+    uint32_t full;              // Remotes left on the shared slots because none were free
+};
+
+class TdmaScheduler {
+public:
+    TdmaScheduler();
+
+    // Use a new layout; owners of slots it no longer has must ask again
+    void setLayout(const SuperframeLayout& layout);
+    const SuperframeLayout& getLayout() const;
+
+    // Slot owned by a remote, assigned if it has none; WIRE_NO_SLOT if all are taken.
+    // now is millis() when the remote was heard.
+    uint16_t slotFor(uint32_t deviceId, uint32_t now);
+
+    // Slots with an owner
+    uint16_t assigned() const;
+
+    // Whether a slot has an owner
+    bool isAssigned(uint16_t slot) const;
+
+    // Count a beacon sent or skipped
+    void countBeacon(bool sent);
+
+    const TdmaStats& getStats() const;
+
+private:
+    SuperframeLayout layout;
+    uint32_t owners[TDMA_MAX_SLOTS];   // Device ID, DEVICE_ID_EMPTY if free
+    uint32_t heardAt[TDMA_MAX_SLOTS];  // millis()
+    TdmaStats stats;
+};
+
+#endif // TDMA_SCHEDULER_H
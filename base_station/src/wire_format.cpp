@@ -0,0 +1,444 @@
+#include "wire_format.h"
+#include "message_schema.h"
+
+namespace WireFormat {
+
+const WireField* findField(uint8_t id) {
+    // The table is indexed by ID (checked in message_schema.h)
+    if (id < 1 || id > Schema::METRIC_FIELD_COUNT) {
+        return nullptr;
+    }
+    return &Schema::METRIC_FIELDS[id - 1];
+}
+
+size_t writeVarint(uint8_t* buffer, size_t size, uint32_t value) {
+    size_t written = 0;
+
+    // Emit 7 bits at a time, least significant group first
+    do {
+        if (written >= size) {
+            return 0;
+        }
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            byte |= 0x80;
+        }
+        buffer[written++] = byte;
+    } while (value != 0);
+
+    return written;
+}
+
+size_t writeHeader(uint8_t* buffer, size_t size, uint8_t type, uint8_t flags, uint32_t id, uint32_t timestamp) {
+    if (size < 2) {
+        return 0;
+    }
+
+    buffer[0] = (WIRE_VERSION << 4) | (type & 0x0F);
+    buffer[1] = flags;
+    size_t offset = 2;
+
+    size_t n = writeVarint(buffer + offset, size - offset, id);
+    if (n == 0) return 0;
+    offset += n;
+
+    n = writeVarint(buffer + offset, size - offset, timestamp);
+    if (n == 0) return 0;
+    offset += n;
+
+    return offset;
+}
+
+size_t writeField(uint8_t* buffer, size_t size, const WireField& field, uint32_t raw) {
+    if (size < 1) {
+        return 0;
+    }
+
+    // Tag byte
+    buffer[0] = (field.id << 2) | field.wireType;
+    size_t n = 0;
+
+    switch (field.wireType) {
+        case WIRE_VARINT:
+            n = writeVarint(buffer + 1, size - 1, raw);
+            break;
+        case WIRE_SVARINT: {
+            // Zigzag so small negative numbers stay short
+            int32_t value = (int32_t)raw;
+            n = writeVarint(buffer + 1, size - 1, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+            break;
+        }
+        case WIRE_FIXED32:
+            if (size < 5) return 0;
+            buffer[1] = raw & 0xFF;
+            buffer[2] = (raw >> 8) & 0xFF;
+            buffer[3] = (raw >> 16) & 0xFF;
+            buffer[4] = (raw >> 24) & 0xFF;
+            n = 4;
+            break;
+        default:
+            return 0;
+    }
+
+    return n == 0 ? 0 : n + 1;
+}
+
+size_t writeBytes(uint8_t* buffer, size_t size, uint8_t fieldId, const uint8_t* data, size_t length) {
+    if (size < 1) {
+        return 0;
+    }
+
+    buffer[0] = (fieldId << 2) | WIRE_BYTES;
+    size_t n = writeVarint(buffer + 1, size - 1, length);
+    if (n == 0 || 1 + n + length > size) {
+        return 0;
+    }
+
+    memcpy(buffer + 1 + n, data, length);
+    return 1 + n + length;
+}
+
+size_t readVarint(const uint8_t* buffer, size_t length, uint32_t* value) {
+    uint32_t result = 0;
+
+    for (size_t i = 0; i < length && i < WIRE_MAX_VARINT_SIZE; i++) {
+        // The fifth byte holds the top 4 bits; anything more doesn't fit 32 bits
+        if (i == WIRE_MAX_VARINT_SIZE - 1 && buffer[i] > 0x0F) {
+            return 0;
+        }
+        result |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+        if ((buffer[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+
+    // Truncated, over-long or too large varint
+    return 0;
+}
+
+size_t readHeader(const uint8_t* buffer, size_t length, FrameHeader& header) {
+    if (length < WIRE_MIN_FRAME_SIZE) {
+        return 0;
+    }
+
+    header.version = buffer[0] >> 4;
+    header.type = buffer[0] & 0x0F;
+    header.flags = buffer[1];
+
+    // Refuse frames from a newer, incompatible format
+    if (header.version != WIRE_VERSION) {
+        return 0;
+    }
+
+    size_t offset = 2;
+    size_t n = readVarint(buffer + offset, length - offset, &header.id);
+    if (n == 0) return 0;
+    offset += n;
+
+    n = readVarint(buffer + offset, length - offset, &header.timestamp);
+    if (n == 0) return 0;
+    offset += n;
+
+    header.length = offset;
+    return offset;
+}
+
+size_t readField(const uint8_t* buffer, size_t length, uint8_t* fieldId, uint8_t* wireType, uint32_t* raw, const uint8_t** bytes) {
+    if (length < 1) {
+        return 0;
+    }
+
+    *fieldId = buffer[0] >> 2;
+    *wireType = buffer[0] & 0x03;
+    *bytes = nullptr;
+    size_t n = 0;
+
+    switch (*wireType) {
+        case WIRE_VARINT:
+            n = readVarint(buffer + 1, length - 1, raw);
+            break;
+        case WIRE_SVARINT: {
+            uint32_t zigzag = 0;
+            n = readVarint(buffer + 1, length - 1, &zigzag);
+            *raw = (zigzag >> 1) ^ (uint32_t)(-(int32_t)(zigzag & 1));
+            break;
+        }
+        case WIRE_BYTES:
+            // n < length here, so this can't wrap the way 1 + n + *raw would
+            n = readVarint(buffer + 1, length - 1, raw);
+            if (n == 0 || *raw > length - 1 - n) {
+                return 0;
+            }
+            *bytes = buffer + 1 + n;
+            n += *raw;
+            break;
+        case WIRE_FIXED32:
+            if (length < 5) return 0;
+            *raw = (uint32_t)buffer[1] | ((uint32_t)buffer[2] << 8) |
+                   ((uint32_t)buffer[3] << 16) | ((uint32_t)buffer[4] << 24);
+            n = 4;
+            break;
+    }
+
+    return n == 0 ? 0 : n + 1;
+}
+
+uint32_t toRaw(const WireField& field, float value) {
+    float scaled = value * field.scale;
+
+    // Clamped to the field's range; the float limit may round up, so values
+    // at or above it get the exact maximum
+    float limit = (float)field.maxRaw;
+
+    if (field.wireType == WIRE_SVARINT) {
+        if (scaled >= limit) return field.maxRaw;
+        if (scaled <= -limit) return (uint32_t)-(int32_t)field.maxRaw;
+        return (uint32_t)(int32_t)lroundf(scaled);
+    }
+
+    // Unsigned fields can't carry negative values
+    if (scaled < 0) {
+        return 0;
+    }
+    if (scaled >= limit) {
+        return field.maxRaw;
+    }
+    return (uint32_t)llroundf(scaled);
+}
+
+float fromRaw(const WireField& field, uint32_t raw) {
+    if (field.wireType == WIRE_SVARINT) {
+        return (float)(int32_t)raw / field.scale;
+    }
+    return (float)raw / field.scale;
+}
+
+void setMetric(JsonObject metrics, const WireField& field, uint32_t raw) {
+    if (field.scale != 1) {
+        metrics[field.name] = fromRaw(field, raw);
+    } else if (field.wireType == WIRE_SVARINT) {
+        metrics[field.name] = (int32_t)raw;
+    } else {
+        metrics[field.name] = raw;
+    }
+}
+
+bool findRawField(const uint8_t* buffer, size_t length, uint8_t fieldId, uint32_t* raw) {
+    FrameHeader header;
+    size_t offset = readHeader(buffer, length, header);
+    if (offset == 0) {
+        return false;
+    }
+
+    while (offset < length) {
+        uint8_t id, wireType;
+        uint32_t value;
+        const uint8_t* bytes;
+        size_t n = readField(buffer + offset, length - offset, &id, &wireType, &value, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        if (id == fieldId) {
+            *raw = value;
+            return true;
+        }
+        offset += n;
+    }
+
+    return false;
+}
+
+size_t encodeBlockAck(uint8_t* buffer, size_t size, uint32_t id, uint32_t timestamp, uint32_t cumulative, uint32_t bitmap,
+                      uint8_t flags, uint32_t linkParams, uint16_t slot) {
+    static const WireField cumulativeField = { FIELD_ACK_CUMULATIVE, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+    static const WireField bitmapField = { FIELD_ACK_BITMAP, WIRE_FIXED32, 1, UINT32_MAX, nullptr };
+    static const WireField slotField = { FIELD_TDMA_SLOT, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+
+    size_t offset = writeHeader(buffer, size, WIRE_TYPE_BLOCK_ACK, flags, id, timestamp);
+    if (offset == 0) return 0;
+
+    size_t n = writeField(buffer + offset, size - offset, cumulativeField, cumulative);
+    if (n == 0) return 0;
+    offset += n;
+
+    n = writeField(buffer + offset, size - offset, bitmapField, bitmap);
+    if (n == 0) return 0;
+    offset += n;
+
+    if (flags & WIRE_ACK_FLAG_PARAMS) {
+        n = writeLinkParams(buffer + offset, size - offset, linkParams);
+        if (n == 0) return 0;
+        offset += n;
+    }
+
+    if (flags & WIRE_ACK_FLAG_SLOT) {
+        n = writeField(buffer + offset, size - offset, slotField, slot);
+        if (n == 0) return 0;
+        offset += n;
+    }
+
+    return offset;
+}
+
+size_t writeLinkParams(uint8_t* buffer, size_t size, uint32_t linkParams) {
+    static const WireField paramsField = { FIELD_LINK_PARAMS, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+    return writeField(buffer, size, paramsField, linkParams);
+}
+
+size_t writeDeviceId(uint8_t* buffer, size_t size, uint32_t deviceId) {
+    static const WireField deviceField = { FIELD_DEVICE_ID, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+    return writeField(buffer, size, deviceField, deviceId);
+}
+
+size_t ackSize(uint8_t flags) {
+    return WIRE_ACK_SIZE + ((flags & WIRE_ACK_FLAG_PARAMS) ? 4 : 0) + ((flags & WIRE_ACK_FLAG_SLOT) ? 2 : 0);
+}
+
+size_t encodeAck(uint8_t* buffer, size_t size, const AckFrame& ack) {
+    size_t length = ackSize(ack.flags);
+    if (size < length) {
+        return 0;
+    }
+
+    // SNR in quarter dB, the SX1262's own resolution
+    float snr = ack.snr * 4.0f;
+    if (snr > 127.0f) snr = 127.0f;
+    if (snr < -128.0f) snr = -128.0f;
+    int8_t snrQuarters = (int8_t)lroundf(snr);
+
+    buffer[0] = (WIRE_VERSION << 4) | WIRE_TYPE_ACK;
+    buffer[1] = ack.flags;
+    buffer[2] = ack.id & 0xFF;
+    buffer[3] = (ack.id >> 8) & 0xFF;
+    buffer[4] = (ack.id >> 16) & 0xFF;
+    buffer[5] = (ack.id >> 24) & 0xFF;
+    buffer[6] = (uint16_t)ack.rssi & 0xFF;
+    buffer[7] = ((uint16_t)ack.rssi >> 8) & 0xFF;
+    buffer[8] = (uint8_t)snrQuarters;
+    buffer[9] = ack.turnaroundUs & 0xFF;
+    buffer[10] = (ack.turnaroundUs >> 8) & 0xFF;
+
+    // Optional proposed radio settings
+    if (ack.flags & WIRE_ACK_FLAG_PARAMS) {
+        buffer[11] = ack.linkParams & 0xFF;
+        buffer[12] = (ack.linkParams >> 8) & 0xFF;
+        buffer[13] = (ack.linkParams >> 16) & 0xFF;
+        buffer[14] = (ack.linkParams >> 24) & 0xFF;
+    }
+
+    // Optional uplink slot, last
+    if (ack.flags & WIRE_ACK_FLAG_SLOT) {
+        buffer[length - 2] = ack.slot & 0xFF;
+        buffer[length - 1] = (ack.slot >> 8) & 0xFF;
+    }
+
+    return length;
+}
+
+bool decodeAck(const uint8_t* buffer, size_t length, AckFrame& ack) {
+    if (length < WIRE_ACK_SIZE || buffer[0] != ((WIRE_VERSION << 4) | WIRE_TYPE_ACK)) {
+        return false;
+    }
+    if (length != ackSize(buffer[1])) {
+        return false;
+    }
+
+    ack.flags = buffer[1];
+    ack.id = (uint32_t)buffer[2] | ((uint32_t)buffer[3] << 8) |
+             ((uint32_t)buffer[4] << 16) | ((uint32_t)buffer[5] << 24);
+    ack.rssi = (int16_t)(buffer[6] | (buffer[7] << 8));
+    ack.snr = (int8_t)buffer[8] / 4.0f;
+    ack.turnaroundUs = buffer[9] | (buffer[10] << 8);
+    ack.linkParams = 0;
+    if (ack.flags & WIRE_ACK_FLAG_PARAMS) {
+        ack.linkParams = (uint32_t)buffer[11] | ((uint32_t)buffer[12] << 8) |
+                         ((uint32_t)buffer[13] << 16) | ((uint32_t)buffer[14] << 24);
+    }
+    ack.slot = WIRE_NO_SLOT;
+    if (ack.flags & WIRE_ACK_FLAG_SLOT) {
+        ack.slot = buffer[length - 2] | (buffer[length - 1] << 8);
+    }
+
+    return true;
+}
+
+bool decode(uint8_t* buffer, size_t length, JsonDocument& doc) {
+    // Fixed-size ACK, no varint header or tagged fields
+    AckFrame ack;
+    if (decodeAck(buffer, length, ack)) {
+        doc["type"] = "ack";
+        doc["id"] = ack.id;
+        JsonObject metrics = doc.createNestedObject("metrics");
+        metrics["rssi"] = ack.rssi;
+        metrics["snr"] = ack.snr;
+        doc["turnaround_us"] = ack.turnaroundUs;
+        return true;
+    }
+
+    DecodedMessage message;
+    if (!Schema::decode(buffer, length, message)) {
+        return false;
+    }
+    Schema::toJson(message, doc);
+    return true;
+}
+
+uint8_t countSamples(const uint8_t* buffer, size_t length) {
+    FrameHeader header;
+    size_t offset = readHeader(buffer, length, header);
+    if (offset == 0) {
+        return 0;
+    }
+
+    uint8_t count = 0;
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = readField(buffer + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            break;
+        }
+        offset += n;
+
+        if ((fieldId == FIELD_SAMPLE || fieldId == FIELD_DELTA_SAMPLE) && wireType == WIRE_BYTES) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+bool findSample(const uint8_t* buffer, size_t length, uint8_t index, uint8_t* fieldId, const uint8_t** body, size_t* bodyLength) {
+    FrameHeader header;
+    size_t offset = readHeader(buffer, length, header);
+    if (offset == 0) {
+        return false;
+    }
+
+    uint8_t count = 0;
+    while (offset < length) {
+        uint8_t id, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = readField(buffer + offset, length - offset, &id, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        bool sample = (id == FIELD_SAMPLE || id == FIELD_DELTA_SAMPLE) && wireType == WIRE_BYTES;
+        if (sample && count++ == index) {
+            *fieldId = id;
+            *body = bytes;
+            *bodyLength = raw;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}  // namespace WireFormat
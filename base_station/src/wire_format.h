@@ -0,0 +1,206 @@
+#ifndef WIRE_FORMAT_H
+#define WIRE_FORMAT_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Binary frame format used over the LoRa link
+//
+// Every frame starts with a fixed header:
+//   byte 0   : version (high nibble) | frame type (low nibble)
+//   byte 1   : flags
+//   varint   : message ID
+//   varint   : timestamp (seconds since boot)
+// followed by zero or more tagged fields. Each field starts with a tag byte
+// (field ID << 2 | wire type) so a receiver can skip fields it doesn't know.
+// The stop-and-wait ACK is the exception: a fixed WIRE_ACK_SIZE layout (see
+// AckFrame) that the base can write without any encoding work.
+// See docs/protocol.md for the field table and size comparison with JSON.
+
+// Format version carried in every header
+#define WIRE_VERSION         1
+
+// Frame type codes (low nibble of header byte 0)
+#define WIRE_TYPE_PING       1
+#define WIRE_TYPE_PONG       2
+#define WIRE_TYPE_DATA       3
+#define WIRE_TYPE_STATUS     4
+#define WIRE_TYPE_BLOCK_ACK  5   // Cumulative ACK + bitmap for windowed transfers
+#define WIRE_TYPE_ACK        6   // Fixed-size ACK for a single frame
+#define WIRE_TYPE_BEACON     7   // Superframe layout broadcast by the base (see tdma.h)
+#define WIRE_TYPE_FRAGMENT   8   // Part of a transfer larger than a frame (see fragment.h)
+
+// Header flags (byte 1)
+#define WIRE_FLAG_WINDOWED   0x01  // Frame is part of a windowed (selective-repeat) transfer
+#define WIRE_FLAG_ACK_REQ    0x02  // Last frame of a burst, receiver should answer with a block ACK
+#define WIRE_FLAG_TDMA       0x04  // Sender follows the beacons and wants an uplink slot (see tdma.h)
+
+// ACK flags (byte 1 of ACK and block ACK frames)
+#define WIRE_ACK_FLAG_RESYNC 0x01  // Receiver lost its compression reference, send a keyframe
+#define WIRE_ACK_FLAG_PARAMS 0x02  // Carries proposed radio settings (see link_params.h)
+#define WIRE_ACK_FLAG_SWITCH 0x04  // Switch to the accepted radio settings after this ACK
+#define WIRE_ACK_FLAG_SLOT   0x08  // Carries the sender's TDMA uplink slot (see tdma.h)
+
+// Field wire types (low two bits of a field tag)
+#define WIRE_VARINT          0   // Unsigned LEB128 varint
+#define WIRE_SVARINT         1   // Zigzag-encoded signed varint
+#define WIRE_BYTES           2   // Varint length followed by raw bytes
+#define WIRE_FIXED32         3   // Little-endian 32-bit value
+
+// Field IDs (6 bits, 1-63)
+#define FIELD_UPTIME          1
+#define FIELD_FREE_MEMORY     2
+#define FIELD_TEMPERATURE     3
+#define FIELD_BATTERY         4
+#define FIELD_BATTERY_PERCENT 5
+#define FIELD_CHARGING        6
+#define FIELD_SUCCESS_RATE    7
+#define FIELD_AVG_RETRIES     8
+#define FIELD_AVG_LATENCY     9
+#define FIELD_TOTAL_PACKETS   10
+#define FIELD_RSSI            11
+#define FIELD_SNR             12
+#define FIELD_SOLAR_VOLTAGE   13
+#define FIELD_PACKET_LOSS     14
+#define FIELD_AIRTIME         15  // Transmit airtime in the last hour (see duty_cycle.h)
+#define FIELD_RTT             16  // Smoothed round-trip time of ACK exchanges (see latency_stats.h)
+#define FIELD_DELTA_SAMPLE    61  // One batched sample, compressed against an earlier one
+#define FIELD_SAMPLE          62  // One batched sample: varint timestamp + metric fields
+#define FIELD_PAYLOAD         63  // Top-level "payload" string
+
+// Protocol field IDs (48-62), not exposed as metrics
+#define FIELD_WINDOW_OFFSET   48  // Message ID minus the sender's oldest unacknowledged ID
+#define FIELD_ACK_CUMULATIVE  49  // All IDs up to and including this one were received
+#define FIELD_ACK_BITMAP      50  // Bit i set: ID cumulative + 1 + i was received
+#define FIELD_LINK_PARAMS     51  // Packed radio settings: proposal (block ACK) or acceptance (uplink)
+#define FIELD_DEVICE_ID       52  // Sender of an uplink; decoded as top-level "device"
+#define FIELD_SUPERFRAME      53  // Beacon: superframe layout, bytes of varints (see tdma.h)
+#define FIELD_BEACON_DELAY    54  // Beacon: us the transmission started after its scheduled time
+#define FIELD_TDMA_SLOT       55  // Block ACK with WIRE_ACK_FLAG_SLOT: the receiver's uplink slot
+#define FIELD_HOP_PLAN        56  // Beacon: hop seed and channel sets, bytes of varints (see hopping.h)
+#define FIELD_FRAGMENT        57  // Fragment: transfer, total length, fragment size, index, then data (see fragment.h)
+#define FIELD_FEC             58  // Fragment: data and parity fragments per group, bytes of varints (see fec.h)
+
+// Smallest possible frame (header with one-byte ID and timestamp)
+#define WIRE_MIN_FRAME_SIZE  4
+
+// Fixed ACK frame: header bytes 0-1 (flags in byte 1), acked ID (uint32), RSSI (int16, dBm),
+// SNR (int8, 0.25 dB), turnaround (uint16, us), all little-endian
+#define WIRE_ACK_SIZE        11
+
+// Fixed ACK with WIRE_ACK_FLAG_PARAMS: followed by the packed settings (uint32)
+#define WIRE_ACK_PARAMS_SIZE 15
+
+// Fixed ACK with WIRE_ACK_FLAG_SLOT: followed by the slot (uint16), after the
+// settings if both flags are set
+#define WIRE_MAX_ACK_SIZE    17
+
+// No TDMA slot assigned (the sender uses the shared contention slots)
+#define WIRE_NO_SLOT         0xFFFF
+
+// Largest block ACK (header, cumulative, bitmap, link params and slot)
+#define WIRE_MAX_BLOCK_ACK_SIZE 32
+
+// Largest encoded sample body (timestamp plus every metric field)
+#define WIRE_MAX_SAMPLE_SIZE 104
+
+// Maximum encoded size of a 32-bit varint
+#define WIRE_MAX_VARINT_SIZE 5
+
+// Longest status string carried in a payload field
+#define WIRE_MAX_PAYLOAD_STRING 128
+
+// Description of one field (metric fields: see message_schema.h)
+struct WireField {
+    uint8_t id;
+    uint8_t wireType;
+    uint16_t scale;     // Fixed-point scale for floating values (1 = integer)
+    uint32_t maxRaw;    // Largest raw value sent (signed: magnitude)
+    const char* name;   // JSON key used on the serial side
+};
+
+// Decoded frame header
+struct FrameHeader {
+    uint8_t version;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    uint32_t timestamp;
+    size_t length;      // Number of header bytes
+};
+
+// Contents of a fixed-size ACK frame
+struct AckFrame {
+    uint32_t id;            // Message ID being acknowledged
+    uint8_t flags;          // WIRE_ACK_FLAG_*
+    int16_t rssi;           // Uplink signal quality as seen by the receiver
+    float snr;
+    uint16_t turnaroundUs;  // Receiver's RX done to ACK transmit start (saturates)
+    uint32_t linkParams;    // Packed proposal, valid with WIRE_ACK_FLAG_PARAMS
+    uint16_t slot;          // Uplink slot, valid with WIRE_ACK_FLAG_SLOT
+};
+
+namespace WireFormat {
+    // Look up a metric field description by ID (nullptr if unknown)
+    const WireField* findField(uint8_t id);
+
+    // Low-level writers; each returns the number of bytes written, 0 if out of space
+    size_t writeVarint(uint8_t* buffer, size_t size, uint32_t value);
+    size_t writeHeader(uint8_t* buffer, size_t size, uint8_t type, uint8_t flags, uint32_t id, uint32_t timestamp);
+    size_t writeField(uint8_t* buffer, size_t size, const WireField& field, uint32_t raw);
+    size_t writeBytes(uint8_t* buffer, size_t size, uint8_t fieldId, const uint8_t* data, size_t length);
+
+    // Low-level readers; each returns the number of bytes consumed, 0 on malformed input
+    size_t readVarint(const uint8_t* buffer, size_t length, uint32_t* value);
+    size_t readHeader(const uint8_t* buffer, size_t length, FrameHeader& header);
+
+    // Read one tagged field. For WIRE_BYTES fields, raw holds the length and
+    // bytes points at the data inside the buffer; otherwise bytes is nullptr.
+    size_t readField(const uint8_t* buffer, size_t length, uint8_t* fieldId, uint8_t* wireType, uint32_t* raw, const uint8_t** bytes);
+
+    // Convert between a floating point value and a field's raw wire value
+    // (scaled fixed-point clamped to maxRaw, signed values stored as two's complement)
+    uint32_t toRaw(const WireField& field, float value);
+    float fromRaw(const WireField& field, uint32_t raw);
+
+    // Write a raw wire value into a "metrics" object (integer fields stay integers)
+    void setMetric(JsonObject metrics, const WireField& field, uint32_t raw);
+
+    // Find a tagged field by ID in a complete frame (header included)
+    bool findRawField(const uint8_t* buffer, size_t length, uint8_t fieldId, uint32_t* raw);
+
+    // Encode a block acknowledgment for windowed transfers. With
+    // WIRE_ACK_FLAG_PARAMS in flags, linkParams is added as FIELD_LINK_PARAMS,
+    // with WIRE_ACK_FLAG_SLOT, slot as FIELD_TDMA_SLOT.
+    size_t encodeBlockAck(uint8_t* buffer, size_t size, uint32_t id, uint32_t timestamp, uint32_t cumulative, uint32_t bitmap,
+                          uint8_t flags = 0, uint32_t linkParams = 0, uint16_t slot = WIRE_NO_SLOT);
+
+    // Append a FIELD_LINK_PARAMS field to a frame; returns bytes written, 0 if out of space
+    size_t writeLinkParams(uint8_t* buffer, size_t size, uint32_t linkParams);
+
+    // Append a FIELD_DEVICE_ID field to a frame; returns bytes written, 0 if out of space
+    size_t writeDeviceId(uint8_t* buffer, size_t size, uint32_t deviceId);
+
+    // Encode/decode the fixed-size ACK frame (longer with WIRE_ACK_FLAG_PARAMS or WIRE_ACK_FLAG_SLOT)
+    size_t ackSize(uint8_t flags);
+    size_t encodeAck(uint8_t* buffer, size_t size, const AckFrame& ack);
+    bool decodeAck(const uint8_t* buffer, size_t length, AckFrame& ack);
+
+    // Decode a binary frame into the JSON layout used on the serial side
+    // (messages are encoded and decoded through their schema, see message_schema.h).
+    // Batched samples are skipped; see countSamples/findSample for those.
+    // Decoded in place: strings in doc point into the buffer (the payload text
+    // is moved over its length prefix to make room for its terminator), so
+    // the buffer is changed and must outlive doc.
+    bool decode(uint8_t* buffer, size_t length, JsonDocument& doc);
+
+    // Number of batched samples (keyframe or delta) in a frame
+    uint8_t countSamples(const uint8_t* buffer, size_t length);
+
+    // Locate the index-th batched sample; body points into the buffer.
+    // fieldId tells a keyframe (FIELD_SAMPLE) from a delta (FIELD_DELTA_SAMPLE),
+    // see metric_codec.h for the body layouts.
+    bool findSample(const uint8_t* buffer, size_t length, uint8_t index, uint8_t* fieldId, const uint8_t** body, size_t* bodyLength);
+}
+
+#endif // WIRE_FORMAT_H
@@ -0,0 +1,255 @@
+#include "arq_window.h"
+#include "wire_format.h"
+
+ArqWindow::ArqWindow() :
+    head(0),
+    queued(0),
+    windowSize(ARQ_DEFAULT_WINDOW),
+    activeSince(0),
+    stats() {
+}
+
+void ArqWindow::setWindowSize(uint8_t size) {
+    if (size < 1) size = 1;
+    if (size > ARQ_QUEUE_SIZE) size = ARQ_QUEUE_SIZE;
+    windowSize = size;
+}
+
+uint8_t ArqWindow::getWindowSize() const {
+    return windowSize;
+}
+
+bool ArqWindow::enqueue(const uint8_t* frame, size_t length, uint32_t id, bool oneShot) {
+    // Leave room for the window offset field appended at send time
+    if (isFull() || length + ARQ_TRAILER_SIZE > ARQ_FRAME_SIZE) {
+        return false;
+    }
+
+    // Start timing a new active period
+    if (queued == 0) {
+        activeSince = millis();
+    }
+
+    ArqSlot& slot = slots[slotAt(queued)];
+    slot.id = id;
+    slot.length = length;
+    slot.attempts = 0;
+    slot.sent = false;
+    slot.acked = false;
+    slot.oneShot = oneShot;
+    slot.queuedAt = millis();
+    if (frame != slot.frame) {
+        memcpy(slot.frame, frame, length);
+    }
+
+    queued++;
+    return true;
+}
+
+uint8_t* ArqWindow::nextFrame() {
+    return isFull() ? nullptr : slots[slotAt(queued)].frame;
+}
+
+bool ArqWindow::cancel(uint32_t id) {
+    for (uint8_t i = 0; i < queued; i++) {
+        ArqSlot& slot = slots[slotAt(i)];
+        if (slot.id == id && !slot.acked) {
+            // The receiver skips it once it falls behind the window offset
+            slot.acked = true;
+            slide();
+            return true;
+        }
+    }
+    return false;
+}
+
+uint8_t ArqWindow::count() const {
+    return queued;
+}
+
+bool ArqWindow::isFull() const {
+    return queued >= ARQ_QUEUE_SIZE;
+}
+
+uint8_t ArqWindow::pendingInWindow() const {
+    uint8_t limit = queued < windowSize ? queued : windowSize;
+    uint8_t pending = 0;
+
+    for (uint8_t i = 0; i < limit; i++) {
+        const ArqSlot& slot = slots[slotAt(i)];
+        if (!slot.acked && !slot.sent) {
+            pending++;
+        }
+    }
+
+    return pending;
+}
+
+int ArqWindow::nextToSend() const {
+    uint8_t limit = queued < windowSize ? queued : windowSize;
+
+    for (uint8_t i = 0; i < limit; i++) {
+        uint8_t index = slotAt(i);
+        if (!slots[index].acked && !slots[index].sent) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+uint8_t ArqWindow::pendingLengths(uint16_t* lengths, uint8_t maxFrames) const {
+    uint8_t limit = queued < windowSize ? queued : windowSize;
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < limit && count < maxFrames; i++) {
+        const ArqSlot& slot = slots[slotAt(i)];
+        if (!slot.acked && !slot.sent) {
+            lengths[count++] = slot.length;
+        }
+    }
+
+    return count;
+}
+
+size_t ArqWindow::prepare(int index, bool ackRequest, uint8_t* out, size_t size) {
+    static const WireField offsetField = { FIELD_WINDOW_OFFSET, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+
+    ArqSlot& slot = slots[index];
+    if (slot.length > size) {
+        return 0;
+    }
+
+    // Frame as encoded, with the windowed flags set in the header
+    memcpy(out, slot.frame, slot.length);
+    out[1] |= WIRE_FLAG_WINDOWED;
+    if (ackRequest) {
+        out[1] |= WIRE_FLAG_ACK_REQ;
+    }
+
+    // Tell the receiver where our window starts, so it can skip IDs we've given up on
+    uint32_t offset = slot.id - slots[head].id;
+    size_t n = WireFormat::writeField(out + slot.length, size - slot.length, offsetField, offset);
+    if (n == 0) {
+        return 0;
+    }
+
+    // Book-keeping
+    if (slot.attempts > 0) {
+        stats.retransmissions++;
+    }
+    slot.attempts++;
+    slot.sent = true;
+    stats.transmissions++;
+    if (ackRequest) {
+        stats.bursts++;
+    }
+
+    return slot.length + n;
+}
+
+uint8_t ArqWindow::onBlockAck(uint32_t cumulative, uint32_t bitmap, ArqCompletion* results, uint8_t maxResults) {
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < queued; i++) {
+        ArqSlot& slot = slots[slotAt(i)];
+        if (slot.acked || !slot.sent) {
+            continue;
+        }
+
+        // Acknowledged cumulatively or by its bit in the bitmap
+        bool received = (int32_t)(slot.id - cumulative) <= 0;
+        if (!received) {
+            uint32_t bit = slot.id - cumulative - 1;
+            received = bit < 32 && (bitmap & (1UL << bit));
+        }
+
+        if (received) {
+            stats.bytesDelivered += slot.length;
+            complete(slot, true, results, maxResults, count);
+        } else if (slot.attempts >= ARQ_MAX_ATTEMPTS || slot.oneShot) {
+            complete(slot, false, results, maxResults, count);
+        } else {
+            // Lost in this burst, send it again
+            slot.sent = false;
+        }
+    }
+
+    slide();
+    return count;
+}
+
+uint8_t ArqWindow::onTimeout(ArqCompletion* results, uint8_t maxResults) {
+    uint8_t count = 0;
+
+    // The block ACK (or the whole burst) was lost. Resend only the oldest
+    // outstanding frame as a probe; its block ACK tells us what's missing.
+    for (uint8_t i = 0; i < queued; i++) {
+        ArqSlot& slot = slots[slotAt(i)];
+        if (slot.acked || !slot.sent) {
+            continue;
+        }
+
+        if (slot.attempts >= ARQ_MAX_ATTEMPTS) {
+            complete(slot, false, results, maxResults, count);
+            continue;
+        }
+
+        slot.sent = false;
+        break;
+    }
+
+    slide();
+    return count;
+}
+
+const ArqStats& ArqWindow::getStats() const {
+    return stats;
+}
+
+float ArqWindow::getGoodput() const {
+    uint32_t activeMs = stats.activeMs;
+    if (queued > 0) {
+        activeMs += millis() - activeSince;
+    }
+
+    if (activeMs == 0) {
+        return 0.0;
+    }
+    return stats.bytesDelivered * 1000.0 / activeMs;
+}
+
+uint8_t ArqWindow::slotAt(uint8_t i) const {
+    return (head + i) % ARQ_QUEUE_SIZE;
+}
+
+void ArqWindow::complete(ArqSlot& slot, bool success, ArqCompletion* results, uint8_t maxResults, uint8_t& count) {
+    slot.acked = true;
+
+    if (success) {
+        stats.framesDelivered++;
+    } else {
+        stats.framesFailed++;
+    }
+
+    if (count < maxResults) {
+        results[count].id = slot.id;
+        results[count].success = success;
+        results[count].attempts = slot.attempts;
+        results[count].elapsedMs = millis() - slot.queuedAt;
+        count++;
+    }
+}
+
+void ArqWindow::slide() {
+    while (queued > 0 && slots[head].acked) {
+        head = (head + 1) % ARQ_QUEUE_SIZE;
+        queued--;
+    }
+
+    // End of an active period
+    if (queued == 0 && activeSince != 0) {
+        stats.activeMs += millis() - activeSince;
+        activeSince = 0;
+    }
+}
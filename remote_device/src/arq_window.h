@@ -0,0 +1,127 @@
+#ifndef ARQ_WINDOW_H
+#define ARQ_WINDOW_H
+
+#include <Arduino.h>
+
+// Frames buffered for windowed (selective-repeat) sending
+#define ARQ_QUEUE_SIZE      16
+
+// Default number of frames in flight per burst (1 behaves like stop-and-wait)
+#define ARQ_DEFAULT_WINDOW  4
+
+// Transmissions of a single frame before it's given up
+#define ARQ_MAX_ATTEMPTS    5
+
+// Largest frame stored in a slot (matches MAX_PACKET_SIZE)
+#define ARQ_FRAME_SIZE      256
+
+// Room reserved at the end of a frame for the window offset field
+#define ARQ_TRAILER_SIZE    6
+
+// A frame waiting for delivery
+struct ArqSlot {
+    uint32_t id;
+    uint16_t length;
+    uint8_t attempts;
+    bool sent;              // Transmitted and waiting for a block ACK
+    bool acked;
+    bool oneShot;           // Given up after the first block ACK that misses it
+    unsigned long queuedAt;
+    uint8_t frame[ARQ_FRAME_SIZE];
+};
+
+// Outcome of one frame leaving the window
+struct ArqCompletion {
+    uint32_t id;
+    bool success;
+    uint8_t attempts;
+    uint32_t elapsedMs;     // From enqueue to ACK (or give-up)
+};
+
+// Windowed transfer statistics
+struct ArqStats {
+    uint32_t framesDelivered;
+    uint32_t framesFailed;
+    uint32_t transmissions;
+    uint32_t retransmissions;
+    uint32_t bursts;
+    uint32_t bytesDelivered;
+    uint32_t activeMs;      // Time with frames outstanding
+};
+
+// Sender side of the selective-repeat protocol: frames are sent in bursts of
+// up to windowSize, the receiver answers each burst with a cumulative ACK plus
+// a bitmap of the IDs after it, and only the missing frames are resent.
+class ArqWindow {
+public:
+    ArqWindow();
+
+    // Set the number of frames in flight per burst (1 to ARQ_QUEUE_SIZE)
+    void setWindowSize(uint8_t size);
+    uint8_t getWindowSize() const;
+
+    // Queue an encoded frame. A one-shot frame isn't resent when a block ACK
+    // shows it missing (only as a probe after a timeout). Returns false if
+    // the queue is full.
+    bool enqueue(const uint8_t* frame, size_t length, uint32_t id, bool oneShot = false);
+
+    // Buffer of the slot the next enqueue() fills (ARQ_FRAME_SIZE minus
+    // ARQ_TRAILER_SIZE bytes of room), nullptr if the queue is full. A frame
+    // encoded there is queued without a copy.
+    uint8_t* nextFrame();
+
+    // Drop a queued frame that's no longer needed, without reporting it.
+    // False if it isn't in the queue.
+    bool cancel(uint32_t id);
+
+    // Number of frames queued or in flight
+    uint8_t count() const;
+    bool isFull() const;
+
+    // Number of frames in the window that are ready to (re)send
+    uint8_t pendingInWindow() const;
+
+    // Slot index of the next frame in the window to (re)send, or -1
+    int nextToSend() const;
+
+    // Encoded lengths of the frames ready to (re)send, in sending order.
+    // Returns how many were written.
+    uint8_t pendingLengths(uint16_t* lengths, uint8_t maxFrames) const;
+
+    // Copy a slot's frame into out with windowed flags and the window offset
+    // field set, and mark it as sent. Returns the on-air length.
+    size_t prepare(int slot, bool ackRequest, uint8_t* out, size_t size);
+
+    // Apply a block ACK. Frames sent but not acknowledged are queued for
+    // retransmission. Completed frames are written to results; returns how many.
+    uint8_t onBlockAck(uint32_t cumulative, uint32_t bitmap, ArqCompletion* results, uint8_t maxResults);
+
+    // No block ACK arrived: probe with the oldest outstanding frame.
+    // Returns the number of frames given up (written to results).
+    uint8_t onTimeout(ArqCompletion* results, uint8_t maxResults);
+
+    // Get transfer statistics
+    const ArqStats& getStats() const;
+
+    // Goodput over the time frames were outstanding (bytes/s)
+    float getGoodput() const;
+
+private:
+    ArqSlot slots[ARQ_QUEUE_SIZE];
+    uint8_t head;           // Oldest queued frame
+    uint8_t queued;
+    uint8_t windowSize;
+    unsigned long activeSince;
+    ArqStats stats;
+
+    // Slot index of the i-th queued frame
+    uint8_t slotAt(uint8_t i) const;
+
+    // Record a frame leaving the window
+    void complete(ArqSlot& slot, bool success, ArqCompletion* results, uint8_t maxResults, uint8_t& count);
+
+    // Release acknowledged/failed frames from the head of the queue
+    void slide();
+};
+
+#endif // ARQ_WINDOW_H
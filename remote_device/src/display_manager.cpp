@@ -5,6 +5,7 @@ DisplayManager displayManager;
 
 DisplayManager::DisplayManager() : 
     display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET_PIN),
+    isInitialized(false),
     currentPage(PAGE_STATUS),
     lastUpdateTime(0),
     displayOn(true),
@@ -38,12 +39,16 @@ bool DisplayManager::begin() {
     display.println(F("LoRa Remote Device"));
     display.println(F("Initializing..."));
     display.display();
+    isInitialized = true;
     
     Serial.println(F("Display manager initialized"));
     return true;
 }
 
 void DisplayManager::clear() {
+    if (!isInitialized) {
+        return;
+    }
     display.clearDisplay();
     display.display();
 }
@@ -54,8 +59,8 @@ void DisplayManager::update() {
         return;
     }
     
-    // Only update if display is on
-    if (!displayOn) {
+    // Only update if display is on (and set up)
+    if (!displayOn || !isInitialized) {
         return;
     }
     
@@ -139,6 +144,9 @@ void DisplayManager::showDebugInfo(const char* message) {
 
 void DisplayManager::setPower(bool on) {
     displayOn = on;
+    if (!isInitialized) {
+        return;
+    }
     
     if (on) {
         // Power on sequence
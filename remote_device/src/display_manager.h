@@ -72,6 +72,7 @@ public:
     
 private:
     Adafruit_SSD1306 display;
+    bool isInitialized;     // begin() done; until then only the data is kept
     ScreenPage currentPage;
     unsigned long lastUpdateTime;
     bool displayOn;
@@ -0,0 +1,78 @@
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <Arduino.h>
+
+// Transmit airtime budget over a rolling window, for regulatory duty-cycle
+// limits (EU868: 1% per hour in the g/g1 sub-bands). Airtime is kept in
+// one-minute buckets, so a frame is forgotten between 59 and 60 minutes
+// after it was sent; the budget errs on the safe side.
+
+// Rolling window and its resolution
+#define DUTY_WINDOW_MS      3600000UL   // 1 hour
+#define DUTY_BUCKETS        60
+#define DUTY_BUCKET_MS      (DUTY_WINDOW_MS / DUTY_BUCKETS)
+
+// Share of the budget each priority may fill; the rest is kept for higher ones
+#define DUTY_LOW_SHARE      80   // %
+#define DUTY_NORMAL_SHARE   95   // %
+
+// How important a frame is when the budget runs short
+enum TxPriority {
+    TX_PRIORITY_LOW,        // Diagnostics (ping): dropped once over its share
+    TX_PRIORITY_NORMAL,     // Data and status: deferred until the budget allows
+    TX_PRIORITY_HIGH        // Acknowledgments: sent up to the full budget, dropped beyond it
+};
+
+// Outcome of a budget check
+enum DutyDecision {
+    DUTY_SEND,
+    DUTY_DEFER,
+    DUTY_DROP
+};
+
+// Duty-cycle statistics
+struct DutyStats {
+    uint32_t framesSent;
+    uint32_t framesDeferred;    // Checks that answered DUTY_DEFER
+    uint32_t framesDropped;
+    uint64_t airtimeTotalUs;
+};
+
+class DutyCycle {
+public:
+    DutyCycle();
+
+    // Budget in permille of the window (10 = 1%); 0 = no limit, airtime still tracked
+    void setLimit(uint16_t permille);
+    uint16_t getLimit() const;
+
+    // Can a frame of this airtime go out now?
+    DutyDecision check(uint32_t airtimeUs, TxPriority priority);
+
+    // Record a frame that was sent
+    void record(uint32_t airtimeUs);
+
+    // Time until a frame of this airtime fits the priority's share (0 = now)
+    uint32_t waitMs(uint32_t airtimeUs, TxPriority priority);
+
+    // Airtime used in the rolling window
+    uint32_t getAirtimeUsedMs();
+
+    const DutyStats& getStats() const;
+
+private:
+    uint32_t buckets[DUTY_BUCKETS];     // Airtime (us) per bucket
+    uint8_t current;
+    unsigned long bucketStart;          // millis() when the current bucket began
+    uint16_t limitPermille;
+    DutyStats stats;
+
+    // Retire buckets older than the window
+    void advance();
+
+    uint64_t usedUs() const;
+    uint64_t shareUs(TxPriority priority) const;
+};
+
+#endif // DUTY_CYCLE_H
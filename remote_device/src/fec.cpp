@@ -0,0 +1,106 @@
+#include "fec.h"
+
+namespace Fec {
+
+// x^8 + x^4 + x^3 + x^2 + 1, with 2 as generator
+static const uint16_t POLYNOMIAL = 0x11D;
+
+// exp is doubled so a sum of two logs needs no reduction
+static uint8_t expTable[512];
+static uint8_t logTable[256];
+static bool ready = false;
+
+static void init() {
+    if (ready) return;
+
+    uint16_t x = 1;
+    for (uint16_t i = 0; i < 255; i++) {
+        expTable[i] = x;
+        logTable[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= POLYNOMIAL;
+    }
+    for (uint16_t i = 255; i < 512; i++) {
+        expTable[i] = expTable[i - 255];
+    }
+    ready = true;
+}
+
+static uint8_t inverse(uint8_t a) {
+    return expTable[255 - logTable[a]];
+}
+
+uint8_t coefficient(uint8_t parity, uint8_t data) {
+    init();
+
+    // 1 / (x + y), with the rows and columns on distinct elements
+    return inverse(parity ^ (FEC_MAX_PARITY + data));
+}
+
+uint8_t multiply(uint8_t a, uint8_t b) {
+    init();
+    if (a == 0 || b == 0) return 0;
+    return expTable[logTable[a] + logTable[b]];
+}
+
+void multiplyAdd(uint8_t* out, const uint8_t* in, size_t length, uint8_t c) {
+    init();
+    if (c == 0) return;
+
+    const uint8_t* row = expTable + logTable[c];
+    for (size_t i = 0; i < length; i++) {
+        if (in[i] != 0) {
+            out[i] ^= row[logTable[in[i]]];
+        }
+    }
+}
+
+bool invert(uint8_t* matrix, uint8_t n) {
+    init();
+    if (n == 0 || n > FEC_MAX_PARITY) return false;
+
+    // Gauss-Jordan on [matrix | identity]
+    uint8_t result[FEC_MAX_PARITY * FEC_MAX_PARITY] = {};
+    for (uint8_t i = 0; i < n; i++) {
+        result[i * n + i] = 1;
+    }
+
+    for (uint8_t column = 0; column < n; column++) {
+        uint8_t pivot = column;
+        while (pivot < n && matrix[pivot * n + column] == 0) {
+            pivot++;
+        }
+        if (pivot == n) return false;
+
+        if (pivot != column) {
+            for (uint8_t j = 0; j < n; j++) {
+                uint8_t t = matrix[pivot * n + j];
+                matrix[pivot * n + j] = matrix[column * n + j];
+                matrix[column * n + j] = t;
+                t = result[pivot * n + j];
+                result[pivot * n + j] = result[column * n + j];
+                result[column * n + j] = t;
+            }
+        }
+
+        uint8_t scale = inverse(matrix[column * n + column]);
+        for (uint8_t j = 0; j < n; j++) {
+            matrix[column * n + j] = multiply(matrix[column * n + j], scale);
+            result[column * n + j] = multiply(result[column * n + j], scale);
+        }
+
+        for (uint8_t i = 0; i < n; i++) {
+            uint8_t factor = matrix[i * n + column];
+            if (i == column || factor == 0) continue;
+            for (uint8_t j = 0; j < n; j++) {
+                matrix[i * n + j] ^= multiply(factor, matrix[column * n + j]);
+                result[i * n + j] ^= multiply(factor, result[column * n + j]);
+            }
+        }
+    }
+
+    memcpy(matrix, result, n * n);
+    return true;
+}
+
+} // namespace Fec
@@ -0,0 +1,338 @@
+#include "fragmenter.h"
+
+Fragmenter::Fragmenter() :
+    data(nullptr),
+    result(),
+    running(false),
+    fragmentSize(FRAG_DATA_SIZE),
+    groupData(0),
+    groupParity(0),
+    groups(0),
+    groupsDone(0),
+    positions(0),
+    nextPosition(0),
+    startedAt(0),
+    inFlight(),
+    inFlightCount(0),
+    resend(),
+    resendCount(0),
+    resendsInRow(0),
+    acked(),
+    parity(),
+    stats() {
+}
+
+bool Fragmenter::start(const uint8_t* data, size_t length, uint16_t transfer, uint16_t fragmentSize,
+                       uint8_t groupData, uint8_t groupParity) {
+    if (isActive() || data == nullptr || length == 0 || length > FRAG_MAX_TRANSFER_SIZE ||
+        fragmentSize < FRAG_MIN_DATA_SIZE || fragmentSize > FRAG_DATA_SIZE) {
+        return false;
+    }
+    if (groupParity > 0 && (groupParity > FEC_MAX_PARITY || groupData < groupParity || groupData > FEC_MAX_DATA)) {
+        return false;
+    }
+
+    this->data = data;
+    this->fragmentSize = fragmentSize;
+    this->groupData = groupParity > 0 ? groupData : 0;
+    this->groupParity = groupParity;
+    result.transfer = transfer;
+    result.success = false;
+    result.length = length;
+    result.fragments = Fragment::count(length, fragmentSize);
+    result.parity = 0;
+    result.resent = 0;
+    result.elapsedMs = 0;
+    groups = groupParity > 0 ? (result.fragments + groupData - 1) / groupData : result.fragments;
+    groupsDone = 0;
+    positions = result.fragments + Fragment::parityCount(result.fragments, groupData, groupParity);
+    nextPosition = 0;
+    resendCount = 0;
+    resendsInRow = 0;
+    memset(acked, 0, sizeof(acked));
+    startedAt = millis();
+    running = true;
+    return true;
+}
+
+bool Fragmenter::isActive() const {
+    return running || inFlightCount > 0;
+}
+
+bool Fragmenter::hasPending() const {
+    return running && (resendCount > 0 || nextPosition < positions);
+}
+
+bool Fragmenter::isOneShot() const {
+    return groupParity > 0;
+}
+
+bool Fragmenter::peek(FragmentInfo& fragment) const {
+    if (!running || inFlightCount >= FRAG_QUEUE_LIMIT) {
+        return false;
+    }
+
+    uint16_t index;
+    if (resendCount > 0) {
+        index = resend[0];
+    } else if (nextPosition < positions) {
+        index = indexAt(nextPosition);
+    } else {
+        return false;
+    }
+
+    fragment.transfer = result.transfer;
+    fragment.totalLength = result.length;
+    fragment.fragmentSize = fragmentSize;
+    fragment.index = index;
+    fragment.groupData = groupData;
+    fragment.groupParity = groupParity;
+    if (index >= result.fragments) {
+        fragment.data = parity[(index - result.fragments) % groupParity];
+        fragment.length = fragmentSize;
+        return true;
+    }
+    uint32_t start = (uint32_t)index * fragmentSize;
+    fragment.data = data + start;
+    fragment.length = result.length - start < fragmentSize ? result.length - start : fragmentSize;
+    return true;
+}
+
+void Fragmenter::queued(const FragmentInfo& fragment, uint32_t messageId) {
+    if (resendCount > 0 && resend[0] == fragment.index) {
+        resendCount--;
+        memmove(resend, resend + 1, resendCount * sizeof(resend[0]));
+        result.resent++;
+        stats.resent++;
+    } else {
+        nextPosition++;
+        if (fragment.index >= result.fragments) {
+            result.parity++;
+            stats.parity++;
+        } else if (groupParity > 0 && nextPosition < positions && indexAt(nextPosition) >= result.fragments) {
+            // Last data fragment of its group: its parity goes next
+            encodeParity(groupOf(fragment.index));
+        }
+    }
+
+    for (uint8_t i = 0; i < FRAG_QUEUE_LIMIT; i++) {
+        if (!inFlight[i].used) {
+            inFlight[i].messageId = messageId;
+            inFlight[i].index = fragment.index;
+            inFlight[i].used = true;
+            inFlight[i].cancel = false;
+            inFlightCount++;
+            break;
+        }
+    }
+    stats.fragments++;
+}
+
+bool Fragmenter::nextCancelled(uint32_t* messageId) {
+    for (uint8_t i = 0; i < FRAG_QUEUE_LIMIT; i++) {
+        if (inFlight[i].used && inFlight[i].cancel) {
+            *messageId = inFlight[i].messageId;
+            inFlight[i].used = false;
+            inFlightCount--;
+            stats.cancelled++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Fragmenter::onCompletion(uint32_t messageId, bool success, bool* finished) {
+    *finished = false;
+
+    uint8_t i = 0;
+    while (i < FRAG_QUEUE_LIMIT && !(inFlight[i].used && inFlight[i].messageId == messageId)) {
+        i++;
+    }
+    if (i == FRAG_QUEUE_LIMIT) {
+        return false;
+    }
+    inFlight[i].used = false;
+    inFlightCount--;
+
+    // What's left of a finished transfer just drains out of the window
+    if (!running) {
+        return true;
+    }
+
+    uint16_t index = inFlight[i].index;
+    uint16_t group = groupOf(index);
+    uint8_t needed = groupSize(group);
+    bool wasDone = ackedIn(group) >= needed;
+
+    if (success) {
+        resendsInRow = 0;
+        acked[index >> 3] |= 1 << (index & 7);
+        if (!wasDone && ackedIn(group) >= needed) {
+            dropGroup(group);
+            groupsDone++;
+            if (groupsDone == groups) {
+                finish(true);
+                *finished = true;
+            }
+        }
+        return true;
+    }
+
+    // Lost, but the group may still get there without it
+    if (wasDone || ackedIn(group) + outstandingIn(group) >= needed) {
+        return true;
+    }
+    if (resendsInRow >= FRAG_MAX_RESENDS) {
+        finish(false);
+        *finished = true;
+        return true;
+    }
+    resendsInRow++;
+    resend[resendCount++] = missingIn(group);
+    return true;
+}
+
+const TransferResult& Fragmenter::getResult() const {
+    return result;
+}
+
+const FragmentStats& Fragmenter::getStats() const {
+    return stats;
+}
+
+uint8_t Fragmenter::groupSize(uint16_t group) const {
+    if (groupParity == 0) return 1;
+    uint16_t first = group * groupData;
+    return result.fragments - first < groupData ? result.fragments - first : groupData;
+}
+
+uint16_t Fragmenter::groupOf(uint16_t index) const {
+    return Fragment::groupOf(index, result.fragments, groupData, groupParity);
+}
+
+uint16_t Fragmenter::groupStart(uint16_t group) const {
+    return group * (groupParity > 0 ? groupData + groupParity : 1);
+}
+
+uint16_t Fragmenter::groupEnd(uint16_t group) const {
+    return groupStart(group) + groupSize(group) + groupParity;
+}
+
+uint16_t Fragmenter::indexAt(uint16_t position) const {
+    if (groupParity == 0) return position;
+
+    uint16_t group = position / (groupData + groupParity);
+    uint8_t offset = position % (groupData + groupParity);
+    uint8_t size = groupSize(group);
+    if (offset < size) {
+        return group * groupData + offset;
+    }
+    return result.fragments + group * groupParity + (offset - size);
+}
+
+bool Fragmenter::isAcked(uint16_t index) const {
+    return acked[index >> 3] & (1 << (index & 7));
+}
+
+uint8_t Fragmenter::ackedIn(uint16_t group) const {
+    if (groupParity == 0) return isAcked(group) ? 1 : 0;
+
+    uint8_t count = 0;
+    uint16_t first = group * groupData;
+    for (uint8_t j = 0; j < groupSize(group); j++) {
+        if (isAcked(first + j)) count++;
+    }
+    first = result.fragments + group * groupParity;
+    for (uint8_t j = 0; j < groupParity; j++) {
+        if (isAcked(first + j)) count++;
+    }
+    return count;
+}
+
+uint8_t Fragmenter::outstandingIn(uint16_t group) const {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < FRAG_QUEUE_LIMIT; i++) {
+        if (inFlight[i].used && !inFlight[i].cancel && groupOf(inFlight[i].index) == group) count++;
+    }
+    for (uint8_t i = 0; i < resendCount; i++) {
+        if (groupOf(resend[i]) == group) count++;
+    }
+
+    uint16_t from = nextPosition > groupStart(group) ? nextPosition : groupStart(group);
+    if (from < groupEnd(group)) {
+        count += groupEnd(group) - from;
+    }
+    return count;
+}
+
+uint16_t Fragmenter::missingIn(uint16_t group) const {
+    uint16_t first = groupParity > 0 ? group * groupData : group;
+    for (uint8_t j = 0; j < groupSize(group); j++) {
+        uint16_t index = first + j;
+        bool busy = isAcked(index);
+        for (uint8_t i = 0; i < FRAG_QUEUE_LIMIT && !busy; i++) {
+            busy = inFlight[i].used && !inFlight[i].cancel && inFlight[i].index == index;
+        }
+        for (uint8_t i = 0; i < resendCount && !busy; i++) {
+            busy = resend[i] == index;
+        }
+        if (!busy) {
+            return index;
+        }
+    }
+    return first;
+}
+
+void Fragmenter::dropGroup(uint16_t group) {
+    for (uint8_t i = 0; i < FRAG_QUEUE_LIMIT; i++) {
+        if (inFlight[i].used && groupOf(inFlight[i].index) == group) {
+            inFlight[i].cancel = true;
+        }
+    }
+
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < resendCount; i++) {
+        if (groupOf(resend[i]) != group) {
+            resend[kept++] = resend[i];
+        }
+    }
+    resendCount = kept;
+
+    // Parity it no longer needs
+    if (nextPosition >= groupStart(group) && nextPosition < groupEnd(group)) {
+        nextPosition = groupEnd(group);
+    }
+}
+
+void Fragmenter::encodeParity(uint16_t group) {
+    unsigned long started = micros();
+
+    uint16_t first = group * groupData;
+    for (uint8_t p = 0; p < groupParity; p++) {
+        memset(parity[p], 0, fragmentSize);
+        for (uint8_t j = 0; j < groupSize(group); j++) {
+            uint32_t start = (uint32_t)(first + j) * fragmentSize;
+            uint16_t length = result.length - start < fragmentSize ? result.length - start : fragmentSize;
+            Fec::multiplyAdd(parity[p], data + start, length, Fec::coefficient(p, j));
+        }
+    }
+
+    uint32_t elapsed = micros() - started;
+    stats.encodeUs += elapsed;
+    if (elapsed > stats.encodeMaxUs) {
+        stats.encodeMaxUs = elapsed;
+    }
+}
+
+void Fragmenter::finish(bool success) {
+    running = false;
+    resendCount = 0;
+    result.success = success;
+    result.elapsedMs = millis() - startedAt;
+    if (success) {
+        stats.transfers++;
+        stats.bytesDelivered += result.length;
+    } else {
+        stats.failed++;
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef FRAGMENTER_H
+#define FRAGMENTER_H
+
+#include <Arduino.h>
+#include "fragment.h"
+
+// Fragments of the transfer in the ARQ window at once; the rest of the
+// window's queue stays free for data frames
+#define FRAG_QUEUE_LIMIT   12
+
+// Fragments queued again in a row, with none acknowledged in between, before
+// the transfer fails: ones the window gave up on, or with FEC, data fragments
+// topping up a group that lost more than its parity covers
+#define FRAG_MAX_RESENDS   32
+
+// Outcome of a finished transfer
+struct TransferResult {
+    uint16_t transfer;
+    bool success;
+    uint32_t length;
+    uint16_t fragments;         // Data fragments
+    uint16_t parity;            // Parity fragments queued
+    uint16_t resent;            // Fragments queued again after the window gave up on them
+    uint32_t elapsedMs;         // From start() to the last fragment acknowledged (or the failure)
+};
+
+// Transfer statistics
+struct FragmentStats {
+    uint32_t transfers;         // Completed
+    uint32_t failed;
+    uint32_t fragments;         // Queued, parity and resends included
+    uint32_t parity;
+    uint32_t resent;
+    uint32_t cancelled;         // Dropped from the window once their group could be decoded
+    uint32_t bytesDelivered;
+    uint32_t encodeUs;          // Time spent computing parity
+    uint32_t encodeMaxUs;       // Longest for one group
+};
+
+// Sender side of a transfer. Hands out fragments for the ARQ window up to
+// FRAG_QUEUE_LIMIT at a time, straight from the caller's data (nothing is
+// copied until a fragment is encoded), and follows their outcomes. One
+// transfer at a time.
+//
+// With FEC, each group's parity fragments follow its data fragments, and
+// they're all sent once (one-shot in the window). A group is done when any
+// groupData of its fragments are acknowledged; whatever of it is still in
+// the window is then cancelled. Only a group that can no longer get there
+// gets another of its data fragments queued.
+class Fragmenter {
+public:
+    Fragmenter();
+
+    // Start a transfer of length bytes, split into fragmentSize pieces, with
+    // groupParity parity fragments per groupData data fragments (0: no FEC).
+    // The data must stay valid until the transfer finishes. False if one is
+    // in progress or the length or FEC settings are out of range.
+    bool start(const uint8_t* data, size_t length, uint16_t transfer, uint16_t fragmentSize,
+               uint8_t groupData = 0, uint8_t groupParity = 0);
+
+    // A transfer is in progress (or fragments of a failed one are still in the window)
+    bool isActive() const;
+
+    // Fragments left to queue (new ones or ones to send again)
+    bool hasPending() const;
+
+    // Whether fragments are sent one-shot (FEC on)
+    bool isOneShot() const;
+
+    // Next fragment to queue: one to send again, then the next new one.
+    // False if there is none or FRAG_QUEUE_LIMIT are in the window.
+    bool peek(FragmentInfo& fragment) const;
+
+    // The fragment from peek() was queued as this message ID
+    void queued(const FragmentInfo& fragment, uint32_t messageId);
+
+    // Take the message ID of a fragment to drop from the window; false if none
+    bool nextCancelled(uint32_t* messageId);
+
+    // Outcome of a frame leaving the ARQ window. Returns false if it isn't
+    // one of our fragments; finished is set when it ended the transfer.
+    bool onCompletion(uint32_t messageId, bool success, bool* finished);
+
+    // Outcome of the last finished transfer
+    const TransferResult& getResult() const;
+
+    const FragmentStats& getStats() const;
+
+private:
+    // A fragment in the ARQ window
+    struct InFlight {
+        uint32_t messageId;
+        uint16_t index;
+        bool used;
+        bool cancel;            // Its group is done; to drop from the window
+    };
+
+    const uint8_t* data;
+    TransferResult result;
+    bool running;
+    uint16_t fragmentSize;
+    uint8_t groupData;
+    uint8_t groupParity;
+    uint16_t groups;
+    uint16_t groupsDone;
+    uint16_t positions;         // Fragments in sending order, parity included
+    uint16_t nextPosition;      // First not queued yet
+    unsigned long startedAt;
+    InFlight inFlight[FRAG_QUEUE_LIMIT];
+    uint8_t inFlightCount;
+    uint16_t resend[FRAG_QUEUE_LIMIT];  // To queue again
+    uint8_t resendCount;
+    uint8_t resendsInRow;       // Since a fragment was last acknowledged
+    uint8_t acked[(FRAG_MAX_INDEX + 7) / 8];                // Bit per fragment index
+    uint8_t parity[FEC_MAX_PARITY][FRAG_DATA_SIZE];         // Of the group being queued
+    FragmentStats stats;
+
+    // Without FEC every fragment is a group of one
+    uint8_t groupSize(uint16_t group) const;
+    uint16_t groupOf(uint16_t index) const;
+    uint16_t groupStart(uint16_t group) const;              // First position
+    uint16_t groupEnd(uint16_t group) const;                // Past the last position
+    uint16_t indexAt(uint16_t position) const;
+
+    bool isAcked(uint16_t index) const;
+    uint8_t ackedIn(uint16_t group) const;
+
+    // Fragments of a group still to be heard of: in the window, to send again or not queued yet
+    uint8_t outstandingIn(uint16_t group) const;
+
+    // A data fragment of the group that's neither acknowledged nor on its way
+    uint16_t missingIn(uint16_t group) const;
+
+    // The group can be decoded: cancel the rest of it
+    void dropGroup(uint16_t group);
+
+    // Compute the parity fragments of a group
+    void encodeParity(uint16_t group);
+
+    // Finish the transfer and fill in the result
+    void finish(bool success);
+};
+
+#endif // FRAGMENTER_H
@@ -0,0 +1,132 @@
+#include "hopping.h"
+
+namespace {
+
+// Finalizer of MurmurHash3: every input bit affects every output bit
+uint32_t mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85EBCA6B;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35;
+    x ^= x >> 16;
+    return x;
+}
+
+uint8_t channelCount(uint16_t mask) {
+    return __builtin_popcount(mask);
+}
+
+// Every channel of the plan, none beyond it
+const uint16_t PLAN_MASK = (uint16_t)((1UL << HOP_CHANNEL_COUNT) - 1);
+
+} // namespace
+
+namespace Hopping {
+
+HopPlan initialPlan(uint16_t seed) {
+    HopPlan plan;
+    plan.seed = seed;
+    plan.mask = PLAN_MASK;
+    plan.nextMask = PLAN_MASK;
+    plan.changeAt = 0;
+    return plan;
+}
+
+float frequencyMhz(uint8_t channel) {
+    return HOP_FIRST_MHZ + channel * HOP_SPACING_MHZ;
+}
+
+uint16_t maskAt(const HopPlan& plan, uint32_t superframe) {
+    return superframe >= plan.changeAt ? plan.nextMask : plan.mask;
+}
+
+uint8_t channelFor(const HopPlan& plan, uint32_t superframe, uint16_t slot) {
+    uint16_t mask = maskAt(plan, superframe);
+    uint8_t count = channelCount(mask);
+    if (count == 0) {
+        return HOP_HOME;
+    }
+
+    // The n-th channel of the hop set, n from a hash of seed, superframe and slot
+    uint32_t n = mix(mix(((uint32_t)plan.seed << 16) ^ superframe) ^ slot) % count;
+    for (uint8_t channel = 0; channel < HOP_MAX_CHANNELS; channel++) {
+        if (mask & (1U << channel)) {
+            if (n == 0) {
+                return channel;
+            }
+            n--;
+        }
+    }
+    return HOP_HOME;
+}
+
+void record(ChannelStats& stats, bool delivered) {
+    stats.frames++;
+    if (delivered) {
+        stats.received++;
+    }
+    stats.errorRate += ((delivered ? 0.0f : 1.0f) - stats.errorRate) / HOP_STATS_GAIN;
+}
+
+void recordRssi(ChannelStats& stats, float rssi) {
+    stats.rssi = stats.rssi == 0.0f ? rssi : stats.rssi + (rssi - stats.rssi) / HOP_STATS_GAIN;
+}
+
+size_t writeBeaconField(uint8_t* buffer, size_t size, const HopPlan& plan, uint32_t superframe) {
+    // Seed, hop set now, hop set next and superframes until it applies (0: no change pending)
+    uint32_t changeIn = plan.changeAt > superframe ? plan.changeAt - superframe : 0;
+    uint32_t values[] = { plan.seed, changeIn > 0 ? plan.mask : maskAt(plan, superframe), plan.nextMask, changeIn };
+
+    uint8_t body[4 * WIRE_MAX_VARINT_SIZE];
+    size_t length = 0;
+    for (size_t i = 0; i < 4; i++) {
+        length += WireFormat::writeVarint(body + length, sizeof(body) - length, values[i]);
+    }
+    return WireFormat::writeBytes(buffer, size, FIELD_HOP_PLAN, body, length);
+}
+
+bool readBeaconField(const uint8_t* buffer, size_t length, uint32_t superframe, HopPlan& plan) {
+    FrameHeader header;
+    size_t offset = WireFormat::readHeader(buffer, length, header);
+    if (offset == 0) {
+        return false;
+    }
+
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(buffer + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        if (fieldId != FIELD_HOP_PLAN || wireType != WIRE_BYTES) {
+            continue;
+        }
+        uint32_t values[4];
+        size_t used = 0;
+        for (size_t i = 0; i < 4; i++) {
+            size_t m = WireFormat::readVarint(bytes + used, raw - used, &values[i]);
+            if (m == 0) {
+                return false;
+            }
+            used += m;
+        }
+
+        // Both hop sets within our channel plan, and not empty
+        if (values[0] > 0xFFFF || values[1] == 0 || values[2] == 0 ||
+            (values[1] & ~PLAN_MASK) || (values[2] & ~PLAN_MASK) || values[3] > HOP_MASK_LEAD) {
+            return false;
+        }
+        plan.seed = values[0];
+        plan.mask = values[1];
+        plan.nextMask = values[2];
+        plan.changeAt = superframe + values[3];
+        return true;
+    }
+    return false;
+}
+
+} // namespace Hopping
@@ -0,0 +1,75 @@
+#ifndef HOPPING_H
+#define HOPPING_H
+
+#include <Arduino.h>
+#include "wire_format.h"
+
+// Frequency hopping on top of TDMA mode. Each slot of each superframe is on a
+// channel of the plan below, picked by a hash of the base's hop seed, the
+// superframe number and the slot, so both ends work it out without sending
+// it. The base leaves channels that lose too many frames out of the hop set
+// and announces the set in its beacons. A change takes effect HOP_MASK_LEAD
+// superframes after the first beacon announcing it, and a remote hears a
+// beacon at least that often, so it never hops on a stale set. Beacons and
+// everything sent outside a slot stay on LORA_FREQUENCY.
+
+// Channel plan: the US915 500 kHz uplink channels (LoRaWAN 64-71). Channels
+// must be at least a bandwidth apart and clear of LORA_FREQUENCY; change
+// these for other bands, identically on both ends.
+#define HOP_CHANNEL_COUNT      8
+#define HOP_FIRST_MHZ          903.0
+#define HOP_SPACING_MHZ        1.6
+
+#define HOP_MAX_CHANNELS       16      // Hop sets are 16-bit channel masks
+#define HOP_HOME               0xFF    // Channel number for LORA_FREQUENCY
+#define HOP_MASK_LEAD          12      // Superframes from announcing a hop set to using it
+#define HOP_MAX_FIELD_SIZE     12      // Beacon field: tag, length, seed, two masks, countdown
+#define HOP_STATS_GAIN         32      // Error rate and RSSI are smoothed over about this many frames
+
+#if HOP_CHANNEL_COUNT > HOP_MAX_CHANNELS
+#error "HOP_CHANNEL_COUNT exceeds the 16-bit hop set"
+#endif
+
+// Hop set in use and the one announced to follow it
+struct HopPlan {
+    uint16_t seed;
+    uint16_t mask;              // Bit i set: channel i in the hop set
+    uint16_t nextMask;
+    uint32_t changeAt;          // First superframe on nextMask
+};
+
+// Slot outcomes on one channel
+struct ChannelStats {
+    uint32_t frames;            // Base: slots with an owner; remote: frames sent
+    uint32_t received;          // Base: of those, heard; remote: acknowledged
+    uint32_t crcErrors;         // Base: corrupted frames heard on it
+    float errorRate;            // Smoothed share of frames lost, 0-1
+    float rssi;                 // Smoothed over frames received, dBm (0 until the first)
+};
+
+namespace Hopping {
+    // Every channel of the plan, on seed
+    HopPlan initialPlan(uint16_t seed);
+
+    // Centre frequency of a plan channel
+    float frequencyMhz(uint8_t channel);
+
+    // Hop set for a superframe
+    uint16_t maskAt(const HopPlan& plan, uint32_t superframe);
+
+    // Channel of a slot; HOP_HOME if the hop set is empty
+    uint8_t channelFor(const HopPlan& plan, uint32_t superframe, uint16_t slot);
+
+    // Update a channel's statistics with a frame delivered or lost, or a received frame's RSSI
+    void record(ChannelStats& stats, bool delivered);
+    void recordRssi(ChannelStats& stats, float rssi);
+
+    // Append the plan to the beacon of a superframe (FIELD_HOP_PLAN); returns
+    // bytes written, 0 if out of space
+    size_t writeBeaconField(uint8_t* buffer, size_t size, const HopPlan& plan, uint32_t superframe);
+
+    // Find the plan in the beacon of a superframe; false if it has none or it's invalid
+    bool readBeaconField(const uint8_t* buffer, size_t length, uint32_t superframe, HopPlan& plan);
+}
+
+#endif // HOPPING_H
@@ -0,0 +1,87 @@
+#include "latency_stats.h"
+
+LatencyStats::LatencyStats() {
+    clear();
+}
+
+void LatencyStats::record(uint32_t us) {
+    // First sample seeds the average
+    if (count == 0) {
+        ewmaUs = us;
+        minUs = us;
+        maxUs = us;
+    } else {
+        ewmaUs = ewmaUs - (ewmaUs >> LATENCY_EWMA_SHIFT) + (us >> LATENCY_EWMA_SHIFT);
+        if (us < minUs) {
+            minUs = us;
+        }
+        if (us > maxUs) {
+            maxUs = us;
+        }
+    }
+    count++;
+
+    // Bucket from the position of the highest set bit
+    uint8_t bucket = 0;
+    if (us >= LATENCY_BUCKET0_US) {
+        bucket = 32 - __builtin_clz(us / LATENCY_BUCKET0_US);
+        if (bucket >= LATENCY_BUCKETS) {
+            bucket = LATENCY_BUCKETS - 1;
+        }
+    }
+    buckets[bucket]++;
+}
+
+uint32_t LatencyStats::getCount() const {
+    return count;
+}
+
+uint32_t LatencyStats::getEwmaUs() const {
+    return ewmaUs;
+}
+
+uint32_t LatencyStats::getMinUs() const {
+    return minUs;
+}
+
+uint32_t LatencyStats::getMaxUs() const {
+    return maxUs;
+}
+
+const uint32_t* LatencyStats::getHistogram() const {
+    return buckets;
+}
+
+uint32_t LatencyStats::percentileUs(uint8_t percent) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    // Samples at or below the percentile, rounded up
+    uint32_t rank = ((uint64_t)count * percent + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            // No bucket limit is more useful than the largest sample itself
+            uint32_t limit = bucketLimitUs(i);
+            return limit < maxUs ? limit : maxUs;
+        }
+    }
+    return maxUs;
+}
+
+uint32_t LatencyStats::bucketLimitUs(uint8_t bucket) {
+    if (bucket >= LATENCY_BUCKETS - 1) {
+        return UINT32_MAX;
+    }
+    return (uint32_t)LATENCY_BUCKET0_US << bucket;
+}
+
+void LatencyStats::clear() {
+    count = 0;
+    ewmaUs = 0;
+    minUs = 0;
+    maxUs = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
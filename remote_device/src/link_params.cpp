@@ -0,0 +1,100 @@
+#include "link_params.h"
+
+namespace LinkRate {
+
+static uint8_t bandwidthCode(uint16_t bandwidth) {
+    switch (bandwidth) {
+        case 250: return 1;
+        case 500: return 2;
+        default:  return 0;
+    }
+}
+
+static const uint16_t BANDWIDTHS[] = { 125, 250, 500 };
+
+LinkParams defaults(float bandwidth, uint8_t spreadingFactor, uint8_t codingRate, int8_t power) {
+    LinkParams params;
+    params.spreadingFactor = spreadingFactor;
+    params.bandwidth = (uint16_t)bandwidth;
+    params.codingRate = codingRate;
+    params.power = power;
+    return params;
+}
+
+LinkParams fallback() {
+    return defaults(LINK_FALLBACK_BW, LINK_FALLBACK_SF, LINK_FALLBACK_CR, LINK_FALLBACK_POWER);
+}
+
+bool equal(const LinkParams& a, const LinkParams& b) {
+    return a.spreadingFactor == b.spreadingFactor && a.bandwidth == b.bandwidth &&
+           a.codingRate == b.codingRate && a.power == b.power;
+}
+
+bool isValid(const LinkParams& params) {
+    return params.spreadingFactor >= LINK_MIN_SF && params.spreadingFactor <= LINK_MAX_SF &&
+           (params.bandwidth == 125 || params.bandwidth == 250 || params.bandwidth == 500) &&
+           params.codingRate >= 5 && params.codingRate <= 8 &&
+           params.power >= LINK_MIN_POWER && params.power <= LINK_MAX_POWER;
+}
+
+uint32_t pack(const LinkParams& params, uint8_t sequence) {
+    return (uint32_t)sequence |
+           ((uint32_t)(params.spreadingFactor & 0x0F) << 8) |
+           ((uint32_t)bandwidthCode(params.bandwidth) << 12) |
+           ((uint32_t)((params.codingRate - 5) & 0x03) << 14) |
+           ((uint32_t)(uint8_t)params.power << 16);
+}
+
+bool unpack(uint32_t packed, LinkParams& params, uint8_t* sequence) {
+    uint8_t code = (packed >> 12) & 0x03;
+    if (code > 2) {
+        return false;
+    }
+
+    params.spreadingFactor = (packed >> 8) & 0x0F;
+    params.bandwidth = BANDWIDTHS[code];
+    params.codingRate = ((packed >> 14) & 0x03) + 5;
+    params.power = (int8_t)((packed >> 16) & 0xFF);
+    if (sequence != nullptr) {
+        *sequence = packed & 0xFF;
+    }
+
+    return isValid(params);
+}
+
+float bitrate(const LinkParams& params) {
+    return params.spreadingFactor * (params.bandwidth * 1000.0f / (1UL << params.spreadingFactor)) *
+           4.0f / params.codingRate;
+}
+
+float requiredSnr(uint8_t spreadingFactor) {
+    // SX1262 datasheet: -5 dB at SF6, 2.5 dB lower per step
+    return -5.0f - 2.5f * (spreadingFactor - 6);
+}
+
+int apply(SX1262& radio, const LinkParams& params) {
+    int state = radio.setBandwidth(params.bandwidth);
+    if (state == RADIOLIB_ERR_NONE) {
+        state = radio.setSpreadingFactor(params.spreadingFactor);
+    }
+    if (state == RADIOLIB_ERR_NONE) {
+        state = radio.setCodingRate(params.codingRate);
+    }
+    if (state == RADIOLIB_ERR_NONE) {
+        state = radio.setOutputPower(params.power);
+    }
+    return state;
+}
+
+void print(const LinkParams& params) {
+    char text[32];
+    format(text, sizeof(text), params);
+    Serial.print(text);
+}
+
+int format(char* buffer, size_t size, const LinkParams& params) {
+    return snprintf(buffer, size, "SF%u/%ukHz CR4/%u %ddBm", params.spreadingFactor, params.bandwidth,
+                    params.codingRate, params.power);
+}
+
+}  // namespace LinkRate
@@ -0,0 +1,66 @@
+#ifndef LINK_PARAMS_H
+#define LINK_PARAMS_H
+
+#include <Arduino.h>
+#include <RadioLib.h>
+
+// Radio settings that adaptive data rate (ADR) can change at runtime.
+// Both ends start from the LORA_* defaults and switch together through the
+// handshake described in docs/protocol.md ("Adaptive Data Rate").
+//
+// On the wire the settings travel packed in one varint (FIELD_LINK_PARAMS,
+// or the 4-byte trailer of a fixed ACK):
+//   bits 0-7   : change sequence number
+//   bits 8-11  : spreading factor (6-12)
+//   bits 12-13 : bandwidth (0 = 125 kHz, 1 = 250 kHz, 2 = 500 kHz)
+//   bits 14-15 : coding rate minus 5 (4/5 to 4/8)
+//   bits 16-23 : TX power (int8, dBm)
+
+// Limits the ADR engine may choose from
+#define LINK_MIN_SF          6
+#define LINK_MAX_SF          12
+#define LINK_MIN_POWER       -9   // dBm, SX1262 minimum
+#define LINK_MAX_POWER       14   // dBm, keep within the regional limit
+
+// Settings both ends fall back to when the link is lost
+#define LINK_FALLBACK_SF     10
+#define LINK_FALLBACK_BW     125
+#define LINK_FALLBACK_CR     5
+#define LINK_FALLBACK_POWER  LINK_MAX_POWER
+
+struct LinkParams {
+    uint8_t spreadingFactor;
+    uint16_t bandwidth;     // kHz: 125, 250 or 500
+    uint8_t codingRate;     // Denominator of 4/x
+    int8_t power;           // dBm
+};
+
+namespace LinkRate {
+    // Settings from the compile-time LORA_* defines, and the robust fallback
+    LinkParams defaults(float bandwidth, uint8_t spreadingFactor, uint8_t codingRate, int8_t power);
+    LinkParams fallback();
+
+    bool equal(const LinkParams& a, const LinkParams& b);
+    bool isValid(const LinkParams& params);
+
+    // Pack/unpack with a change sequence number; unpack fails on invalid settings
+    uint32_t pack(const LinkParams& params, uint8_t sequence);
+    bool unpack(uint32_t packed, LinkParams& params, uint8_t* sequence);
+
+    // Raw bit rate in bits/s
+    float bitrate(const LinkParams& params);
+
+    // SNR the SX1262 needs to demodulate at a spreading factor (dB)
+    float requiredSnr(uint8_t spreadingFactor);
+
+    // Apply to the radio (must be in standby)
+    int apply(SX1262& radio, const LinkParams& params);
+
+    // Print as "SF7/125kHz CR4/5 14dBm"
+    void print(const LinkParams& params);
+    
+    // The same into buffer; returns what snprintf() does
+    int format(char* buffer, size_t size, const LinkParams& params);
+}
+
+#endif // LINK_PARAMS_H
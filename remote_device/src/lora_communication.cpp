@@ -1,22 +1,125 @@
 #include "lora_communication.h"
 #include <time.h>
+#include <esp_timer.h>
 
 // Initialize message ID counter
 uint32_t nextMessageId = 1;
 
+// Every message fits a frame at its longest, protocol fields included
+static_assert(Schema::PING.maxSize <= MAX_PACKET_SIZE, "ping doesn't fit MAX_PACKET_SIZE");
+static_assert(Schema::PONG.maxSize <= MAX_PACKET_SIZE, "pong doesn't fit MAX_PACKET_SIZE");
+static_assert(Schema::DATA.maxSize <= MAX_PACKET_SIZE, "data doesn't fit MAX_PACKET_SIZE");
+static_assert(Schema::STATUS.maxSize <= MAX_PACKET_SIZE, "status doesn't fit MAX_PACKET_SIZE");
+
+// Kept through deep sleep for a warm boot
+struct SavedRadioState {
+    uint32_t nextMessageId;
+    uint16_t nextTransferId;
+    LinkParams linkParams;
+};
+static RTC_DATA_ATTR SavedRadioState savedRadio;
+
+// Set by the DIO1 interrupt (TX done or RX done, depending on radio mode)
+static TaskHandle_t txTaskHandle = nullptr;
+static volatile bool dio1Fired = false;
+static volatile uint32_t dio1At = 0;        // micros() of the last DIO1 interrupt
+
 // Global instance
 LoRaCommunication loraCommunication;
 
+// Send an SX1262 read command (opcode, arguments and status byte) and clock
+// in the reply. RadioLib keeps its register access protected, so this goes
+// to SPI directly. False if the radio stays busy.
+static bool readCommand(const uint8_t* command, size_t commandLength, uint8_t* data, size_t length) {
+    uint32_t start = micros();
+    while (digitalRead(LORA_BUSY_PIN) == HIGH) {
+        if (micros() - start > RADIO_BUSY_TIMEOUT_US) {
+            return false;
+        }
+    }
+    
+    SPI.beginTransaction(SPISettings(2000000, MSBFIRST, SPI_MODE0));
+    digitalWrite(LORA_CS_PIN, LOW);
+    for (size_t i = 0; i < commandLength; i++) {
+        SPI.transfer(command[i]);
+    }
+    for (size_t i = 0; i < length; i++) {
+        data[i] = SPI.transfer(RADIOLIB_SX126X_CMD_NOP);
+    }
+    digitalWrite(LORA_CS_PIN, HIGH);
+    SPI.endTransaction();
+    return true;
+}
+
 LoRaCommunication::LoRaCommunication() : 
     // For Heltec WiFi LoRa 32 V3 with original schematic pins
     // The pin discovery test confirmed these are the correct pins
     lora(new Module(LORA_CS_PIN, LORA_DIO1_PIN, LORA_RST_PIN, LORA_BUSY_PIN, SPI, SPISettings(2000000, MSBFIRST, SPI_MODE0))),
-    isInitialized(false) {
+    isInitialized(false),
+    radioMutex(nullptr),
+    wakeStats(),
+    txErrors(),
+    txErrorsReported(),
+    deviceId(LORA_DEVICE_ID),
+    txState(TX_IDLE),
+    txMode(TX_MODE_SINGLE),
+    txStatus(SEND_IDLE),
+    txLength(0),
+    txMessageId(0),
+    txAttempt(0),
+    txExpectAck(false),
+    txPriority(TX_PRIORITY_NORMAL),
+    txStartTime(0),
+    txStartUs(0),
+    txDoneUs(0),
+    firstTxUs(0),
+    txDeadline(0),
+    lastResult(),
+    sendCallback(nullptr),
+    windowedMode(LORA_ARQ_WINDOW > 0),
+    burstRemaining(0),
+    transferCallback(nullptr),
+    nextTransferId(0),
+    fecData(LORA_FEC_DATA),
+    fecParity(LORA_FEC_PARITY),
+    ackRttUs(0),
+    lbtBusyScans(0),
+    lbtSlotMs(0),
+    lbtStats(),
+    adrState(ADR_IDLE),
+    linkParams(LinkRate::defaults(LORA_BANDWIDTH, LORA_SPREADING_FACTOR, LORA_CODING_RATE, LORA_POWER)),
+    previousParams(linkParams),
+    pendingParams(linkParams),
+    pendingPacked(0),
+    failedSends(0),
+    tdmaSlot(WIRE_NO_SLOT),
+    tdmaSlotAt(0),
+    tdmaContention(false),
+    tdmaInSlot(false),
+    tdmaListen(false),
+    tdmaAwake(false),
+    tdmaSearching(false),
+    tdmaSearchFailed(false),
+    tdmaSearchFailedAt(0),
+    tdmaWakeAt(0),
+    tdmaWindowEnd(0),
+    tdmaListenFrom(0),
+    tdmaAirtimeUs(0),
+    beaconLength(TDMA_MAX_BEACON_SIZE),
+    hopPlan(Hopping::initialPlan(0)),
+    hopKnown(false),
+    hopHeardAt(0),
+    hopChannel(HOP_HOME),
+    txChannel(HOP_HOME),
+    radioChannel(HOP_HOME),
+    channelStats() {
+    arq.setWindowSize(LORA_ARQ_WINDOW);
+    dutyCycle.setLimit(LORA_DUTY_CYCLE_PERMILLE);
     // Initialize SPI explicitly for ESP32-S3 with the schematic pin configuration
     SPI.begin(LORA_SCK_PIN, LORA_MISO_PIN, LORA_MOSI_PIN, LORA_CS_PIN); // SCK, MISO, MOSI, SS
 }
 
-bool LoRaCommunication::begin() {
+bool LoRaCommunication::begin(bool warm) {
     // Initialize the LoRa module
     Serial.print(F("Initializing LoRa module with correct pin configuration... "));
     
@@ -31,30 +134,49 @@ bool LoRaCommunication::begin() {
     
     digitalWrite(LORA_CS_PIN, HIGH); // Deselect chip
     
-    // Reset the module before initializing (full reset sequence for SX1262)
-    digitalWrite(LORA_RST_PIN, LOW);
-    delay(10);
-    digitalWrite(LORA_RST_PIN, HIGH);
-    delay(100);
+    // Reset the module before initializing (full reset sequence for SX1262).
+    // After deep sleep the module is in the sleep mode we left it in, and
+    // lora.begin() resets it anyway.
+    if (!warm) {
+        digitalWrite(LORA_RST_PIN, LOW);
+        delay(10);
+        digitalWrite(LORA_RST_PIN, HIGH);
+        delay(100);
+    }
+    
+    // After deep sleep, start on the settings ADR picked: the base is still on them
+    if (warm && LinkRate::isValid(savedRadio.linkParams)) {
+        linkParams = savedRadio.linkParams;
+    }
     
-    int state = lora.begin();
+    int state = initRadio();
     if (state != RADIOLIB_ERR_NONE) {
         Serial.print(F("Failed! Error code: "));
         Serial.println(state);
         return false;
     }
     
-    // Configure the module
-    lora.setFrequency(LORA_FREQUENCY);
-    lora.setBandwidth(LORA_BANDWIDTH);
-    lora.setSpreadingFactor(LORA_SPREADING_FACTOR);
-    lora.setCodingRate(LORA_CODING_RATE);
-    lora.setSyncWord(LORA_SYNC_WORD);
-    lora.setOutputPower(LORA_POWER);
-    lora.setPreambleLength(LORA_PREAMBLE_LENGTH);
+    // TX done is handled as soon as DIO1 signals it
+    radioMutex = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(txTask, "lora_tx", TX_TASK_STACK_SIZE, this,
+                            TX_TASK_PRIORITY, &txTaskHandle, TX_TASK_CORE);
     
-    if (LORA_ENABLE_CRC) {
-        lora.setCRC(true);
+    // Unique per chip: the device-specific half of the factory MAC address
+    if (deviceId == 0) {
+        deviceId = (uint32_t)(ESP.getEfuseMac() >> 24) & 0xFFFFFF;
+    }
+    Serial.print(F("Device ID "));
+    Serial.print(deviceId, HEX);
+    Serial.print(F(", "));
+    
+    if (warm) {
+        // Carry on where we were before deep sleep: IDs keep counting
+        nextMessageId = savedRadio.nextMessageId;
+        nextTransferId = savedRadio.nextTransferId;
+    } else {
+        // Transfer IDs start somewhere new after every reboot, so the base can't
+        // mistake a new transfer for the rest of one it has half of
+        nextTransferId = esp_random();
     }
     
     Serial.println(F("LoRa module initialized!"));
@@ -62,113 +184,580 @@ bool LoRaCommunication::begin() {
     return true;
 }
 
-bool LoRaCommunication::sendMessage(const char* type, JsonDocument& payload, int* rssi, float* snr) {
+bool LoRaCommunication::sendMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload,
+                                     int* rssi, float* snr) {
+    // Start the send and pump the state machine until it completes
+    if (!startSend(message, metrics, payload)) {
+        return false;
+    }
+    
+    // Waits out a duty-cycle deferral too
+    while (txPending()) {
+        poll();
+        delay(1);
+    }
+    
+    // Report signal quality of the acknowledgment
+    if (rssi != nullptr) {
+        *rssi = lastResult.rssi;
+    }
+    if (snr != nullptr) {
+        *snr = lastResult.snr;
+    }
+    
+    return lastResult.success;
+}
+
+bool LoRaCommunication::startSend(const MessageSchema& message, const MetricRecord* metrics, const char* payload,
+                                  uint32_t* messageId) {
+    if (!isInitialized) {
+        Serial.println(F("LoRa module not initialized"));
+        return false;
+    }
+    
+    // Only one send in flight at a time
+    if (txPending()) {
+        Serial.println(F("LoRa send already in progress"));
+        return false;
+    }
+    
+    // Build the binary frame
+    txLength = buildMessage(txBuffer, sizeof(txBuffer), message, metrics, payload, &txMessageId);
+    if (txLength == 0) {
+        Serial.println(F("Failed to encode message"));
+        return false;
+    }
+    
+    if (messageId != nullptr) {
+        *messageId = txMessageId;
+    }
+    
+    // Acks (pong) are fire-and-forget
+    beginSend(message, message.type != WIRE_TYPE_PONG);
+    return true;
+}
+
+bool LoRaCommunication::startBatch(const SampleBatch& batch, uint32_t* messageId) {
+    return startSamples(batch.data(), batch.length(), batch.count(), messageId);
+}
+
+bool LoRaCommunication::startSamples(const uint8_t* samples, size_t samplesLength, uint8_t count, uint32_t* messageId) {
     if (!isInitialized) {
         Serial.println(F("LoRa module not initialized"));
         return false;
     }
     
-    // Create the message document
-    StaticJsonDocument<MAX_PACKET_SIZE> doc;
+    if (count == 0) {
+        return false;
+    }
     
-    // Build the message
-    buildMessage(doc, type, payload);
+    if (windowedMode ? arq.isFull() : txPending()) {
+        Serial.println(windowedMode ? F("LoRa send window full") : F("LoRa send already in progress"));
+        return false;
+    }
     
-    // Serialize the JSON document to a string
-    char buffer[MAX_PACKET_SIZE];
-    size_t bytes = serializeJson(doc, buffer, MAX_PACKET_SIZE);
+    // Data frame header followed by the already encoded samples
+    uint8_t buffer[MAX_PACKET_SIZE];
+    uint32_t id = getNextMessageId();
+    size_t length = WireFormat::writeHeader(buffer, sizeof(buffer), WIRE_TYPE_DATA, LORA_TDMA_ENABLE ? WIRE_FLAG_TDMA : 0,
+                                            id, millis() / 1000);
+    if (length == 0 || length + samplesLength > sizeof(buffer)) {
+        Serial.println(F("Failed to encode batch"));
+        return false;
+    }
+    memcpy(buffer + length, samples, samplesLength);
+    length += samplesLength;
     
-    // Send the message with retries
-    for (int attempt = 0; attempt < MAX_RETRIES; attempt++) {
-        // Print debug info
-        Serial.print(F("Sending message (attempt "));
-        Serial.print(attempt + 1);
-        Serial.print(F("): "));
-        Serial.println(buffer);
-        
-        // Transmit the packet
-        int state = lora.transmit(buffer, bytes);
-        if (state != RADIOLIB_ERR_NONE) {
-            Serial.print(F("Transmission failed! Error code: "));
-            Serial.println(state);
-            delay(100 * (attempt + 1));  // Exponential backoff
-            continue;
+    // Tell the base who we are
+    size_t n = WireFormat::writeDeviceId(buffer + length, sizeof(buffer) - length, deviceId);
+    if (n == 0) {
+        Serial.println(F("Failed to encode batch"));
+        return false;
+    }
+    length += n;
+    
+    if (windowedMode) {
+        if (!arq.enqueue(buffer, length, id)) {
+            Serial.println(F("Failed to queue batch"));
+            return false;
         }
-        
-        // Wait for acknowledgment if this is not an ack itself
-        if (strcmp(type, MSG_TYPE_PONG) != 0) {
-            if (waitForAck(doc["id"], ACK_TIMEOUT, rssi, snr)) {
-                return true;
+    } else {
+        memcpy(txBuffer, buffer, length);
+        txLength = length;
+        txMessageId = id;
+        beginSend(Schema::DATA, true);
+    }
+    
+    Serial.print(F("Batched "));
+    Serial.print(count);
+    Serial.print(F(" samples into #"));
+    Serial.print(id);
+    Serial.print(F(", "));
+    Serial.print(length);
+    Serial.println(F(" bytes"));
+    
+    if (messageId != nullptr) {
+        *messageId = id;
+    }
+    return true;
+}
+
+void LoRaCommunication::beginSend(const MessageSchema& message, bool expectAck) {
+    txMode = TX_MODE_SINGLE;
+    txExpectAck = expectAck;
+    txAttempt = 0;
+    
+    // Pings are diagnostics; pongs answer the base like an ACK
+    if (message.type == WIRE_TYPE_PING) {
+        txPriority = TX_PRIORITY_LOW;
+    } else if (message.type == WIRE_TYPE_PONG) {
+        txPriority = TX_PRIORITY_HIGH;
+    } else {
+        txPriority = TX_PRIORITY_NORMAL;
+    }
+    txStartTime = millis();
+    txStartUs = micros();
+    txStatus = SEND_IN_PROGRESS;
+    
+    Serial.print(F("Sending "));
+    Serial.print(message.name);
+    Serial.print(F(" #"));
+    Serial.print(txMessageId);
+    Serial.print(F(", "));
+    Serial.print(txLength);
+    Serial.println(F(" bytes"));
+    
+    startAttempt();
+}
+
+void LoRaCommunication::poll() {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    
+    switch (txState) {
+        case TX_IDLE:
+            // Start the next burst if windowed frames are waiting
+            queueFragments();
+            if (arq.nextToSend() >= 0) {
+                startBurst();
             }
-        } else {
-            // For acks (pong), no need to wait for response
-            return true;
+            break;
+            
+        case TX_TRANSMITTING:
+            // Normally the TX task has been here first; this catches a TX done
+            // that came before txState was set
+            if (dio1Fired) {
+                onTxDone();
+            }
+            break;
+            
+        case TX_SENT:
+            completeSend(true, 0, 0.0);
+            break;
+            
+        case TX_FAILED:
+            reportTxErrors();
+            retryOrFail();
+            break;
+            
+        case TX_WAIT_ACK: {
+            if (dio1Fired) {
+                dio1Fired = false;
+                
+                uint8_t buffer[MAX_PACKET_SIZE];
+                size_t length = 0;
+                int rssi = 0;
+                float snr = 0.0;
+                FrameHeader header;
+                AckFrame ack;
+                // The base answers within the window opened by our own TX done,
+                // so every ACK times exactly one exchange, retries included
+                ackRttUs = dio1At - txDoneUs;
+                if (readRaw(buffer, &length, &rssi, &snr)) {
+                    // Stop-and-wait: fixed ACK echoing our message ID
+                    if (txMode == TX_MODE_SINGLE && WireFormat::decodeAck(buffer, length, ack) && ack.id == txMessageId) {
+                        Serial.print(F("Acknowledgment received, uplink RSSI "));
+                        Serial.print(ack.rssi);
+                        Serial.print(F(" dBm, SNR "));
+                        Serial.print(ack.snr);
+                        Serial.print(F(" dB, turnaround "));
+                        Serial.print(ack.turnaroundUs);
+                        Serial.print(F(" us, RTT "));
+                        Serial.print(ackRttUs);
+                        Serial.println(F(" us"));
+                        lora.standby();
+                        rttStats.record(ackRttUs);
+                        adrOnAck(ack.flags, ack.linkParams);
+                        tdmaOnAck(ack.flags, ack.slot);
+                        hopRecord(true, rssi);
+                        completeSend(true, rssi, snr, &ack);
+                        break;
+                    }
+                    
+                    // Windowed: block ACK for the burst
+                    if (txMode == TX_MODE_WINDOW && WireFormat::readHeader(buffer, length, header) > 0 &&
+                        header.type == WIRE_TYPE_BLOCK_ACK) {
+                        lora.standby();
+                        rttStats.record(ackRttUs);
+                        hopRecord(true, rssi);
+                        handleBlockAck(buffer, length, rssi, snr);
+                        break;
+                    }
+                }
+                
+                // Not our acknowledgment, keep listening
+                lora.startReceive();
+            }
+            
+            if ((long)(millis() - txDeadline) >= 0) {
+                Serial.println(F("Acknowledgment timeout"));
+                lora.standby();
+                hopRecord(false, 0);
+                retryOrFail();
+            }
+            break;
         }
+            
+        case TX_TDMA_WAIT: {
+            int64_t now = esp_timer_get_time();
+            
+            // Radio out of sleep in time for the slot or beacon
+            if (!tdmaAwake && tdmaWakeAt - now <= TDMA_RADIO_WAKE_US) {
+                wakeRadio();
+                tune(tdmaListen ? HOP_HOME : hopChannel);
+                tdmaAwake = true;
+            }
+            if (now < tdmaWakeAt) {
+                break;
+            }
+            
+            // Slept past it (light sleep, a long loop()); take the next one
+            if (now - tdmaWakeAt > TDMA_GUARD_BASE_US) {
+                tdma.countLateWakeup();
+                tdmaSchedule();
+                break;
+            }
+            
+            if (tdmaListen) {
+                tdmaOpenWindow(now, tdmaWindowEnd);
+            } else if (tdmaContention) {
+                // Shared slot: others may be waiting for it too
+                txChannel = hopChannel;
+                listenBeforeTalk(tdmaAirtimeUs);
+            } else {
+                tdmaInSlot = true;
+                txChannel = hopChannel;
+                channelClear();
+            }
+            break;
+        }
+            
+        case TX_TDMA_BEACON: {
+            if (dio1Fired) {
+                dio1Fired = false;
+                
+                uint8_t buffer[MAX_PACKET_SIZE];
+                size_t length = 0;
+                FrameHeader header;
+                if (readRaw(buffer, &length, nullptr, nullptr) && WireFormat::readHeader(buffer, length, header) > 0 &&
+                    header.type == WIRE_TYPE_BEACON) {
+                    tdmaOnBeacon(buffer, length);
+                    break;
+                }
+                
+                // Someone else's frame, keep listening
+                lora.startReceive();
+            }
+            
+            int64_t now = esp_timer_get_time();
+            if (now < tdmaWindowEnd) {
+                break;
+            }
+            
+            lora.standby();
+            tdma.recordListen(now - tdmaListenFrom);
+            if (tdmaSearching) {
+                // No base running TDMA in range (or it's out of budget)
+                Serial.println(F("TDMA: no beacon found, sending without a slot"));
+                tdmaSearchFailed = true;
+                tdmaSearchFailedAt = millis();
+            } else {
+                Serial.println(F("TDMA: beacon missed"));
+                tdma.onMissed();
+            }
+            tdmaSchedule();
+            break;
+        }
+            
+        case TX_CAD:
+            // Wait for the CAD-done interrupt
+            if (!dio1Fired) {
+                break;
+            }
+            dio1Fired = false;
+            onChannelScan(lora.getChannelScanResult() == RADIOLIB_LORA_DETECTED);
+            break;
+            
+        case TX_CAD_BACKOFF:
+            // Someone else was on air, scan again when the backoff is over
+            if ((long)(millis() - txDeadline) >= 0) {
+                startChannelScan();
+            }
+            break;
+            
+        case TX_BACKOFF:
+        case TX_DEFERRED:
+            // Wait out the retry delay or the duty cycle without blocking
+            if ((long)(millis() - txDeadline) >= 0) {
+                if (txMode == TX_MODE_WINDOW) {
+                    // Next poll starts a burst with whatever needs resending
+                    txState = TX_IDLE;
+                } else {
+                    startAttempt();
+                }
+            }
+            break;
     }
     
-    Serial.println(F("Failed to send message after max retries"));
-    return false;
+    xSemaphoreGive(radioMutex);
 }
 
-bool LoRaCommunication::receiveMessage(JsonDocument& doc, int* rssi, float* snr) {
+bool LoRaCommunication::isBusy() const {
+    switch (txState) {
+        case TX_DEFERRED:
+        case TX_CAD_BACKOFF:
+            return false;
+            
+        case TX_TDMA_WAIT:
+            // Only close to the wakeup, so loop() doesn't make us late
+            return tdmaWakeAt - esp_timer_get_time() <= (int64_t)TDMA_WAKE_LEAD_MS * 1000;
+            
+        case TX_TDMA_BEACON:
+            // A search can take a whole superframe
+            return !tdmaSearching;
+            
+        default:
+            return txPending();
+    }
+}
+
+bool LoRaCommunication::txPending() const {
+    return txState != TX_IDLE || arq.nextToSend() >= 0 || fragmenter.hasPending();
+}
+
+SendStatus LoRaCommunication::getSendStatus() const {
+    return txStatus;
+}
+
+const SendResult& LoRaCommunication::getLastResult() const {
+    return lastResult;
+}
+
+void LoRaCommunication::setSendCallback(SendCallback callback) {
+    sendCallback = callback;
+}
+
+bool LoRaCommunication::queueMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload,
+                                     uint32_t* messageId) {
     if (!isInitialized) {
         Serial.println(F("LoRa module not initialized"));
         return false;
     }
     
-    // Check if a packet is available
-    if (!lora.available()) {
+    if (arq.isFull()) {
+        Serial.println(F("LoRa send window full"));
         return false;
     }
     
-    // Receive the packet
-    String message = "";
-    int state = lora.readData(message);
+    // Encode now; poll() sends it in the next burst
+    uint8_t buffer[MAX_PACKET_SIZE];
+    uint32_t id = 0;
+    size_t length = buildMessage(buffer, sizeof(buffer) - ARQ_TRAILER_SIZE, message, metrics, payload, &id);
+    if (length == 0 || !arq.enqueue(buffer, length, id)) {
+        Serial.println(F("Failed to queue message"));
+        return false;
+    }
     
-    // Get RSSI and SNR
-    if (rssi != nullptr) {
-        *rssi = lora.getRSSI();
+    if (messageId != nullptr) {
+        *messageId = id;
     }
-    if (snr != nullptr) {
-        *snr = lora.getSNR();
+    return true;
+}
+
+bool LoRaCommunication::startTransfer(const uint8_t* data, size_t length, uint16_t* transferId) {
+    if (!isInitialized) {
+        Serial.println(F("LoRa module not initialized"));
+        return false;
     }
     
-    // Check for errors
-    if (state != RADIOLIB_ERR_NONE) {
-        Serial.print(F("Reception failed! Error code: "));
-        Serial.println(state);
+    // Fragments fill a TDMA slot, or a frame
+    uint16_t fragmentSize = LORA_TDMA_ENABLE ? FRAG_TDMA_DATA_SIZE : FRAG_DATA_SIZE;
+    if (LORA_TDMA_ENABLE && fecParity > 0) {
+        fragmentSize -= FEC_FIELD_OVERHEAD;
+    }
+    uint16_t id = nextTransferId;
+    if (!fragmenter.start(data, length, id, fragmentSize, fecData, fecParity)) {
+        Serial.println(fragmenter.isActive() ? F("LoRa transfer already in progress") : F("Transfer size out of range"));
         return false;
     }
+    nextTransferId++;
     
-    // Print debug info
-    Serial.print(F("Received: "));
-    Serial.println(message);
+    Serial.print(F("Transfer "));
+    Serial.print(id);
+    Serial.print(F(", "));
+    Serial.print(length);
+    Serial.print(F(" bytes in "));
+    Serial.print(Fragment::count(length, fragmentSize));
+    Serial.print(F(" fragments"));
+    if (fecParity > 0) {
+        Serial.print(F(", FEC "));
+        Serial.print(fecParity);
+        Serial.print(F("/"));
+        Serial.print(fecData);
+    }
+    Serial.println();
     
-    // Parse the JSON document
-    DeserializationError error = deserializeJson(doc, message);
-    if (error) {
-        Serial.print(F("JSON parsing failed: "));
-        Serial.println(error.c_str());
+    // poll() queues the fragments as the window has room
+    queueFragments();
+    
+    if (transferId != nullptr) {
+        *transferId = id;
+    }
+    return true;
+}
+
+void LoRaCommunication::setTransferCallback(TransferCallback callback) {
+    transferCallback = callback;
+}
+
+bool LoRaCommunication::setTransferFec(uint8_t dataFragments, uint8_t parityFragments) {
+    if (parityFragments > 0 &&
+        (parityFragments > FEC_MAX_PARITY || dataFragments < parityFragments || dataFragments > FEC_MAX_DATA)) {
         return false;
     }
+    fecData = dataFragments;
+    fecParity = parityFragments;
+    return true;
+}
+
+const FragmentStats& LoRaCommunication::getFragmentStats() const {
+    return fragmenter.getStats();
+}
+
+void LoRaCommunication::queueFragments() {
+    // Fragments of groups the base can already decode
+    uint32_t cancelled;
+    while (fragmenter.nextCancelled(&cancelled)) {
+        arq.cancel(cancelled);
+    }
     
-    // If this is a ping message, send a pong automatically
-    if (doc.containsKey("type") && strcmp(doc["type"], MSG_TYPE_PING) == 0) {
-        Serial.println(F("Automatic PONG response"));
-        
-        // Create a pong response with the same ID
-        StaticJsonDocument<200> response;
-        response["type"] = MSG_TYPE_PONG;
-        response["id"] = doc["id"];
-        response["timestamp"] = millis() / 1000;
-        
-        // Add metrics if present
-        if (doc.containsKey("metrics")) {
-            response["metrics"] = doc["metrics"];
+    FragmentInfo fragment;
+    while (!arq.isFull() && fragmenter.peek(fragment)) {
+        uint8_t buffer[MAX_PACKET_SIZE];
+        uint32_t id = getNextMessageId();
+        size_t length = Fragment::encode(buffer, sizeof(buffer) - ARQ_TRAILER_SIZE, id, millis() / 1000,
+                                         LORA_TDMA_ENABLE ? WIRE_FLAG_TDMA : 0, deviceId, fragment);
+        if (length == 0 || !arq.enqueue(buffer, length, id, fragmenter.isOneShot())) {
+            Serial.println(F("Failed to queue fragment"));
+            return;
         }
-        
-        // Send the pong
-        sendMessage(MSG_TYPE_PONG, response);
+        fragmenter.queued(fragment, id);
+    }
+}
+
+void LoRaCommunication::setWindowSize(uint8_t size) {
+    windowedMode = size > 0;
+    if (windowedMode) {
+        arq.setWindowSize(size);
+    }
+}
+
+uint8_t LoRaCommunication::getWindowSize() const {
+    return windowedMode ? arq.getWindowSize() : 0;
+}
+
+const ArqStats& LoRaCommunication::getArqStats() const {
+    return arq.getStats();
+}
+
+float LoRaCommunication::getGoodput() const {
+    return arq.getGoodput();
+}
+
+uint32_t LoRaCommunication::getDeviceId() const {
+    return deviceId;
+}
+
+const LinkParams& LoRaCommunication::getLinkParams() const {
+    return linkParams;
+}
+
+int64_t LoRaCommunication::getFirstTxUs() const {
+    return firstTxUs;
+}
+
+uint32_t LoRaCommunication::getAirtimePerHourMs() {
+    return dutyCycle.getAirtimeUsedMs();
+}
+
+const DutyStats& LoRaCommunication::getDutyStats() const {
+    return dutyCycle.getStats();
+}
+
+const LatencyStats& LoRaCommunication::getRttStats() const {
+    return rttStats;
+}
+
+const LatencyStats& LoRaCommunication::getDeliveryStats() const {
+    return deliveryStats;
+}
+
+const LbtStats& LoRaCommunication::getLbtStats() const {
+    return lbtStats;
+}
+
+const TdmaSync& LoRaCommunication::getTdma() const {
+    return tdma;
+}
+
+uint16_t LoRaCommunication::getTdmaSlot() const {
+    return tdmaSlot;
+}
+
+const HopPlan& LoRaCommunication::getHopPlan() const {
+    return hopPlan;
+}
+
+const ChannelStats& LoRaCommunication::getChannelStats(uint8_t channel) const {
+    return channelStats[channel < HOP_CHANNEL_COUNT ? channel : 0];
+}
+
+bool LoRaCommunication::receiveMessage(JsonDocument& doc, int* rssi, float* snr) {
+    if (!isInitialized) {
+        Serial.println(F("LoRa module not initialized"));
+        return false;
+    }
+    
+    // Receiving while a send is in flight would steal its acknowledgment (or beacon)
+    if (isBusy() || txState == TX_TDMA_BEACON) {
+        return false;
+    }
+    
+    // Check if a packet is available
+    if (!dio1Fired) {
+        return false;
+    }
+    dio1Fired = false;
+    
+    if (!readFrame(doc, rssi, snr)) {
+        lora.startReceive();
+        return false;
+    }
+    
+    // If this is a ping message, send a pong automatically (frame type in
+    // the low nibble of the first byte, ACKs included)
+    if ((rxBuffer[0] & 0x0F) == WIRE_TYPE_PING) {
+        Serial.println(F("Automatic PONG response"));
+        sendMessage(Schema::PONG, nullptr);
     }
     
     return true;
@@ -180,121 +769,928 @@ int LoRaCommunication::ping(int* rssi, float* snr) {
         return -1;
     }
     
-    // Create ping message
-    StaticJsonDocument<200> ping;
-    
-    // Add empty metrics object
-    JsonObject metrics = ping.createNestedObject("metrics");
-    
-    // Record start time
-    unsigned long startTime = millis();
-    
     // Send ping
-    if (!sendMessage(MSG_TYPE_PING, ping, rssi, snr)) {
+    if (!sendMessage(Schema::PING, nullptr, nullptr, rssi, snr)) {
         return -1;  // Failed to get response
     }
     
-    // Calculate round-trip time
-    return millis() - startTime;
+    // Round-trip time of the exchange that got through, without earlier attempts
+    return (lastResult.rttUs + 500) / 1000;
 }
 
-bool LoRaCommunication::sendMetrics(JsonDocument& metrics) {
+bool LoRaCommunication::sendMetrics(const MetricRecord& metrics) {
     if (!isInitialized) {
         Serial.println(F("LoRa module not initialized"));
         return false;
     }
     
-    // Create the message
-    StaticJsonDocument<MAX_PACKET_SIZE> payload;
-    payload["metrics"] = metrics;
-    
     // Send the data message
-    return sendMessage(MSG_TYPE_DATA, payload);
+    return sendMessage(Schema::DATA, &metrics);
 }
 
-bool LoRaCommunication::sendStatus(const char* status, JsonDocument& metrics) {
+bool LoRaCommunication::startMetrics(MetricsWriter write, uint32_t* messageId) {
     if (!isInitialized) {
         Serial.println(F("LoRa module not initialized"));
         return false;
     }
     
-    // Create the message
-    StaticJsonDocument<MAX_PACKET_SIZE> payload;
-    payload["metrics"] = metrics;
-    payload["payload"] = status;
+    if (windowedMode ? arq.isFull() : txPending()) {
+        Serial.println(windowedMode ? F("LoRa send window full") : F("LoRa send already in progress"));
+        return false;
+    }
+    
+    // Encoded where it's sent from: the next window slot, or the transmit buffer
+    uint8_t* buffer = windowedMode ? arq.nextFrame() : txBuffer;
+    size_t size = windowedMode ? ARQ_FRAME_SIZE - ARQ_TRAILER_SIZE : sizeof(txBuffer);
+    uint32_t id = getNextMessageId();
+    Schema::FrameWriter frame(buffer, size, Schema::DATA, id, millis() / 1000, LORA_TDMA_ENABLE ? WIRE_FLAG_TDMA : 0);
+    write(frame);
+    
+    // Tell the base who we are
+    frame.deviceId(deviceId);
+    size_t length = frame.length();
+    if (length == 0) {
+        Serial.println(F("Failed to encode message"));
+        return false;
+    }
+    
+    if (windowedMode) {
+        if (!arq.enqueue(buffer, length, id)) {
+            Serial.println(F("Failed to queue message"));
+            return false;
+        }
+    } else {
+        txLength = length;
+        txMessageId = id;
+        beginSend(Schema::DATA, true);
+    }
+    
+    if (messageId != nullptr) {
+        *messageId = id;
+    }
+    return true;
+}
+
+bool LoRaCommunication::sendStatus(const char* status, const MetricRecord& metrics) {
+    if (!isInitialized) {
+        Serial.println(F("LoRa module not initialized"));
+        return false;
+    }
     
     // Send the status message
-    return sendMessage(MSG_TYPE_STATUS, payload);
+    return sendMessage(Schema::STATUS, &metrics, status);
 }
 
 uint32_t LoRaCommunication::getNextMessageId() {
     return nextMessageId++;
 }
 
-void LoRaCommunication::sleep() {
+void LoRaCommunication::saveState() {
+    savedRadio.nextMessageId = nextMessageId;
+    savedRadio.nextTransferId = nextTransferId;
+    
+    // Settings still on probation haven't been shown to work; keep the
+    // ones they would roll back to
+    savedRadio.linkParams = adrState == ADR_PROBATION ? previousParams : linkParams;
+}
+
+void LoRaCommunication::sleep(bool retainConfig) {
     if (isInitialized) {
-        lora.sleep();
-        Serial.println(F("LoRa module in sleep mode"));
+        lora.sleep(retainConfig);
+        Serial.println(retainConfig ? F("LoRa module in sleep mode") : F("LoRa module in cold sleep mode"));
     }
 }
 
 void LoRaCommunication::wakeup() {
     if (isInitialized) {
-        lora.standby();
+        wakeRadio();
         Serial.println(F("LoRa module woken up"));
     }
 }
 
+const RadioWakeStats& LoRaCommunication::getRadioWakeStats() const {
+    return wakeStats;
+}
+
+const TxErrorStats& LoRaCommunication::getTxErrorStats() const {
+    return txErrors;
+}
+
 SX1262* LoRaCommunication::getModule() {
     return &lora;
 }
 
-void LoRaCommunication::buildMessage(JsonDocument& doc, const char* type, const JsonDocument& payload) {
-    // Set message type
-    doc["type"] = type;
+size_t LoRaCommunication::buildMessage(uint8_t* buffer, size_t size, const MessageSchema& message, const MetricRecord* metrics,
+                                       const char* payload, uint32_t* messageId) {
+    // Assign the message ID
+    *messageId = getNextMessageId();
+    
+    // Encode header (type, ID, seconds since boot, TDMA slot request) followed by metrics and payload
+    Schema::FrameWriter frame(buffer, size, message, *messageId, millis() / 1000, LORA_TDMA_ENABLE ? WIRE_FLAG_TDMA : 0);
+    if (metrics != nullptr) {
+        frame.add(*metrics);
+    }
+    if (payload != nullptr) {
+        frame.payload(payload);
+    }
+    
+    // Tell the base who we are
+    frame.deviceId(deviceId);
+    return frame.length();
+}
+
+bool LoRaCommunication::readRaw(uint8_t* buffer, size_t* length, int* rssi, float* snr) {
+    // Receive the packet into a byte buffer (binary frames may contain zeros)
+    *length = lora.getPacketLength();
+    if (*length > MAX_PACKET_SIZE) {
+        *length = MAX_PACKET_SIZE;
+    }
+    int state = lora.readData(buffer, *length);
+    
+    // Get RSSI and SNR
+    if (rssi != nullptr) {
+        *rssi = lora.getRSSI();
+    }
+    if (snr != nullptr) {
+        *snr = lora.getSNR();
+    }
+    
+    // Check for errors
+    if (state != RADIOLIB_ERR_NONE) {
+        Serial.print(F("Reception failed! Error code: "));
+        Serial.println(state);
+        return false;
+    }
+    
+    return true;
+}
+
+bool LoRaCommunication::readFrame(JsonDocument& doc, int* rssi, float* snr) {
+    size_t length = 0;
+    if (!readRaw(rxBuffer, &length, rssi, snr)) {
+        return false;
+    }
+    
+    // Decode the binary frame in place
+    if (!WireFormat::decode(rxBuffer, length, doc)) {
+        Serial.print(F("Frame decoding failed, "));
+        Serial.print(length);
+        Serial.println(F(" bytes"));
+        return false;
+    }
+    
+    // Print debug info
+    Serial.print(F("Received: "));
+    serializeJson(doc, Serial);
+    Serial.println();
+    
+    return true;
+}
+
+void LoRaCommunication::startBurst() {
+    // Everything in the window that still needs sending goes in this burst,
+    // as far as the duty-cycle budget allows
+    txMode = TX_MODE_WINDOW;
+    txPriority = TX_PRIORITY_NORMAL;
+    uint16_t lengths[ARQ_QUEUE_SIZE];
+    uint8_t pending = arq.pendingLengths(lengths, ARQ_QUEUE_SIZE);
+    
+    uint32_t airtime = frameAirtimeUs(lengths[0] + ARQ_TRAILER_SIZE);
+    if (dutyCycle.check(airtime, TX_PRIORITY_NORMAL) != DUTY_SEND) {
+        deferSend(airtime, TX_PRIORITY_NORMAL);
+        return;
+    }
+    
+    // A TDMA slot has room for one TDMA_SLOT_FRAME_SIZE frame's airtime
+    uint32_t burstLimit = LORA_TDMA_ENABLE ? frameAirtimeUs(TDMA_SLOT_FRAME_SIZE) : UINT32_MAX;
+    
+    burstRemaining = 1;
+    while (burstRemaining < pending) {
+        airtime += frameAirtimeUs(lengths[burstRemaining] + ARQ_TRAILER_SIZE);
+        if (airtime > burstLimit || dutyCycle.waitMs(airtime, TX_PRIORITY_NORMAL) > 0) {
+            break;
+        }
+        burstRemaining++;
+    }
+    
+    Serial.print(F("Sending burst of "));
+    Serial.print(burstRemaining);
+    Serial.print(F(" frames, "));
+    Serial.print(arq.count());
+    Serial.println(F(" queued"));
+    
+    // The rest of the burst follows back to back, so only the first frame listens
+    accessChannel(frameAirtimeUs(lengths[0] + ARQ_TRAILER_SIZE));
+}
+
+void LoRaCommunication::sendNextInBurst() {
+    int slot = arq.nextToSend();
+    if (slot < 0) {
+        txState = TX_IDLE;
+        return;
+    }
     
-    // Set message ID
-    doc["id"] = getNextMessageId();
+    // The last frame of the burst asks for the block ACK
+    burstRemaining--;
+    txLength = arq.prepare(slot, burstRemaining == 0, txBuffer, sizeof(txBuffer));
     
-    // Set timestamp (seconds since boot)
-    doc["timestamp"] = millis() / 1000;
+    dio1Fired = false;
+    int state = txLength > 0 ? transmit(txBuffer, txLength) : RADIOLIB_ERR_PACKET_TOO_LONG;
+    if (state != RADIOLIB_ERR_NONE) {
+        txErrors.transmitErrors++;
+        txErrors.lastError = state;
+        
+        // May be in the TX task; poll() reports the error and retries
+        txState = TX_FAILED;
+        return;
+    }
     
-    // Copy metrics if present
-    if (payload.containsKey("metrics")) {
-        doc["metrics"] = payload["metrics"];
+    txState = TX_TRANSMITTING;
+}
+
+void LoRaCommunication::handleBlockAck(const uint8_t* buffer, size_t length, int rssi, float snr) {
+    uint32_t cumulative = 0;
+    uint32_t bitmap = 0;
+    if (!WireFormat::findRawField(buffer, length, FIELD_ACK_CUMULATIVE, &cumulative)) {
+        retryOrFail();
+        return;
     }
+    WireFormat::findRawField(buffer, length, FIELD_ACK_BITMAP, &bitmap);
+    
+    Serial.print(F("Block ACK up to #"));
+    Serial.print(cumulative);
+    Serial.print(F(", bitmap 0x"));
+    Serial.println(bitmap, HEX);
     
-    // Copy payload if present
-    if (payload.containsKey("payload")) {
-        doc["payload"] = payload["payload"];
+    // Slide the window and report delivered frames
+    ArqCompletion results[ARQ_QUEUE_SIZE];
+    uint8_t count = arq.onBlockAck(cumulative, bitmap, results, ARQ_QUEUE_SIZE);
+    
+    // Header flags carry the base's keyframe request and ADR handshake
+    bool resync = buffer[1] & WIRE_ACK_FLAG_RESYNC;
+    uint32_t packedParams = 0;
+    WireFormat::findRawField(buffer, length, FIELD_LINK_PARAMS, &packedParams);
+    adrOnAck(buffer[1], packedParams);
+    uint32_t slot = WIRE_NO_SLOT;
+    WireFormat::findRawField(buffer, length, FIELD_TDMA_SLOT, &slot);
+    tdmaOnAck(buffer[1], slot);
+    
+    txState = TX_IDLE;
+    for (uint8_t i = 0; i < count; i++) {
+        notifyCompletion(results[i], rssi, snr, resync);
     }
 }
 
-bool LoRaCommunication::waitForAck(uint32_t messageId, int timeout, int* rssi, float* snr) {
-    // Wait for acknowledgment
-    unsigned long startTime = millis();
+void LoRaCommunication::startAttempt() {
+    // Stay within the regulatory duty cycle
+    uint32_t airtime = frameAirtimeUs(txLength);
+    switch (dutyCycle.check(airtime, txPriority)) {
+        case DUTY_DROP:
+            Serial.println(F("Duty cycle budget exhausted, frame dropped"));
+            completeSend(false, 0, 0.0);
+            return;
+            
+        case DUTY_DEFER:
+            deferSend(airtime, txPriority);
+            return;
+            
+        case DUTY_SEND:
+            break;
+    }
     
-    while (millis() - startTime < timeout) {
-        // Check for incoming packet
-        if (lora.available()) {
-            // Receive the packet
-            StaticJsonDocument<MAX_PACKET_SIZE> response;
-            if (receiveMessage(response, rssi, snr)) {
-                // Check if this is a pong message with the correct ID
-                if (response.containsKey("type") && 
-                    strcmp(response["type"], MSG_TYPE_PONG) == 0 && 
-                    response.containsKey("id") && 
-                    response["id"] == messageId) {
-                    Serial.println(F("Acknowledgment received"));
-                    return true;
-                }
+    txAttempt++;
+    accessChannel(airtime);
+}
+
+void LoRaCommunication::onTxDone() {
+    dio1Fired = false;
+    txDoneUs = dio1At;
+    lora.finishTransmit();
+    
+    // Rest of the burst goes out back to back
+    if (txMode == TX_MODE_WINDOW && burstRemaining > 0) {
+        sendNextInBurst();
+        return;
+    }
+    
+    if (txMode == TX_MODE_SINGLE && !txExpectAck) {
+        txState = TX_SENT;
+        return;
+    }
+    
+    // Open the receive window for the acknowledgment
+    int state = lora.startReceive();
+    if (state != RADIOLIB_ERR_NONE) {
+        txErrors.ackWindowErrors++;
+        txErrors.lastError = state;
+        txState = TX_FAILED;
+        return;
+    }
+    txState = TX_WAIT_ACK;
+    txDeadline = millis() + ackTimeout();
+}
+
+void LoRaCommunication::sendAttempt() {
+    // Start transmitting; completion is signalled on DIO1
+    dio1Fired = false;
+    int state = transmit(txBuffer, txLength);
+    if (state != RADIOLIB_ERR_NONE) {
+        txErrors.transmitErrors++;
+        txErrors.lastError = state;
+        reportTxErrors();
+        retryOrFail();
+        return;
+    }
+    
+    txState = TX_TRANSMITTING;
+}
+
+void LoRaCommunication::reportTxErrors() {
+    if (txErrors.transmitErrors != txErrorsReported.transmitErrors) {
+        Serial.print(F("Transmission failed! Error code: "));
+        Serial.println(txErrors.lastError);
+    }
+    if (txErrors.ackWindowErrors != txErrorsReported.ackWindowErrors) {
+        Serial.print(F("Failed to open ACK window, error code: "));
+        Serial.println(txErrors.lastError);
+    }
+    txErrorsReported = txErrors;
+}
+
+void LoRaCommunication::accessChannel(uint32_t airtimeUs) {
+    tdmaInSlot = false;
+    txChannel = HOP_HOME;
+    
+    // Data waits for our slot; pings and pongs go out straight away
+    if (LORA_TDMA_ENABLE && txPriority == TX_PRIORITY_NORMAL) {
+        tdmaAirtimeUs = airtimeUs;
+        tdmaSchedule();
+        return;
+    }
+    tune(HOP_HOME);
+    listenBeforeTalk(airtimeUs);
+}
+
+void LoRaCommunication::tdmaSchedule() {
+    int64_t now = esp_timer_get_time();
+    const SuperframeLayout& layout = tdma.getLayout();
+    
+    if (!tdma.isSynced()) {
+        // Nothing heard when we last looked: send without a slot for a while
+        if (tdmaSearchFailed && millis() - tdmaSearchFailedAt < TDMA_SEARCH_RETRY_MS) {
+            tdma.countFallback();
+            tune(HOP_HOME);
+            listenBeforeTalk(tdmaAirtimeUs);
+            return;
+        }
+        
+        // Listen for a whole beacon period
+        Serial.println(F("TDMA: searching for a beacon"));
+        tdma.countSearch();
+        tdmaSearching = true;
+        tune(HOP_HOME);
+        tdmaOpenWindow(now, now + (int64_t)(TDMA_SUPERFRAME_MS + TDMA_SEARCH_SLACK_MS) * 1000);
+        return;
+    }
+    tdmaSearching = false;
+    tdmaSearchFailed = false;
+    
+    // Our slot is given away if the base doesn't hear us for TDMA_SLOT_EXPIRY superframes
+    if (tdmaSlot != WIRE_NO_SLOT && (tdmaSlot >= Tdma::dedicatedSlots(layout) ||
+                                     millis() - tdmaSlotAt >= (TDMA_SLOT_EXPIRY - 1) * layout.periodMs)) {
+        tdmaSlot = WIRE_NO_SLOT;
+    }
+    
+    // Without one of our own, a random shared slot; the ACK brings ours
+    tdmaContention = tdmaSlot == WIRE_NO_SLOT;
+    if (tdmaContention && layout.contentionSlots == 0) {
+        tdma.countFallback();
+        tune(HOP_HOME);
+        listenBeforeTalk(tdmaAirtimeUs);
+        return;
+    }
+    uint16_t slot = tdmaContention ? Tdma::dedicatedSlots(layout) + random(layout.contentionSlots) : tdmaSlot;
+    
+    // Transmit a guard into the first occurrence of the slot still ahead
+    uint32_t offset = Tdma::slotOffsetUs(layout, slot) + TDMA_GUARD_MS * 1000;
+    uint32_t n = tdma.superframeAfter(now + TDMA_RADIO_WAKE_US, offset);
+    int64_t txAt = tdma.beaconAt(n) + offset;
+    
+    // A new hop set is announced HOP_MASK_LEAD superframes ahead; past that
+    // since the last beacon heard, ours may be out of date
+    uint32_t superframe = tdma.getSequence() + n;
+    bool hopCurrent = !LORA_HOP_ENABLE || !hopKnown || superframe - hopHeardAt < HOP_MASK_LEAD;
+    hopChannel = LORA_HOP_ENABLE && hopKnown ? Hopping::channelFor(hopPlan, superframe, slot) : HOP_HOME;
+    
+    if (tdma.isLayoutCurrent() && hopCurrent && tdma.guardUs(txAt) <= TDMA_GUARD_MS * 1000) {
+        tdmaListen = false;
+        tdmaWakeAt = txAt;
+    } else {
+        // Our clock may be off by more than the slot's guard (or the layout
+        // or hop set changed): hear the next beacon first, then take the slot after it
+        int64_t beaconAt = tdma.beaconAt(tdma.superframeAfter(now + TDMA_RADIO_WAKE_US, 0));
+        uint32_t guard = tdma.guardUs(beaconAt);
+        tdmaListen = true;
+        tdmaWakeAt = beaconAt - guard > now + TDMA_RADIO_WAKE_US ? beaconAt - guard : now + TDMA_RADIO_WAKE_US;
+        
+        // The base sends up to TDMA_GUARD_MS late rather than skip a beacon
+        tdmaWindowEnd = beaconAt + beaconAirtimeUs() + guard + TDMA_GUARD_MS * 1000;
+    }
+    
+    lora.sleep(true);
+    tdmaAwake = false;
+    txState = TX_TDMA_WAIT;
+}
+
+void LoRaCommunication::tdmaOpenWindow(int64_t now, int64_t end) {
+    // RX done is signalled on DIO1
+    dio1Fired = false;
+    tdmaListenFrom = now;
+    tdmaWindowEnd = end;
+    if (lora.startReceive() != RADIOLIB_ERR_NONE) {
+        Serial.println(F("Failed to open beacon window"));
+    }
+    txState = TX_TDMA_BEACON;
+}
+
+void LoRaCommunication::tdmaOnBeacon(const uint8_t* buffer, size_t length) {
+    // Our clock at RX done, from the micros() the interrupt took
+    int64_t rxDoneAt = esp_timer_get_time() - (uint32_t)(micros() - dio1At);
+    
+    uint32_t sequence = 0;
+    uint32_t delayUs = 0;
+    SuperframeLayout layout;
+    if (!Tdma::decodeBeacon(buffer, length, &sequence, layout, &delayUs)) {
+        lora.startReceive();
+        return;
+    }
+    lora.standby();
+    tdma.recordListen(rxDoneAt - tdmaListenFrom);
+    
+    // Back to when the base meant to start it
+    int64_t startAt = rxDoneAt - Airtime::timeOnAirUs(linkParams, length, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC) - delayUs;
+    bool wasSynced = tdma.isSynced();
+    tdma.onBeacon(startAt, sequence, layout);
+    beaconLength = length;
+    
+    // Without a hop plan in it the base isn't hopping; slots stay on LORA_FREQUENCY
+    if (LORA_HOP_ENABLE) {
+        hopKnown = Hopping::readBeaconField(buffer, length, sequence, hopPlan);
+        hopHeardAt = sequence;
+    }
+    
+    if (!wasSynced) {
+        Serial.print(F("TDMA: synchronized, "));
+        Serial.print(layout.slotCount);
+        Serial.print(F(" slots of "));
+        Serial.print(layout.slotMs);
+        Serial.print(F(" ms every "));
+        Serial.print(layout.periodMs / 1000);
+        Serial.println(F(" s"));
+    }
+    
+    // Now take the slot
+    tdmaSchedule();
+}
+
+void LoRaCommunication::tdmaOnAck(uint8_t flags, uint16_t slot) {
+    if (!(flags & WIRE_ACK_FLAG_SLOT)) {
+        return;
+    }
+    
+    if (slot != tdmaSlot) {
+        Serial.print(F("TDMA: slot "));
+        if (slot == WIRE_NO_SLOT) {
+            Serial.println(F("none free"));
+        } else {
+            Serial.println(slot);
+        }
+    }
+    tdmaSlot = slot;
+    tdmaSlotAt = millis();
+}
+
+uint32_t LoRaCommunication::beaconAirtimeUs() const {
+    // A little longer than the last one, its sequence number grows
+    return Airtime::timeOnAirUs(linkParams, beaconLength + 2, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC);
+}
+
+int LoRaCommunication::initRadio() {
+    int64_t started = esp_timer_get_time();
+    
+    // All settings in one call: begin() with its defaults followed by each
+    // setter would calibrate for 434 MHz first and write the modulation
+    // parameters several times
+    int state = lora.begin(LORA_FREQUENCY, linkParams.bandwidth, linkParams.spreadingFactor, linkParams.codingRate,
+                           LORA_SYNC_WORD, linkParams.power, LORA_PREAMBLE_LENGTH);
+    if (state != RADIOLIB_ERR_NONE) {
+        return state;
+    }
+    
+    if (LORA_ENABLE_CRC) {
+        lora.setCRC(true);
+    }
+    radioChannel = HOP_HOME;
+    
+    // TX done and RX done are reported through DIO1
+    lora.setDio1Action(onDio1Interrupt);
+    
+    // What wakeRadio() expects to read back
+    readSignature(radioSignature);
+    
+    wakeStats.beginUs = esp_timer_get_time() - started;
+    return state;
+}
+
+void LoRaCommunication::wakeRadio() {
+    int64_t started = esp_timer_get_time();
+    lora.standby();
+    wakeStats.wakes++;
+    
+    // Warm sleep keeps the whole configuration. A reset or brownout loses
+    // all of it, and the packet type and sync word go back to their defaults.
+    uint8_t signature[RADIO_SIGNATURE_SIZE];
+    if (readSignature(signature) && memcmp(signature, radioSignature, sizeof(signature)) == 0) {
+        wakeStats.configKept++;
+    } else {
+        Serial.println(F("LoRa module lost its configuration, setting it up again"));
+        wakeStats.reinits++;
+        int state = initRadio();
+        if (state != RADIOLIB_ERR_NONE) {
+            Serial.print(F("Failed to set up LoRa module! Error code: "));
+            Serial.println(state);
+        }
+    }
+    
+    wakeStats.readyUs = esp_timer_get_time() - started;
+    if (wakeStats.readyUs > wakeStats.readyMaxUs) {
+        wakeStats.readyMaxUs = wakeStats.readyUs;
+    }
+}
+
+bool LoRaCommunication::readSignature(uint8_t* signature) {
+    const uint8_t getPacketType[] = { RADIOLIB_SX126X_CMD_GET_PACKET_TYPE, RADIOLIB_SX126X_CMD_NOP };
+    const uint8_t readSyncWord[] = {
+        RADIOLIB_SX126X_CMD_READ_REGISTER,
+        (uint8_t)(RADIOLIB_SX126X_REG_LORA_SYNC_WORD_MSB >> 8), (uint8_t)(RADIOLIB_SX126X_REG_LORA_SYNC_WORD_MSB & 0xFF),
+        RADIOLIB_SX126X_CMD_NOP
+    };
+    return readCommand(getPacketType, sizeof(getPacketType), signature, 1) &&
+           readCommand(readSyncWord, sizeof(readSyncWord), signature + 1, 2);
+}
+
+void LoRaCommunication::tune(uint8_t channel) {
+    if (!LORA_HOP_ENABLE || channel == radioChannel) {
+        return;
+    }
+    
+    // The image calibration done by begin() covers the whole band; skip it on every hop
+    float frequency = channel == HOP_HOME ? LORA_FREQUENCY : Hopping::frequencyMhz(channel);
+    int state = lora.setFrequency(frequency, false);
+    if (state != RADIOLIB_ERR_NONE) {
+        Serial.print(F("Failed to change channel! Error code: "));
+        Serial.println(state);
+        return;
+    }
+    radioChannel = channel;
+}
+
+void LoRaCommunication::hopRecord(bool acked, int rssi) {
+    if (txChannel == HOP_HOME) {
+        return;
+    }
+    
+    Hopping::record(channelStats[txChannel], acked);
+    if (acked) {
+        Hopping::recordRssi(channelStats[txChannel], rssi);
+    }
+    txChannel = HOP_HOME;
+}
+
+void LoRaCommunication::listenBeforeTalk(uint32_t airtimeUs) {
+    lbtBusyScans = 0;
+    lbtSlotMs = airtimeUs / 1000 + 1;
+    
+#if LORA_LBT_ENABLE
+    startChannelScan();
+#else
+    channelClear();
+#endif
+}
+
+void LoRaCommunication::startChannelScan() {
+    // CAD done is signalled on DIO1
+    dio1Fired = false;
+    if (lora.startChannelScan() != RADIOLIB_ERR_NONE) {
+        // Can't listen, talk anyway; the ACK and retries cover a collision
+        channelClear();
+        return;
+    }
+    
+    lbtStats.scans++;
+    txState = TX_CAD;
+}
+
+void LoRaCommunication::onChannelScan(bool busy) {
+    // Simulated contention exercises the backoff with a single remote
+    if (!busy && LBT_SIMULATE_BUSY_PERCENT > 0 && random(100) < LBT_SIMULATE_BUSY_PERCENT) {
+        busy = true;
+    }
+    
+    if (!busy) {
+        channelClear();
+        return;
+    }
+    
+    lbtStats.busy++;
+    lbtBusyScans++;
+    if (lbtBusyScans >= LBT_MAX_SCANS) {
+        // Don't starve; the ACK and retries cover a collision
+        lbtStats.forced++;
+        Serial.println(F("Channel still busy, transmitting anyway"));
+        channelClear();
+        return;
+    }
+    
+    // Randomized binary exponential backoff in units of our own frame's airtime
+    uint8_t exponent = lbtBusyScans < LBT_MAX_BACKOFF_EXPONENT ? lbtBusyScans : LBT_MAX_BACKOFF_EXPONENT;
+    uint32_t backoff = (random(1L << exponent) + 1) * lbtSlotMs;
+    lbtStats.backoffMs += backoff;
+    
+    Serial.print(F("Channel busy, backing off "));
+    Serial.print(backoff);
+    Serial.println(F(" ms"));
+    
+    txState = TX_CAD_BACKOFF;
+    txDeadline = millis() + backoff;
+}
+
+void LoRaCommunication::channelClear() {
+    if (txMode == TX_MODE_WINDOW) {
+        sendNextInBurst();
+    } else {
+        sendAttempt();
+    }
+}
+
+void LoRaCommunication::retryOrFail() {
+    // Windowed: probe with the oldest outstanding frame after a backoff
+    if (txMode == TX_MODE_WINDOW) {
+        ArqCompletion results[ARQ_QUEUE_SIZE];
+        uint8_t count = arq.onTimeout(results, ARQ_QUEUE_SIZE);
+        
+        txState = TX_BACKOFF;
+        txDeadline = millis() + retryBackoff(1);
+        for (uint8_t i = 0; i < count; i++) {
+            notifyCompletion(results[i], 0, 0.0);
+        }
+        
+        // Frames given up on count as one failed send; our slot may have been given away
+        if (count > 0) {
+            adrOnFailure();
+            tdmaSlot = WIRE_NO_SLOT;
+        }
+        return;
+    }
+    
+    if (txAttempt >= MAX_RETRIES) {
+        Serial.println(F("Failed to send message after max retries"));
+        adrOnFailure();
+        tdmaSlot = WIRE_NO_SLOT;
+        completeSend(false, 0, 0.0);
+        return;
+    }
+    
+    // Back off before the next attempt
+    txState = TX_BACKOFF;
+    txDeadline = millis() + retryBackoff(txAttempt);
+}
+
+int LoRaCommunication::transmit(const uint8_t* frame, size_t length) {
+    // Echo the accepted proposal so the base knows we're ready to switch
+    uint8_t buffer[MAX_PACKET_SIZE];
+    if (adrState == ADR_ACCEPTED) {
+        memcpy(buffer, frame, length);
+        length += WireFormat::writeLinkParams(buffer + length, sizeof(buffer) - length, pendingPacked);
+        frame = buffer;
+    }
+    
+    // Charge what actually goes on air to the duty cycle
+    int state = lora.startTransmit(frame, length);
+    if (state == RADIOLIB_ERR_NONE) {
+        if (firstTxUs == 0) {
+            firstTxUs = esp_timer_get_time();
+        }
+        dutyCycle.record(Airtime::timeOnAirUs(linkParams, length, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC));
+    }
+    return state;
+}
+
+uint32_t LoRaCommunication::frameAirtimeUs(size_t length) const {
+    // Room for the echoed proposal (tag plus packed settings)
+    if (adrState == ADR_ACCEPTED) {
+        length += 1 + WIRE_MAX_VARINT_SIZE;
+    }
+    return Airtime::timeOnAirUs(linkParams, length, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC);
+}
+
+unsigned long LoRaCommunication::ackTimeout() const {
+    // Slow settings need longer for the largest ACK to arrive
+    uint32_t ackMs = Airtime::timeOnAirUs(linkParams, WIRE_MAX_BLOCK_ACK_SIZE, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC) / 1000;
+    
+    // In our own slot the ACK comes within what the slot leaves for it
+    if (tdmaInSlot) {
+        return TDMA_ACK_DELAY_MS + ackMs + TDMA_GUARD_MS;
+    }
+    return ACK_TIMEOUT + ackMs;
+}
+
+unsigned long LoRaCommunication::retryBackoff(uint8_t attempt) const {
+    // Scales with the data rate: a few ms at SF6/500 kHz, about half a second per attempt at SF10/125 kHz
+    uint32_t exchangeUs = frameAirtimeUs(txLength) +
+                          Airtime::timeOnAirUs(linkParams, WIRE_ACK_SIZE, LORA_PREAMBLE_LENGTH, true, LORA_ENABLE_CRC);
+    return attempt * (exchangeUs / 1000 + 1);
+}
+
+void LoRaCommunication::deferSend(uint32_t airtimeUs, TxPriority priority) {
+    uint32_t waitMs = dutyCycle.waitMs(airtimeUs, priority);
+    
+    Serial.print(F("Duty cycle budget exhausted, deferring "));
+    Serial.print(waitMs / 1000);
+    Serial.println(F(" s"));
+    
+    txState = TX_DEFERRED;
+    txDeadline = millis() + waitMs;
+}
+
+void LoRaCommunication::adrOnAck(uint8_t flags, uint32_t packedParams) {
+    failedSends = 0;
+    
+    // An ACK on new settings confirms them
+    if (adrState == ADR_PROBATION) {
+        adrState = ADR_IDLE;
+        Serial.println(F("Link settings confirmed"));
+    }
+    
+    // Base received our echo and switches after this ACK; so do we
+    if ((flags & WIRE_ACK_FLAG_SWITCH) && adrState == ADR_ACCEPTED) {
+        previousParams = linkParams;
+        switchParams(pendingParams, F("switch"));
+        adrState = ADR_PROBATION;
+        return;
+    }
+    
+    // New proposal: echo it until the base tells us to switch
+    LinkParams proposal;
+    if ((flags & WIRE_ACK_FLAG_PARAMS) && LinkRate::unpack(packedParams, proposal, nullptr)) {
+        pendingParams = proposal;
+        pendingPacked = packedParams;
+        adrState = ADR_ACCEPTED;
+        Serial.print(F("Link settings proposed: "));
+        LinkRate::print(proposal);
+        Serial.println();
+    }
+}
+
+void LoRaCommunication::adrOnFailure() {
+    failedSends++;
+    
+    switch (adrState) {
+        case ADR_PROBATION:
+            // New settings don't work, go back
+            adrState = ADR_IDLE;
+            switchParams(previousParams, F("rollback"));
+            break;
+            
+        case ADR_ACCEPTED:
+            // Most likely the base switched and its switch ACK was lost
+            previousParams = linkParams;
+            switchParams(pendingParams, F("switch without ACK"));
+            adrState = ADR_PROBATION;
+            break;
+            
+        case ADR_IDLE:
+            // Link lost; the base falls back too once it stops hearing us
+            if (failedSends >= ADR_LINK_LOST_FAILURES && !LinkRate::equal(linkParams, LinkRate::fallback())) {
+                previousParams = linkParams;
+                switchParams(LinkRate::fallback(), F("fallback"));
+                failedSends = 0;
+            }
+            break;
+    }
+}
+
+void LoRaCommunication::switchParams(const LinkParams& params, const __FlashStringHelper* reason) {
+    int state = LinkRate::apply(lora, params);
+    if (state != RADIOLIB_ERR_NONE) {
+        // Leave the radio as it was rather than half configured
+        LinkRate::apply(lora, linkParams);
+        Serial.print(F("Failed to change link settings! Error code: "));
+        Serial.println(state);
+        return;
+    }
+    linkParams = params;
+    
+    // Beacons change length and the base plans new slots
+    tdma.invalidateLayout();
+    
+    Serial.print(F("Link settings ("));
+    Serial.print(reason);
+    Serial.print(F("): "));
+    LinkRate::print(linkParams);
+    Serial.println();
+}
+
+void LoRaCommunication::completeSend(bool success, int rssi, float snr, const AckFrame* ack) {
+    txState = TX_IDLE;
+    txStatus = success ? SEND_ACKED : SEND_FAILED;
+    
+    lastResult.messageId = txMessageId;
+    lastResult.success = success;
+    lastResult.attempts = txAttempt;
+    lastResult.rssi = rssi;
+    lastResult.snr = snr;
+    lastResult.uplinkRssi = ack != nullptr ? ack->rssi : 0;
+    lastResult.uplinkSnr = ack != nullptr ? ack->snr : 0.0;
+    lastResult.turnaroundUs = ack != nullptr ? ack->turnaroundUs : 0;
+    lastResult.resyncRequested = ack != nullptr && (ack->flags & WIRE_ACK_FLAG_RESYNC);
+    lastResult.rttUs = ack != nullptr ? ackRttUs : 0;
+    lastResult.elapsedMs = millis() - txStartTime;
+    
+    if (ack != nullptr) {
+        deliveryStats.record(micros() - txStartUs);
+    }
+    
+    if (sendCallback != nullptr) {
+        sendCallback(lastResult);
+    }
+}
+
+void LoRaCommunication::notifyCompletion(const ArqCompletion& completion, int rssi, float snr, bool resync) {
+    // Fragments are reported once per transfer
+    bool finished = false;
+    if (fragmenter.onCompletion(completion.id, completion.success, &finished)) {
+        if (finished) {
+            const TransferResult& result = fragmenter.getResult();
+            Serial.print(F("Transfer "));
+            Serial.print(result.transfer);
+            Serial.println(result.success ? F(" delivered") : F(" failed"));
+            if (transferCallback != nullptr) {
+                transferCallback(result);
             }
         }
+        return;
+    }
+    
+    txStatus = completion.success ? SEND_ACKED : SEND_FAILED;
+    
+    lastResult.messageId = completion.id;
+    lastResult.success = completion.success;
+    lastResult.attempts = completion.attempts;
+    lastResult.rssi = completion.success ? rssi : 0;
+    lastResult.snr = completion.success ? snr : 0.0;
+    lastResult.uplinkRssi = 0;
+    lastResult.uplinkSnr = 0.0;
+    lastResult.turnaroundUs = 0;
+    lastResult.resyncRequested = resync;
+    lastResult.rttUs = completion.success ? ackRttUs : 0;
+    lastResult.elapsedMs = completion.elapsedMs;
+    
+    if (completion.success) {
+        // Windowed frames are timed in ms from when they were queued (saturates after ~71 min)
+        deliveryStats.record(completion.elapsedMs < UINT32_MAX / 1000 ? completion.elapsedMs * 1000 : UINT32_MAX);
+    }
+    
+    if (sendCallback != nullptr) {
+        sendCallback(lastResult);
+    }
+}
+
+void LoRaCommunication::txTask(void* param) {
+    LoRaCommunication* self = static_cast<LoRaCommunication*>(param);
+    
+    for (;;) {
+        // Sleep until the DIO1 interrupt fires; only TX done is ours
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
         
-        // Small delay to prevent CPU hogging
-        delay(10);
+        xSemaphoreTake(self->radioMutex, portMAX_DELAY);
+        if (self->txState == TX_TRANSMITTING && dio1Fired) {
+            self->onTxDone();
+        }
+        xSemaphoreGive(self->radioMutex);
     }
+}
+
+void IRAM_ATTR LoRaCommunication::onDio1Interrupt() {
+    dio1At = micros();
+    dio1Fired = true;
     
-    Serial.println(F("Acknowledgment timeout"));
-    return false;
+    if (txTaskHandle == nullptr) {
+        return;
+    }
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(txTaskHandle, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
 }
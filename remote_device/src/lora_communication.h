@@ -4,6 +4,17 @@
 #include <Arduino.h>
 #include <RadioLib.h>
 #include <ArduinoJson.h>
+#include "wire_format.h"
+#include "message_schema.h"
+#include "arq_window.h"
+#include "sample_batch.h"
+#include "link_params.h"
+#include "airtime.h"
+#include "duty_cycle.h"
+#include "latency_stats.h"
+#include "tdma_sync.h"
+#include "hopping.h"
+#include "fragmenter.h"
 
 // LoRa module pins for Heltec WiFi LoRa 32 V3 (ESP32-S3)
 // Using pins confirmed by pin discovery testing
@@ -26,16 +37,120 @@
 #define LORA_PREAMBLE_LENGTH 8       // symbols - minimal preamble length
 #define LORA_ENABLE_CRC      true    // Enable CRC checking
 
-// Message types
-#define MSG_TYPE_PING    "ping"
-#define MSG_TYPE_PONG    "pong"
-#define MSG_TYPE_DATA    "data"
-#define MSG_TYPE_STATUS  "status"
+// Longest wait for the radio's BUSY line before a register readback
+#define RADIO_BUSY_TIMEOUT_US 5000
+
+// Bytes read back to check the radio's configuration: packet type and LoRa sync word
+#define RADIO_SIGNATURE_SIZE 3
+
+// Regulatory duty cycle, permille of airtime per hour (EU868: 1%, US915: no limit)
+#define LORA_DUTY_CYCLE_PERMILLE ((LORA_FREQUENCY) < 900.0 ? 10 : 0)
+
+// Sent in every uplink so the base can tell remotes apart (0 = derive from the chip's MAC address)
+#define LORA_DEVICE_ID     0
 
 // Communication parameters
 #define MAX_PACKET_SIZE    256   // Maximum size of packet to send
 #define MAX_RETRIES        3     // Maximum number of transmission retries
 #define ACK_TIMEOUT        1000  // Timeout for acknowledgment in ms
+#define LORA_ARQ_WINDOW    ARQ_DEFAULT_WINDOW  // Data frames in flight per burst (0 = stop-and-wait)
+
+// TX done is handled by a task woken from the DIO1 interrupt, so the next
+// frame of a burst or the ACK window doesn't wait for loop()
+#define TX_TASK_PRIORITY     (configMAX_PRIORITIES - 2)
+#define TX_TASK_STACK_SIZE   4096
+#define TX_TASK_CORE         0   // loop() runs on core 1
+
+// Listen before talk: 1 = run channel activity detection (CAD) before each
+// send or burst and back off while another transmitter is heard, 0 = transmit blind
+#define LORA_LBT_ENABLE            1
+#define LBT_MAX_SCANS              6   // Busy scans in a row before transmitting anyway
+#define LBT_MAX_BACKOFF_EXPONENT   5   // Backoff is 1 to 2^n frame airtimes, n = busy scans so far
+#define LBT_SIMULATE_BUSY_PERCENT  0   // Report this share of free scans as busy (testing without a second transmitter)
+
+// TDMA: 1 = follow the base's beacons and send data only in our slot (see
+// tdma.h; the base must have it enabled too), 0 = send whenever data is ready.
+// Pings and pongs never wait for a slot.
+#define LORA_TDMA_ENABLE       0
+#define TDMA_RADIO_WAKE_US     5000     // Take the radio out of sleep this long before a slot or beacon
+#define TDMA_WAKE_LEAD_MS      250      // Hold loop() to short delays this long before one
+#define TDMA_SEARCH_SLACK_MS   5000     // A search listens one superframe plus this
+#define TDMA_SEARCH_RETRY_MS   1800000  // After a search finds nothing, send without a slot this long
+
+// Frequency hopping: 1 = send in each TDMA slot on the channel the base's hop
+// plan gives it (see hopping.h; the base must have it enabled too), 0 = stay
+// on LORA_FREQUENCY
+#define LORA_HOP_ENABLE        0
+
+#if LORA_HOP_ENABLE && !LORA_TDMA_ENABLE
+#error "Frequency hopping follows the TDMA slots, it needs LORA_TDMA_ENABLE"
+#endif
+
+// Forward error correction for transfers: LORA_FEC_PARITY parity fragments
+// after every LORA_FEC_DATA data fragments (see fec.h; 0 = off). More parity
+// costs airtime up front and saves resends on lossy links.
+#define LORA_FEC_DATA          8
+#define LORA_FEC_PARITY        0
+
+// Adaptive data rate: the base proposes settings, we follow (see link_params.h)
+#define ADR_LINK_LOST_FAILURES 3   // Failed sends in a row before falling back to LINK_FALLBACK_*
+
+// Progress of an asynchronous send
+enum SendStatus {
+    SEND_IDLE,          // Nothing sent yet
+    SEND_IN_PROGRESS,   // Transmitting, waiting for the ACK, or waiting before a retry or for duty-cycle budget
+    SEND_ACKED,         // Delivered (acknowledged, or sent if no ACK is expected)
+    SEND_FAILED         // Gave up after MAX_RETRIES, or dropped by the duty-cycle budget
+};
+
+// Outcome of a finished send
+struct SendResult {
+    uint32_t messageId;
+    bool success;
+    uint8_t attempts;
+    int rssi;           // Signal quality of the acknowledgment
+    float snr;
+    int uplinkRssi;     // Signal quality of our frame at the base (stop-and-wait only)
+    float uplinkSnr;
+    uint16_t turnaroundUs;  // Base's RX done to ACK transmit start
+    bool resyncRequested;   // Base lost its compression reference (see metric_codec.h)
+    uint32_t rttUs;     // Our TX done to ACK RX done for the attempt that got through (0 = no ACK)
+    uint32_t elapsedMs; // From startSend() to completion
+};
+
+// Listen-before-talk statistics
+struct LbtStats {
+    uint32_t scans;         // CAD runs
+    uint32_t busy;          // Scans that heard another transmitter
+    uint32_t forced;        // Sends that went out after LBT_MAX_SCANS busy scans
+    uint32_t backoffMs;     // Total time spent backing off
+};
+
+// Radio wakeups from sleep
+struct RadioWakeStats {
+    uint32_t wakes;
+    uint32_t configKept;    // Readback matched, used as it was
+    uint32_t reinits;       // Configuration lost, radio set up again
+    uint32_t readyUs;       // Last wakeup until ready to use
+    uint32_t readyMaxUs;
+    uint32_t beginUs;       // Reset and configuration, in begin() or after a lost configuration
+};
+
+// Radio errors while sending. The TX task only counts these; poll() prints them.
+struct TxErrorStats {
+    uint32_t transmitErrors;    // Frames the radio refused to start sending
+    uint32_t ackWindowErrors;   // ACK receive windows that failed to open
+    int lastError;              // RadioLib error code of the last one
+};
+
+// Called from poll() when a send completes
+typedef void (*SendCallback)(const SendResult& result);
+
+// Called from poll() when a transfer completes or fails
+typedef void (*TransferCallback)(const TransferResult& result);
+
+// Writes the metrics of a data frame, from startMetrics()
+typedef void (*MetricsWriter)(Schema::FrameWriter& frame);
 
 // Message IDs
 extern uint32_t nextMessageId;
@@ -44,45 +159,367 @@ class LoRaCommunication {
 public:
     LoRaCommunication();
     
-    // Initialize the LoRa module
-    bool begin();
+    // Initialize the LoRa module. warm = waking from deep sleep with the
+    // state from saveState(): skip the reset sequence and carry on from it.
+    bool begin(bool warm = false);
+    
+    // Keep message IDs and radio settings in RTC memory through deep sleep
+    void saveState();
+    
+    // Encode a message as a binary frame, send it and wait for acknowledgment
+    // (blocking wrapper around startSend() and poll()). The schema decides
+    // which fields of metrics (nullptr = none) and whether payload go in the frame.
+    bool sendMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload = nullptr,
+                     int* rssi = nullptr, float* snr = nullptr);
+    
+    // Start sending a message without blocking. Returns false if a send is
+    // already in progress or the message can't be encoded.
+    bool startSend(const MessageSchema& message, const MetricRecord* metrics, const char* payload = nullptr,
+                   uint32_t* messageId = nullptr);
+    
+    // Advance the transmit/ACK state machine (call from loop()). TX done is
+    // handled as it happens by the TX task; poll() does the rest, and all the
+    // callbacks.
+    void poll();
+    
+    // Check whether a send is in progress or windowed frames are waiting to go out
+    // (false while only waiting for duty-cycle budget, a busy channel, or a TDMA
+    // slot or beacon that isn't due yet, so the caller isn't held up)
+    bool isBusy() const;
+    
+    // Whether anything is still to be sent or acknowledged: unlike isBusy(),
+    // also while waiting for duty-cycle budget, a busy channel or a TDMA slot
+    bool txPending() const;
+    
+    // Get the status of the most recent send
+    SendStatus getSendStatus() const;
+    
+    // Get the outcome of the most recently completed send
+    const SendResult& getLastResult() const;
+    
+    // Register a function called when a send completes (once per frame in windowed mode)
+    void setSendCallback(SendCallback callback);
+    
+    // Queue a message for windowed (selective-repeat) delivery. poll() sends
+    // queued frames in bursts and resends only those the base reports missing.
+    bool queueMessage(const MessageSchema& message, const MetricRecord* metrics, const char* payload = nullptr,
+                      uint32_t* messageId = nullptr);
+    
+    // Send data larger than a frame as a transfer of fragments through the
+    // ARQ window (see fragment.h). The data must stay valid until the
+    // transfer callback. Returns false if a transfer is in progress.
+    bool startTransfer(const uint8_t* data, size_t length, uint16_t* transferId = nullptr);
+    
+    // Register a function called when a transfer completes or fails
+    void setTransferCallback(TransferCallback callback);
+    
+    // FEC for transfers started from now on: parity fragments per group of
+    // data fragments (parity 0 = off). False if out of range.
+    bool setTransferFec(uint8_t dataFragments, uint8_t parityFragments);
+    
+    // Transfers sent and fragments resent
+    const FragmentStats& getFragmentStats() const;
+    
+    // Set the number of frames in flight per burst (0 = stop-and-wait for data)
+    void setWindowSize(uint8_t size);
+    uint8_t getWindowSize() const;
+    
+    // Windowed transfer statistics and goodput (bytes/s)
+    const ArqStats& getArqStats() const;
+    float getGoodput() const;
+    
+    // ID sent in every uplink
+    uint32_t getDeviceId() const;
+    
+    // Radio settings in use (changed at runtime by the base's ADR)
+    const LinkParams& getLinkParams() const;
+    
+    // esp_timer_get_time() of the first transmission since boot, 0 until then
+    int64_t getFirstTxUs() const;
+    
+    // Channel contention seen by listen before talk
+    const LbtStats& getLbtStats() const;
+    
+    // Transmit airtime in the last hour and duty-cycle statistics
+    uint32_t getAirtimePerHourMs();
+    const DutyStats& getDutyStats() const;
     
-    // Send JSON message and wait for acknowledgment
-    bool sendMessage(const char* type, JsonDocument& payload, int* rssi = nullptr, float* snr = nullptr);
+    // Round-trip time of each ACK exchange (TX done to ACK RX done), and delivery
+    // time of each acknowledged send (start to ACK, including retries and waits)
+    const LatencyStats& getRttStats() const;
+    const LatencyStats& getDeliveryStats() const;
+    
+    // Beacon tracking and our uplink slot (WIRE_NO_SLOT = none assigned) in TDMA mode
+    const TdmaSync& getTdma() const;
+    uint16_t getTdmaSlot() const;
+    
+    // Hop plan from the last beacon, and what happened to our slot frames on each channel
+    const HopPlan& getHopPlan() const;
+    const ChannelStats& getChannelStats(uint8_t channel) const;
     
     // Check if a message is available and receive it
     bool receiveMessage(JsonDocument& doc, int* rssi = nullptr, float* snr = nullptr);
     
-    // Ping the base station and measure round-trip time
+    // Ping the base station; returns the round-trip time of the acknowledged
+    // attempt in ms, -1 on failure
     int ping(int* rssi = nullptr, float* snr = nullptr);
     
     // Send a data message with metrics
-    bool sendMetrics(JsonDocument& metrics);
+    bool sendMetrics(const MetricRecord& metrics);
+    
+    // Start sending a data message with metrics without blocking (queued
+    // for windowed delivery unless the window size is 0). write is called
+    // once, to put the metrics straight into the frame that goes out.
+    bool startMetrics(MetricsWriter write, uint32_t* messageId = nullptr);
+    
+    // Send a batch of samples as one data frame (queued for windowed delivery
+    // unless the window size is 0). The batch can be cleared once this returns true.
+    bool startBatch(const SampleBatch& batch, uint32_t* messageId = nullptr);
+    
+    // Send already encoded sample fields (count of them) as one data frame,
+    // the same way as startBatch()
+    bool startSamples(const uint8_t* samples, size_t length, uint8_t count, uint32_t* messageId = nullptr);
     
     // Send a status update
-    bool sendStatus(const char* status, JsonDocument& metrics);
+    bool sendStatus(const char* status, const MetricRecord& metrics);
     
     // Get the next message ID
     uint32_t getNextMessageId();
     
-    // Put the LoRa module to sleep
-    void sleep();
+    // Put the LoRa module to sleep. Warm sleep (retainConfig) keeps its
+    // configuration for wakeup(); cold sleep draws less but needs a full setup.
+    void sleep(bool retainConfig = true);
     
-    // Wake up the LoRa module
+    // Wake up the LoRa module, setting it up again if it lost its configuration
     void wakeup();
     
+    // Wakeups and how long the radio took to be ready
+    const RadioWakeStats& getRadioWakeStats() const;
+    
+    // Transmit and ACK window errors
+    const TxErrorStats& getTxErrorStats() const;
+    
     // Return the LoRa module instance for direct access if needed
     SX1262* getModule();
     
 private:
+    // Transmit state machine
+    enum TxState {
+        TX_IDLE,
+        TX_TRANSMITTING,    // Waiting for TX done
+        TX_SENT,            // TX done without an ACK to wait for, poll() completes the send
+        TX_FAILED,          // Transmit or ACK window failed, poll() retries or fails the send
+        TX_WAIT_ACK,        // Receive window open for the acknowledgment
+        TX_BACKOFF,         // Waiting before the next attempt
+        TX_DEFERRED,        // Waiting for duty-cycle budget
+        TX_CAD,             // Channel activity detection running
+        TX_CAD_BACKOFF,     // Channel was busy, waiting before the next scan
+        TX_TDMA_WAIT,       // Radio asleep until our slot or a beacon window
+        TX_TDMA_BEACON      // Receiver open for a beacon
+    };
+    
+    enum TxMode {
+        TX_MODE_SINGLE,     // Stop-and-wait send started by startSend()
+        TX_MODE_WINDOW      // Burst of frames from the ARQ window
+    };
+    
+    // Adaptive data rate handshake
+    enum AdrState {
+        ADR_IDLE,
+        ADR_ACCEPTED,       // Echoing the base's proposal, waiting for its switch ACK
+        ADR_PROBATION       // Switched, waiting for the first ACK on the new settings
+    };
+    
     SX1262 lora;
     bool isInitialized;
+    SemaphoreHandle_t radioMutex;   // Serializes the transmit state machine between the TX task and poll()
+    uint8_t radioSignature[RADIO_SIGNATURE_SIZE];   // Read back after configuring
+    uint8_t rxBuffer[MAX_PACKET_SIZE];              // Frame decoded by receiveMessage()
+    RadioWakeStats wakeStats;
+    TxErrorStats txErrors;
+    TxErrorStats txErrorsReported;  // Counts already printed by reportTxErrors()
+    uint32_t deviceId;
+    
+    // Message currently being sent
+    TxState txState;
+    TxMode txMode;
+    SendStatus txStatus;
+    uint8_t txBuffer[MAX_PACKET_SIZE];
+    size_t txLength;
+    uint32_t txMessageId;
+    uint8_t txAttempt;
+    bool txExpectAck;
+    TxPriority txPriority;
+    unsigned long txStartTime;
+    uint32_t txStartUs;
+    uint32_t txDoneUs;          // TX-done interrupt of the last frame sent
+    int64_t firstTxUs;          // First transmission since boot
+    unsigned long txDeadline;   // ACK window end or backoff end
+    SendResult lastResult;
+    SendCallback sendCallback;
+    
+    // Windowed delivery
+    ArqWindow arq;
+    bool windowedMode;
+    uint8_t burstRemaining;     // Frames of the current burst still to transmit
+    
+    // Transfers, sent as fragments through the window
+    Fragmenter fragmenter;
+    TransferCallback transferCallback;
+    uint16_t nextTransferId;
+    uint8_t fecData;
+    uint8_t fecParity;
+    
+    // Airtime budget
+    DutyCycle dutyCycle;
+    
+    // Latency
+    LatencyStats rttStats;
+    LatencyStats deliveryStats;
+    uint32_t ackRttUs;          // RTT of the ACK being handled
+    
+    // Listen before talk
+    uint8_t lbtBusyScans;       // Busy scans in a row for the pending send
+    uint32_t lbtSlotMs;         // Backoff unit: airtime of the frame waiting to go out
+    LbtStats lbtStats;
+    
+    // Adaptive data rate
+    AdrState adrState;
+    LinkParams linkParams;      // Settings in use
+    LinkParams previousParams;  // Restored if the new settings don't work
+    LinkParams pendingParams;   // Accepted proposal
+    uint32_t pendingPacked;     // Echoed in every uplink until the switch
+    uint8_t failedSends;        // Consecutive failed sends
+    
+    // TDMA; times are esp_timer_get_time() us
+    TdmaSync tdma;
+    uint16_t tdmaSlot;          // Assigned by the base, WIRE_NO_SLOT until then
+    unsigned long tdmaSlotAt;   // millis() of the last ACK confirming it
+    bool tdmaContention;        // Waiting for a shared slot
+    bool tdmaInSlot;            // Sent in our own slot, the ACK comes within it
+    bool tdmaListen;            // TX_TDMA_WAIT ends in a beacon window rather than a slot
+    bool tdmaAwake;             // Radio taken out of sleep for the wakeup
+    bool tdmaSearching;         // Beacon window is a search without sync
+    bool tdmaSearchFailed;
+    unsigned long tdmaSearchFailedAt;
+    int64_t tdmaWakeAt;         // End of TX_TDMA_WAIT
+    int64_t tdmaWindowEnd;      // End of the beacon window
+    int64_t tdmaListenFrom;
+    uint32_t tdmaAirtimeUs;     // Frame or burst waiting for the slot
+    size_t beaconLength;        // Last beacon heard, sizes the next window
+    
+    // Frequency hopping
+    HopPlan hopPlan;
+    bool hopKnown;              // The last beacon heard carried a hop plan
+    uint32_t hopHeardAt;        // Superframe of that beacon
+    uint8_t hopChannel;         // Channel of the slot we're waiting for
+    uint8_t txChannel;          // Channel of the exchange in progress, HOP_HOME outside a slot
+    uint8_t radioChannel;       // Channel the radio is tuned to
+    ChannelStats channelStats[HOP_CHANNEL_COUNT];
+    
+    // Reset the radio and configure it with the settings in use
+    int initRadio();
+    
+    // Take the radio from sleep to standby; set it up again if the readback
+    // shows it lost its configuration
+    void wakeRadio();
+    
+    // Read the packet type and LoRa sync word registers
+    bool readSignature(uint8_t* signature);
+    
+    // Helper method to build a standard message as a binary frame.
+    // Returns the frame length (0 on failure) and the assigned message ID.
+    size_t buildMessage(uint8_t* buffer, size_t size, const MessageSchema& message, const MetricRecord* metrics,
+                        const char* payload, uint32_t* messageId);
+    
+    // Read the frame that raised RX done
+    bool readRaw(uint8_t* buffer, size_t* length, int* rssi, float* snr);
+    
+    // Read and decode the frame that raised RX done into rxBuffer; strings
+    // in doc point into it until the next frame is read
+    bool readFrame(JsonDocument& doc, int* rssi, float* snr);
+    
+    // Windowed bursts
+    void startBurst();
+    void sendNextInBurst();
+    void handleBlockAck(const uint8_t* buffer, size_t length, int rssi, float snr);
+    void notifyCompletion(const ArqCompletion& completion, int rssi, float snr, bool resync = false);
+    
+    // Queue fragments of the transfer in progress while the window has room
+    void queueFragments();
+    
+    // Start transmitting a frame, echoing an accepted ADR proposal if there is one
+    int transmit(const uint8_t* frame, size_t length);
+    
+    // Time on air of a frame at the current settings, including the ADR echo
+    uint32_t frameAirtimeUs(size_t length) const;
+    
+    // Time to wait for an ACK after TX done at the current settings
+    unsigned long ackTimeout() const;
+    
+    // Time to wait before the given attempt: one frame and ACK exchange per attempt so far
+    unsigned long retryBackoff(uint8_t attempt) const;
+    
+    // Wait in TX_DEFERRED until a frame of this airtime fits the budget
+    void deferSend(uint32_t airtimeUs, TxPriority priority);
+    
+    // ADR handshake: flags and proposal from an ACK, and a failed send
+    void adrOnAck(uint8_t flags, uint32_t packedParams);
+    void adrOnFailure();
+    
+    // Change radio settings (radio must be in standby)
+    void switchParams(const LinkParams& params, const __FlashStringHelper* reason);
+    
+    // Start a stop-and-wait send of the frame in txBuffer
+    void beginSend(const MessageSchema& message, bool expectAck);
+    
+    // Start the next transmission attempt
+    void startAttempt();
+    
+    // TX done: send the next frame of the burst or open the ACK window.
+    // Caller holds radioMutex. Runs in the TX task, so it never calls back
+    // into the application; completions are left to poll().
+    void onTxDone();
+    
+    // Transmit the frame in txBuffer for the current attempt
+    void sendAttempt();
+    
+    // Print the transmit errors counted since the last call; loop() only
+    void reportTxErrors();
+    
+    // Wait for our TDMA slot if data goes by TDMA, otherwise listen before talk
+    void accessChannel(uint32_t airtimeUs);
+    
+    // TDMA: sleep until our next slot, or until the beacon we need to hear
+    // first; search for the beacons without sync; send without a slot if none
+    // were found recently
+    void tdmaSchedule();
+    void tdmaOpenWindow(int64_t now, int64_t end);
+    void tdmaOnBeacon(const uint8_t* buffer, size_t length);
+    void tdmaOnAck(uint8_t flags, uint16_t slot);
+    uint32_t beaconAirtimeUs() const;
+    
+    // Hopping: tune the radio (in standby) to a plan channel or HOP_HOME, and
+    // note how the exchange on a hopped channel ended
+    void tune(uint8_t channel);
+    void hopRecord(bool acked, int rssi);
+    
+    // Listen before talk: scan the channel, then send the attempt or burst
+    // once it's free (or after LBT_MAX_SCANS busy scans)
+    void listenBeforeTalk(uint32_t airtimeUs);
+    void startChannelScan();
+    void onChannelScan(bool busy);
+    void channelClear();
+    
+    // Schedule a retry, or fail the send after MAX_RETRIES attempts
+    void retryOrFail();
     
-    // Helper method to build a standard message
-    void buildMessage(JsonDocument& doc, const char* type, const JsonDocument& payload);
+    // Finish the current send and notify the callback
+    void completeSend(bool success, int rssi, float snr, const AckFrame* ack = nullptr);
     
-    // Try to receive an acknowledgment
-    bool waitForAck(uint32_t messageId, int timeout, int* rssi = nullptr, float* snr = nullptr);
+    // DIO1 interrupt handler and the task it wakes
+    static void onDio1Interrupt();
+    static void txTask(void* param);
 };
 
 extern LoRaCommunication loraCommunication;
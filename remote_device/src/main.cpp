@@ -3,6 +3,8 @@
 #include "power_management.h"
 #include "display_manager.h"
 #include "metrics.h"
+#include "uplink_store.h"
+#include "warm_boot.h"
 
 // Pin for a button to cycle display pages (optional)
 #define BUTTON_PIN 0  // Usually GPIO0 has a button on ESP32 dev boards
@@ -10,23 +12,100 @@
 // Interval between data transmissions (when not sleeping)
 #define DATA_TRANSMISSION_INTERVAL 30000  // 30 seconds
 
+// On a low battery, longest wait for queued frames to go out and be
+// acknowledged before sleeping; whatever is left is stored for after the wakeup
+#define SLEEP_DRAIN_TIMEOUT 15000  // ms
+
+// Batching: take a sample every DATA_TRANSMISSION_INTERVAL but send them
+// together, once BATCH_SAMPLES are queued or the oldest is BATCH_AGE old
+#define BATCH_MODE     1
+#define BATCH_SAMPLES  BATCH_MAX_SAMPLES
+#define BATCH_AGE      BATCH_MAX_AGE      // ms
+
+// Benchmark: send a transfer of TRANSFER_TEST_SIZE bytes (up to
+// FRAG_MAX_TRANSFER_SIZE) every TRANSFER_TEST_INTERVAL and print its
+// throughput; 0 = off
+#define TRANSFER_TEST_SIZE      0
+#define TRANSFER_TEST_INTERVAL  600000  // 10 minutes
+
+// Samples waiting to be sent
+SampleBatch sampleBatch;
+
+// Samples of failed frames, sent again once the link is back
+UplinkStore uplinkStore;
+bool linkUp = false;            // Last frame was acknowledged
+bool draining = false;          // A frame from the store is in flight
+uint32_t drainMessageId = 0;
+
+// Display and store still to start after a warm boot
+bool warmBootPending = false;
+
+// Since when a low battery has been waiting for queued frames before sleeping
+bool sleepWaiting = false;
+unsigned long sleepWaitSince = 0;
+
+#if TRANSFER_TEST_SIZE > 0
+// Byte i is i & 0xFF, so the receiving end can check it
+uint8_t transferTestData[TRANSFER_TEST_SIZE];
+unsigned long lastTransferTime = 0;
+#endif
+
 // Last transmission time
 unsigned long lastTransmissionTime = 0;
 
+// Time taken to read and encode a sample (us), last and longest
+uint32_t sampleUs = 0;
+uint32_t sampleMaxUs = 0;
+
 // Function prototypes
 void setupHardware();
+void setupDisplay();
+void setupUplinkStore();
+void finishWarmBoot();
+void onDeepSleep();
+bool readyToSleep();
+template <typename Sink> void collectMetrics(Sink& out);
+void writeSample(Schema::FrameWriter& frame);
+void recordSampleTime(uint32_t elapsed);
 void transmitMetricsData();
+void flushSampleBatch();
+void drainUplinkStore();
+void onSendComplete(const SendResult& result);
+void startTestTransfer();
+void onTransferComplete(const TransferResult& result);
 void handleButton();
 void printDebugInfo();
+void printLatency(const __FlashStringHelper* name, const LatencyStats& stats);
 
 void setup() {
   // Initialize serial communication
   Serial.begin(115200);
-  Serial.println(F("\n\nLoRa Remote Device Starting..."));
+  
+  // A wakeup from deep sleep with saved state takes the fast path
+  warmBoot.begin();
+  Serial.println(warmBoot.isWarm() ? F("\n\nLoRa Remote Device Waking Up...") : F("\n\nLoRa Remote Device Starting..."));
   
   // Initialize hardware
   setupHardware();
   
+  // Completed sends are reported back through a callback
+  loraCommunication.setSendCallback(onSendComplete);
+  loraCommunication.setTransferCallback(onTransferComplete);
+  powerManagement.setDeepSleepCallback(onDeepSleep);
+  
+  // Configure sample batching
+  sampleBatch.setLimits(BATCH_SAMPLES, BATCH_AGE);
+  
+  if (warmBoot.isWarm()) {
+    // Send a sample straight away; the display and the store start once it's out
+    warmBootPending = true;
+    transmitMetricsData();
+#if BATCH_MODE
+    flushSampleBatch();
+#endif
+    return;
+  }
+  
   // Display welcome message
   displayManager.showStatus("System Ready");
   
@@ -35,25 +114,54 @@ void setup() {
 }
 
 void loop() {
-  // Check for button press to cycle display pages
-  handleButton();
+  // Advance any transmission in progress (TX done itself is handled by the
+  // radio's TX task, so the ACK window doesn't wait for us)
+  loraCommunication.poll();
   
-  // Update display
-  displayManager.update();
+  // Finish a warm boot now that the first send is done
+  if (warmBootPending && !loraCommunication.isBusy()) {
+    finishWarmBoot();
+  }
+  
+  // The display and the store are only set up once a warm boot is finished
+  if (!warmBootPending) {
+    // Check for button press to cycle display pages
+    handleButton();
+    
+    // Update display
+    displayManager.update();
+    loraCommunication.poll();
+  }
   
   // Update metrics
   metrics.update();
+  loraCommunication.poll();
   
-  // Check if it's time to transmit metrics
-  if (millis() - lastTransmissionTime >= DATA_TRANSMISSION_INTERVAL) {
-    transmitMetricsData();
+  // New sends wait until the radio is free
+  if (!warmBootPending && !loraCommunication.isBusy()) {
+    // Check if it's time to transmit metrics
+    if (millis() - lastTransmissionTime >= DATA_TRANSMISSION_INTERVAL) {
+      transmitMetricsData();
+    }
+    
+    // Catch up on stored samples while the link works
+    drainUplinkStore();
+    uplinkStore.update();
+    
+#if TRANSFER_TEST_SIZE > 0
+    // Benchmark transfer
+    if (millis() - lastTransferTime >= TRANSFER_TEST_INTERVAL) {
+      startTestTransfer();
+    }
+#endif
   }
   
   // Print debug info periodically
   printDebugInfo();
   
-  // Check battery status and sleep if needed
-  if (powerManagement.getBatteryStatus() != BATTERY_STATUS_NORMAL) {
+  // Check battery status and sleep if needed (never with a send in flight,
+  // and only once queued frames are out or SLEEP_DRAIN_TIMEOUT has passed)
+  if (!loraCommunication.isBusy() && readyToSleep()) {
     // Prepare for sleep
     loraCommunication.sleep();
     
@@ -67,8 +175,8 @@ void loop() {
     lastTransmissionTime = millis();
   }
   
-  // Small delay to prevent CPU hogging
-  delay(100);
+  // Small delay to prevent CPU hogging (short if a send was just started)
+  delay(loraCommunication.isBusy() ? 1 : 100);
 }
 
 void setupHardware() {
@@ -81,7 +189,7 @@ void setupHardware() {
   
   // Initialize LoRa communication
   Serial.println(F("Initializing LoRa communication..."));
-  if (!loraCommunication.begin()) {
+  if (!loraCommunication.begin(warmBoot.isWarm())) {
     displayManager.showStatus("LoRa Init Failed");
     Serial.println(F("Failed to initialize LoRa!"));
     while (1) {
@@ -90,17 +198,23 @@ void setupHardware() {
     }
   }
   
-  // Initialize display
-  Serial.println(F("Initializing display..."));
-  if (!displayManager.begin()) {
-    Serial.println(F("Failed to initialize display!"));
-    // Continue anyway, display is non-critical
+  // A warm boot keeps the metrics from before deep sleep, and starts the
+  // display and the store after its first send
+  if (warmBoot.isWarm()) {
+    metrics.restoreState();
+    return;
   }
   
+  // Initialize display
+  setupDisplay();
+  
   // Initialize metrics system
   Serial.println(F("Initializing metrics system..."));
   metrics.begin();
   
+  // Samples left from before a reboot or deep sleep
+  setupUplinkStore();
+  
   // Update power metrics display
   float batteryVoltage = powerManagement.getBatteryVoltage();
   uint8_t batteryPercentage = powerManagement.getBatteryPercentage();
@@ -111,53 +225,249 @@ void setupHardware() {
   Serial.println(F("Hardware initialization complete"));
 }
 
-void transmitMetricsData() {
-  // Create metrics document
-  StaticJsonDocument<512> metricsDoc;
+void setupDisplay() {
+  Serial.println(F("Initializing display..."));
+  if (!displayManager.begin()) {
+    Serial.println(F("Failed to initialize display!"));
+    // Continue anyway, display is non-critical
+  }
+}
+
+void setupUplinkStore() {
+  Serial.println(F("Initializing uplink store..."));
+  if (!uplinkStore.begin()) {
+    Serial.println(F("Failed to initialize uplink store!"));
+    // Continue anyway, failed samples are just lost
+  }
+}
+
+void finishWarmBoot() {
+  warmBootPending = false;
+  
+  // How quickly the fast path got a frame on air
+  int64_t firstTxUs = loraCommunication.getFirstTxUs();
+  Serial.print(F("Warm boot "));
+  Serial.print(warmBoot.getWakeCount());
+  if (firstTxUs > 0) {
+    Serial.print(F(", first TX "));
+    Serial.print((uint32_t)(firstTxUs / 1000));
+    Serial.print(F(" ms after reset (budget "));
+    Serial.print(WARM_BOOT_TX_BUDGET_MS);
+    Serial.print(F(" ms)"));
+  }
+  Serial.println();
+  
+  setupDisplay();
+  setupUplinkStore();
+  
+  // Samples that were waiting when we went to sleep go out through the store
+  const uint8_t* samples;
+  size_t length = warmBoot.pendingSamples(&samples);
+  if (length > 0) {
+    uplinkStore.push(samples, length);
+  }
+}
+
+bool readyToSleep() {
+  if (powerManagement.getBatteryStatus() == BATTERY_STATUS_NORMAL) {
+    sleepWaiting = false;
+    return false;
+  }
+  
+  // Frames in the window, held back by the duty cycle or queued as
+  // fragments are lost in deep sleep; give them a while to get through
+  if (!loraCommunication.txPending()) {
+    sleepWaiting = false;
+    return true;
+  }
+  if (!sleepWaiting) {
+    sleepWaiting = true;
+    sleepWaitSince = millis();
+  }
+  if (millis() - sleepWaitSince < SLEEP_DRAIN_TIMEOUT) {
+    return false;
+  }
+  
+  sleepWaiting = false;
+  Serial.println(F("Sleeping with frames still queued"));
+  return true;
+}
+
+void onDeepSleep() {
+  // Samples of frames still waiting for their ACK go out again after the
+  // wakeup (the base may get some twice)
+  uint8_t slot = 0;
+  const uint8_t* samples;
+  size_t length;
+  while ((length = sampleBatch.nextSentCopies(&slot, &samples)) > 0) {
+    uplinkStore.push(samples, length);
+  }
+  
+  // Stored samples go to flash, the rest of the state to RTC memory
+  uplinkStore.flush();
+  loraCommunication.saveState();
+  metrics.saveState();
+  
+  // The radio is reset and set up again at boot, so it needn't keep its
+  // configuration through deep sleep
+  loraCommunication.sleep(false);
+  
+  // Samples not sent yet go out after the wakeup
+  length = sampleBatch.unsentCopies(&samples);
+  warmBoot.commit(samples, length);
+}
+
+template <typename Sink>
+void collectMetrics(Sink& out) {
+  // Every metric in field ID order, so a frame written as it goes is the
+  // same as one encoded from a record
   
   // Add system metrics
-  metrics.getSystemMetrics(metricsDoc);
+  metrics.getSystemMetrics(out);
   
   // Add power metrics
-  metricsDoc["battery"] = powerManagement.getBatteryVoltage();
-  metricsDoc["battery_percent"] = powerManagement.getBatteryPercentage();
-  metricsDoc["charging"] = (powerManagement.getChargingStatus() == CHARGING ? 1 : 0);
+  Schema::set<FIELD_BATTERY>(out, powerManagement.getBatteryVoltage());
+  Schema::setCount<FIELD_BATTERY_PERCENT>(out, powerManagement.getBatteryPercentage());
+  Schema::setCount<FIELD_CHARGING>(out, powerManagement.getChargingStatus() == CHARGING ? 1 : 0);
   
-  // Create a temporary document for performance metrics
-  StaticJsonDocument<256> perfDoc;
+  // Add performance metrics
+  metrics.getPerformanceMetrics(out);
   
-  // Get performance metrics
-  metrics.getPerformanceMetrics(perfDoc);
+  // Add transmit airtime in the last hour (duty cycle)
+  Schema::setCount<FIELD_AIRTIME>(out, loraCommunication.getAirtimePerHourMs());
   
-  // Copy all performance metrics to the main document
-  for (JsonPair kv : perfDoc.as<JsonObject>()) {
-    metricsDoc[kv.key()] = kv.value();
+  // Add the smoothed round-trip time of our ACK exchanges
+  const LatencyStats& rtt = loraCommunication.getRttStats();
+  if (rtt.getCount() > 0) {
+    Schema::set<FIELD_RTT>(out, rtt.getEwmaUs() / 1000.0f);
+  }
+}
+
+void writeSample(Schema::FrameWriter& frame) {
+  // Called by startMetrics() with the frame that goes out
+  unsigned long started = micros();
+  collectMetrics(frame);
+  recordSampleTime(micros() - started);
+}
+
+void recordSampleTime(uint32_t elapsed) {
+  sampleUs = elapsed;
+  if (elapsed > sampleMaxUs) {
+    sampleMaxUs = elapsed;
+  }
+}
+
+void transmitMetricsData() {
+#if BATCH_MODE
+  unsigned long started = micros();
+  
+  // Sample of every metric, taken now; it's compressed against the one before
+  MetricRecord sample;
+  MetricCodec::clear(sample);
+  sample.timestamp = millis() / 1000;
+  collectMetrics(sample);
+  
+  // Queue the sample; if the batch is full send it first
+  if (!sampleBatch.add(sample)) {
+    flushSampleBatch();
+    if (!sampleBatch.add(sample)) {
+      Serial.println(F("Sample batch full, sample dropped"));
+    }
+  }
+  recordSampleTime(micros() - started);
+  
+  if (sampleBatch.isDue()) {
+    flushSampleBatch();
+  } else {
+    Serial.print(F("Sample queued, "));
+    Serial.print(sampleBatch.count());
+    Serial.println(F(" in batch"));
+  }
+#else
+  // Display status
+  displayManager.showStatus("Sending data...");
+  
+  // Start sending metrics to the base station, written straight into the
+  // frame; the result arrives in onSendComplete()
+  if (!loraCommunication.startMetrics(writeSample)) {
+    displayManager.showStatus("Failed to send data");
+    Serial.println(F("Failed to start data transmission"));
+  }
+#endif
+  
+  // Update last transmission time
+  lastTransmissionTime = millis();
+}
+
+void flushSampleBatch() {
+  if (sampleBatch.count() == 0) {
+    return;
   }
   
   // Display status
   displayManager.showStatus("Sending data...");
   
-  // Send metrics to base station
-  int rssi = 0;
-  float snr = 0;
-  unsigned long startTime = millis();
+  // Start sending the batch; the result arrives in onSendComplete()
+  uint32_t messageId;
+  if (loraCommunication.startBatch(sampleBatch, &messageId)) {
+    sampleBatch.sent(messageId);
+  } else {
+    // Keep the samples and try again with the next one
+    displayManager.showStatus("Failed to send data");
+    Serial.println(F("Failed to start batch transmission"));
+  }
+}
+
+void drainUplinkStore() {
+  if (!linkUp || draining || uplinkStore.isEmpty()) {
+    return;
+  }
   
-  bool success = loraCommunication.sendMetrics(metricsDoc);
+  // As many stored samples as fit in a frame
+  uint8_t samples[BATCH_BUFFER_SIZE];
+  uint8_t count;
+  size_t length = uplinkStore.peek(samples, sizeof(samples), &count);
+  if (length == 0) {
+    return;
+  }
   
-  unsigned long latency = millis() - startTime;
+  if (loraCommunication.startSamples(samples, length, count, &drainMessageId)) {
+    draining = true;
+  } else {
+    uplinkStore.drained(false);
+  }
+}
+
+void onSendComplete(const SendResult& result) {
+  if (draining && result.messageId == drainMessageId) {
+    // Frame from the store; its samples stay queued if it failed
+    draining = false;
+    uplinkStore.drained(result.success);
+  } else {
+    // Keep the samples of a failed batch for when the link is back
+    const uint8_t* samples;
+    size_t length = sampleBatch.copiesOf(result.messageId, &samples);
+    if (!result.success && length > 0) {
+      uplinkStore.push(samples, length);
+    }
+    
+    // Later samples are compressed against what the base has received
+    sampleBatch.onResult(result.messageId, result.success, result.resyncRequested);
+  }
+  linkUp = result.success;
   
   // Record transmission in metrics
   metrics.recordTransmission(
-    metricsDoc["id"] | 0,  // Extract ID or use 0 if not available
-    success,
-    rssi,
-    snr,
-    0,  // retries
-    latency
+    result.messageId,
+    result.success,
+    result.rssi,
+    result.snr,
+    result.attempts > 0 ? result.attempts - 1 : 0,  // retries
+    result.elapsedMs
   );
   
   // Update display with new signal metrics
-  displayManager.updateSignalMetrics(rssi, snr, latency);
+  displayManager.updateSignalMetrics(result.rssi, result.snr, result.elapsedMs);
   
   // Update power metrics display
   float batteryVoltage = powerManagement.getBatteryVoltage();
@@ -167,16 +477,51 @@ void transmitMetricsData() {
   displayManager.updatePowerMetrics(batteryVoltage, batteryPercentage, isCharging);
   
   // Update status
-  if (success) {
+  if (result.success) {
     displayManager.showStatus("Data sent successfully");
   } else {
     displayManager.showStatus("Failed to send data");
   }
   
-  // Update last transmission time
-  lastTransmissionTime = millis();
+  Serial.println(result.success ? F("Data sent successfully") : F("Failed to send data"));
+}
+
+void startTestTransfer() {
+#if TRANSFER_TEST_SIZE > 0
+  for (size_t i = 0; i < TRANSFER_TEST_SIZE; i++) {
+    transferTestData[i] = i & 0xFF;
+  }
+  
+  // Try again next interval if the last one is still going
+  if (loraCommunication.startTransfer(transferTestData, TRANSFER_TEST_SIZE)) {
+    displayManager.showStatus("Sending transfer...");
+  }
+  lastTransferTime = millis();
+#endif
+}
+
+void onTransferComplete(const TransferResult& result) {
+  Serial.print(F("Transfer "));
+  Serial.print(result.transfer);
+  Serial.print(result.success ? F(" delivered, ") : F(" failed, "));
+  Serial.print(result.length);
+  Serial.print(F(" bytes in "));
+  Serial.print(result.fragments);
+  Serial.print(F(" fragments + "));
+  Serial.print(result.parity);
+  Serial.print(F(" parity, "));
+  Serial.print(result.resent);
+  Serial.print(F(" resent, "));
+  Serial.print(result.elapsedMs);
+  Serial.print(F(" ms"));
+  if (result.success && result.elapsedMs > 0) {
+    Serial.print(F(", "));
+    Serial.print(result.length * 1000.0f / result.elapsedMs);
+    Serial.print(F(" B/s"));
+  }
+  Serial.println();
   
-  Serial.println(success ? F("Data sent successfully") : F("Failed to send data"));
+  displayManager.showStatus(result.success ? "Transfer sent" : "Transfer failed");
 }
 
 void handleButton() {
@@ -259,6 +604,174 @@ void printDebugInfo() {
   Serial.print(metrics.getAverageLatency());
   Serial.println(F("ms"));
   
+  // Cost of taking a sample, and the loop task's stack never used so far
+  Serial.print(F("Sample: "));
+  Serial.print(sampleUs);
+  Serial.print(F(" us (max "));
+  Serial.print(sampleMaxUs);
+  Serial.print(F(" us), Stack free: "));
+  Serial.print(uxTaskGetStackHighWaterMark(NULL));
+  Serial.println(F(" bytes"));
+  
+  // Round-trip time of ACK exchanges and delivery time including retries
+  printLatency(F("RTT"), loraCommunication.getRttStats());
+  printLatency(F("Delivery"), loraCommunication.getDeliveryStats());
+  
+  // Windowed delivery info
+  const ArqStats& arqStats = loraCommunication.getArqStats();
+  Serial.print(F("Window: "));
+  Serial.print(loraCommunication.getWindowSize());
+  Serial.print(F(", Bursts: "));
+  Serial.print(arqStats.bursts);
+  Serial.print(F(", Retransmissions: "));
+  Serial.print(arqStats.retransmissions);
+  Serial.print(F("/"));
+  Serial.print(arqStats.transmissions);
+  Serial.print(F(", Goodput: "));
+  Serial.print(loraCommunication.getGoodput());
+  Serial.println(F(" B/s"));
+  
+  // Transfers larger than a frame
+  const FragmentStats& fragmentStats = loraCommunication.getFragmentStats();
+  Serial.print(F("Transfers: "));
+  Serial.print(fragmentStats.transfers);
+  Serial.print(F(" delivered ("));
+  Serial.print(fragmentStats.bytesDelivered);
+  Serial.print(F(" B), "));
+  Serial.print(fragmentStats.failed);
+  Serial.print(F(" failed, Fragments: "));
+  Serial.print(fragmentStats.fragments);
+  Serial.print(F(", Resent: "));
+  Serial.println(fragmentStats.resent);
+  if (fragmentStats.parity > 0) {
+    Serial.print(F("FEC: "));
+    Serial.print(fragmentStats.parity);
+    Serial.print(F(" parity, "));
+    Serial.print(fragmentStats.cancelled);
+    Serial.print(F(" cancelled, encode "));
+    Serial.print(fragmentStats.encodeUs);
+    Serial.print(F(" us (max "));
+    Serial.print(fragmentStats.encodeMaxUs);
+    Serial.println(F(" us per group)"));
+  }
+  
+  // Radio settings chosen by the base's ADR
+  Serial.print(F("Link: "));
+  LinkRate::print(loraCommunication.getLinkParams());
+  Serial.println();
+  
+  // Duty-cycle budget
+  const DutyStats& dutyStats = loraCommunication.getDutyStats();
+  Serial.print(F("Airtime: "));
+  Serial.print(loraCommunication.getAirtimePerHourMs());
+  Serial.print(F(" ms in the last hour, Deferred: "));
+  Serial.print(dutyStats.framesDeferred);
+  Serial.print(F(", Dropped: "));
+  Serial.println(dutyStats.framesDropped);
+  
+  // Channel contention
+  const LbtStats& lbtStats = loraCommunication.getLbtStats();
+  Serial.print(F("Channel busy: "));
+  Serial.print(lbtStats.busy);
+  Serial.print(F("/"));
+  Serial.print(lbtStats.scans);
+  Serial.print(F(" scans, Backoff: "));
+  Serial.print(lbtStats.backoffMs);
+  Serial.print(F(" ms, Forced: "));
+  Serial.println(lbtStats.forced);
+  
+  // Beacon tracking
+  if (LORA_TDMA_ENABLE) {
+    const TdmaSync& tdma = loraCommunication.getTdma();
+    const TdmaStats& tdmaStats = tdma.getStats();
+    Serial.print(F("TDMA: "));
+    Serial.print(tdma.isSynced() ? F("synced") : F("not synced"));
+    Serial.print(F(", Slot: "));
+    if (loraCommunication.getTdmaSlot() == WIRE_NO_SLOT) {
+      Serial.print(F("shared"));
+    } else {
+      Serial.print(loraCommunication.getTdmaSlot());
+    }
+    Serial.print(F(", Drift: "));
+    Serial.print(tdma.getDriftPpm());
+    Serial.print(F(" ppm, Beacons: "));
+    Serial.print(tdmaStats.beacons);
+    Serial.print(F(" heard/"));
+    Serial.print(tdmaStats.missed);
+    Serial.print(F(" missed, Listening: "));
+    Serial.print((uint32_t)(tdmaStats.listenUs / 1000));
+    Serial.print(F(" ms, Fallbacks: "));
+    Serial.println(tdmaStats.fallbacks);
+  }
+  
+  // Slot frames acknowledged per hop channel
+  if (LORA_HOP_ENABLE) {
+    const HopPlan& plan = loraCommunication.getHopPlan();
+    Serial.print(F("Hop set: 0x"));
+    Serial.print(plan.mask, HEX);
+    for (uint8_t channel = 0; channel < HOP_CHANNEL_COUNT; channel++) {
+      const ChannelStats& stats = loraCommunication.getChannelStats(channel);
+      Serial.print(F(", "));
+      Serial.print(Hopping::frequencyMhz(channel), 1);
+      Serial.print(F(": "));
+      Serial.print(stats.received);
+      Serial.print(F("/"));
+      Serial.print(stats.frames);
+    }
+    Serial.println();
+  }
+  
+  // Sample compression info
+  const CodecStats& codecStats = sampleBatch.getCodecStats();
+  Serial.print(F("Samples: "));
+  Serial.print(codecStats.keyframes);
+  Serial.print(F(" keyframes ("));
+  Serial.print(codecStats.keyframeBytes);
+  Serial.print(F(" B), "));
+  Serial.print(codecStats.deltas);
+  Serial.print(F(" deltas ("));
+  Serial.print(codecStats.deltaBytes);
+  Serial.println(F(" B)"));
+  
+  // Store-and-forward queue info
+  const StoreStats& storeStats = uplinkStore.getStats();
+  Serial.print(F("Uplink store: "));
+  Serial.print(uplinkStore.depth());
+  Serial.print(F(" queued, "));
+  Serial.print(storeStats.stored);
+  Serial.print(F(" stored, "));
+  Serial.print(storeStats.drained);
+  Serial.print(F(" drained ("));
+  Serial.print(uplinkStore.getDrainRate(), 2);
+  Serial.print(F("/s), "));
+  Serial.print(storeStats.dropped);
+  Serial.print(F(" dropped, "));
+  Serial.print(storeStats.flashWrites);
+  Serial.print(F(" flash writes ("));
+  Serial.print(storeStats.flashBytes);
+  Serial.println(F(" B)"));
+  
+  // Radio wakeup info
+  const RadioWakeStats& wakeStats = loraCommunication.getRadioWakeStats();
+  Serial.print(F("Radio: "));
+  Serial.print(wakeStats.wakes);
+  Serial.print(F(" wakes, "));
+  Serial.print(wakeStats.configKept);
+  Serial.print(F(" kept config, "));
+  Serial.print(wakeStats.reinits);
+  Serial.print(F(" re-inits, ready in "));
+  Serial.print(wakeStats.readyUs);
+  Serial.print(F(" us (max "));
+  Serial.print(wakeStats.readyMaxUs);
+  Serial.print(F(" us), full setup "));
+  Serial.print(wakeStats.beginUs);
+  Serial.print(F(" us, "));
+  const TxErrorStats& txErrors = loraCommunication.getTxErrorStats();
+  Serial.print(txErrors.transmitErrors);
+  Serial.print(F(" TX errors, "));
+  Serial.print(txErrors.ackWindowErrors);
+  Serial.println(F(" ACK window errors"));
+  
   // System info
   Serial.print(F("Uptime: "));
   unsigned long uptime = millis() / 1000;
@@ -283,3 +796,26 @@ void printDebugInfo() {
   
   displayManager.showDebugInfo(debugInfo);
 }
+
+void printLatency(const __FlashStringHelper* name, const LatencyStats& stats) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print(stats.getCount());
+  Serial.print(F(" samples, avg "));
+  Serial.print(stats.getEwmaUs() / 1000.0);
+  Serial.print(F(" ms, p50 <= "));
+  Serial.print(stats.percentileUs(50) / 1000.0);
+  Serial.print(F(" ms, p90 <= "));
+  Serial.print(stats.percentileUs(90) / 1000.0);
+  Serial.print(F(" ms, max "));
+  Serial.print(stats.getMaxUs() / 1000.0);
+  Serial.print(F(" ms, buckets"));
+  
+  // Counts per power-of-two bucket, from under 1 ms up
+  const uint32_t* histogram = stats.getHistogram();
+  for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+    Serial.print(' ');
+    Serial.print(histogram[i]);
+  }
+  Serial.println();
+}
@@ -0,0 +1,182 @@
+#include "message_schema.h"
+
+namespace Schema {
+
+// Raw value within the field's range, so a frame never exceeds its schema's maxSize
+static uint32_t clampRaw(const WireField& field, uint32_t raw) {
+    if (field.wireType == WIRE_SVARINT) {
+        int32_t value = (int32_t)raw;
+        int32_t limit = (int32_t)field.maxRaw;
+        if (value > limit) return (uint32_t)limit;
+        if (value < -limit) return (uint32_t)-limit;
+        return raw;
+    }
+    return raw < field.maxRaw ? raw : field.maxRaw;
+}
+
+const char* fieldName(uint8_t id) {
+    const WireField* field = WireFormat::findField(id);
+    return field != nullptr ? field->name : nullptr;
+}
+
+const MessageSchema* find(uint8_t type) {
+    switch (type) {
+        case WIRE_TYPE_PING:   return &PING;
+        case WIRE_TYPE_PONG:   return &PONG;
+        case WIRE_TYPE_DATA:   return &DATA;
+        case WIRE_TYPE_STATUS: return &STATUS;
+        default:               return nullptr;
+    }
+}
+
+FrameWriter::FrameWriter(uint8_t* buffer, size_t size, const MessageSchema& message, uint32_t id, uint32_t timestamp,
+                         uint8_t flags) :
+    buffer(buffer),
+    size(size),
+    offset(WireFormat::writeHeader(buffer, size, message.type, flags, id, timestamp)),
+    fields(message.fields),
+    hasPayload(message.hasPayload) {
+}
+
+void FrameWriter::write(const WireField& field, uint32_t raw) {
+    if (offset == 0 || !(fields & fieldBit(field.id))) {
+        return;
+    }
+    size_t n = WireFormat::writeField(buffer + offset, size - offset, field, clampRaw(field, raw));
+    offset = n > 0 ? offset + n : 0;
+}
+
+void FrameWriter::add(const MetricRecord& record) {
+    for (uint8_t i = 0; i < METRIC_FIELD_COUNT; i++) {
+        if (record.present & (1u << i)) {
+            write(METRIC_FIELDS[i], record.raw[i]);
+        }
+    }
+}
+
+void FrameWriter::payload(const char* text) {
+    if (offset == 0 || !hasPayload) {
+        return;
+    }
+    size_t n = WireFormat::writeBytes(buffer + offset, size - offset, FIELD_PAYLOAD, (const uint8_t*)text,
+                                      strnlen(text, WIRE_MAX_PAYLOAD_STRING));
+    offset = n > 0 ? offset + n : 0;
+}
+
+void FrameWriter::deviceId(uint32_t id) {
+    if (offset == 0) {
+        return;
+    }
+    size_t n = WireFormat::writeDeviceId(buffer + offset, size - offset, id);
+    offset = n > 0 ? offset + n : 0;
+}
+
+size_t FrameWriter::length() const {
+    return offset;
+}
+
+size_t encode(uint8_t* buffer, size_t size, const MessageSchema& message, uint32_t id, uint32_t timestamp,
+              const MetricRecord* metrics, const char* payload) {
+    FrameWriter frame(buffer, size, message, id, timestamp);
+    if (metrics != nullptr) {
+        frame.add(*metrics);
+    }
+    if (payload != nullptr) {
+        frame.payload(payload);
+    }
+    return frame.length();
+}
+
+bool decode(uint8_t* buffer, size_t length, DecodedMessage& message) {
+    size_t offset = WireFormat::readHeader(buffer, length, message.header);
+    if (offset == 0) {
+        return false;
+    }
+
+    const MessageSchema* schema = find(message.header.type);
+    if (schema == nullptr) {
+        return false;
+    }
+
+    MetricCodec::clear(message.metrics);
+    message.metrics.timestamp = message.header.timestamp;
+    message.device = 0;
+    message.payload = nullptr;
+    message.sample = 0;
+    message.samples = 0;
+
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(buffer + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        if (fieldId == FIELD_PAYLOAD && wireType == WIRE_BYTES && schema->hasPayload) {
+            // Terminated in place: the text moves back over the last byte of
+            // its length prefix, which was just read
+            char* text = (char*)bytes - 1;
+            size_t textLength = raw < WIRE_MAX_PAYLOAD_STRING ? raw : WIRE_MAX_PAYLOAD_STRING;
+            memmove(text, bytes, textLength);
+            text[textLength] = '\0';
+            message.payload = text;
+            continue;
+        }
+
+        if (fieldId == FIELD_DEVICE_ID && wireType == WIRE_VARINT) {
+            message.device = raw;
+            continue;
+        }
+
+        // Skip fields from newer firmware, metrics the type doesn't carry
+        // (and batched samples, see WireFormat::findSample)
+        const WireField* field = WireFormat::findField(fieldId);
+        if (field == nullptr || field->wireType != wireType || !(schema->fields & fieldBit(fieldId))) {
+            continue;
+        }
+        message.metrics.raw[fieldId - 1] = raw;
+        message.metrics.present |= fieldBit(fieldId);
+    }
+
+    return true;
+}
+
+void toJson(const DecodedMessage& message, JsonDocument& doc) {
+    const MessageSchema* schema = find(message.header.type);
+    if (schema == nullptr) {
+        return;
+    }
+
+    doc["type"] = schema->name;
+    doc["id"] = message.header.id;
+    if (message.device != 0) {
+        doc["device"] = message.device;
+    }
+    if (message.samples > 0) {
+        doc["sample"] = message.sample;
+        doc["samples"] = message.samples;
+    }
+    doc["timestamp"] = message.metrics.timestamp;
+
+    if (schema->fields != 0) {
+        metricsToJson(message.metrics, doc.createNestedObject("metrics"));
+    }
+
+    // Linked, not copied: the text stays in the frame buffer
+    if (message.payload != nullptr) {
+        doc["payload"] = message.payload;
+    }
+}
+
+void metricsToJson(const MetricRecord& record, JsonObject metrics) {
+    for (uint8_t i = 0; i < METRIC_FIELD_COUNT; i++) {
+        if (record.present & (1u << i)) {
+            WireFormat::setMetric(metrics, METRIC_FIELDS[i], record.raw[i]);
+        }
+    }
+}
+
+}  // namespace Schema
@@ -0,0 +1,270 @@
+#ifndef MESSAGE_SCHEMA_H
+#define MESSAGE_SCHEMA_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "wire_format.h"
+#include "metric_codec.h"
+
+// Compile-time schema of the ping, pong, data and status messages
+//
+// The metric fields are described once, in METRIC_FIELDS: ID, wire type,
+// fixed-point scale, largest raw value and the JSON key used on the serial
+// side. Metrics are set and read through templates on the field ID, e.g.
+//   Schema::set<FIELD_BATTERY>(record, 3.92f);
+// so the scale and wire type are resolved when compiling and no key is
+// looked up at run time (the same setters write a sample straight into a
+// frame through FrameWriter). Each message type lists the fields it can carry;
+// its worst-case frame length follows from the table and is checked against
+// the radio buffers with static_assert (see lora_communication.cpp).
+
+// What a message type carries
+struct MessageSchema {
+    uint8_t type;           // WIRE_TYPE_*
+    const char* name;       // "type" on the serial side
+    uint16_t fields;        // Metric fields it can carry (Schema::fieldBit)
+    bool hasPayload;        // Carries a status text
+    size_t maxSize;         // Longest frame, protocol fields included
+};
+
+// A received ping, pong, data or status message
+struct DecodedMessage {
+    FrameHeader header;
+    uint32_t device;        // Sender's ID, 0 if the frame didn't carry one
+    MetricRecord metrics;   // Timestamp from the header
+    const char* payload;    // Status text in the frame, nullptr if none
+    uint8_t sample;         // Batched sample index and count (0 if not batched)
+    uint8_t samples;
+};
+
+namespace Schema {
+
+// Metric fields, indexed by ID - 1. Values are clamped to the largest raw
+// value (negative values of signed fields to its negative) when encoded,
+// which bounds the length of every field.
+constexpr WireField METRIC_FIELDS[] = {
+    { FIELD_UPTIME,          WIRE_VARINT,  1,    UINT32_MAX, "uptime" },           // s
+    { FIELD_FREE_MEMORY,     WIRE_VARINT,  1,    0x0FFFFFFF, "free_memory" },      // bytes
+    { FIELD_TEMPERATURE,     WIRE_SVARINT, 100,  32767,      "temperature" },      // 0.01 °C
+    { FIELD_BATTERY,         WIRE_VARINT,  1000, 65535,      "battery" },          // mV
+    { FIELD_BATTERY_PERCENT, WIRE_VARINT,  1,    100,        "battery_percent" },
+    { FIELD_CHARGING,        WIRE_VARINT,  1,    1,          "charging" },
+    { FIELD_SUCCESS_RATE,    WIRE_VARINT,  1000, 1000,       "success_rate" },     // 0.1 %
+    { FIELD_AVG_RETRIES,     WIRE_VARINT,  100,  65535,      "avg_retries" },
+    { FIELD_AVG_LATENCY,     WIRE_VARINT,  1,    0x1FFFFF,   "avg_latency" },      // ms
+    { FIELD_TOTAL_PACKETS,   WIRE_VARINT,  1,    UINT32_MAX, "total_packets" },
+    { FIELD_RSSI,            WIRE_SVARINT, 1,    255,        "rssi" },             // dBm
+    { FIELD_SNR,             WIRE_SVARINT, 100,  32767,      "snr" },              // 0.01 dB
+    { FIELD_SOLAR_VOLTAGE,   WIRE_VARINT,  1000, 65535,      "solar_voltage" },    // mV
+    { FIELD_PACKET_LOSS,     WIRE_VARINT,  1000, 1000,       "packet_loss" },      // 0.1 %
+    { FIELD_AIRTIME,         WIRE_VARINT,  1,    3600000,    "airtime" },          // ms in the last hour
+    { FIELD_RTT,             WIRE_VARINT,  10,   0x1FFFFF,   "rtt" },              // 0.1 ms
+};
+
+constexpr uint8_t METRIC_FIELD_COUNT = sizeof(METRIC_FIELDS) / sizeof(METRIC_FIELDS[0]);
+
+// Presence bit of a field, in MetricRecord::present and MessageSchema::fields
+constexpr uint16_t fieldBit(uint8_t id) {
+    return (uint16_t)(1u << (id - 1));
+}
+
+constexpr uint16_t ALL_METRICS = (uint16_t)((1u << METRIC_FIELD_COUNT) - 1);
+
+// Length of a varint
+constexpr size_t varintSize(uint64_t value) {
+    return value < (1u << 7) ? 1 : value < (1u << 14) ? 2 : value < (1u << 21) ? 3 : value < (1u << 28) ? 4 : 5;
+}
+
+// Longest encoding of a field, tag included
+constexpr size_t fieldMaxSize(const WireField& field) {
+    return 1 + (field.wireType == WIRE_FIXED32 ? 4 :
+                field.wireType == WIRE_SVARINT ? varintSize((uint64_t)field.maxRaw * 2) : varintSize(field.maxRaw));
+}
+
+// Longest encoding of a set of metric fields
+constexpr size_t metricsMaxSize(uint16_t fields) {
+    size_t size = 0;
+    for (uint8_t i = 0; i < METRIC_FIELD_COUNT; i++) {
+        if (fields & (1u << i)) {
+            size += fieldMaxSize(METRIC_FIELDS[i]);
+        }
+    }
+    return size;
+}
+
+// Field i has ID i + 1
+constexpr bool fieldsInOrder() {
+    for (uint8_t i = 0; i < METRIC_FIELD_COUNT; i++) {
+        if (METRIC_FIELDS[i].id != i + 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(fieldsInOrder(), "METRIC_FIELDS must be indexed by field ID");
+static_assert(METRIC_FIELD_COUNT <= CODEC_MAX_FIELDS, "metric field IDs beyond the codec's records");
+static_assert(WIRE_MAX_VARINT_SIZE + metricsMaxSize(ALL_METRICS) <= WIRE_MAX_SAMPLE_SIZE,
+              "a sample with every metric doesn't fit WIRE_MAX_SAMPLE_SIZE");
+
+// Longest header: type, flags, message ID and timestamp
+constexpr size_t HEADER_MAX_SIZE = 2 + 2 * WIRE_MAX_VARINT_SIZE;
+
+// Longest payload field (the text is cut at WIRE_MAX_PAYLOAD_STRING)
+constexpr size_t PAYLOAD_MAX_SIZE = 1 + varintSize(WIRE_MAX_PAYLOAD_STRING) + WIRE_MAX_PAYLOAD_STRING;
+
+// Packed radio settings take 24 bits (see link_params.h)
+constexpr uint32_t LINK_PARAMS_MAX = 0xFFFFFF;
+
+// Protocol fields added to an uplink: device ID, window offset and accepted radio settings
+constexpr size_t LINK_FIELDS_MAX_SIZE = 2 * (1 + WIRE_MAX_VARINT_SIZE) + 1 + varintSize(LINK_PARAMS_MAX);
+
+// Block ACK: cumulative ID, 32-bit bitmap, proposed settings and slot
+static_assert(HEADER_MAX_SIZE + (1 + WIRE_MAX_VARINT_SIZE) + 5 + (1 + varintSize(LINK_PARAMS_MAX)) +
+              (1 + varintSize(WIRE_NO_SLOT)) <= WIRE_MAX_BLOCK_ACK_SIZE,
+              "a block ACK with settings and slot doesn't fit WIRE_MAX_BLOCK_ACK_SIZE");
+
+constexpr MessageSchema message(uint8_t type, const char* name, uint16_t fields, bool hasPayload) {
+    return { type, name, fields, hasPayload,
+             HEADER_MAX_SIZE + metricsMaxSize(fields) + (hasPayload ? PAYLOAD_MAX_SIZE : 0) + LINK_FIELDS_MAX_SIZE };
+}
+
+constexpr MessageSchema PING = message(WIRE_TYPE_PING, "ping", 0, false);
+constexpr MessageSchema PONG = message(WIRE_TYPE_PONG, "pong", 0, false);
+constexpr MessageSchema DATA = message(WIRE_TYPE_DATA, "data", ALL_METRICS, false);
+constexpr MessageSchema STATUS = message(WIRE_TYPE_STATUS, "status", ALL_METRICS, true);
+
+// A metric field, checked when compiling
+template <uint8_t Id>
+struct Metric {
+    static_assert(Id >= 1 && Id <= METRIC_FIELD_COUNT, "not a metric field ID");
+
+    static constexpr uint8_t wireType = METRIC_FIELDS[Id - 1].wireType;
+    static constexpr uint16_t scale = METRIC_FIELDS[Id - 1].scale;
+    static constexpr uint32_t maxRaw = METRIC_FIELDS[Id - 1].maxRaw;
+
+    // Counted values (uptime, packets, bytes) are set and read as integers
+    static constexpr bool isCount = wireType == WIRE_VARINT && scale == 1;
+
+    static constexpr WireField field() {
+        return { Id, wireType, scale, maxRaw, nullptr };
+    }
+};
+
+template <uint8_t Id> constexpr uint8_t Metric<Id>::wireType;
+template <uint8_t Id> constexpr uint16_t Metric<Id>::scale;
+template <uint8_t Id> constexpr uint32_t Metric<Id>::maxRaw;
+template <uint8_t Id> constexpr bool Metric<Id>::isCount;
+
+// Set a metric from its value in natural units (V, °C, ratio, ms)
+template <uint8_t Id>
+inline void set(MetricRecord& record, float value) {
+    record.raw[Id - 1] = WireFormat::toRaw(Metric<Id>::field(), value);
+    record.present |= fieldBit(Id);
+}
+
+// Set a counted metric exactly
+template <uint8_t Id>
+inline void setCount(MetricRecord& record, uint32_t value) {
+    static_assert(Metric<Id>::isCount, "not a counted metric, use set()");
+    record.raw[Id - 1] = value < Metric<Id>::maxRaw ? value : Metric<Id>::maxRaw;
+    record.present |= fieldBit(Id);
+}
+
+template <uint8_t Id>
+inline bool has(const MetricRecord& record) {
+    return (record.present & fieldBit(Id)) != 0;
+}
+
+template <uint8_t Id>
+inline float get(const MetricRecord& record) {
+    return WireFormat::fromRaw(Metric<Id>::field(), record.raw[Id - 1]);
+}
+
+template <uint8_t Id>
+inline uint32_t getCount(const MetricRecord& record) {
+    static_assert(Metric<Id>::isCount, "not a counted metric, use get()");
+    return record.raw[Id - 1];
+}
+
+// Writes a message straight into a frame buffer, header first and then one
+// field at a time, so a sample can go out without being collected in a
+// MetricRecord first. Metrics the message type doesn't carry are left out and
+// values are clamped like encode() does. If anything doesn't fit, length()
+// returns 0.
+class FrameWriter {
+public:
+    // Writes the header
+    FrameWriter(uint8_t* buffer, size_t size, const MessageSchema& message, uint32_t id, uint32_t timestamp,
+                uint8_t flags = 0);
+
+    // Same as the MetricRecord setters above; each field at most once
+    template <uint8_t Id>
+    void set(float value) {
+        write(Metric<Id>::field(), WireFormat::toRaw(Metric<Id>::field(), value));
+    }
+
+    template <uint8_t Id>
+    void setCount(uint32_t value) {
+        static_assert(Metric<Id>::isCount, "not a counted metric, use set()");
+        write(Metric<Id>::field(), value);
+    }
+
+    // The metrics of a record that the message type carries, in ID order
+    void add(const MetricRecord& record);
+
+    // Status text, cut at WIRE_MAX_PAYLOAD_STRING (left out if the message type has none)
+    void payload(const char* text);
+
+    // Sender's device ID
+    void deviceId(uint32_t id);
+
+    // Frame length so far, 0 if something didn't fit
+    size_t length() const;
+
+private:
+    uint8_t* buffer;
+    size_t size;
+    size_t offset;          // 0 once something didn't fit
+    uint16_t fields;
+    bool hasPayload;
+
+    void write(const WireField& field, uint32_t raw);
+};
+
+// The setters, for code that fills either a record or a frame
+template <uint8_t Id>
+inline void set(FrameWriter& frame, float value) {
+    frame.set<Id>(value);
+}
+
+template <uint8_t Id>
+inline void setCount(FrameWriter& frame, uint32_t value) {
+    frame.setCount<Id>(value);
+}
+
+// JSON key of a metric field
+const char* fieldName(uint8_t id);
+
+// Schema of a frame type, nullptr if it isn't a ping, pong, data or status message
+const MessageSchema* find(uint8_t type);
+
+// Encode a message: header, the metrics of the record that the message type
+// carries (none if metrics is nullptr) and the status text, cut at
+// WIRE_MAX_PAYLOAD_STRING. Returns the frame length, 0 if it doesn't fit.
+size_t encode(uint8_t* buffer, size_t size, const MessageSchema& message, uint32_t id, uint32_t timestamp,
+              const MetricRecord* metrics, const char* payload = nullptr);
+
+// Decode a ping, pong, data or status frame. Decoded in place like
+// WireFormat::decode(): the payload points into the buffer.
+bool decode(uint8_t* buffer, size_t length, DecodedMessage& message);
+
+// Write a decoded message in the JSON layout used on the serial side
+void toJson(const DecodedMessage& message, JsonDocument& doc);
+
+// Write the metrics of a record into a "metrics" object (counted values stay integers)
+void metricsToJson(const MetricRecord& record, JsonObject metrics);
+
+}  // namespace Schema
+
+#endif // MESSAGE_SCHEMA_H
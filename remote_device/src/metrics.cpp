@@ -8,6 +8,16 @@
 // Global instance
 Metrics metrics;
 
+// Packet history and totals kept through deep sleep
+struct SavedMetrics {
+    PacketRecord packetHistory[MAX_PACKET_HISTORY];
+    uint8_t packetHistoryIndex;
+    uint8_t packetHistoryCount;
+    uint32_t totalPackets;
+    uint32_t successfulPackets;
+};
+static RTC_DATA_ATTR SavedMetrics savedMetrics;
+
 Metrics::Metrics() : 
     packetHistoryIndex(0),
     packetHistoryCount(0),
@@ -158,37 +168,51 @@ uint32_t Metrics::getAverageLatency() {
     return total / count;
 }
 
-void Metrics::getSystemMetrics(JsonDocument& doc) {
+template <typename Sink>
+void Metrics::getSystemMetrics(Sink& out) {
     // Update system metrics first
     updateSystemMetrics();
     
-    // Add system metrics to JSON document
-    doc["uptime"] = uptime;
-    doc["free_memory"] = freeMemory;
-    doc["temperature"] = cpuTemperature;
+    // Add system metrics
+    Schema::setCount<FIELD_UPTIME>(out, uptime);
+    Schema::setCount<FIELD_FREE_MEMORY>(out, freeMemory);
+    Schema::set<FIELD_TEMPERATURE>(out, cpuTemperature);
 }
 
-void Metrics::getSignalMetrics(JsonDocument& doc) {
-    // Add signal metrics to JSON document
-    doc["rssi"] = getAverageRSSI();
-    doc["snr"] = getAverageSNR();
+template <typename Sink>
+void Metrics::getSignalMetrics(Sink& out) {
+    // Add signal metrics
+    Schema::set<FIELD_RSSI>(out, getAverageRSSI());
+    Schema::set<FIELD_SNR>(out, getAverageSNR());
 }
 
-void Metrics::getPerformanceMetrics(JsonDocument& doc) {
-    // Add performance metrics to JSON document
-    doc["success_rate"] = getPacketSuccessRate();
-    doc["avg_retries"] = getAverageRetries();
-    doc["avg_latency"] = getAverageLatency();
-    doc["total_packets"] = totalPackets;
+template <typename Sink>
+void Metrics::getPerformanceMetrics(Sink& out) {
+    // Add performance metrics
+    Schema::set<FIELD_SUCCESS_RATE>(out, getPacketSuccessRate());
+    Schema::set<FIELD_AVG_RETRIES>(out, getAverageRetries());
+    Schema::setCount<FIELD_AVG_LATENCY>(out, getAverageLatency());
+    Schema::setCount<FIELD_TOTAL_PACKETS>(out, totalPackets);
 }
 
-void Metrics::getAllMetrics(JsonDocument& doc) {
-    // Add all metrics to JSON document
-    getSystemMetrics(doc);
-    getSignalMetrics(doc);
-    getPerformanceMetrics(doc);
+template <typename Sink>
+void Metrics::getAllMetrics(Sink& out) {
+    // Add all metrics, in field ID order
+    getSystemMetrics(out);
+    getPerformanceMetrics(out);
+    getSignalMetrics(out);
 }
 
+// Filled into a record (batched samples) or written straight into a frame
+template void Metrics::getSystemMetrics(MetricRecord& out);
+template void Metrics::getSignalMetrics(MetricRecord& out);
+template void Metrics::getPerformanceMetrics(MetricRecord& out);
+template void Metrics::getAllMetrics(MetricRecord& out);
+template void Metrics::getSystemMetrics(Schema::FrameWriter& out);
+template void Metrics::getSignalMetrics(Schema::FrameWriter& out);
+template void Metrics::getPerformanceMetrics(Schema::FrameWriter& out);
+template void Metrics::getAllMetrics(Schema::FrameWriter& out);
+
 void Metrics::reset() {
     // Reset packet history
     packetHistoryIndex = 0;
@@ -234,3 +258,21 @@ uint32_t Metrics::getFreeMemory() {
         return 50000;  // Return a default value
     #endif
 }
+
+void Metrics::saveState() {
+    memcpy(savedMetrics.packetHistory, packetHistory, sizeof(packetHistory));
+    savedMetrics.packetHistoryIndex = packetHistoryIndex;
+    savedMetrics.packetHistoryCount = packetHistoryCount;
+    savedMetrics.totalPackets = totalPackets;
+    savedMetrics.successfulPackets = successfulPackets;
+}
+
+void Metrics::restoreState() {
+    memcpy(packetHistory, savedMetrics.packetHistory, sizeof(packetHistory));
+    packetHistoryIndex = savedMetrics.packetHistoryIndex;
+    packetHistoryCount = savedMetrics.packetHistoryCount;
+    totalPackets = savedMetrics.totalPackets;
+    successfulPackets = savedMetrics.successfulPackets;
+    
+    Serial.println(F("Metrics restored"));
+}
@@ -2,7 +2,7 @@
 #define METRICS_H
 
 #include <Arduino.h>
-#include <ArduinoJson.h>
+#include "message_schema.h"
 
 // Maximum number of packets to track for statistics
 #define MAX_PACKET_HISTORY  20
@@ -49,21 +49,31 @@ public:
     // Get average latency
     uint32_t getAverageLatency();
     
-    // Get current system metrics as JSON
-    void getSystemMetrics(JsonDocument& doc);
+    // Add current system metrics to a record, or write them into a frame
+    // (MetricRecord or Schema::FrameWriter, see message_schema.h)
+    template <typename Sink>
+    void getSystemMetrics(Sink& out);
     
-    // Get signal metrics as JSON
-    void getSignalMetrics(JsonDocument& doc);
+    // Add signal metrics to a record or frame
+    template <typename Sink>
+    void getSignalMetrics(Sink& out);
     
-    // Get performance metrics as JSON
-    void getPerformanceMetrics(JsonDocument& doc);
+    // Add performance metrics to a record or frame
+    template <typename Sink>
+    void getPerformanceMetrics(Sink& out);
     
-    // Get all metrics as JSON
-    void getAllMetrics(JsonDocument& doc);
+    // Add all metrics to a record or frame
+    template <typename Sink>
+    void getAllMetrics(Sink& out);
     
     // Reset all metrics
     void reset();
     
+    // Keep the packet history and totals in RTC memory through deep sleep,
+    // and take them back after a warm boot (instead of begin())
+    void saveState();
+    void restoreState();
+    
 private:
     // Packet history for statistics
     PacketRecord packetHistory[MAX_PACKET_HISTORY];
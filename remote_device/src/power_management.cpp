@@ -12,7 +12,8 @@ PowerManagement::PowerManagement() :
     batteryStatus(BATTERY_STATUS_NORMAL),
     chargingStatus(CHARGING_UNKNOWN),
     adcCalibration(1.0),
-    lastBatteryReadTime(0) {
+    lastBatteryReadTime(0),
+    deepSleepCallback(nullptr) {
 }
 
 void PowerManagement::begin() {
@@ -105,6 +106,11 @@ void PowerManagement::deepSleep(uint32_t seconds) {
     // Configure timer wakeup
     esp_sleep_enable_timer_wakeup(sleepTime);
     
+    // Last chance to keep state in RTC memory
+    if (deepSleepCallback != nullptr) {
+        deepSleepCallback();
+    }
+    
     // Enter deep sleep (device will reset after waking up)
     Serial.flush();
     esp_deep_sleep_start();
@@ -130,6 +136,10 @@ void PowerManagement::smartSleep() {
     }
 }
 
+void PowerManagement::setDeepSleepCallback(DeepSleepCallback callback) {
+    deepSleepCallback = callback;
+}
+
 void PowerManagement::calibrateBatteryADC(float knownVoltage) {
     // Read raw ADC value
     uint16_t adcValue = analogRead(BATTERY_ADC_PIN);
@@ -35,6 +35,9 @@ enum ChargingStatus {
     CHARGING_UNKNOWN
 };
 
+// Called right before deep sleep, to save what should survive it
+typedef void (*DeepSleepCallback)();
+
 class PowerManagement {
 public:
     PowerManagement();
@@ -66,6 +69,9 @@ public:
     // Smart sleep function that decides which sleep mode to use
     void smartSleep();
     
+    // Register a function to run before deep sleep resets the chip
+    void setDeepSleepCallback(DeepSleepCallback callback);
+    
     // Calibrate the ADC reading for battery voltage
     void calibrateBatteryADC(float knownVoltage);
     
@@ -80,6 +86,7 @@ private:
     ChargingStatus chargingStatus;
     float adcCalibration;
     unsigned long lastBatteryReadTime;
+    DeepSleepCallback deepSleepCallback;
     
     // Convert ADC reading to voltage
     float adcToVoltage(uint16_t adcValue);
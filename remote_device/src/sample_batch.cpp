@@ -0,0 +1,135 @@
+#include "sample_batch.h"
+
+SampleBatch::SampleBatch() :
+    used(0),
+    copiesUsed(0),
+    sentFrames(),
+    nextSent(0),
+    samples(0),
+    maxSamples(BATCH_MAX_SAMPLES),
+    maxAgeMs(BATCH_MAX_AGE),
+    firstAddedAt(0) {
+}
+
+void SampleBatch::setLimits(uint8_t maxSamples, unsigned long maxAgeMs) {
+    this->maxSamples = maxSamples;
+    this->maxAgeMs = maxAgeMs;
+}
+
+bool SampleBatch::add(const MetricRecord& sample) {
+    MetricRecord copy = sample;
+
+    // Keyframe or delta against the last acknowledged frame / previous sample
+    size_t n = encoder.encode(buffer + used, sizeof(buffer) - used, sample, samples == 0);
+    if (n == 0) {
+        return false;
+    }
+
+    if (samples == 0) {
+        firstAddedAt = millis();
+    }
+    used += n;
+
+    // Without room for its copy, the sample is lost if the frame fails
+    copiesUsed += MetricCodec::encodeKeyframe(copies + copiesUsed, sizeof(copies) - copiesUsed, copy);
+    samples++;
+    return true;
+}
+
+bool SampleBatch::isDue() const {
+    if (samples == 0) {
+        return false;
+    }
+
+    if (maxSamples > 0 && samples >= maxSamples) {
+        return true;
+    }
+
+    return maxAgeMs > 0 && millis() - firstAddedAt >= maxAgeMs;
+}
+
+const uint8_t* SampleBatch::data() const {
+    return buffer;
+}
+
+size_t SampleBatch::length() const {
+    return used;
+}
+
+uint8_t SampleBatch::count() const {
+    return samples;
+}
+
+void SampleBatch::sent(uint32_t frameId) {
+    encoder.frameQueued(frameId);
+
+    uint8_t slot = 0;
+    while (slot < BATCH_SENT_FRAMES && sentFrames[slot].used) {
+        slot++;
+    }
+    if (slot == BATCH_SENT_FRAMES) {
+        slot = nextSent;
+        nextSent = (nextSent + 1) % BATCH_SENT_FRAMES;
+    }
+    sentFrames[slot].used = true;
+    sentFrames[slot].frameId = frameId;
+    sentFrames[slot].length = copiesUsed;
+    memcpy(sentFrames[slot].data, copies, copiesUsed);
+
+    clear();
+}
+
+size_t SampleBatch::unsentCopies(const uint8_t** samples) const {
+    *samples = copies;
+    return copiesUsed;
+}
+
+size_t SampleBatch::copiesOf(uint32_t frameId, const uint8_t** samples) const {
+    for (uint8_t i = 0; i < BATCH_SENT_FRAMES; i++) {
+        if (sentFrames[i].used && sentFrames[i].frameId == frameId) {
+            *samples = sentFrames[i].data;
+            return sentFrames[i].length;
+        }
+    }
+    return 0;
+}
+
+size_t SampleBatch::nextSentCopies(uint8_t* slot, const uint8_t** samples) const {
+    for (; *slot < BATCH_SENT_FRAMES; (*slot)++) {
+        const SentCopies& frame = sentFrames[*slot];
+        if (frame.used && frame.length > 0) {
+            (*slot)++;
+            *samples = frame.data;
+            return frame.length;
+        }
+    }
+    return 0;
+}
+
+void SampleBatch::onResult(uint32_t frameId, bool success, bool resync) {
+    if (success) {
+        encoder.frameAcked(frameId);
+    } else {
+        encoder.frameFailed(frameId);
+    }
+
+    if (resync) {
+        encoder.requestKeyframe();
+    }
+
+    for (uint8_t i = 0; i < BATCH_SENT_FRAMES; i++) {
+        if (sentFrames[i].used && sentFrames[i].frameId == frameId) {
+            sentFrames[i].used = false;
+        }
+    }
+}
+
+const CodecStats& SampleBatch::getCodecStats() const {
+    return encoder.getStats();
+}
+
+void SampleBatch::clear() {
+    used = 0;
+    copiesUsed = 0;
+    samples = 0;
+}
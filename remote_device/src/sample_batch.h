@@ -0,0 +1,89 @@
+#ifndef SAMPLE_BATCH_H
+#define SAMPLE_BATCH_H
+
+#include <Arduino.h>
+#include "metric_codec.h"
+
+// Default limits; the batch is sent when either is reached
+#define BATCH_MAX_SAMPLES   6
+#define BATCH_MAX_AGE       300000  // ms, oldest sample waiting
+
+// Room for samples in one frame: MAX_PACKET_SIZE minus the largest frame
+// header (12 bytes), the device ID field (5 bytes) and the ARQ trailer (6 bytes)
+#define BATCH_BUFFER_SIZE   233
+
+// Self-contained (keyframe) copies of the samples, kept for the frames
+// waiting for their result so a failed frame's samples can be stored
+#define BATCH_COPY_SIZE     512
+#define BATCH_SENT_FRAMES   4
+
+// Metric samples packed into a single data frame. Each sample is compressed
+// (see metric_codec.h) as it is added, so the batch always knows whether the
+// next one still fits.
+class SampleBatch {
+public:
+    SampleBatch();
+
+    // Set the number of samples and the age of the oldest one that make the
+    // batch due (0 disables that limit)
+    void setLimits(uint8_t maxSamples, unsigned long maxAgeMs);
+
+    // Encode and append a sample (metrics and timestamp, see message_schema.h
+    // for filling one in). Returns false if it doesn't fit.
+    bool add(const MetricRecord& sample);
+
+    // Check whether the batch should be sent now
+    bool isDue() const;
+
+    // Encoded sample fields, to follow a data frame header
+    const uint8_t* data() const;
+    size_t length() const;
+    uint8_t count() const;
+
+    // The batch was handed to the radio as this frame; start a new one
+    void sent(uint32_t frameId);
+
+    // Keyframe copies of the samples not sent yet. Returns their length.
+    size_t unsentCopies(const uint8_t** samples) const;
+
+    // Keyframe copies of the samples sent as this frame, one field 62 each,
+    // until its result arrives. Returns their length, 0 if not kept.
+    size_t copiesOf(uint32_t frameId, const uint8_t** samples) const;
+
+    // Iterate the copies of every frame still waiting for its result: start
+    // with *slot = 0; returns 0 after the last
+    size_t nextSentCopies(uint8_t* slot, const uint8_t** samples) const;
+
+    // Delivery result of a frame, so later samples are coded against what
+    // the base has. resync = the base asked for a keyframe.
+    void onResult(uint32_t frameId, bool success, bool resync);
+
+    // Drop all samples
+    void clear();
+
+    // Keyframe/delta counts and sizes
+    const CodecStats& getCodecStats() const;
+
+private:
+    // Copies of a frame that was sent
+    struct SentCopies {
+        bool used;
+        uint32_t frameId;
+        uint16_t length;
+        uint8_t data[BATCH_COPY_SIZE];
+    };
+
+    uint8_t buffer[BATCH_BUFFER_SIZE];
+    size_t used;
+    uint8_t copies[BATCH_COPY_SIZE];
+    size_t copiesUsed;
+    SentCopies sentFrames[BATCH_SENT_FRAMES];
+    uint8_t nextSent;       // Slot reused when all are taken
+    uint8_t samples;
+    uint8_t maxSamples;
+    unsigned long maxAgeMs;
+    unsigned long firstAddedAt;
+    MetricEncoder encoder;
+};
+
+#endif // SAMPLE_BATCH_H
@@ -0,0 +1,109 @@
+#include "tdma.h"
+
+// Longest superframe a beacon may announce (slot offsets stay within 32 bits of us)
+#define TDMA_MAX_PERIOD_MS     3600000
+
+namespace Tdma {
+
+SuperframeLayout plan(uint32_t periodMs, uint32_t beaconUs, uint32_t frameUs, uint32_t ackUs) {
+    SuperframeLayout layout;
+    layout.periodMs = periodMs;
+
+    // Slot 0 starts a guard after the beacon is off the air
+    uint32_t firstSlotMs = beaconUs / 1000 + 1 + TDMA_GUARD_MS;
+    layout.firstSlotMs = firstSlotMs > 0xFFFF ? 0xFFFF : firstSlotMs;
+
+    // Guard, uplink, ACK delay, ACK, guard, rounded up to whole ms
+    uint32_t slotMs = (2 * TDMA_GUARD_MS + TDMA_ACK_DELAY_MS) + (frameUs + ackUs) / 1000 + 1;
+    layout.slotMs = slotMs > 0xFFFF ? 0xFFFF : slotMs;
+
+    // The last slot ends a guard before the next beacon goes on air
+    uint32_t reserved = layout.firstSlotMs + TDMA_GUARD_MS;
+    uint32_t count = periodMs > reserved ? (periodMs - reserved) / layout.slotMs : 0;
+    layout.slotCount = count > TDMA_MAX_SLOTS ? TDMA_MAX_SLOTS : count;
+    layout.contentionSlots = layout.slotCount > TDMA_CONTENTION_SLOTS ? TDMA_CONTENTION_SLOTS : layout.slotCount;
+    return layout;
+}
+
+uint32_t slotOffsetUs(const SuperframeLayout& layout, uint16_t slot) {
+    return ((uint32_t)layout.firstSlotMs + (uint32_t)slot * layout.slotMs) * 1000;
+}
+
+uint16_t dedicatedSlots(const SuperframeLayout& layout) {
+    return layout.slotCount - layout.contentionSlots;
+}
+
+size_t encodeBeacon(uint8_t* buffer, size_t size, uint32_t sequence, uint32_t timestamp,
+                    const SuperframeLayout& layout, uint32_t delayUs) {
+    static const WireField delayField = { FIELD_BEACON_DELAY, WIRE_VARINT, 1, UINT32_MAX, nullptr };
+
+    size_t offset = WireFormat::writeHeader(buffer, size, WIRE_TYPE_BEACON, 0, sequence, timestamp);
+    if (offset == 0) return 0;
+
+    // Layout as consecutive varints in one field
+    uint8_t body[5 * WIRE_MAX_VARINT_SIZE];
+    size_t length = 0;
+    uint32_t values[] = { layout.periodMs, layout.firstSlotMs, layout.slotMs, layout.slotCount, layout.contentionSlots };
+    for (size_t i = 0; i < 5; i++) {
+        length += WireFormat::writeVarint(body + length, sizeof(body) - length, values[i]);
+    }
+
+    size_t n = WireFormat::writeBytes(buffer + offset, size - offset, FIELD_SUPERFRAME, body, length);
+    if (n == 0) return 0;
+    offset += n;
+
+    n = WireFormat::writeField(buffer + offset, size - offset, delayField, delayUs);
+    if (n == 0) return 0;
+    return offset + n;
+}
+
+bool decodeBeacon(const uint8_t* buffer, size_t length, uint32_t* sequence,
+                  SuperframeLayout& layout, uint32_t* delayUs) {
+    FrameHeader header;
+    size_t offset = WireFormat::readHeader(buffer, length, header);
+    if (offset == 0 || header.type != WIRE_TYPE_BEACON) {
+        return false;
+    }
+    *sequence = header.id;
+    *delayUs = 0;
+
+    bool haveLayout = false;
+    while (offset < length) {
+        uint8_t fieldId, wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(buffer + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0) {
+            return false;
+        }
+        offset += n;
+
+        if (fieldId == FIELD_BEACON_DELAY && wireType == WIRE_VARINT) {
+            *delayUs = raw;
+        } else if (fieldId == FIELD_SUPERFRAME && wireType == WIRE_BYTES) {
+            uint32_t values[5];
+            size_t used = 0;
+            for (size_t i = 0; i < 5; i++) {
+                size_t m = WireFormat::readVarint(bytes + used, raw - used, &values[i]);
+                if (m == 0) {
+                    return false;
+                }
+                used += m;
+            }
+            layout.periodMs = values[0];
+            layout.firstSlotMs = values[1];
+            layout.slotMs = values[2];
+            layout.slotCount = values[3];
+            layout.contentionSlots = values[4];
+            haveLayout = true;
+        }
+    }
+
+    // Slots must fit the superframe
+    return haveLayout && layout.periodMs > 0 && layout.periodMs <= TDMA_MAX_PERIOD_MS &&
+           layout.slotMs > 0 && layout.slotCount <= TDMA_MAX_SLOTS &&
+           layout.contentionSlots <= layout.slotCount &&
+           layout.firstSlotMs + (uint32_t)layout.slotCount * layout.slotMs <= layout.periodMs;
+}
+
+} // namespace Tdma
@@ -0,0 +1,131 @@
+#include "tdma_sync.h"
+
+TdmaSync::TdmaSync() :
+    layout(),
+    lastStart(0),
+    lastSequence(0),
+    driftPpm(0.0),
+    spreadPpm(0.0),
+    synced(false),
+    driftKnown(false),
+    layoutCurrent(false),
+    missedInRow(0),
+    stats() {
+}
+
+void TdmaSync::onBeacon(int64_t startAt, uint32_t sequence, const SuperframeLayout& beaconLayout) {
+    stats.beacons++;
+
+    // Time between two beacons against the base's period gives our drift
+    if (synced && sequence > lastSequence && beaconLayout.periodMs == layout.periodMs) {
+        double expected = (double)(sequence - lastSequence) * layout.periodMs * 1000.0;
+        float sample = (float)(((double)(startAt - lastStart) - expected) / expected * 1e6);
+
+        if (fabsf(sample) <= TDMA_MAX_DRIFT_PPM) {
+            if (!driftKnown) {
+                driftPpm = sample;
+                spreadPpm = 0.0;
+                driftKnown = true;
+            } else {
+                // Smoothed with 1/4 gain; a new sample only every superframe or more
+                spreadPpm += (fabsf(sample - driftPpm) - spreadPpm) / 4;
+                driftPpm += (sample - driftPpm) / 4;
+            }
+        }
+    }
+
+    layout = beaconLayout;
+    lastStart = startAt;
+    lastSequence = sequence;
+    synced = true;
+    layoutCurrent = true;
+    missedInRow = 0;
+}
+
+void TdmaSync::onMissed() {
+    stats.missed++;
+    missedInRow++;
+    if (missedInRow >= TDMA_MAX_MISSED) {
+        // Keep the drift estimate, it still applies when we find the beacons again
+        synced = false;
+    }
+}
+
+void TdmaSync::invalidateLayout() {
+    layoutCurrent = false;
+}
+
+void TdmaSync::recordListen(uint32_t us) {
+    stats.listenUs += us;
+}
+
+bool TdmaSync::isSynced() const {
+    return synced;
+}
+
+bool TdmaSync::isLayoutCurrent() const {
+    return synced && layoutCurrent;
+}
+
+int64_t TdmaSync::beaconAt(uint32_t n) const {
+    // The base's period as our clock measures it
+    return lastStart + (int64_t)((double)n * layout.periodMs * (1000.0 + driftPpm / 1000.0));
+}
+
+uint32_t TdmaSync::getSequence() const {
+    return lastSequence;
+}
+
+uint32_t TdmaSync::superframeAfter(int64_t at, uint32_t offsetUs) const {
+    int64_t elapsed = at - offsetUs - lastStart;
+    if (elapsed <= 0 || layout.periodMs == 0) {
+        return 0;
+    }
+
+    // Estimate, then step past any rounding
+    uint32_t n = elapsed / ((int64_t)layout.periodMs * 1000);
+    while (n > 0 && beaconAt(n - 1) + offsetUs >= at) {
+        n--;
+    }
+    while (beaconAt(n) + offsetUs < at) {
+        n++;
+    }
+    return n;
+}
+
+uint32_t TdmaSync::guardUs(int64_t at) const {
+    int64_t distance = at > lastStart ? at - lastStart : lastStart - at;
+
+    // Measured spread with a margin, or the crystal tolerance before there is a measurement
+    float uncertaintyPpm = driftKnown ? TDMA_DRIFT_MARGIN_PPM + 2 * spreadPpm : TDMA_CRYSTAL_PPM;
+    double guard = TDMA_GUARD_BASE_US + (double)distance * uncertaintyPpm / 1e6;
+    return guard > UINT32_MAX ? UINT32_MAX : (uint32_t)guard;
+}
+
+float TdmaSync::getDriftPpm() const {
+    return driftPpm;
+}
+
+bool TdmaSync::isDriftKnown() const {
+    return driftKnown;
+}
+
+const SuperframeLayout& TdmaSync::getLayout() const {
+    return layout;
+}
+
+const TdmaStats& TdmaSync::getStats() const {
+    return stats;
+}
+
+void TdmaSync::countSearch() {
+    stats.searches++;
+}
+
+void TdmaSync::countFallback() {
+    stats.fallbacks++;
+}
+
+void TdmaSync::countLateWakeup() {
+    stats.lateWakeups++;
+}
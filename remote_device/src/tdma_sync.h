@@ -0,0 +1,88 @@
+#ifndef TDMA_SYNC_H
+#define TDMA_SYNC_H
+
+#include <Arduino.h>
+#include "tdma.h"
+
+// Remote side of TDMA mode: follows the base's beacons with the local clock.
+// Each beacon heard after another one measures how fast our crystal runs
+// against the base's. Later beacons and slots are predicted with that drift
+// taken out, and the guard around a prediction grows with its distance from
+// the last beacon by the uncertainty left in the estimate. Times are
+// esp_timer_get_time() us (keeps counting through light sleep); a beacon's
+// time is when the base scheduled its start.
+
+#define TDMA_CRYSTAL_PPM       40      // Drift assumed until it's measured (two 20 ppm crystals)
+#define TDMA_DRIFT_MARGIN_PPM  5       // Added to the measured spread (temperature changes)
+#define TDMA_MAX_DRIFT_PPM     200     // Larger measurements are taken as a miscounted beacon
+#define TDMA_GUARD_BASE_US     3000    // Timing noise at both ends, independent of drift
+#define TDMA_MAX_MISSED        3       // Expected beacons missed in a row before sync is lost
+
+// TDMA statistics
+struct TdmaStats {
+    uint32_t beacons;           // Beacons heard
+    uint32_t missed;            // Beacon windows that closed empty
+    uint32_t searches;          // Continuous listens for a beacon without sync
+    uint32_t fallbacks;         // Sends made without a slot because no beacon was found
+    uint32_t lateWakeups;       // Slots or windows missed because we woke too late
+    uint64_t listenUs;          // Receiver time spent waiting for beacons
+};
+
+class TdmaSync {
+public:
+    TdmaSync();
+
+    // A beacon scheduled to start at local time startAt was heard
+    void onBeacon(int64_t startAt, uint32_t sequence, const SuperframeLayout& layout);
+
+    // A beacon window closed without one; sync is lost after TDMA_MAX_MISSED
+    void onMissed();
+
+    // Radio settings changed: hear a beacon before the next slot
+    void invalidateLayout();
+
+    // Receiver time spent listening for beacons
+    void recordListen(uint32_t us);
+
+    // Following the beacons (and the layout is current)
+    bool isSynced() const;
+    bool isLayoutCurrent() const;
+
+    // Predicted start of the beacon n superframes after the last one heard
+    int64_t beaconAt(uint32_t n) const;
+
+    // Superframe number of the last beacon heard
+    uint32_t getSequence() const;
+
+    // First superframe whose beacon start plus offsetUs is at or after at
+    uint32_t superframeAfter(int64_t at, uint32_t offsetUs) const;
+
+    // Error bound of a prediction for local time at
+    uint32_t guardUs(int64_t at) const;
+
+    // Local clock rate against the base's (positive: ours runs fast)
+    float getDriftPpm() const;
+    bool isDriftKnown() const;
+
+    const SuperframeLayout& getLayout() const;
+    const TdmaStats& getStats() const;
+
+    // Count a search, a fallback send or a late wakeup
+    void countSearch();
+    void countFallback();
+    void countLateWakeup();
+
+private:
+    SuperframeLayout layout;
+    int64_t lastStart;          // Scheduled start of the last beacon heard
+    uint32_t lastSequence;
+    float driftPpm;
+    float spreadPpm;            // Smoothed deviation of the measurements from driftPpm
+    bool synced;
+    bool driftKnown;
+    bool layoutCurrent;
+    uint8_t missedInRow;
+    TdmaStats stats;
+};
+
+#endif // TDMA_SYNC_H
@@ -0,0 +1,348 @@
+#include "uplink_store.h"
+#include <LittleFS.h>
+#include "wire_format.h"
+
+// Oldest segment and the read offset in it
+#define STORE_POSITION_PATH STORE_DIR "/position"
+
+UplinkStore::UplinkStore() :
+    mounted(false),
+    firstSegment(1),
+    lastSegment(0),
+    readOffset(0),
+    flashRecords(0),
+    positionDirty(false),
+    positionDirtySince(0),
+    buffered(0),
+    bufferedRecords(0),
+    bufferedSince(0),
+    peeked(false),
+    peekedFromFlash(false),
+    peekedBytes(0),
+    peekedRecords(0),
+    peekedAt(0),
+    stats() {
+}
+
+bool UplinkStore::begin() {
+    if (!LittleFS.begin(true)) {
+        Serial.println(F("Uplink store: no file system"));
+        return false;
+    }
+    mounted = true;
+
+    if (!LittleFS.exists(STORE_DIR)) {
+        LittleFS.mkdir(STORE_DIR);
+    }
+
+    // Segments are numbered in the order they were written
+    bool found = false;
+    File dir = LittleFS.open(STORE_DIR);
+    File file = dir.openNextFile();
+    while (file) {
+        const char* name = strrchr(file.name(), '/');
+        name = name != nullptr ? name + 1 : file.name();
+        if (name[0] >= '0' && name[0] <= '9') {
+            uint32_t segment = strtoul(name, nullptr, 10);
+            if (!found || segment < firstSegment) firstSegment = segment;
+            if (!found || segment > lastSegment) lastSegment = segment;
+            found = true;
+        }
+        file.close();
+        file = dir.openNextFile();
+    }
+    dir.close();
+    if (!found) {
+        firstSegment = 1;
+        lastSegment = 0;
+    }
+
+    // Where draining stopped
+    readOffset = 0;
+    File position = LittleFS.open(STORE_POSITION_PATH, "r");
+    if (position) {
+        uint8_t saved[6];
+        if (position.read(saved, sizeof(saved)) == sizeof(saved)) {
+            uint32_t segment = saved[0] | (saved[1] << 8) | (saved[2] << 16) | ((uint32_t)saved[3] << 24);
+            if (found && segment == firstSegment) {
+                readOffset = saved[4] | (saved[5] << 8);
+            }
+        }
+        position.close();
+    }
+
+    flashRecords = 0;
+    for (uint32_t segment = firstSegment; found && segment <= lastSegment; segment++) {
+        flashRecords += countRecords(segment, segment == firstSegment ? readOffset : 0);
+    }
+
+    Serial.print(F("Uplink store: "));
+    Serial.print(flashRecords);
+    Serial.println(F(" samples queued"));
+    return true;
+}
+
+bool UplinkStore::push(const uint8_t* samples, size_t length) {
+    if (!mounted) {
+        return false;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        uint8_t fieldId;
+        uint8_t wireType;
+        uint32_t raw;
+        const uint8_t* bytes;
+        size_t n = WireFormat::readField(samples + offset, length - offset, &fieldId, &wireType, &raw, &bytes);
+        if (n == 0 || n > 255 || fieldId != FIELD_SAMPLE) {
+            return false;
+        }
+
+        if (buffered + 1 + n > sizeof(buffer)) {
+            flush();
+        }
+        if (buffered + 1 + n > sizeof(buffer)) {
+            // Flash write failed and the buffer is still full
+            stats.dropped++;
+        } else {
+            if (buffered == 0) {
+                bufferedSince = millis();
+            }
+            buffer[buffered++] = n;
+            memcpy(buffer + buffered, samples + offset, n);
+            buffered += n;
+            bufferedRecords++;
+            stats.stored++;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+void UplinkStore::update() {
+    // Draining alone moves the position, with nothing in the write buffer
+    if (positionDirty && millis() - positionDirtySince >= STORE_FLUSH_MS) {
+        savePosition();
+    }
+
+    // Not while a drain frame is carrying records from the buffer
+    if (buffered == 0 || (peeked && !peekedFromFlash)) {
+        return;
+    }
+
+    if (millis() - bufferedSince >= STORE_FLUSH_MS) {
+        flush();
+    }
+}
+
+void UplinkStore::flush() {
+    if (!mounted) {
+        return;
+    }
+
+    if (buffered > 0) {
+        if (append(buffer, buffered, bufferedRecords)) {
+            // Records of a drain frame in flight move to flash as well and
+            // are sent again even if it's acknowledged
+            if (peeked && !peekedFromFlash) {
+                peeked = false;
+            }
+            buffered = 0;
+            bufferedRecords = 0;
+        } else {
+            // Try again later
+            bufferedSince = millis();
+        }
+    }
+
+    if (positionDirty) {
+        savePosition();
+    }
+}
+
+uint32_t UplinkStore::depth() const {
+    return flashRecords + bufferedRecords;
+}
+
+bool UplinkStore::isEmpty() const {
+    return depth() == 0;
+}
+
+size_t UplinkStore::peek(uint8_t* samples, size_t size, uint8_t* count) {
+    *count = 0;
+    if (peeked || isEmpty()) {
+        return 0;
+    }
+
+    // Oldest first: flash, then the write buffer
+    size_t length = 0;
+    size_t bytes = 0;
+    if (flashRecords > 0) {
+        char path[32];
+        segmentPath(firstSegment, path, sizeof(path));
+        File file = LittleFS.open(path, "r");
+        if (!file) {
+            return 0;
+        }
+        file.seek(readOffset);
+        uint8_t n;
+        while (file.read(&n, 1) == 1 && length + n <= size && *count < 255) {
+            if (file.read(samples + length, n) != n) {
+                break;
+            }
+            length += n;
+            bytes += 1 + n;
+            (*count)++;
+        }
+        file.close();
+        peekedFromFlash = true;
+    } else {
+        while (bytes < buffered && length + buffer[bytes] <= size && *count < 255) {
+            uint8_t n = buffer[bytes];
+            memcpy(samples + length, buffer + bytes + 1, n);
+            length += n;
+            bytes += 1 + n;
+            (*count)++;
+        }
+        peekedFromFlash = false;
+    }
+
+    if (*count == 0) {
+        return 0;
+    }
+    peeked = true;
+    peekedBytes = bytes;
+    peekedRecords = *count;
+    peekedAt = millis();
+    return length;
+}
+
+void UplinkStore::drained(bool success) {
+    if (!peeked) {
+        return;
+    }
+    peeked = false;
+    stats.drainMs += millis() - peekedAt;
+
+    if (!success) {
+        return;
+    }
+    stats.drained += peekedRecords;
+
+    if (!peekedFromFlash) {
+        memmove(buffer, buffer + peekedBytes, buffered - peekedBytes);
+        buffered -= peekedBytes;
+        bufferedRecords -= peekedRecords;
+        return;
+    }
+
+    readOffset += peekedBytes;
+    flashRecords -= peekedRecords;
+    if (!positionDirty) {
+        positionDirty = true;
+        positionDirtySince = millis();
+    }
+
+    // Done with the segment once everything in it was read
+    if (countRecords(firstSegment, readOffset) == 0) {
+        removeFirstSegment();
+    }
+}
+
+const StoreStats& UplinkStore::getStats() const {
+    return stats;
+}
+
+float UplinkStore::getDrainRate() const {
+    return stats.drainMs > 0 ? stats.drained * 1000.0f / stats.drainMs : 0;
+}
+
+void UplinkStore::segmentPath(uint32_t segment, char* path, size_t size) const {
+    snprintf(path, size, STORE_DIR "/%lu", (unsigned long)segment);
+}
+
+bool UplinkStore::append(const uint8_t* records, size_t length, uint32_t count) {
+    char path[32];
+    bool hasSegment = lastSegment >= firstSegment;
+    if (hasSegment) {
+        segmentPath(lastSegment, path, sizeof(path));
+        File file = LittleFS.open(path, "r");
+        hasSegment = file && file.size() + length <= STORE_SEGMENT_SIZE;
+        file.close();
+    }
+
+    if (!hasSegment) {
+        // Full: the oldest samples make way
+        if (lastSegment - firstSegment + 1 >= STORE_MAX_SEGMENTS) {
+            removeFirstSegment();
+        }
+        lastSegment++;
+        segmentPath(lastSegment, path, sizeof(path));
+    }
+
+    File file = LittleFS.open(path, "a");
+    if (!file) {
+        return false;
+    }
+    size_t written = file.write(records, length);
+    file.close();
+    if (written != length) {
+        return false;
+    }
+
+    flashRecords += count;
+    stats.flashWrites++;
+    stats.flashBytes += length;
+    return true;
+}
+
+void UplinkStore::removeFirstSegment() {
+    uint32_t unread = countRecords(firstSegment, readOffset);
+    flashRecords -= unread;
+    stats.dropped += unread;
+
+    char path[32];
+    segmentPath(firstSegment, path, sizeof(path));
+    LittleFS.remove(path);
+    firstSegment++;
+    readOffset = 0;
+
+    // A drain frame in flight no longer has its records
+    if (peeked && peekedFromFlash) {
+        peeked = false;
+    }
+    savePosition();
+}
+
+uint32_t UplinkStore::countRecords(uint32_t segment, uint16_t offset) const {
+    char path[32];
+    segmentPath(segment, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+    size_t size = file.size();
+    size_t position = offset;
+    uint8_t n;
+    while (position < size && file.seek(position) && file.read(&n, 1) == 1 && position + 1 + n <= size) {
+        position += 1 + n;
+        count++;
+    }
+    file.close();
+    return count;
+}
+
+void UplinkStore::savePosition() {
+    uint8_t saved[6] = {
+        (uint8_t)firstSegment, (uint8_t)(firstSegment >> 8), (uint8_t)(firstSegment >> 16), (uint8_t)(firstSegment >> 24),
+        (uint8_t)readOffset, (uint8_t)(readOffset >> 8)
+    };
+    File file = LittleFS.open(STORE_POSITION_PATH, "w");
+    if (file) {
+        file.write(saved, sizeof(saved));
+        file.close();
+    }
+    positionDirty = false;
+}
@@ -0,0 +1,114 @@
+#ifndef UPLINK_STORE_H
+#define UPLINK_STORE_H
+
+#include <Arduino.h>
+
+// Flash used by the queue: segment files of one flash block each. When all
+// are full, the oldest segment is dropped to make room.
+#define STORE_SEGMENT_SIZE  4096
+#define STORE_MAX_SEGMENTS  16
+
+// Write combining: samples collect in RAM and are appended to flash in one
+// write once this many bytes are waiting or the oldest is STORE_FLUSH_MS old
+#define STORE_WRITE_SIZE    512
+#define STORE_FLUSH_MS      600000  // 10 minutes
+
+// Where the queue lives on the LittleFS partition
+#define STORE_DIR           "/uplink"
+
+// Queue statistics
+struct StoreStats {
+    uint32_t stored;        // Samples put in the queue
+    uint32_t drained;       // Samples delivered from the queue
+    uint32_t dropped;       // Samples lost to a full queue
+    uint32_t flashWrites;   // Appends to flash (one per flush)
+    uint32_t flashBytes;    // Bytes appended to flash
+    uint32_t drainMs;       // Time drain frames were in flight
+};
+
+// Store-and-forward queue for samples whose frame failed. Each record is one
+// keyframe sample field (field 62), so it can be sent in any later frame
+// whatever the base has received since. Records survive reboot and deep sleep
+// once flushed; draining takes the oldest first, and a record is only removed
+// when the frame carrying it is acknowledged.
+class UplinkStore {
+public:
+    UplinkStore();
+
+    // Mount the file system (formatting it if it can't be mounted) and pick
+    // up the records left from before. False if there's no usable flash.
+    bool begin();
+
+    // Queue sample fields (one or more field 62s). Returns false if the
+    // store isn't available or a field is malformed.
+    bool push(const uint8_t* samples, size_t length);
+
+    // Flush the write buffer, and save the drain position, when it's due
+    void update();
+
+    // Write the buffered records and the drain position to flash now
+    // (before deep sleep)
+    void flush();
+
+    // Samples in the queue, in RAM and on flash
+    uint32_t depth() const;
+    bool isEmpty() const;
+
+    // Copy as many of the oldest records as fit in size into samples, for one
+    // drain frame. Returns their length; count gets the number of samples.
+    size_t peek(uint8_t* samples, size_t size, uint8_t* count);
+
+    // Result of the frame carrying the last peek(): delivered records are
+    // removed, failed ones stay queued
+    void drained(bool success);
+
+    // Get queue statistics
+    const StoreStats& getStats() const;
+
+    // Samples delivered per second while draining
+    float getDrainRate() const;
+
+private:
+    bool mounted;
+
+    // Segment files hold [length][field] records; the oldest is read from
+    // readOffset, new records are appended to the newest
+    uint32_t firstSegment;
+    uint32_t lastSegment;   // firstSegment - 1 when there are none
+    uint16_t readOffset;
+    uint32_t flashRecords;
+    bool positionDirty;     // readOffset changed since it was saved
+    unsigned long positionDirtySince;
+
+    // Write buffer, in the same record format
+    uint8_t buffer[STORE_WRITE_SIZE];
+    size_t buffered;
+    uint32_t bufferedRecords;
+    unsigned long bufferedSince;
+
+    // Records handed out by the last peek()
+    bool peeked;
+    bool peekedFromFlash;
+    size_t peekedBytes;
+    uint8_t peekedRecords;
+    unsigned long peekedAt;
+
+    StoreStats stats;
+
+    // Segment file name
+    void segmentPath(uint32_t segment, char* path, size_t size) const;
+
+    // Append records to the newest segment (starting a new one when full)
+    bool append(const uint8_t* records, size_t length, uint32_t count);
+
+    // Remove the oldest segment; its records that weren't read are dropped
+    void removeFirstSegment();
+
+    // Count the records of a segment from offset
+    uint32_t countRecords(uint32_t segment, uint16_t offset) const;
+
+    // Save the drain position
+    void savePosition();
+};
+
+#endif // UPLINK_STORE_H
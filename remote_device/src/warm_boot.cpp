@@ -0,0 +1,52 @@
+#include "warm_boot.h"
+#include <esp_sleep.h>
+
+// Marks the saved state as complete
+#define WARM_BOOT_MAGIC  0x57524D31
+
+// Global instance
+WarmBoot warmBoot;
+
+// Kept in RTC slow memory through deep sleep
+static RTC_DATA_ATTR uint32_t savedMagic = 0;
+static RTC_DATA_ATTR uint32_t wakeCount = 0;
+static RTC_DATA_ATTR uint16_t pendingLength = 0;
+static RTC_DATA_ATTR uint8_t pending[WARM_BOOT_PENDING_SIZE];
+
+WarmBoot::WarmBoot() :
+    warm(false) {
+}
+
+void WarmBoot::begin() {
+    warm = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && savedMagic == WARM_BOOT_MAGIC;
+
+    // Anything that resets the chip from here on boots cold
+    savedMagic = 0;
+
+    if (warm) {
+        wakeCount++;
+    } else {
+        wakeCount = 0;
+        pendingLength = 0;
+    }
+}
+
+bool WarmBoot::isWarm() const {
+    return warm;
+}
+
+void WarmBoot::commit(const uint8_t* samples, size_t length) {
+    // Samples that don't fit are lost, as they would be without a warm boot
+    pendingLength = length <= sizeof(pending) ? length : 0;
+    memcpy(pending, samples, pendingLength);
+    savedMagic = WARM_BOOT_MAGIC;
+}
+
+size_t WarmBoot::pendingSamples(const uint8_t** samples) const {
+    *samples = pending;
+    return warm ? pendingLength : 0;
+}
+
+uint32_t WarmBoot::getWakeCount() const {
+    return wakeCount;
+}
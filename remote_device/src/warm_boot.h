@@ -0,0 +1,43 @@
+#ifndef WARM_BOOT_H
+#define WARM_BOOT_H
+
+#include <Arduino.h>
+
+// Time from reset to the first transmission a warm boot should stay within
+#define WARM_BOOT_TX_BUDGET_MS  50
+
+// Room for samples that were waiting to be sent (one batch of keyframe copies)
+#define WARM_BOOT_PENDING_SIZE  512
+
+// Deep sleep resets the chip, but RTC slow memory keeps its contents. Right
+// before deep sleep, modules save the state worth keeping there (message IDs,
+// radio settings, metric totals), and commit() marks it complete. A timer
+// wakeup with complete state is a warm boot: setup() restores that state and
+// skips the slow parts of initialization. Any other start is a cold boot.
+class WarmBoot {
+public:
+    WarmBoot();
+
+    // Find out how the chip started; call first in setup()
+    void begin();
+
+    // Woke from deep sleep with saved state
+    bool isWarm() const;
+
+    // The modules' state is saved: mark it complete, with the samples not
+    // sent yet (keyframe fields) to send after the wakeup
+    void commit(const uint8_t* samples, size_t length);
+
+    // Samples saved by commit(), on a warm boot. Returns their length.
+    size_t pendingSamples(const uint8_t** samples) const;
+
+    // Warm boots in a row since the last cold boot
+    uint32_t getWakeCount() const;
+
+private:
+    bool warm;
+};
+
+extern WarmBoot warmBoot;
+
+#endif // WARM_BOOT_H
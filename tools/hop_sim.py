@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+"""Co-located TDMA networks on one channel or hopping, with a jammed channel.
+
+Each network is a base station with a full set of remotes in TDMA mode: every
+dedicated slot is owned and carries one data frame per superframe. Networks
+run their superframes at random offsets to each other, as independent bases
+would. A frame is delivered when neither it nor its ACK overlaps a
+transmission of another network on the same channel and the interferer
+doesn't hit it. Three setups are compared:
+
+  single     every network on LORA_FREQUENCY, and the interferer is on it too
+  hop        LORA_HOP_ENABLE: slots hop over the plan with a seed per network,
+             the interferer is on one of the plan's channels
+  blacklist  hop, with the base leaving out channels that lose frames, as
+             channel_monitor.cpp does (including the HOP_MASK_LEAD delay)
+
+Beacons, retries and remotes without a slot are not modelled; see
+tdma_sim.py for those. The channel choice and the blacklisting use the same
+formulas as hopping.cpp and channel_monitor.cpp.
+
+Usage: python3 tools/hop_sim.py [--sf 10] [--bw 125] [--frame 64]
+                                [--networks 1,2,4,8] [--jam 0.5] [--hours 12]
+"""
+
+import argparse
+import random
+
+from tdma_sim import ACK_SLOT_SIZE, GUARD_MS, SUPERFRAME_MS, TURNAROUND_US, airtime_us, plan
+
+# hopping.h
+HOP_CHANNEL_COUNT = 8
+HOP_MASK_LEAD = 12
+HOP_STATS_GAIN = 32
+
+# channel_monitor.h
+HOP_BLACKLIST_ERROR_RATE = 0.5
+HOP_BLACKLIST_MARGIN = 0.25
+HOP_MIN_FRAMES = 8
+HOP_MIN_CHANNELS = 3
+HOP_RETRY_SUPERFRAMES = 20
+
+JAMMED_CHANNEL = 2
+PLAN_MASK = (1 << HOP_CHANNEL_COUNT) - 1
+
+
+def mix(x):
+    """MurmurHash3 finalizer, as in hopping.cpp."""
+    x &= 0xFFFFFFFF
+    x ^= x >> 16
+    x = (x * 0x85EBCA6B) & 0xFFFFFFFF
+    x ^= x >> 13
+    x = (x * 0xC2B2AE35) & 0xFFFFFFFF
+    x ^= x >> 16
+    return x
+
+
+def channel_for(seed, mask, superframe, slot):
+    channels = [c for c in range(HOP_CHANNEL_COUNT) if mask & (1 << c)]
+    n = mix(mix((seed << 16) ^ superframe) ^ slot) % len(channels)
+    return channels[n]
+
+
+class Monitor:
+    """ChannelMonitor: per-channel error rate and the hop set."""
+
+    def __init__(self):
+        self.mask = PLAN_MASK
+        self.next_mask = PLAN_MASK
+        self.change_at = 0
+        self.frames = [0] * HOP_CHANNEL_COUNT
+        self.error_rate = [0.0] * HOP_CHANNEL_COUNT
+        self.left_out_at = [0] * HOP_CHANNEL_COUNT
+        self.judged_from = [0] * HOP_CHANNEL_COUNT
+        self.blacklisted = 0
+
+    def mask_at(self, superframe):
+        return self.next_mask if superframe >= self.change_at else self.mask
+
+    def on_slot(self, channel, heard):
+        self.frames[channel] += 1
+        self.error_rate[channel] += ((0.0 if heard else 1.0) - self.error_rate[channel]) / HOP_STATS_GAIN
+
+    def update(self, superframe):
+        if self.change_at > superframe:
+            return
+        self.mask = self.next_mask
+        judged = [c for c in range(HOP_CHANNEL_COUNT)
+                  if self.mask & (1 << c) and self.frames[c] - self.judged_from[c] >= HOP_MIN_FRAMES]
+        total = sum(self.error_rate[c] for c in judged)
+        mask = self.mask
+        in_use = bin(mask).count("1")
+        for c in range(HOP_CHANNEL_COUNT):
+            bit = 1 << c
+            if not mask & bit:
+                if superframe >= self.left_out_at[c] + HOP_RETRY_SUPERFRAMES:
+                    mask |= bit
+                    self.error_rate[c] = 0.0
+                    self.judged_from[c] = self.frames[c]
+                continue
+            if self.frames[c] - self.judged_from[c] < HOP_MIN_FRAMES or len(judged) < 2 or in_use <= HOP_MIN_CHANNELS:
+                continue
+            others = (total - self.error_rate[c]) / (len(judged) - 1)
+            if self.error_rate[c] >= HOP_BLACKLIST_ERROR_RATE and self.error_rate[c] >= others + HOP_BLACKLIST_MARGIN:
+                mask &= ~bit
+                self.left_out_at[c] = superframe + HOP_MASK_LEAD
+                in_use -= 1
+                self.blacklisted += 1
+        if mask != self.mask:
+            self.next_mask = mask
+            self.change_at = superframe + HOP_MASK_LEAD
+
+
+def overlaps(intervals):
+    """Indexes of intervals overlapping another one (sorted sweep)."""
+    order = sorted(range(len(intervals)), key=lambda i: intervals[i][0])
+    hit = set()
+    end, owner = -1, None
+    for i in order:
+        start, stop = intervals[i]
+        if start < end:
+            hit.add(i)
+            hit.add(owner)
+        if stop > end:
+            end, owner = stop, i
+    return hit
+
+
+def simulate(mode, networks, sf, bw_khz, frame_bytes, jam, hours, seed):
+    rng = random.Random(seed)
+    period_us = SUPERFRAME_MS * 1000
+    frame = airtime_us(frame_bytes, sf, bw_khz)
+    ack = airtime_us(ACK_SLOT_SIZE, sf, bw_khz)
+    first_slot_ms, slot_ms, slots, shared = plan(sf, bw_khz)
+    dedicated = slots - shared
+    superframes = int(hours * 3600e3 / SUPERFRAME_MS)
+
+    offsets = [rng.randrange(period_us) for _ in range(networks)]
+    seeds = [rng.randrange(1 << 16) for _ in range(networks)]
+    sequences = [rng.randrange(1 << 20) for _ in range(networks)]
+    monitors = [Monitor() for _ in range(networks)]
+    jammed = None if mode == "single" else JAMMED_CHANNEL
+
+    sent = delivered = 0
+    per_channel = [[0, 0] for _ in range(HOP_CHANNEL_COUNT)]   # network 0: sent, delivered
+
+    # One superframe of every network at a time; a network's superframe k
+    # overlaps the next one of a network with a larger offset, so carry over
+    pending = []
+    for k in range(superframes + 1):
+        batch = []
+        for n in range(networks):
+            start = k * period_us + offsets[n]
+            superframe = sequences[n] + k
+            if mode == "blacklist":
+                monitors[n].update(superframe)
+            mask = monitors[n].mask_at(superframe)
+            for s in range(dedicated):
+                t = start + (first_slot_ms + s * slot_ms + GUARD_MS) * 1000
+                channel = 0 if mode == "single" else channel_for(seeds[n], mask, superframe, s)
+                batch.append((n, channel, t, t + frame, t + frame + TURNAROUND_US + ack))
+
+        # Everything that can still overlap: last superframe's tail and this one
+        window = pending + batch
+        by_channel = {}
+        for i, (n, channel, t, tx_end, ack_end) in enumerate(window):
+            by_channel.setdefault(channel, []).append(i)
+        collided = set()
+        for channel, members in by_channel.items():
+            hit = overlaps([(window[i][2], window[i][4]) for i in members])
+            collided.update(members[j] for j in hit)
+
+        # Settle last superframe's transmissions; this one's wait for the next
+        for i, (n, channel, t, tx_end, ack_end) in enumerate(window[:len(pending)]):
+            jam_hit = (channel == 0 if mode == "single" else channel == jammed) and rng.random() < jam
+            ok = i not in collided and not jam_hit
+            sent += 1
+            delivered += ok
+            if mode == "blacklist":
+                monitors[n].on_slot(channel, ok)
+            if n == 0 and mode != "single":
+                per_channel[channel][0] += 1
+                per_channel[channel][1] += ok
+        pending = batch
+
+    seconds = superframes * SUPERFRAME_MS / 1000
+    return {
+        "delivered": delivered / max(sent, 1),
+        "goodput": delivered * frame_bytes / seconds,
+        "per": [1 - d / s if s else 0.0 for s, d in per_channel],
+        "blacklisted": sum(m.blacklisted for m in monitors),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--sf", type=int, default=10)
+    parser.add_argument("--bw", type=float, default=125.0, help="kHz")
+    parser.add_argument("--frame", type=int, default=64, help="data frame bytes")
+    parser.add_argument("--networks", default="1,2,4,8")
+    parser.add_argument("--jam", type=float, default=0.5, help="share of frames the interferer destroys")
+    parser.add_argument("--hours", type=float, default=12.0)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    first_slot_ms, slot_ms, slots, shared = plan(args.sf, args.bw)
+    print(f"SF{args.sf}/{args.bw:g} kHz, {args.frame} byte frames, {slots - shared} remotes per network, "
+          f"{HOP_CHANNEL_COUNT} channels, interferer destroys {args.jam:.0%} on its channel, "
+          f"{args.hours:g} h simulated, seed {args.seed}\n")
+
+    print("| Networks | Mode | Delivered | Aggregate goodput | Network 0 loss per channel | Channels left out |")
+    print("|---|---|---|---|---|---|")
+    for networks in [int(n) for n in args.networks.split(",")]:
+        for mode in ("single", "hop", "blacklist"):
+            r = simulate(mode, networks, args.sf, args.bw, args.frame, args.jam, args.hours, args.seed)
+            per = "-" if mode == "single" else " ".join(f"{p:.0%}" for p in r["per"])
+            left_out = r["blacklisted"] if mode == "blacklist" else "-"
+            print(f"| {networks} | {mode} | {r['delivered']:.1%} | {r['goodput']:.1f} B/s | {per} | {left_out} |")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+"""Read the base station's serial output, JSON lines or binary records, and count records per second.
+
+The base writes one JSON object per line by default. With --binary this
+script first sends CMD:CONFIG {"output": "binary"} (and {"baud": N} with
+--baud, then reopens the port at that rate), after which the base writes
+COBS-framed records with a CRC-32 (record_writer.h). Either way each record
+is printed as one JSON line in the layout of the JSON mode, so whatever
+reads this script's output doesn't need to know which mode the base is in.
+
+Text printed with Serial.print between records (boot messages, debug
+output) goes to stderr with --text and is dropped otherwise. With --stats,
+records/s, bytes/s and CRC errors are printed to stderr every few seconds.
+
+Needs pyserial for a port; --file reads a capture instead ("-" for stdin).
+
+Usage: python3 tools/serial_decode.py --port /dev/ttyUSB0 [--binary] [--baud 921600]
+                                      [--stats 10] [--text]
+       python3 tools/serial_decode.py --file capture.bin [--stats 10]
+"""
+
+import argparse
+import json
+import struct
+import sys
+import time
+import zlib
+
+# serial_manager.h
+SERIAL_BAUD_RATE = 115200
+
+# record_writer.h
+RECORD_MESSAGE = 1
+RECORD_SIGNAL = 2
+RECORD_SYSTEM = 3
+RECORD_STATUS = 4
+RECORD_LOG = 5
+RECORD_DEBUG = 6
+RECORD_ERROR = 7
+RECORD_METRICS = 8
+RECORD_TRANSFER = 9
+
+TEXT_RECORDS = {RECORD_STATUS: "status", RECORD_LOG: "log", RECORD_DEBUG: "debug", RECORD_ERROR: "error"}
+
+# wire_format.h frame types
+MESSAGE_TYPES = {1: "ping", 2: "pong", 3: "data", 4: "status"}
+
+# message_schema.h METRIC_FIELDS, indexed by field ID - 1: key, scale, signed
+METRIC_FIELDS = [
+    ("uptime", 1, False),
+    ("free_memory", 1, False),
+    ("temperature", 100, True),
+    ("battery", 1000, False),
+    ("battery_percent", 1, False),
+    ("charging", 1, False),
+    ("success_rate", 1000, False),
+    ("avg_retries", 100, False),
+    ("avg_latency", 1, False),
+    ("total_packets", 1, False),
+    ("rssi", 1, True),
+    ("snr", 100, True),
+    ("solar_voltage", 1000, False),
+    ("packet_loss", 1000, False),
+    ("airtime", 1, False),
+    ("rtt", 10, False),
+]
+
+
+class RecordError(Exception):
+    pass
+
+
+def cobs_decode(data):
+    """Undo COBS; raises RecordError on a malformed block."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise RecordError("bad COBS block")
+        out += data[i + 1:i + code]
+        i += code
+        if code < 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def metric_value(index, raw):
+    name, scale, signed = METRIC_FIELDS[index]
+    if signed and raw >= 1 << 31:
+        raw -= 1 << 32
+    return name, raw if scale == 1 else raw / scale
+
+
+def decode_record(frame):
+    """One record between delimiters, as the JSON mode would have written it."""
+    data = cobs_decode(frame)
+    if len(data) < 5:
+        raise RecordError("short record")
+    body, crc = data[:-4], struct.unpack("<I", data[-4:])[0]
+    if zlib.crc32(body) != crc:
+        raise RecordError("CRC mismatch")
+    kind, fields = body[0], body[1:]
+
+    if kind == RECORD_MESSAGE:
+        msg_type, device, msg_id, timestamp, sample, samples, present = struct.unpack_from("<BIIIBBH", fields)
+        offset = struct.calcsize("<BIIIBBH")
+        message = {"type": MESSAGE_TYPES.get(msg_type, msg_type), "id": msg_id}
+        if device:
+            message["device"] = device
+        if samples:
+            message["sample"] = sample
+            message["samples"] = samples
+        message["timestamp"] = timestamp
+        metrics = {}
+        for i in range(len(METRIC_FIELDS)):
+            if present & (1 << i):
+                name, value = metric_value(i, struct.unpack_from("<I", fields, offset)[0])
+                metrics[name] = value
+                offset += 4
+        if msg_type in (3, 4):
+            message["metrics"] = metrics
+        if offset < len(fields):
+            message["payload"] = fields[offset:].decode("utf-8", "replace")
+        return {"type": "remote_data", "data": message}
+
+    if kind == RECORD_SIGNAL:
+        rssi, snr, loss, latency = struct.unpack("<hfff", fields)
+        return {"type": "signal_metrics",
+                "metrics": {"rssi": rssi, "snr": round(snr, 2), "packet_loss": round(loss, 4),
+                            "latency": round(latency, 2)}}
+
+    if kind == RECORD_SYSTEM:
+        uptime, packets, errors = struct.unpack("<III", fields)
+        return {"type": "system_metrics",
+                "metrics": {"uptime": uptime, "packets_received": packets, "errors": errors}}
+
+    if kind in TEXT_RECORDS:
+        timestamp = struct.unpack_from("<I", fields)[0]
+        return {"type": TEXT_RECORDS[kind], "message": fields[4:].decode("utf-8", "replace"),
+                "timestamp": timestamp}
+
+    if kind == RECORD_METRICS:
+        return {"type": "metrics", "data": json.loads(fields.decode("utf-8"))}
+
+    if kind == RECORD_TRANSFER:
+        device, transfer, length, fragments, elapsed = struct.unpack_from("<IHIHI", fields)
+        data = fields[struct.calcsize("<IHIHI"):]
+        if len(data) != length:
+            raise RecordError("transfer length mismatch")
+        return {"type": "transfer", "device": device, "transfer": transfer, "length": length,
+                "fragments": fragments, "elapsed_ms": elapsed, "data": data.hex()}
+
+    raise RecordError(f"unknown record type {kind}")
+
+
+class Reader:
+    """Splits the byte stream into records: zero-delimited in binary mode,
+    lines starting with '{' in JSON mode; anything else is text."""
+
+    def __init__(self, on_record, on_text):
+        self.on_record = on_record
+        self.on_text = on_text
+        self.pending = bytearray()
+        self.records = 0
+        self.bytes = 0
+        self.errors = 0
+
+    def feed(self, data):
+        self.pending += data
+        while True:
+            zero = self.pending.find(0)
+            if zero < 0:
+                # JSON lines and text have no zeros; take whole lines
+                newline = self.pending.rfind(b"\n")
+                if newline >= 0:
+                    self.lines(bytes(self.pending[:newline + 1]))
+                    del self.pending[:newline + 1]
+                return
+            chunk = bytes(self.pending[:zero])
+            del self.pending[:zero + 1]
+            if chunk:
+                self.binary(chunk)
+
+    def binary(self, chunk):
+        try:
+            record = decode_record(chunk)
+        except (RecordError, struct.error, ValueError):
+            # Text between records, or a damaged one
+            if b"\n" in chunk or not chunk.isascii():
+                if chunk.isascii():
+                    self.lines(chunk)
+                else:
+                    self.errors += 1
+            else:
+                self.on_text(chunk.decode("ascii"))
+            return
+        self.count(len(chunk) + 2)
+        self.on_record(record)
+
+    def lines(self, data):
+        for line in data.decode("utf-8", "replace").splitlines():
+            if line.startswith("{"):
+                try:
+                    record = json.loads(line)
+                except ValueError:
+                    self.on_text(line)
+                    continue
+                self.count(len(line) + 2)
+                self.on_record(record)
+            elif line.strip():
+                self.on_text(line)
+
+    def count(self, size):
+        self.records += 1
+        self.bytes += size
+
+
+def open_port(port, baud):
+    import serial
+    return serial.Serial(port, baud, timeout=0.1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--port", help="serial port of the base station")
+    source.add_argument("--file", help="captured output to decode ('-' for stdin)")
+    parser.add_argument("--binary", action="store_true", help="switch the base to binary records first")
+    parser.add_argument("--json", action="store_true", help="switch the base back to JSON lines first")
+    parser.add_argument("--baud", type=int, help="switch the base's UART to this rate first")
+    parser.add_argument("--stats", type=float, default=0, help="print records/s every this many seconds")
+    parser.add_argument("--text", action="store_true", help="print text between records to stderr")
+    args = parser.parse_args()
+
+    def on_record(record):
+        print(json.dumps(record, separators=(",", ":")), flush=True)
+
+    def on_text(text):
+        if args.text:
+            print(text.rstrip(), file=sys.stderr)
+
+    reader = Reader(on_record, on_text)
+
+    if args.file:
+        stream = sys.stdin.buffer if args.file == "-" else open(args.file, "rb")
+        read = lambda: stream.read(4096)
+    else:
+        port = open_port(args.port, SERIAL_BAUD_RATE)
+        config = {}
+        if args.binary or args.json:
+            config["output"] = "binary" if args.binary else "json"
+        if args.baud:
+            config["baud"] = args.baud
+        if config:
+            port.write(f"CMD:CONFIG {json.dumps(config)}\n".encode())
+            port.flush()
+            if args.baud:
+                # The base changes rate once its reply is out
+                time.sleep(0.5)
+                port.close()
+                port = open_port(args.port, args.baud)
+        read = lambda: port.read(4096)
+
+    started = last = time.monotonic()
+    records = size = 0
+    try:
+        while True:
+            data = read()
+            if args.file and not data:
+                break
+            reader.feed(data)
+
+            now = time.monotonic()
+            if args.stats and now - last >= args.stats:
+                print(f"{(reader.records - records) / (now - last):.1f} records/s, "
+                      f"{(reader.bytes - size) / (now - last):.0f} B/s, {reader.errors} damaged",
+                      file=sys.stderr)
+                records, size, last = reader.records, reader.bytes, now
+    except KeyboardInterrupt:
+        pass
+
+    elapsed = time.monotonic() - started
+    if args.stats and args.port:
+        print(f"{reader.records} records in {elapsed:.1f} s ({reader.records / elapsed:.1f}/s), "
+              f"{reader.bytes} bytes, {reader.errors} damaged", file=sys.stderr)
+    elif args.stats:
+        print(f"{reader.records} records, {reader.bytes} bytes, {reader.errors} damaged", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
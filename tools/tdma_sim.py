@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""Many remotes on one channel: the firmware's send-when-ready access against TDMA mode.
+
+Each remote has one data frame ready per superframe (a batch of six 30 s
+samples), at its own random phase, for one base station. Three ways to get
+it across are simulated with the firmware's timings:
+
+  aloha   transmit as soon as the frame is ready (LORA_LBT_ENABLE 0)
+  lbt     the default: channel activity detection and random backoff first
+  tdma    LORA_TDMA_ENABLE 1: beacons, one slot per remote, shared slots with
+          listen before talk for remotes that don't fit the dedicated ones
+
+Frames and ACKs are lost only when they overlap another transmission (every
+remote hears every other; no capture, no noise), so the numbers isolate
+contention. Listen before talk is modelled as ideal carrier sense, which
+flatters it: real CAD only detects preambles. TDMA remotes are in steady
+state (slots already handed out, drift already measured); each one listens
+to a beacon only when its guard time says it must, using the same formula
+as tdma_sync.cpp. The one-off search for the first beacon after boot is
+not counted.
+
+Usage: python3 tools/tdma_sim.py [--sf 10] [--bw 125] [--frame 64]
+                                 [--remotes 25,50,100,124,200] [--hours 6]
+"""
+
+import argparse
+import heapq
+import math
+import random
+
+# lora_communication.h (remote)
+ACK_TIMEOUT_MS = 1000
+MAX_RETRIES = 3
+LBT_MAX_SCANS = 6
+LBT_MAX_BACKOFF_EXPONENT = 5
+
+# tdma.h / tdma_sync.h
+SUPERFRAME_MS = 180000
+MAX_SLOTS = 128
+CONTENTION_SLOTS = 4
+SLOT_FRAME_SIZE = 80
+GUARD_MS = 10
+ACK_DELAY_MS = 50
+GUARD_BASE_US = 3000
+DRIFT_MARGIN_PPM = 5
+
+# wire_format.h
+ACK_SIZE = 11
+ACK_SLOT_SIZE = 13
+MAX_BLOCK_ACK_SIZE = 32
+BEACON_SIZE = 22              # Typical; TDMA_MAX_BEACON_SIZE is 34
+MAX_BEACON_SIZE = 34
+
+TURNAROUND_US = 1000          # Base RX done to ACK on air (radio task)
+TIMING_ERROR_US = 500         # Remote's slot timing error after drift correction
+CRYSTAL_PPM = 20              # Each remote's clock error against the base
+
+
+def airtime_us(length, sf, bw_khz, cr=5, preamble=8, crc=True):
+    """Time on air, as airtime.cpp computes it."""
+    symbol_us = (1000 << sf) / bw_khz
+    ldro = symbol_us >= 16000
+    bits = max(8 * length + (16 if crc else 0) - 4 * sf + (0 if sf < 7 else 8) + 20, 0)
+    divisor = 4 * (sf - 2 if ldro and sf >= 7 else sf)
+    blocks = -(-bits // divisor)
+    symbols = preamble + 8 + (6.25 if sf < 7 else 4.25) + blocks * cr
+    return int(symbols * symbol_us)
+
+
+def plan(sf, bw_khz):
+    """Superframe layout, as Tdma::plan() in tdma.cpp."""
+    beacon = airtime_us(MAX_BEACON_SIZE, sf, bw_khz)
+    first_slot_ms = beacon // 1000 + 1 + GUARD_MS
+    slot_ms = 2 * GUARD_MS + ACK_DELAY_MS + (airtime_us(SLOT_FRAME_SIZE, sf, bw_khz) +
+                                              airtime_us(MAX_BLOCK_ACK_SIZE, sf, bw_khz)) // 1000 + 1
+    count = min((SUPERFRAME_MS - first_slot_ms - GUARD_MS) // slot_ms, MAX_SLOTS)
+    return first_slot_ms, slot_ms, count, min(CONTENTION_SLOTS, count)
+
+
+class Channel:
+    """Everything on air, to find overlaps."""
+
+    def __init__(self):
+        self.intervals = []
+
+    def add(self, start, end):
+        self.intervals.append((start, end))
+
+    def busy(self, t):
+        return any(s <= t < e for s, e in self.intervals)
+
+    def clean(self, start, end):
+        # The interval itself is in the list once
+        return sum(1 for s, e in self.intervals if s < end and e > start) == 1
+
+    def prune(self, before):
+        self.intervals = [(s, e) for s, e in self.intervals if e >= before]
+
+
+class Stats:
+    def __init__(self):
+        self.messages = 0
+        self.delivered = 0
+        self.failed = 0
+        self.frames = 0
+        self.collided = 0
+        self.rx_wait_us = 0
+        self.latency_us = 0
+        self.beacons = 0
+
+
+def simulate(mode, remotes, sf, bw_khz, frame_bytes, hours, seed):
+    rng = random.Random(seed)
+    period_us = SUPERFRAME_MS * 1000
+    end_us = int(hours * 3600e6)
+    # New frames stop two superframes early so the last ones can finish
+    ready_end_us = end_us - 2 * period_us
+    frame = airtime_us(frame_bytes, sf, bw_khz)
+    ack = airtime_us(ACK_SLOT_SIZE if mode == "tdma" else ACK_SIZE, sf, bw_khz)
+    beacon = airtime_us(BEACON_SIZE, sf, bw_khz)
+    ack_timeout = ACK_TIMEOUT_MS * 1000 + airtime_us(MAX_BLOCK_ACK_SIZE, sf, bw_khz)
+    slot_ack_window = (ACK_DELAY_MS + GUARD_MS) * 1000 + airtime_us(MAX_BLOCK_ACK_SIZE, sf, bw_khz)
+    first_slot_ms, slot_ms, slots, shared = plan(sf, bw_khz)
+    dedicated = slots - shared
+
+    channel = Channel()
+    stats = Stats()
+    events = []
+    seq = 0
+
+    def push(t, kind, remote, data=None):
+        nonlocal seq
+        seq += 1
+        heapq.heappush(events, (t, seq, kind, remote, data))
+
+    # Per remote: phase, message state, TDMA beacon tracking
+    state = []
+    for r in range(remotes):
+        phase = rng.randrange(period_us)
+        state.append({"ready": 0, "attempt": 0, "scans": 0, "heard": phase // period_us * period_us,
+                      "slot": r if r < dedicated else None})
+        push(phase, "ready", r)
+
+    if mode == "tdma":
+        for k in range(int(end_us // period_us) + 2):
+            channel.add(k * period_us, k * period_us + beacon)
+
+    def next_slot(r, t):
+        """Start of the remote's next slot (or a random shared one) after t."""
+        s = state[r]["slot"]
+        if s is None:
+            s = dedicated + rng.randrange(shared)
+        offset = (first_slot_ms + s * slot_ms + GUARD_MS) * 1000
+        k = max(0, math.ceil((t - offset) / period_us))
+        return k, k * period_us + offset
+
+    def schedule(r, t):
+        """Start an attempt: straight away, or in the next slot."""
+        if mode != "tdma":
+            push(t, "attempt", r)
+            return
+        k, tx_at = next_slot(r, t)
+        # Listen to this superframe's beacon if the guard has outgrown the slot's
+        distance = tx_at - state[r]["heard"]
+        guard = GUARD_BASE_US + distance * DRIFT_MARGIN_PPM / 1e6
+        if guard > GUARD_MS * 1000:
+            stats.beacons += 1
+            beacon_guard = GUARD_BASE_US + (k * period_us - state[r]["heard"]) * DRIFT_MARGIN_PPM / 1e6
+            stats.rx_wait_us += beacon_guard + beacon
+            state[r]["heard"] = k * period_us
+        push(tx_at + rng.uniform(-TIMING_ERROR_US, TIMING_ERROR_US), "attempt", r)
+
+    while events:
+        t, _, kind, r, data = heapq.heappop(events)
+        if t > end_us:
+            break
+        st = state[r]
+
+        if kind == "ready":
+            if t >= ready_end_us:
+                continue
+            stats.messages += 1
+            st["ready"] = t
+            st["attempt"] = 0
+            push(t + period_us * (1 + rng.uniform(-CRYSTAL_PPM, CRYSTAL_PPM) / 1e6), "ready", r)
+            schedule(r, t)
+
+        elif kind == "attempt":
+            # Listen before talk, except in a slot of our own
+            own_slot = mode == "tdma" and st["slot"] is not None
+            if mode != "aloha" and not own_slot and channel.busy(t) and st["scans"] < LBT_MAX_SCANS - 1:
+                st["scans"] += 1
+                exponent = min(st["scans"], LBT_MAX_BACKOFF_EXPONENT)
+                push(t + (rng.randrange(1 << exponent) + 1) * (frame // 1000 + 1) * 1000, "attempt", r)
+                continue
+            st["scans"] = 0
+            st["attempt"] += 1
+            stats.frames += 1
+            channel.add(t, t + frame)
+            push(t + frame, "tx_end", r, t)
+
+        elif kind == "tx_end":
+            start = data
+            if channel.clean(start, t):
+                # Fixed ACK from the base's radio task
+                ack_start = t + TURNAROUND_US
+                channel.add(ack_start, ack_start + ack)
+                push(ack_start + ack, "ack_end", r, (ack_start, t))
+            else:
+                stats.collided += 1
+                push(t, "timeout", r, t)
+
+        elif kind == "ack_end":
+            ack_start, tx_end = data
+            if channel.clean(ack_start, t):
+                stats.delivered += 1
+                stats.rx_wait_us += t - tx_end
+                stats.latency_us += t - st["ready"]
+            else:
+                stats.collided += 1
+                push(tx_end, "timeout", r, tx_end)
+            channel.prune(t - 4 * (frame + ack_timeout))
+
+        elif kind == "timeout":
+            # Receive window stays open until it times out
+            in_slot = mode == "tdma" and st["slot"] is not None
+            window = slot_ack_window if in_slot else ack_timeout
+            stats.rx_wait_us += window
+            if st["attempt"] >= MAX_RETRIES:
+                stats.failed += 1
+                continue
+            backoff = st["attempt"] * ((frame + airtime_us(ACK_SIZE, sf, bw_khz)) // 1000 + 1) * 1000
+            schedule(r, t + window + backoff)
+
+    stats.efficiency = stats.delivered * frame / ready_end_us
+    stats.load = remotes * frame / period_us
+    return stats, (slots, dedicated, slot_ms)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--sf", type=int, default=10)
+    parser.add_argument("--bw", type=float, default=125.0, help="kHz")
+    parser.add_argument("--frame", type=int, default=64, help="data frame bytes")
+    parser.add_argument("--remotes", default="25,50,100,124,200")
+    parser.add_argument("--hours", type=float, default=6.0)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    frame = airtime_us(args.frame, args.sf, args.bw)
+    first_slot_ms, slot_ms, slots, shared = plan(args.sf, args.bw)
+    print(f"SF{args.sf}/{args.bw:g} kHz, {args.frame} byte frame ({frame / 1000:.0f} ms), "
+          f"one per remote every {SUPERFRAME_MS // 1000} s, {args.hours:g} h simulated, seed {args.seed}")
+    print(f"TDMA layout: {slots} slots of {slot_ms} ms, {slots - shared} dedicated, {shared} shared\n")
+
+    print("| Remotes | Offered load | Mode | Delivered | Frames lost to collisions | Channel use | "
+          "RX wait per delivery | Delivery latency |")
+    print("|---|---|---|---|---|---|---|---|")
+    for remotes in [int(n) for n in args.remotes.split(",")]:
+        for mode in ("aloha", "lbt", "tdma"):
+            s, _ = simulate(mode, remotes, args.sf, args.bw, args.frame, args.hours, args.seed)
+            delivered = max(s.delivered, 1)
+            print(f"| {remotes} | {s.load:.0%} | {mode} | {s.delivered / max(s.messages, 1):.1%} | "
+                  f"{s.collided / max(s.frames, 1):.1%} | {s.efficiency:.1%} | "
+                  f"{s.rx_wait_us / delivered / 1000:.0f} ms | {s.latency_us / delivered / 1e6:.1f} s |")
+
+
+if __name__ == "__main__":
+    main()